@@ -0,0 +1,448 @@
+// HTTP load generator for `make bench`. Each thread drives its share of the
+// connections from its own epoll loop, either closed-loop (a connection
+// sends its next request as soon as the last response is in) or open-loop
+// at a fixed total rate, where latency is measured from when a request was
+// due rather than when it was sent, so a stalled server cannot hide behind
+// a slowed-down client. Prints one JSON object on stdout.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RESPONSE_BUFFER_SIZE 16384
+
+// Log-linear latency buckets, the same layout as the server's /metrics
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_VALUE_BITS 36
+#define HISTOGRAM_BUCKETS ((MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+typedef struct {
+    const char* name;
+    const char* host;
+    int port;
+    const char* path;
+    int threads;
+    int connections;
+    double duration;
+    double rate;          // requests per second over all connections, 0 for closed loop
+    int keep_alive;
+} load_config_t;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t errors;      // failed connects, resets and malformed responses
+    uint64_t non_2xx;
+    uint64_t bytes;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} load_stats_t;
+
+typedef struct client {
+    int fd;
+    int connected;
+    int busy;             // a request is out and its response not yet complete
+    uint64_t due_ns;      // when the current (or next) request was due
+    char response[RESPONSE_BUFFER_SIZE];
+    size_t response_len;
+    size_t header_len;    // 0 until the header block is complete
+    long long body_length;  // -1 means the body runs to the end of the connection
+    int status;
+    int closing;          // the server said Connection: close
+} client_t;
+
+typedef struct {
+    pthread_t thread;
+    const load_config_t* config;
+    int connections;
+    double interval_ns;   // open loop: time between a connection's requests
+    uint64_t start_ns;
+    uint64_t end_ns;
+    struct sockaddr_in address;
+    char request[1024];
+    size_t request_len;
+    load_stats_t stats;
+} load_thread_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude >= MAX_VALUE_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = magnitude - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)(value >> shift) - SUB_BUCKETS;
+}
+
+static uint64_t bucket_upper_bound(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+static uint64_t percentile(const load_stats_t* stats, double fraction) {
+    uint64_t target = (uint64_t)(stats->requests * fraction);
+    if (target >= stats->requests) {
+        target = stats->requests ? stats->requests - 1 : 0;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen > target) {
+            return bucket_upper_bound(i);
+        }
+    }
+    return 0;
+}
+
+static void client_reset(client_t* client) {
+    client->response_len = 0;
+    client->header_len = 0;
+    client->body_length = -1;
+    client->status = 0;
+    client->closing = 0;
+}
+
+static int client_connect(load_thread_t* thread, client_t* client, int epoll_fd) {
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(client->fd, (struct sockaddr*)&thread->address, sizeof(thread->address)) < 0 &&
+        errno != EINPROGRESS) {
+        close(client->fd);
+        client->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev);
+    return 0;
+}
+
+static void client_close(client_t* client) {
+    if (client->fd >= 0) {
+        close(client->fd);  // Also leaves the epoll set
+    }
+    client->fd = -1;
+    client->connected = 0;
+    client->busy = 0;
+}
+
+// Requests are small enough to go out in one send on an idle socket; on a
+// new one the send waits until the connect is through
+static int client_send(load_thread_t* thread, client_t* client) {
+    ssize_t n = send(client->fd, thread->request, thread->request_len, MSG_NOSIGNAL);
+    return n == (ssize_t)thread->request_len ? 0 : -1;
+}
+
+static int client_start(load_thread_t* thread, client_t* client, int epoll_fd) {
+    client_reset(client);
+    client->busy = 1;
+    if (client->fd < 0) {
+        return client_connect(thread, client, epoll_fd);
+    }
+    return client_send(thread, client);
+}
+
+// Find the end of the header block and the body framing. Returns 1 once the
+// head is complete, 0 while it is not, -1 if it is malformed.
+static int parse_response_head(client_t* client) {
+    char* end = strstr(client->response, "\r\n\r\n");
+    if (!end) {
+        return 0;
+    }
+    client->header_len = end + 4 - client->response;
+    if (sscanf(client->response, "HTTP/1.%*d %d", &client->status) != 1) {
+        return -1;
+    }
+    for (char* line = strstr(client->response, "\r\n"); line && line < end;
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            client->body_length = strtoll(line + 17, NULL, 10);
+        } else if (strncasecmp(line + 2, "Connection: close", 17) == 0) {
+            client->closing = 1;
+        }
+    }
+    if (client->status == 204 || client->status == 304) {
+        client->body_length = 0;
+    }
+    return 1;
+}
+
+// Read what has arrived. Returns 1 when the response is complete, 0 when
+// more is to come, -1 on failure.
+static int client_receive(client_t* client, load_stats_t* stats) {
+    while (1) {
+        // The head is kept for parsing; body bytes are only counted
+        char* buf = client->response;
+        size_t room = RESPONSE_BUFFER_SIZE;
+        if (!client->header_len) {
+            buf += client->response_len;
+            room -= client->response_len + 1;
+            if (room == 0) {
+                return -1;
+            }
+        }
+        ssize_t n = recv(client->fd, buf, room, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (n == 0) {
+            // A close-delimited body ends here; anything else was cut short
+            return client->header_len && client->body_length < 0 ? 1 : -1;
+        }
+        stats->bytes += n;
+
+        if (!client->header_len) {
+            client->response_len += n;
+            client->response[client->response_len] = '\0';
+            int head = parse_response_head(client);
+            if (head <= 0) {
+                if (head < 0) return -1;
+                continue;
+            }
+            n = client->response_len - client->header_len;
+        }
+        if (client->body_length >= 0) {
+            client->body_length -= n;
+            if (client->body_length <= 0) {
+                return client->body_length == 0 ? 1 : -1;  // Requests are never pipelined
+            }
+        }
+    }
+}
+
+static void record_response(load_thread_t* thread, client_t* client, uint64_t now) {
+    load_stats_t* stats = &thread->stats;
+    stats->requests++;
+    stats->buckets[bucket_index(now - client->due_ns)]++;
+    if (client->status < 200 || client->status >= 300) {
+        stats->non_2xx++;
+    }
+    client->busy = 0;
+}
+
+static void* load_thread_main(void* arg) {
+    load_thread_t* thread = arg;
+    const load_config_t* config = thread->config;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    client_t* clients = calloc(thread->connections, sizeof(client_t));
+    if (epoll_fd < 0 || !clients) {
+        return NULL;
+    }
+
+    // Open loop: spread the connections' first requests over one interval
+    for (int i = 0; i < thread->connections; i++) {
+        clients[i].fd = -1;
+        clients[i].due_ns = thread->start_ns;
+        if (config->rate > 0) {
+            clients[i].due_ns += (uint64_t)(thread->interval_ns * i / thread->connections);
+        }
+    }
+
+    struct epoll_event events[256];
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= thread->end_ns) {
+            break;
+        }
+
+        // Start every request that is due; closed-loop ones are always due
+        uint64_t next_due = thread->end_ns;
+        for (int i = 0; i < thread->connections; i++) {
+            client_t* client = &clients[i];
+            if (client->busy) {
+                continue;
+            }
+            if (config->rate > 0 && client->due_ns > now) {
+                if (client->due_ns < next_due) next_due = client->due_ns;
+                continue;
+            }
+            if (config->rate <= 0) {
+                client->due_ns = now;
+            }
+            if (client_start(thread, client, epoll_fd) != 0) {
+                thread->stats.errors++;
+                client_close(client);
+                client->due_ns += (uint64_t)thread->interval_ns;
+            }
+        }
+
+        int timeout_ms = (int)((next_due - now + 999999) / 1000000);
+        if (timeout_ms > 100) timeout_ms = 100;
+        int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            client_t* client = events[i].data.ptr;
+            if (client->fd < 0 || !client->busy) {
+                continue;
+            }
+            int status = 0;
+            if (!client->connected) {
+                // The connect finished one way or the other: send the request
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                if (!(events[i].events & EPOLLOUT) || error) {
+                    status = -1;
+                } else {
+                    client->connected = 1;
+                    status = client_send(thread, client);
+                }
+            } else {
+                status = client_receive(client, &thread->stats);
+            }
+
+            if (status < 0) {
+                thread->stats.errors++;
+                client_close(client);
+            } else if (status > 0) {
+                record_response(thread, client, now);
+                if (!config->keep_alive || client->body_length < 0 || client->closing) {
+                    client_close(client);
+                }
+            } else {
+                continue;
+            }
+            client->due_ns += (uint64_t)thread->interval_ns;
+        }
+    }
+
+    for (int i = 0; i < thread->connections; i++) {
+        client_close(&clients[i]);
+    }
+    free(clients);
+    close(epoll_fd);
+    return NULL;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-u path] [-t threads] [-c connections]\n"
+            "          [-d seconds] [-r rate] [-k] [-n name]\n"
+            "  -H host        server address (default 127.0.0.1)\n"
+            "  -p port        server port (default 8080)\n"
+            "  -u path        request path (default /hello)\n"
+            "  -t threads     load threads (default 4)\n"
+            "  -c connections concurrent connections over all threads (default 64)\n"
+            "  -d seconds     test duration (default 5)\n"
+            "  -r rate        open loop at this many requests per second, 0 = closed loop\n"
+            "  -k             reuse connections (keep-alive); otherwise one per request\n"
+            "  -n name        workload name for the report\n",
+            program);
+}
+
+int main(int argc, char** argv) {
+    load_config_t config = {"custom", "127.0.0.1", 8080, "/hello", 4, 64, 5.0, 0.0, 0};
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:u:t:c:d:r:kn:h")) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 'u': config.path = optarg; break;
+        case 't': config.threads = atoi(optarg); break;
+        case 'c': config.connections = atoi(optarg); break;
+        case 'd': config.duration = atof(optarg); break;
+        case 'r': config.rate = atof(optarg); break;
+        case 'k': config.keep_alive = 1; break;
+        case 'n': config.name = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (config.threads < 1 || config.connections < config.threads || config.duration <= 0 ||
+        config.port <= 0 || config.port > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &address.sin_addr) != 1) {
+        fprintf(stderr, "%s: not an IPv4 address\n", config.host);
+        return 1;
+    }
+
+    load_thread_t* threads = calloc(config.threads, sizeof(load_thread_t));
+    if (!threads) {
+        return 1;
+    }
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(config.duration * 1e9);
+    for (int i = 0; i < config.threads; i++) {
+        load_thread_t* thread = &threads[i];
+        thread->config = &config;
+        thread->connections = config.connections / config.threads +
+                              (i < config.connections % config.threads);
+        if (config.rate > 0) {
+            thread->interval_ns = 1e9 * config.connections / config.rate;
+        }
+        thread->start_ns = start;
+        thread->end_ns = end;
+        thread->address = address;
+        thread->request_len = snprintf(thread->request, sizeof(thread->request),
+                                       "GET %s HTTP/1.1\r\nHost: %s:%d\r\n"
+                                       "User-Agent: load_gen\r\nAccept: */*\r\n%s\r\n",
+                                       config.path, config.host, config.port,
+                                       config.keep_alive ? "" : "Connection: close\r\n");
+        pthread_create(&thread->thread, NULL, load_thread_main, thread);
+    }
+
+    load_stats_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        const load_stats_t* stats = &threads[i].stats;
+        total.requests += stats->requests;
+        total.errors += stats->errors;
+        total.non_2xx += stats->non_2xx;
+        total.bytes += stats->bytes;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            total.buckets[b] += stats->buckets[b];
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("{\"workload\": \"%s\", \"path\": \"%s\", \"mode\": \"%s\", \"keep_alive\": %s, "
+           "\"threads\": %d, \"connections\": %d, \"target_rate\": %.0f, \"duration_s\": %.2f, "
+           "\"requests\": %llu, \"errors\": %llu, \"non_2xx\": %llu, \"rps\": %.0f, "
+           "\"mb_per_sec\": %.1f, \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+           "\"p999\": %.1f, \"max\": %.1f}}\n",
+           config.name, config.path, config.rate > 0 ? "open" : "closed",
+           config.keep_alive ? "true" : "false", config.threads, config.connections, config.rate,
+           elapsed, (unsigned long long)total.requests, (unsigned long long)total.errors,
+           (unsigned long long)total.non_2xx, total.requests / elapsed,
+           total.bytes / elapsed / (1024.0 * 1024.0), percentile(&total, 0.50) / 1e3,
+           percentile(&total, 0.90) / 1e3, percentile(&total, 0.99) / 1e3,
+           percentile(&total, 0.999) / 1e3, percentile(&total, 1.0) / 1e3);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,281 @@
+// Micro-benchmarks of the request path, run by `make bench`: the parser,
+// the router, MIME lookup and the response serializer, over the recorded
+// requests in bench/corpus. Prints one JSON object on stdout.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include "../include/http.h"
+#include "../include/router.h"
+#include "../include/server.h"
+#include "../include/file_server.h"
+#include "../include/connection.h"
+#include "../include/event_loop.h"
+#include "../include/metrics.h"
+#include "../include/config.h"
+
+#define CORPUS_DIR "bench/corpus"
+#define MAX_CORPUS 64
+#define BENCH_MIN_SECONDS 0.2     // each measurement runs at least this long
+
+typedef struct {
+    char name[64];
+    char* data;
+    size_t length;
+} corpus_entry_t;
+
+static corpus_entry_t corpus[MAX_CORPUS];
+static int corpus_count = 0;
+static int results_written = 0;
+
+typedef void (*bench_fn_t)(void* context, long iterations);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(((const corpus_entry_t*)a)->name, ((const corpus_entry_t*)b)->name);
+}
+
+static int load_corpus(void) {
+    DIR* dir = opendir(CORPUS_DIR);
+    if (!dir) {
+        perror(CORPUS_DIR);
+        return -1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && corpus_count < MAX_CORPUS) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len < 6 || name_len >= sizeof(corpus[0].name) ||
+            strcmp(entry->d_name + name_len - 5, ".http") != 0) {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", CORPUS_DIR, entry->d_name);
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+            continue;
+        }
+        corpus_entry_t* item = &corpus[corpus_count];
+        item->data = malloc(CONN_READ_BUFFER_SIZE);
+        item->length = item->data ? fread(item->data, 1, CONN_READ_BUFFER_SIZE, file) : 0;
+        fclose(file);
+        if (item->length == 0) {
+            free(item->data);
+            continue;
+        }
+        memcpy(item->name, entry->d_name, name_len - 5);
+        item->name[name_len - 5] = '\0';
+        corpus_count++;
+    }
+    closedir(dir);
+    qsort(corpus, corpus_count, sizeof(corpus_entry_t), compare_names);
+    return corpus_count > 0 ? 0 : -1;
+}
+
+// Double the batch until it runs for BENCH_MIN_SECONDS, then report that batch
+static void run_bench(const char* group, const char* name, bench_fn_t fn, void* context,
+                      size_t bytes_per_op) {
+    fn(context, 1);  // Warm caches and lazily built tables
+    long iterations = 1;
+    double elapsed;
+    while (1) {
+        double start = now_seconds();
+        fn(context, iterations);
+        elapsed = now_seconds() - start;
+        if (elapsed >= BENCH_MIN_SECONDS || iterations >= (1L << 40)) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    double ns_per_op = elapsed * 1e9 / iterations;
+    printf("%s\n    {\"benchmark\": \"%s\", \"input\": \"%s\", \"iterations\": %ld, "
+           "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f",
+           results_written++ ? "," : "", group, name, iterations, ns_per_op, 1e9 / ns_per_op);
+    if (bytes_per_op) {
+        printf(", \"mb_per_sec\": %.1f", bytes_per_op / ns_per_op * 1e9 / (1024.0 * 1024.0));
+    }
+    printf("}");
+}
+
+// The parser terminates views in place, so every pass starts from a fresh
+// copy of the recorded bytes, as it would from a freshly read buffer
+static void bench_parse(void* context, long iterations) {
+    const corpus_entry_t* item = context;
+    char buffer[CONN_READ_BUFFER_SIZE];
+    http_request_t request;
+    for (long i = 0; i < iterations; i++) {
+        memcpy(buffer, item->data, item->length);
+        if (parse_http_request(buffer, item->length, &request) != 0) {
+            fprintf(stderr, "%s: does not parse\n", item->name);
+            exit(1);
+        }
+        free_http_request(&request);
+    }
+}
+
+typedef struct {
+    http_request_t request;
+    char buffer[CONN_READ_BUFFER_SIZE];
+    arena_t* arena;
+} route_context_t;
+
+// Routing runs the handler too, as a connection would; handler memory comes
+// from an arena that is reset between passes
+static void bench_route(void* context, long iterations) {
+    route_context_t* route = context;
+    for (long i = 0; i < iterations; i++) {
+        http_request_t* request = &route->request;
+        request->route = ROUTE_UNMATCHED;
+        request->param_count = 0;
+        request->body_context = NULL;
+        request->offload_state = ROUTE_INLINE;
+        request->arena = route->arena;
+
+        http_response_t response;
+        init_http_response(&response);
+        handle_route(request, &response);
+        free_http_response(&response);
+        arena_reset(route->arena);
+    }
+}
+
+static const char* mime_names[] = {
+    "/index.html", "/css/style.css", "/js/script.js", "/api/data.json", "/img/logo.png",
+    "/photos/IMG_2041.JPG", "/img/banner.jpeg", "/img/spinner.gif", "/icons/menu.svg",
+    "/robots.txt", "/docs/manual.pdf", "/downloads/archive.tar.gz", "/README", "/fonts/inter.woff2",
+};
+#define MIME_NAME_COUNT (sizeof(mime_names) / sizeof(mime_names[0]))
+
+static void bench_mime(void* context, long iterations) {
+    (void)context;
+    size_t total = 0;
+    for (long i = 0; i < iterations; i++) {
+        const char* type = get_mime_type(mime_names[i % MIME_NAME_COUNT]);
+        total += type[0];
+    }
+    // Keep the lookups from being optimized away
+    __asm__ volatile("" : : "r"(total));
+}
+
+typedef struct {
+    connection_t* conn;
+    const char* kind;
+} serialize_context_t;
+
+static char large_body[64 * 1024];
+static const char json_body[] =
+    "{\"id\": 4127, \"name\": \"Ada Lovelace\", \"email\": \"ada@example.com\", "
+    "\"roles\": [\"admin\", \"editor\"], \"created\": \"2024-05-07T09:12:44Z\", "
+    "\"last_login\": \"2024-05-08T17:03:11Z\", \"preferences\": {\"theme\": \"dark\", "
+    "\"language\": \"en-GB\", \"notifications\": true}}";
+
+static void keep_body(void* owner) {
+    (void)owner;  // Static memory; nothing to release
+}
+
+static void fill_response(http_response_t* response, const char* kind) {
+    response->status_code = 200;
+    response->keep_alive = 1;
+    response->body_release = keep_body;
+    if (strcmp(kind, "small_text") == 0) {
+        response->body = (char*)"Hello, World!";
+        response->body_length = 13;
+        http_response_add_header(response, "Content-Type", "text/plain");
+    } else if (strcmp(kind, "json_api") == 0) {
+        response->body = (char*)json_body;
+        response->body_length = sizeof(json_body) - 1;
+        http_response_add_header(response, "Content-Type", "application/json");
+        http_response_add_header(response, "Cache-Control", "no-store");
+        http_response_add_header(response, "X-Request-Id", "9b2f6c1e-4d7a-4f3e-8a61-0c5d2e7b9f14");
+        http_response_add_header(response, "Vary", "Accept-Encoding, Authorization");
+        http_response_add_headerf(response, "Set-Cookie", "session=%08x; Path=/; HttpOnly", 0x8f14e45fu);
+    } else if (strcmp(kind, "large_body") == 0) {
+        response->body = large_body;
+        response->body_length = sizeof(large_body);
+        http_response_add_header(response, "Content-Type", "application/octet-stream");
+        http_response_add_header(response, "ETag", "\"10000-663a0e5c\"");
+        http_response_add_header(response, "Last-Modified", "Tue, 07 May 2024 09:12:44 GMT");
+    } else {
+        response->status_code = 304;
+        http_response_add_header(response, "ETag", "\"5f3a-663a0e5c\"");
+        http_response_add_header(response, "Cache-Control", "public, max-age=3600");
+    }
+}
+
+// Build and serialize a response into the output queue, then drop the output
+static void bench_serialize(void* context, long iterations) {
+    serialize_context_t* serialize = context;
+    for (long i = 0; i < iterations; i++) {
+        http_response_t response;
+        init_http_response(&response);
+        fill_response(&response, serialize->kind);
+        send_http_response(serialize->conn, &response);
+        free_http_response(&response);
+        connection_discard_output(serialize->conn);
+    }
+}
+
+int main(void) {
+    if (load_corpus() != 0) {
+        fprintf(stderr, "No requests found in %s; run from the repository root\n", CORPUS_DIR);
+        return 1;
+    }
+
+    // The server's own routes and static file setup, without its workers
+    server_config_t config;
+    config_init(&config);
+    config.workers = 1;
+    if (setup_routes() != 0) {
+        return 1;
+    }
+    init_file_server(&config);
+
+    event_loop_t loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.config = &config;
+    loop.metrics = metrics_register_worker();
+    timer_wheel_init(&loop.timers, 0);
+    connection_t* conn = connection_create(&loop, -1);
+    if (!loop.metrics || !conn) {
+        return 1;
+    }
+
+    printf("{\"suite\": \"micro\", \"results\": [");
+    for (int i = 0; i < corpus_count; i++) {
+        run_bench("parse_http_request", corpus[i].name, bench_parse, &corpus[i], corpus[i].length);
+    }
+
+    route_context_t* route = malloc(sizeof(route_context_t));
+    route->arena = arena_pool_get(&loop.arenas);
+    for (int i = 0; i < corpus_count; i++) {
+        memcpy(route->buffer, corpus[i].data, corpus[i].length);
+        if (parse_http_request(route->buffer, corpus[i].length, &route->request) != 0) {
+            return 1;
+        }
+        run_bench("handle_route", corpus[i].name, bench_route, route, 0);
+        free_http_request(&route->request);
+    }
+    arena_pool_put(&loop.arenas, route->arena);
+    free(route);
+
+    run_bench("get_mime_type", "mixed", bench_mime, NULL, 0);
+
+    const char* kinds[] = {"small_text", "json_api", "large_body", "not_modified"};
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        serialize_context_t serialize = {conn, kinds[i]};
+        run_bench("send_http_response", kinds[i], bench_serialize, &serialize, 0);
+    }
+    printf("\n]}\n");
+
+    connection_destroy(conn);
+    connection_pool_destroy(&loop);
+    arena_pool_destroy(&loop.arenas);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Run the micro-benchmarks and the load workloads against a freshly started
+# server, and write one combined JSON report. Invoked by `make bench`; the
+# knobs below can be set in the environment.
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=${BENCH_PORT:-8099}
+DURATION=${BENCH_DURATION:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-64}
+THREADS=${BENCH_THREADS:-4}
+RATE=${BENCH_RATE:-20000}
+SERVER_ARGS=${BENCH_SERVER_ARGS:-}
+OUTPUT=${BENCH_OUTPUT:-bench/results.json}
+
+./server -p "$PORT" $SERVER_ARGS >/dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null' EXIT INT TERM
+sleep 0.5
+if ! kill -0 $SERVER_PID 2>/dev/null; then
+    echo "server did not start on port $PORT" >&2
+    exit 1
+fi
+
+load() {
+    bench/load_gen -p "$PORT" -t "$THREADS" -c "$CONNECTIONS" -d "$DURATION" "$@"
+}
+
+{
+    printf '{"micro": '
+    bench/micro_bench
+    printf ', "load": [\n'
+    load -n keepalive -k -u /hello
+    printf ',\n'
+    load -n close -u /hello
+    printf ',\n'
+    load -n static -k -u /index.html
+    printf ',\n'
+    load -n keepalive_open_loop -k -u /hello -r "$RATE"
+    printf ']}\n'
+} > "$OUTPUT"
+cat "$OUTPUT"
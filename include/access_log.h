@@ -0,0 +1,56 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "http.h"
+#include "config.h"
+
+#define ACCESS_LOG_RING_SIZE 8192       // records per worker, a power of two
+#define ACCESS_LOG_METHOD_MAX 15
+#define ACCESS_LOG_URI_MAX 200          // longer URIs are truncated in the log
+#define ACCESS_LOG_BATCH_SIZE (256 * 1024)
+#define ACCESS_LOG_DRAIN_INTERVAL_MS 20
+
+// One request as the worker saw it; formatting happens on the log thread
+typedef struct {
+    uint64_t timestamp_ns;      // wall clock when the request was handled
+    uint64_t duration_ns;
+    uint64_t bytes;
+    int32_t fd;
+    uint16_t status_code;
+    uint16_t uri_len;
+    uint8_t method_len;
+    char method[ACCESS_LOG_METHOD_MAX];
+    char uri[ACCESS_LOG_URI_MAX];
+} access_record_t;
+
+// Single-producer/single-consumer ring owned by one worker. The worker only
+// advances head and the log thread only advances tail, so neither side
+// ever waits for the other; a full ring drops the record and counts it.
+typedef struct access_log_ring {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t dropped __attribute__((aligned(64)));
+    access_record_t records[ACCESS_LOG_RING_SIZE];
+    struct access_log_ring* next;
+} access_log_ring_t;
+
+// Open the log and start the writer thread; a no-op when no log is configured
+int access_log_init(const server_config_t* config);
+
+// Flush what is queued and stop the writer thread
+void access_log_shutdown(void);
+
+// A ring for one worker, or NULL when logging is disabled
+access_log_ring_t* access_log_register_worker(void);
+
+// Queue a record without blocking or making a system call. request may be
+// NULL for a request that could not be parsed.
+void access_log_record(access_log_ring_t* ring, int fd, const http_request_t* request,
+                       int status_code, size_t bytes, uint64_t duration_ns);
+
+// Records dropped because a ring was full, across all workers
+uint64_t access_log_dropped(void);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_INITIAL_SIZE 4096    // covers a typical request without growing
+#define ARENA_ALIGNMENT 16
+#define ARENA_POOL_MAX 64          // idle arenas a worker keeps for reuse
+
+// Memory that grows past the initial block, freed on reset
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+} arena_chunk_t;
+
+// Bump-pointer allocator for everything that lives as long as one request.
+// Nothing is freed individually; arena_reset() drops it all at once. While
+// queued output still points into the arena it is pinned, and resets are
+// skipped until the last pin is gone.
+typedef struct arena {
+    char* pos;
+    char* end;
+    arena_chunk_t* chunks;
+    size_t last_chunk_size;
+    int pins;
+    struct arena* next_free;
+    char initial[ARENA_INITIAL_SIZE] __attribute__((aligned(ARENA_ALIGNMENT)));
+} arena_t;
+
+// Per-worker free list, so connections reuse arenas instead of allocating
+typedef struct {
+    arena_t* free;
+    int count;
+} arena_pool_t;
+
+void* arena_alloc(arena_t* arena, size_t size);
+char* arena_strdup(arena_t* arena, const char* text);
+void arena_reset(arena_t* arena);
+
+// void* so arena_unpin can be an output segment's release callback
+void arena_pin(arena_t* arena);
+void arena_unpin(void* arena);
+
+arena_t* arena_pool_get(arena_pool_t* pool);
+void arena_pool_put(arena_pool_t* pool, arena_t* arena);
+void arena_pool_destroy(arena_pool_t* pool);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef ASSET_CACHE_H
+#define ASSET_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "content_encoding.h"
+#include "mime_types.h"
+
+#define ASSET_CACHE_SHARDS 16          // independent locks, picked by key hash
+#define ASSET_CACHE_BUCKETS 1024       // hash buckets per shard
+#define ASSET_CACHE_MAX_ENTRY (1024 * 1024)  // larger files keep using sendfile()
+
+// Lifecycle of an encoded variant; identity is always VARIANT_READY
+typedef enum {
+    VARIANT_UNKNOWN = 0,       // not built yet
+    VARIANT_PENDING,           // one thread is building it
+    VARIANT_READY,
+    VARIANT_NONE               // no sibling file and compressing did not pay off
+} variant_state_t;
+
+// One representation of a file: its bytes plus the response headers that go with them
+typedef struct {
+    char* data;
+    size_t size;
+    char* headers;             // pre-serialized "Name: value\r\n" lines
+    size_t headers_len;
+} asset_variant_t;
+
+// A cached static file with its identity and content-coded variants.
+// Entries are reference counted so a response can keep using one after
+// it has been evicted or replaced.
+typedef struct asset {
+    char* key;                 // normalized URI
+    size_t key_len;
+    unsigned int hash;
+    char* path;                // file the entry was loaded from
+    const mime_type_t* mime;   // resolved once, when the file was loaded
+    asset_variant_t variants[ENCODING_COUNT];
+    int variant_state[ENCODING_COUNT];
+
+    // Identity of the file when it was loaded, compared on revalidation
+    dev_t dev;
+    ino_t inode;
+    off_t file_size;
+    struct timespec mtime;
+    time_t checked_at;
+
+    size_t charge;             // bytes counted against the memory budget
+    int refcount;
+    struct asset* hash_next;
+    struct asset* lru_prev;
+    struct asset* lru_next;
+} asset_t;
+
+// budget is in bytes (0 disables caching); entries are re-checked against
+// the filesystem at most once every revalidate_interval seconds
+void asset_cache_init(size_t budget, int revalidate_interval);
+int asset_cache_enabled(size_t size);
+
+// Returns a referenced entry, or NULL on a miss or if the file changed
+asset_t* asset_cache_lookup(const char* key, size_t key_len);
+
+// Build an entry from freshly read file contents and try to cache it. Takes
+// ownership of data and headers. Unless the type is compressible the entry
+// never gets encoded variants. The returned entry is referenced for the caller
+// whether or not it fit in the cache; NULL if allocation failed.
+asset_t* asset_cache_insert(const char* key, size_t key_len, const char* path,
+                            char* data, size_t size, char* headers,
+                            const struct stat* file_stat, const mime_type_t* mime);
+
+// The variant to send for a set of accepted codings (a parse_accept_encoding()
+// mask). Codings that have never been tried are reported through *missing so
+// the caller can build one with asset_cache_claim_variant().
+const asset_variant_t* asset_pick_variant(asset_t* asset, unsigned int accepted,
+                                          content_encoding_t* missing);
+
+// Make the caller responsible for building a variant; fails if another thread already is
+int asset_cache_claim_variant(asset_t* asset, content_encoding_t encoding);
+
+// Publish a claimed variant. Takes ownership of data and headers; NULL data
+// records that the coding is not worth offering for this file.
+void asset_cache_attach_variant(asset_t* asset, content_encoding_t encoding,
+                                char* data, size_t size, char* headers);
+
+// Drop a reference taken by lookup or insert (void* so it can be a body release callback)
+void asset_release(void* asset);
+
+#endif
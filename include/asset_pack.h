@@ -0,0 +1,65 @@
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "content_encoding.h"
+#include "mime_types.h"
+
+#define ASSET_PACK_MAGIC "HTTPPAK1"
+#define ASSET_PACK_ALIGN 8          // every section and blob starts on this boundary
+
+// On-disk layout, in the byte order of the machine that built it: this
+// header, then the blobs (paths, types, headers, file bytes), then the
+// entries sorted by key. Offsets count from the start of the file.
+typedef struct {
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t encoding_count;    // ENCODING_COUNT of the tool that wrote it
+    uint64_t index_offset;      // the entries
+    uint64_t file_size;         // catches a truncated copy
+} asset_pack_header_t;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t headers_offset;    // pre-serialized "Name: value\r\n" lines
+    uint64_t headers_len;       // 0 when the coding is not offered
+} asset_pack_variant_t;
+
+typedef struct {
+    uint64_t key_offset;        // normalized URI path, as asset cache keys are
+    uint64_t key_len;
+    uint64_t type_offset;       // Content-Type, NUL-terminated
+    uint32_t compressible;
+    uint32_t reserved;
+
+    // Identity of the source file at build time; the validators derive from it
+    uint64_t inode;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    asset_pack_variant_t variants[ENCODING_COUNT];
+} asset_pack_entry_t;
+
+// Map a pack built by asset_pack_write() for every worker to serve from.
+// The whole file is checked once here, so lookups can trust its offsets.
+int asset_pack_open(const char* path);
+void asset_pack_close(void);
+
+// Binary search of the index; NULL on a miss or when no pack is open
+const asset_pack_entry_t* asset_pack_find(const char* key, size_t key_len);
+
+// Views of an entry inside the mapping, which lives until asset_pack_close()
+const char* asset_pack_data(const asset_pack_variant_t* variant);
+const char* asset_pack_headers(const asset_pack_variant_t* variant);
+const mime_type_t* asset_pack_mime(const asset_pack_entry_t* entry);
+
+// Pack every regular file below root into output. Headers and encoded
+// variants are produced the same way the file server builds them at run
+// time; precompressed siblings ("app.js.br") are preferred when present.
+// The pack is written beside output and renamed over it, so a server
+// started at any moment sees either the old pack or the new one.
+int asset_pack_write(const char* root, const char* output);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+#define BUFFER_SLAB_BUFFERS 64       // buffers carved from each mmap()ed slab
+#define BUFFER_POOL_RESIDENT 64      // free buffers kept backed by memory
+
+// Per-worker allocator of fixed-size I/O buffers. Buffers come from large
+// page-aligned slabs, so taking and returning one is a pointer push or pop.
+// Free buffers beyond BUFFER_POOL_RESIDENT have their pages handed back to
+// the kernel while staying in the pool, so a burst of connections does not
+// leave its buffers resident once it is over.
+typedef struct buffer_slab {
+    struct buffer_slab* next;
+    char* memory;
+} buffer_slab_t;
+
+typedef struct {
+    size_t buffer_size;          // a multiple of the page size
+    buffer_slab_t* slabs;
+    char** free;                 // stack of free buffers, the most recent on top
+    int free_count;
+    int free_cap;
+    int released;                // free[0..released) have no pages behind them
+} buffer_pool_t;
+
+void buffer_pool_init(buffer_pool_t* pool, size_t buffer_size);
+char* buffer_pool_get(buffer_pool_t* pool);
+void buffer_pool_put(buffer_pool_t* pool, char* buffer);
+void buffer_pool_destroy(buffer_pool_t* pool);
+
+#endif
@@ -1,7 +1,16 @@
 #ifndef BUILD_FILE_PATH_SUPPLEMENT_H
 #define BUILD_FILE_PATH_SUPPLEMENT_H
 
+#include <stddef.h>
+
 const char* get_default_file_path(const char* uri);
 char* construct_full_path(const char* base_dir, const char* file_path);
 
+// Percent-decode a URI path and remove its dot segments (RFC 3986 5.2.4) in
+// one pass, stopping at a query or fragment; empty segments collapse. out
+// receives a NUL-terminated path starting with '/' and its length is
+// returned, or -1 for a malformed escape, an encoded NUL or '/', a ".."
+// that would climb above the root, or a result longer than out_size.
+int normalize_uri_path(const char* uri, size_t uri_len, char* out, size_t out_size);
+
 #endif
@@ -0,0 +1,55 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define DEFAULT_PORT 8080
+#define DEFAULT_TLS_PORT 8443          // used once -c and -K are given
+#define DEFAULT_BACKLOG 4096
+#define DEFAULT_WORKERS 0   // 0 means one worker per online CPU
+#define DEFAULT_KEEPALIVE_TIMEOUT 15      // seconds a connection may sit idle
+#define DEFAULT_HEADER_TIMEOUT 10         // seconds to send a request's headers
+#define DEFAULT_BODY_TIMEOUT 30           // seconds a request body may stall
+#define DEFAULT_WRITE_TIMEOUT 30          // seconds a client may take no output
+#define DEFAULT_MAX_KEEPALIVE_REQUESTS 1000
+#define DEFAULT_CACHE_MB 64               // static asset cache budget, 0 disables it
+#define DEFAULT_CACHE_REVALIDATE 2        // seconds between stat() checks of a cached file
+#define DEFAULT_FILE_CACHE 1024           // open descriptors kept for static files, 0 disables
+#define DEFAULT_ACCESS_LOG_ROTATE_MB 100  // access log size that triggers rotation, 0 never
+#define DEFAULT_MAX_BODY_KB 1024          // request body limit of routes without their own
+#define DEFAULT_POOL_THREADS 4            // threads for blocking work, 0 keeps it all inline
+#define DEFAULT_MAX_CONNECTIONS 100000    // open connections over all workers, 0 no limit
+#define DEFAULT_MEMORY_MB 1024            // connection buffer memory over all workers, 0 no limit
+#define DEFAULT_DRAIN_TIMEOUT 30          // seconds old connections get after a reload or stop
+
+typedef struct {
+    int port;
+    int tls_port;
+    const char* tls_cert;     // PEM certificate chain; with tls_key, enables TLS
+    const char* tls_key;      // PEM private key
+    int workers;
+    int backlog;
+    int pin_cpus;
+    int keepalive_timeout;
+    int header_timeout;
+    int body_timeout;
+    int write_timeout;
+    int max_keepalive_requests;
+    int cache_mb;
+    int cache_revalidate;
+    int file_cache;
+    const char* access_log;   // NULL disables access logging
+    const char* mime_types;   // mime.types file extending the built-in table, or NULL
+    const char* asset_pack;   // pack of ./static served from memory, or NULL
+    int access_log_rotate_mb;
+    int max_body_kb;
+    int pool_threads;
+    int io_uring;             // drive the workers with io_uring where the kernel allows
+    int max_connections;
+    int memory_mb;
+    int drain_timeout;
+} server_config_t;
+
+void config_init(server_config_t* config);
+int config_parse_args(server_config_t* config, int argc, char** argv);
+void config_print_usage(const char* program);
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include "http.h"
+#include "config.h"
+#include "request_body.h"
+#include "uring_loop.h"
+#include "timer_wheel.h"
+
+#define CONN_READ_BUFFER_SIZE 8192
+#define CONN_WRITE_BUFFER_SIZE 4096
+#define CONN_WRITE_HIGH_WATERMARK (256 * 1024)   // stop taking pipelined requests above this
+#define CONN_MAX_IOVECS 64                        // segments gathered into one writev()
+#define STREAM_BATCH_SIZE (64 * 1024)             // streamed output produced between flushes
+#define CONN_POOL_MAX 256                         // closed connection objects a worker keeps
+#define CONN_LINGER_TIMEOUT 2                     // seconds an ended HTTP/2 session waits for the peer to close
+
+// A run of output bytes. Copied bytes live in the connection's write buffer
+// and are referenced by offset, since that buffer may move as it grows;
+// memory segments point at buffers handed over by the caller, and file
+// segments are sent straight from the page cache with sendfile().
+typedef struct {
+    const char* data;   // NULL for bytes in write_buf or a file
+    size_t offset;      // position in write_buf when data is NULL
+    size_t length;
+    void (*release)(void* owner);  // called once written, may be NULL
+    void* owner;
+    int fd;             // file to send from, closed once written; -1 otherwise
+    off_t file_offset;
+} out_segment_t;
+
+struct event_loop;
+struct ssl_st;
+struct http2_session;
+struct http2_stream;
+
+// The streamed body of the response currently being produced
+struct http_stream {
+    struct connection* conn;
+    http_stream_producer_t producer;
+    void* context;
+    void (*release)(void* context);
+    long long remaining;    // bytes still owed under a Content-Length, -1 otherwise
+    int chunked;
+    int failed;             // the producer overran its length or output failed
+    struct http2_stream* h2;  // the HTTP/2 stream it is the body of, NULL for HTTP/1.x
+};
+
+// What a connection's timer is waiting for
+#define CONN_TIMEOUT_UNSET (-1)  // whichever phase comes next gets a fresh deadline
+#define CONN_TIMEOUT_NONE 0      // the thread pool has the request
+#define CONN_TIMEOUT_HEADER 1    // a request's headers, from their first byte
+#define CONN_TIMEOUT_BODY 2      // more of a request body
+#define CONN_TIMEOUT_IDLE 3      // the next request on a persistent connection
+#define CONN_TIMEOUT_WRITE 4     // room in the socket for pending output
+#define CONN_TIMEOUT_LINGER 5    // the peer's close, once ours is sent
+
+// Per-connection state owned by the event loop
+typedef struct connection {
+    int fd;
+    struct event_loop* loop;
+    int request_count;
+    int close_after_write;   // no further requests: close once output is flushed
+    int lingering;           // our side is shut down; input is discarded until the peer's EOF
+    int peer_closed;         // read side hit EOF
+    int reaping;             // closed, and on its loop's closed list until the batch ends
+
+    // TLS session of a connection accepted on the TLS port, NULL otherwise.
+    // Reads and writes go through it once the handshake is done.
+    struct ssl_st* tls;
+    int tls_ready;           // handshake complete
+    int tls_ktls;            // the kernel encrypts what is sent, so sendfile() stays zero-copy
+
+    // Kept by the event loop: its list of connections and the one deadline
+    // the connection is working against
+    struct connection* prev;
+    struct connection* next;
+    timer_entry_t timer;
+    int timeout_phase;       // CONN_TIMEOUT_* the timer was armed for
+    int progress;            // bytes moved since then
+
+    // Read side: bytes received so far and the request being parsed from them
+    char* read_buf;
+    size_t read_start;       // first byte of the request being assembled
+    size_t read_len;
+    http_parser_t parser;
+    http_request_t request;  // views into read_buf, valid until it is consumed
+    struct arena* arena;     // scratch memory of the request being handled
+
+    // Request body being received: streamed into the route's body handler,
+    // whose request then waits for it, or skipped after the response
+    int body_active;
+    int body_route;          // routes[] index waiting for the body, -1 when skipping
+    body_decoder_t body;
+    const char* head;        // the waiting request's bytes in read_buf, until copied out
+    size_t head_len;
+
+    int offloaded;           // requests whose handlers are running on the thread pool
+
+    // Set once the connection speaks HTTP/2: requests are streams of the
+    // session rather than parsed from read_buf one after another
+    struct http2_session* h2;
+
+    // A response body being streamed; requests behind it wait until it ends
+    int streaming;
+    http_stream_t stream;
+
+    // Write side: queued output of every pending response, in order
+    char* write_buf;
+    size_t write_len;
+    size_t write_cap;
+    out_segment_t* segments;
+    int segment_head;        // first segment not fully written
+    int segment_count;
+    int segment_cap;
+    size_t head_sent;        // bytes of the head segment already written
+    size_t write_pending;    // total bytes still queued
+    int corked;              // TCP_CORK held so headers share a packet with file data
+
+    uring_conn_t ring;       // io_uring backend state
+} connection_t;
+
+connection_t* connection_create(struct event_loop* loop, int fd);
+void connection_destroy(connection_t* conn);
+// Free the connections closed while the loop was dispatching a batch
+void connection_reap(struct event_loop* loop);
+// Free the connection objects a loop kept for reuse
+void connection_pool_destroy(struct event_loop* loop);
+
+// Whether the -N and -M limits leave room for another connection; if not,
+// connection_refuse() answers 503 and closes the socket without setting up
+// anything for it
+int connection_admit(const server_config_t* config);
+void connection_refuse(int fd);
+
+// Append bytes to the pending output of a connection, copying them
+int connection_write(connection_t* conn, const void* data, size_t length);
+
+// Queue a buffer without copying; release(owner) runs once it has been sent,
+// or immediately on failure
+int connection_write_ref(connection_t* conn, const void* data, size_t length,
+                         void (*release)(void* owner), void* owner);
+
+// Queue length bytes of an open file starting at offset; the connection
+// takes over the descriptor and closes it when done (or on failure)
+int connection_write_file(connection_t* conn, int fd, off_t offset, size_t length);
+
+// Queue part of a file the caller keeps open; release(owner) runs instead of
+// close() once it has been sent, or immediately on failure
+int connection_write_file_ref(connection_t* conn, int fd, off_t offset, size_t length,
+                              void (*release)(void* owner), void* owner);
+
+// Account for bytes the io_uring backend got onto the socket
+void connection_sent(connection_t* conn, size_t written);
+
+// Drop all pending output unsent, releasing what it holds
+void connection_discard_output(connection_t* conn);
+
+// Take over the stream of a response whose headers were just queued
+void connection_start_stream(connection_t* conn, http_response_t* response);
+
+// Decide whether the connection survives this request
+int connection_keep_alive(connection_t* conn, const http_request_t* request);
+
+// Run a request's handler on the thread pool, see route_offload(); the
+// response is queued through complete_request() when it returns
+void connection_offload_request(connection_t* conn, http_request_t* request);
+
+// Memory held for connections outside their own buffers, e.g. HTTP/2
+// streams, counted against the -M budget
+void connection_charge_memory(long long bytes);
+int connection_memory_exhausted(const server_config_t* config);
+
+// Its loop is draining: close now if between requests (returns -1), or
+// let it finish; HTTP/2 sessions are sent GOAWAY
+int connection_drain(connection_t* conn);
+
+// Readiness callback: read, handle and write as far as the socket allows.
+// Returns 0 to keep the connection, -1 to close it.
+int connection_on_ready(connection_t* conn);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <stddef.h>
+
+// Content codings in order of preference; identity must stay first
+typedef enum {
+    ENCODING_IDENTITY = 0,
+    ENCODING_BROTLI,
+    ENCODING_GZIP,
+    ENCODING_COUNT
+} content_encoding_t;
+
+// Bodies smaller than this are not worth compressing
+#define MIN_COMPRESS_SIZE 256
+
+// Bitmask (1 << encoding) of the codings an Accept-Encoding value allows.
+// Identity is always included; a NULL header allows only identity.
+unsigned int parse_accept_encoding(const char* accept_encoding);
+
+const char* encoding_name(content_encoding_t encoding);     // "br", "gzip"
+const char* encoding_suffix(content_encoding_t encoding);   // ".br", ".gz"
+
+// Can this build produce the coding itself (as opposed to serving siblings)?
+int encoding_supported(content_encoding_t encoding);
+
+// Compress a whole buffer; returns a malloc'd result or NULL
+char* compress_buffer(content_encoding_t encoding, const char* data, size_t size,
+                      size_t* compressed_size);
+
+#endif
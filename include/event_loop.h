@@ -0,0 +1,83 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <time.h>
+#include "config.h"
+#include "arena.h"
+#include "timer_wheel.h"
+#include "buffer_pool.h"
+
+#define MAX_EVENTS 1024
+
+struct connection;
+struct worker_metrics;
+struct access_log_ring;
+struct pool_task;
+struct uring_loop;
+
+typedef struct event_loop {
+    int epoll_fd;                 // -1 when the io_uring backend drives the loop
+    struct uring_loop* uring;     // NULL under epoll
+    int listen_fd;
+    int tls_listen_fd;            // -1 without TLS
+    volatile int running;
+    const server_config_t* config;
+    uint64_t now_ms;              // monotonic milliseconds, refreshed once per wakeup
+    time_t date_second;           // wall-clock second that date was formatted for
+    char date[32];                // for Date headers, see http_prebuilt_send()
+    struct worker_metrics* metrics;  // this loop's counters, written only by it
+    struct access_log_ring* access_log;  // NULL when access logging is off
+    arena_pool_t arenas;          // recycled request arenas for this loop's connections
+    buffer_pool_t read_buffers;   // slab-allocated read buffers of its connections
+    struct connection* free_connections;  // closed connection objects kept for reuse
+    int free_connection_count;
+
+    // Finished thread pool tasks, pushed by pool threads and signalled on
+    // completion_fd; drained and completed on this loop's thread
+    int completion_fd;
+    struct pool_task* completions;
+
+    // Every open connection, and the deadline each one is working against
+    struct connection* connections;
+    timer_wheel_t timers;
+
+    // While an epoll batch is being dispatched, closed connections are only
+    // put on the closed list: events later in the batch may still name them.
+    // They are freed once the whole batch has been handled.
+    int dispatching;
+    struct connection* closed;
+
+    // Once draining the loop accepts nothing, closes connections as their
+    // requests finish, and returns when none are left or the deadline passes
+    int drain_requested;          // set by event_loop_drain() from any thread
+    int draining;
+    uint64_t drain_deadline_ms;
+} event_loop_t;
+
+int set_nonblocking(int fd);
+
+int event_loop_init(event_loop_t* loop, int listen_fd, int tls_listen_fd,
+                    const server_config_t* config);
+void event_loop_run(event_loop_t* loop);
+void event_loop_destroy(event_loop_t* loop);
+
+// Hand a finished task back to its loop; safe to call from any thread
+void event_loop_post(event_loop_t* loop, struct pool_task* task);
+void event_loop_run_completions(event_loop_t* loop);
+
+// Make the loop drain and return; safe to call from any thread
+void event_loop_drain(event_loop_t* loop);
+
+// Take on a freshly accepted client, speaking TLS if it came in on the TLS
+// listener; closes fd if that fails
+struct connection* event_loop_add_connection(event_loop_t* loop, int fd, int tls);
+
+// Add a connection to the loop's list, and take it off again along with its timer
+void event_loop_track(event_loop_t* loop, struct connection* conn);
+void event_loop_forget(event_loop_t* loop, struct connection* conn);
+
+// Close the connection unless something re-arms its timer within seconds
+void event_loop_set_timeout(event_loop_t* loop, struct connection* conn, int seconds);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_SHARDS 16           // independent locks, picked by path hash
+#define FILE_CACHE_BUCKETS 256         // hash buckets per shard
+
+// Open descriptors of files below the document root, keyed by normalized
+// URI path, with the status they had when opened. A hit costs a dup()
+// instead of a path walk in the kernel; paths that named no file are
+// remembered too, so missing precompressed siblings are not looked up on
+// every request. An entry is trusted for revalidate_interval seconds, then
+// opened again, so replaced, created and removed files are noticed.
+//
+// capacity bounds the entries kept (0 disables caching), and is lowered to
+// a quarter of the descriptor limit if that is smaller. Fails if the
+// document root cannot be opened; every lookup then fails with EBADF.
+int file_cache_init(const char* root, int capacity, int revalidate_interval);
+void file_cache_shutdown(void);
+
+// Open a regular file by its NUL-terminated path as normalize_uri_path()
+// produces it ("/css/site.css"). Returns a descriptor the caller owns and
+// fills *file_stat, or -1 with errno set.
+int file_cache_open(const char* path, size_t path_len, struct stat* file_stat);
+
+#endif
@@ -1,8 +1,22 @@
 #ifndef FILE_SERVER_H
 #define FILE_SERVER_H
 
+#include <sys/stat.h>
 #include "http.h"
+#include "config.h"
+#include "content_encoding.h"
+#include "mime_types.h"
 
+// Set up the asset cache, the MIME table and any asset pack from the configuration
+int init_file_server(const server_config_t* config);
 void serve_static_file_handler(http_request_t* request, http_response_t* response);
 
+// Content type of a file, by its extension
+const char* get_mime_type(const char* filename);
+
+// The header lines a file is served with in one coding, as cached entries
+// and asset packs store them; file_stat describes the identity file
+char* static_file_headers(const mime_type_t* mime, const struct stat* file_stat,
+                          content_encoding_t encoding);
+
 #endif
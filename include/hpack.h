@@ -0,0 +1,64 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+
+#define HPACK_TABLE_SIZE 4096          // SETTINGS_HEADER_TABLE_SIZE, the protocol default
+#define HPACK_ENTRY_OVERHEAD 32        // counted per entry on top of name and value (RFC 7541 4.1)
+#define HPACK_STATIC_ENTRIES 61
+
+// How the encoder may treat a field, see hpack_encode()
+#define HPACK_INDEX 0          // add it to the dynamic table for later responses
+#define HPACK_NO_INDEX 1       // unique to this message (dates, validators, lengths)
+#define HPACK_NEVER_INDEX 2    // sensitive: intermediaries must not index it either
+
+typedef struct hpack_entry hpack_entry_t;
+
+// The dynamic table one direction of a connection keeps: entries newest
+// first in a ring, evicted oldest first once their sizes pass max_size
+typedef struct {
+    hpack_entry_t** entries;
+    int capacity;
+    int first;                 // ring position of the newest entry
+    int count;
+    size_t size;
+    size_t max_size;           // current size, set by size updates
+    size_t limit;              // the most max_size may be, from SETTINGS
+    int update_pending;        // encoder: announce the new size in the next block
+    size_t update_min;         // smallest size it went through since the last block
+} hpack_table_t;
+
+// A header block being encoded
+typedef struct {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+} hpack_block_t;
+
+void hpack_table_init(hpack_table_t* table, size_t limit);
+void hpack_table_destroy(hpack_table_t* table);
+
+// The encoder's peer changed SETTINGS_HEADER_TABLE_SIZE: shrink or grow to
+// it, announced at the start of the next block
+void hpack_table_set_limit(hpack_table_t* table, size_t limit);
+
+// Called for each field of a block in order. Pointers are only valid for
+// the call; values may contain any byte but NUL-free names are not checked.
+typedef void (*hpack_field_t)(void* context, const char* name, size_t name_len,
+                              const char* value, size_t value_len);
+
+// Decode a complete header block. Returns 0, or -1 when it is malformed,
+// which leaves the table out of step with the peer (a connection error).
+// Every field is decoded even once the caller has no more use for them.
+int hpack_decode(hpack_table_t* table, const unsigned char* block, size_t length,
+                 hpack_field_t field, void* context);
+
+// Append one field to block, from the static or dynamic table where it can,
+// Huffman-coded where that is shorter. Names are lowercased, as HTTP/2
+// requires. Returns -1 when the block cannot grow.
+int hpack_encode(hpack_table_t* table, hpack_block_t* block, const char* name, size_t name_len,
+                 const char* value, size_t value_len, int indexing);
+
+void hpack_block_free(hpack_block_t* block);
+
+#endif
@@ -3,38 +3,236 @@
 #define HTTP_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define MAX_HEADERS 50
-#define MAX_HEADER_SIZE 256
 #define MAX_URI_SIZE 1024
-#define MAX_METHOD_SIZE 16
-#define MAX_VERSION_SIZE 16
+#define RESPONSE_HEADER_INLINE 1024   // response header bytes stored without malloc
+#define MAX_BYTE_RANGES 16
+#define BYTERANGES_BOUNDARY_LEN 24    // hex digits of a multipart/byteranges boundary
+#define MAX_ROUTE_PARAMS 8
+#define ROUTE_UNMATCHED (-2)   // request->route before route_find() has run
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"   // IMF-fixdate, for strftime()
 
+// Header names the server itself looks at, interned so that a lookup is an
+// array index rather than a string search
+typedef enum {
+    HTTP_HEADER_UNKNOWN = 0,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_ACCEPT_RANGES,
+    HTTP_HEADER_ALLOW,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_ENCODING,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_RANGE,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_COOKIE,
+    HTTP_HEADER_DATE,
+    HTTP_HEADER_ETAG,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_LAST_MODIFIED,
+    HTTP_HEADER_LOCATION,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_SERVER,
+    HTTP_HEADER_SET_COOKIE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_VARY,
+    HTTP_HEADER_KNOWN_COUNT
+} http_header_id_t;
+
+// A request header as a view into the receive buffer
+typedef struct {
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+    http_header_id_t id;
+} http_header_t;
+
+struct arena;
+struct http2_stream;
+
+// A ":name" or "*" capture from the matched route, as a view into the URI.
+// Unlike the other request views these are not NUL-terminated.
+typedef struct {
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+} route_param_t;
+
+// Every string in a parsed request is a (pointer, length) view into the
+// buffer it was parsed from. The parser also NUL-terminates each view in
+// place, so they can be used as C strings while that buffer is alive.
 typedef struct {
-    char method[MAX_METHOD_SIZE];
-    char uri[MAX_URI_SIZE];
-    char version[MAX_VERSION_SIZE];
-    char headers[MAX_HEADERS][2][MAX_HEADER_SIZE];  // [index][key/value][string]
+    const char* method;
+    size_t method_len;
+    const char* uri;
+    size_t uri_len;
+    const char* version;
+    size_t version_len;
+    http_header_t headers[MAX_HEADERS];
     int header_count;
+    uint8_t known_headers[HTTP_HEADER_KNOWN_COUNT];  // 1 + index of the first such header, 0 if absent
+    route_param_t params[MAX_ROUTE_PARAMS];   // filled in by route_find()
+    int param_count;
+    int route;                 // routes[] index from route_find(), or ROUTE_UNMATCHED
+    void* body_context;        // for the route's body handler, e.g. from route_alloc()
+    int offload_state;         // see route_offload()
+    struct arena* arena;       // per-request scratch memory, see route_alloc()
     char* body;
-    size_t body_length;
+    size_t body_length;        // bytes of a streamed body, see route_body_handler_t
+    struct http2_stream* stream;  // the HTTP/2 stream it came on, NULL for HTTP/1.x
 } http_request_t;
 
+// One part of a Range request, resolved against the representation's length
+typedef struct {
+    off_t offset;
+    size_t length;
+} byte_range_t;
+
+// A response body generated after the headers are sent, see http_response_stream()
+typedef struct http_stream http_stream_t;
+typedef int (*http_stream_producer_t)(http_stream_t* stream, void* context);
+
+#define HTTP_STREAM_MORE 0    // call the producer again once there is room
+#define HTTP_STREAM_DONE 1    // the body is complete
+#define HTTP_STREAM_ERROR -1  // abandon the body; the connection is closed
+
+// A response header: offsets into the response's header buffer. Known
+// names are stored as their id alone.
+typedef struct {
+    uint32_t name_offset;
+    uint32_t value_offset;
+    uint32_t value_len;
+    uint16_t name_len;
+    uint8_t id;
+} http_response_header_t;
+
 typedef struct {
     int status_code;
-    char headers[MAX_HEADERS][2][MAX_HEADER_SIZE];
+    int keep_alive;   // emit "Connection: keep-alive" instead of "close"
+    // Added with http_response_add_header(); bytes live in header_inline
+    // until they outgrow it, then in the malloc()ed header_buf
+    http_response_header_t headers[MAX_HEADERS];
     int header_count;
+    char* header_buf;
+    size_t header_len;
+    size_t header_cap;
+    char header_inline[RESPONSE_HEADER_INLINE];
+    const char* raw_headers;   // pre-serialized header lines sent after headers[]
+    size_t raw_headers_len;
     char* body;
     size_t body_length;
+    void (*body_release)(void* owner);  // if set, called instead of free(body)
+    void* body_owner;
+    int body_fd;        // when >= 0 the body is body_length bytes of this file
+    off_t body_offset;
+    // Set by set_byte_ranges(): only these parts of body/body_fd are sent
+    byte_range_t ranges[MAX_BYTE_RANGES];
+    int range_count;
+    off_t range_complete_length;
+    const char* range_content_type;
+    char range_boundary[BYTERANGES_BOUNDARY_LEN + 1];  // random, for multipart/byteranges
+    // Set by http_response_stream(): the body comes from a producer instead
+    http_stream_producer_t stream_producer;
+    void* stream_context;
+    void (*stream_release)(void* context);
+    long long stream_length;   // -1 when not known in advance
 } http_response_t;
 
+typedef enum {
+    HTTP_PARSE_TOO_MANY_HEADERS = -4,     // more than MAX_HEADERS header lines
+    HTTP_PARSE_URI_TOO_LONG = -3,         // request target of MAX_URI_SIZE or more
+    HTTP_PARSE_VERSION_UNSUPPORTED = -2,  // well-formed, but not HTTP/1.0 or HTTP/1.1
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_INCOMPLETE = 0,
+    HTTP_PARSE_DONE = 1
+} http_parse_status_t;
+
+// Resumable request parser state. Call http_parser_execute() each time more
+// bytes arrive; the buffer must keep its address until the request is done.
+typedef struct {
+    int state;
+    size_t offset;   // next byte to examine; the request length once done
+    size_t mark;     // start of the token currently being scanned
+} http_parser_t;
+
+struct connection;
+
 // Function declarations
-int parse_http_request(const char* raw_request, http_request_t* request);
+void http_parser_init(http_parser_t* parser);
+http_parse_status_t http_parser_execute(http_parser_t* parser, http_request_t* request,
+                                        char* buffer, size_t length);
+int parse_http_request(char* raw_request, size_t length, http_request_t* request);
 void init_http_request(http_request_t* request);
 void free_http_request(http_request_t* request);
+const char* get_http_header(const http_request_t* request, const char* name);
+const char* get_known_header(const http_request_t* request, http_header_id_t id);
+// Move every view of a request whose bytes were copied from old_base to new_base
+void http_request_relocate(http_request_t* request, const char* old_base, size_t length,
+                           char* new_base);
+
+// Map a header name to its interned id, HTTP_HEADER_UNKNOWN if it has none
+http_header_id_t http_header_intern(const char* name, size_t length);
+const char* http_header_name(http_header_id_t id);
+
+// Response headers are copied, so values may be of any length and need not
+// outlive the call. Return -1 when a header cannot be stored.
+int http_response_add_header(http_response_t* response, const char* name, const char* value);
+int http_response_add_header_len(http_response_t* response, const char* name,
+                                 const char* value, size_t value_len);
+int http_response_add_headerf(http_response_t* response, const char* name, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+// Replace the first header of that name, or add it
+int http_response_set_header(http_response_t* response, const char* name, const char* value);
+void http_response_clear_headers(http_response_t* response);
+const char* http_response_header_name(const http_response_t* response, int index, size_t* length);
+const char* http_response_header_value(const http_response_t* response, int index, size_t* length);
+// Stream the body instead of setting it. Once the headers are queued the
+// producer is called whenever the connection can take more output; it
+// writes with http_stream_write() and returns HTTP_STREAM_MORE until done.
+// With length -1 the body is sent chunked, or until the connection closes
+// when it is not kept alive. release(context), if set, runs once the
+// stream has ended for any reason. Neither context nor the producer may
+// rely on request views, which go stale once the handler returns; copy
+// what is needed into route_alloc() memory.
+void http_response_stream(http_response_t* response, http_stream_producer_t producer,
+                          void* context, void (*release)(void* context), long long length);
+int http_stream_write(http_stream_t* stream, const void* data, size_t length);
+int http_stream_printf(http_stream_t* stream, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
 void init_http_response(http_response_t* response);
 void free_http_response(http_response_t* response);
-int send_http_response(int client_fd, http_response_t* response);
+// Turn a response holding a whole representation into a 206 carrying only
+// the given ranges (multipart/byteranges when there is more than one)
+void set_byte_ranges(http_response_t* response, const byte_range_t* ranges, int count,
+                     off_t complete_length, const char* content_type);
+int send_http_response(struct connection* conn, http_response_t* response);
+
+// A fixed response serialized once, status line, headers and body in one
+// buffer, for routes that answer every request the same way. Sending it is
+// a copy into the output buffer: no formatting and no allocation. With
+// HTTP_PREBUILT_DATE it carries a Date header kept current as it is sent.
+typedef struct http_prebuilt http_prebuilt_t;
+#define HTTP_PREBUILT_DATE 1
+
+http_prebuilt_t* http_prebuilt_create(int status_code, const char* content_type,
+                                      const char* body, size_t body_length, int flags);
+void http_prebuilt_destroy(http_prebuilt_t* prebuilt);
+int http_prebuilt_status(const http_prebuilt_t* prebuilt);
+size_t http_prebuilt_body_length(const http_prebuilt_t* prebuilt);
+int http_prebuilt_send(struct connection* conn, const http_prebuilt_t* prebuilt, int keep_alive);
+// The same response as an ordinary one, for callers without a connection
+void http_prebuilt_fill(const http_prebuilt_t* prebuilt, http_response_t* response);
 
 #endif
 
@@ -0,0 +1,66 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+#include "http.h"
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+#define HTTP2_FRAME_HEADER_SIZE 9
+#define HTTP2_MAX_FRAME_SIZE 16384            // largest frame taken in, the protocol minimum
+#define HTTP2_SEND_FRAME_MAX (64 * 1024)      // largest DATA frame sent, if the peer allows it
+#define HTTP2_MAX_CONCURRENT_STREAMS 128
+#define HTTP2_STREAM_WINDOW (256 * 1024)      // request body bytes a stream may have in flight
+#define HTTP2_CONNECTION_WINDOW (1024 * 1024) // and all streams together
+#define HTTP2_MAX_HEADER_LIST_SIZE 16384      // decoded request headers, as announced
+#define HTTP2_MAX_HEADER_BLOCK (64 * 1024)    // compressed, across CONTINUATION frames
+
+struct connection;
+struct http2_stream;
+
+// HTTP/2 runs a connection's requests as multiplexed streams, each with its
+// own http_request_t and arena, through the same handle_request() the
+// HTTP/1.1 parser feeds. Responses come back through finish_request() and
+// are framed here instead of serialized: headers HPACK-coded, bodies sent
+// as DATA frames from the same memory and files, under flow control.
+
+// Whether data starts with the client preface, or could once more arrives
+int http2_match_preface(const char* data, size_t length);
+
+// Switch the connection to HTTP/2 (chosen by ALPN, or a client that opened
+// with the preface): queue the server's SETTINGS and expect the preface.
+// Returns -1 when the session cannot be set up.
+int http2_start(struct connection* conn);
+
+// Answer an HTTP/1.1 "Upgrade: h2c" request with 101 and carry on with it
+// as stream 1. Returns 1 when the connection has switched, 0 to serve the
+// request over HTTP/1.1 after all.
+int http2_upgrade(struct connection* conn, http_request_t* request);
+
+// Handle every complete frame buffered, then frame output of the open
+// streams as far as flow control lets it. Returns 1 if it stopped early
+// because too much output is pending.
+int http2_process(struct connection* conn);
+
+// The CONN_TIMEOUT_* phase while nothing is offloaded or waiting to be written
+int http2_timeout_phase(const struct connection* conn);
+
+// Send GOAWAY: streams already open finish, no new ones are taken, and the
+// connection closes after the last
+void http2_shutdown(struct connection* conn);
+
+// Release the session and every stream still open; once output is discarded
+void http2_destroy(struct connection* conn);
+
+// Queue the response to a stream's request, see finish_request(). Takes the
+// body over; whatever it leaves in response the caller frees as usual.
+void http2_send_response(struct connection* conn, http_request_t* request,
+                         http_response_t* response);
+
+// The handler of an offloaded stream request has returned
+void http2_request_done(struct connection* conn, http_request_t* request);
+
+// Output of a stream producer, held until flow control lets it go
+int http2_stream_write(struct http2_stream* stream, const void* data, size_t length);
+
+#endif
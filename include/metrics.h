@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "http.h"
+#include "router.h"
+
+// Log-linear (HDR-style) latency buckets: values below 2^SUB_BUCKET_BITS ns
+// get exact buckets, every power of two above is split into as many equal
+// sub-buckets, so each bucket is within ~6% of the values it holds.
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_VALUE_BITS 36      // ~68 s; slower requests share the last bucket
+#define METRICS_HISTOGRAM_BUCKETS \
+    ((METRICS_MAX_VALUE_BITS - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+#define METRICS_STATUS_CODES 600
+#define METRICS_STATUS_CLASSES 5       // 1xx .. 5xx
+#define METRICS_UNROUTED MAX_ROUTES    // requests no registered route handled
+
+// Outcomes of TLS handshakes, see metrics_tls_handshake()
+#define METRICS_TLS_FULL 0
+#define METRICS_TLS_RESUMED 1          // from a session id or a ticket
+#define METRICS_TLS_FAILED 2
+#define METRICS_TLS_KTLS 3             // also counted: the kernel took over sending
+#define METRICS_TLS_KINDS 4
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} latency_histogram_t;
+
+// One worker's counters. Only the owning worker writes them, so updates are
+// plain relaxed stores; /metrics sums every worker's copy without locking.
+// Each block starts on its own cache line so workers never share one.
+typedef struct worker_metrics {
+    uint64_t connections_accepted;
+    uint64_t connections_closed;
+    uint64_t connections_rejected;
+    uint64_t tls_handshakes[METRICS_TLS_KINDS];
+    uint64_t response_bytes;
+    uint64_t status_counts[METRICS_STATUS_CODES];
+    latency_histogram_t routes[MAX_ROUTES + 1];
+    latency_histogram_t status_classes[METRICS_STATUS_CLASSES];
+    struct worker_metrics* next;
+} __attribute__((aligned(64))) worker_metrics_t;
+
+// Allocate a worker's block and make it visible to /metrics. Blocks live
+// for the rest of the process so a concurrent scrape never sees one freed.
+worker_metrics_t* metrics_register_worker(void);
+
+uint64_t metrics_now_ns(void);
+void metrics_connection_accepted(worker_metrics_t* metrics);
+void metrics_connection_closed(worker_metrics_t* metrics);
+void metrics_connection_rejected(worker_metrics_t* metrics);
+void metrics_tls_handshake(worker_metrics_t* metrics, int kind);
+
+// route is an index into routes[], or METRICS_UNROUTED
+void metrics_record_request(worker_metrics_t* metrics, int route, int status_code,
+                            size_t bytes, uint64_t duration_ns);
+
+// GET /metrics in the Prometheus text exposition format
+void handle_metrics_request(http_request_t* request, http_response_t* response);
+
+#endif
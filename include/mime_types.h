@@ -0,0 +1,22 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#define MIME_EXTENSION_MAX 16       // longer extensions always get the default type
+
+// A content type as it goes into Content-Type, and whether it is worth
+// offering gzip/brotli variants of
+typedef struct {
+    const char* type;
+    int compressible;
+} mime_type_t;
+
+// Build the extension table from the built-in types plus, when path is not
+// NULL, a mime.types file ("type ext1 ext2 ..." lines) whose entries win.
+// The table is read-only afterwards, so lookups need no locking.
+int mime_types_init(const char* path);
+void mime_types_shutdown(void);
+
+// Type of a file by its extension, case-insensitively; never NULL
+const mime_type_t* mime_type_for(const char* filename);
+
+#endif
@@ -1,9 +1,18 @@
 #ifndef PARSE_HTTP_REQUEST_SUPPLEMENT_H
 #define PARSE_HTTP_REQUEST_SUPPLEMENT_H
 
-char* find_header_end(const char* raw_request);
-char* find_request_line_end(const char* raw_request);
-char* copy_line(const char* start, const char* end);
-int parse_header(const char* header_line, http_request_t* request);
+#include "http.h"
+
+// Each scanner returns the first byte in [start, end) that ends the current
+// token, or end if the token continues past the data received so far.
+const char* scan_token(const char* start, const char* end);
+const char* scan_uri(const char* start, const char* end);
+const char* scan_header_value(const char* start, const char* end);
+
+// Scanners use SSE4.2/AVX2 or NEON when the CPU has them, chosen on first use
+void select_request_scanners(void);
+const char* request_scanner_name(void);
+
+void terminate_request_views(char* buffer, http_request_t* request);
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include "config.h"
+
+#define RELOAD_ENV "HTTP_SERVER_LISTENERS"   // descriptor the listeners arrive on
+#define RELOAD_READY_TIMEOUT 30              // seconds a new process has to start serving
+
+// What reload_wait() was woken for
+#define RELOAD_NONE 0
+#define RELOAD_RELOAD 1    // SIGHUP or SIGUSR2: hand over to a new process, then drain
+#define RELOAD_STOP 2      // SIGTERM or SIGINT: drain and exit
+
+// Zero-downtime reload. The running server starts its binary again with
+// the arguments it was given and passes it every listening socket over a
+// UNIX socket (SCM_RIGHTS). The new process sets up its routes, caches and
+// workers around them and says when it is accepting; only then do the old
+// workers stop accepting and drain. The sockets stay open throughout, so no
+// client is refused and nothing has to bind again.
+
+// Remember how the server was started and, in a process started by a
+// reload, receive the listeners. Adds workers so every inherited listener
+// has one. Returns -1 when they cannot be used with this configuration.
+int reload_init(char** argv, server_config_t* config);
+
+// An inherited listener for the plain (tls 0) or TLS port, -1 once none are left
+int reload_take_listener(int tls);
+
+// The workers are accepting: tell the process being replaced, and close
+// inherited listeners no worker took
+void reload_ready(void);
+
+// Start a new process and hand it the listeners (tls_listen_fds entries may
+// be -1). Returns 0 once it serves; on failure this process carries on.
+int reload_spawn(const int* listen_fds, const int* tls_listen_fds, int count);
+
+// The signals above are taken here rather than by handlers. Block them
+// before any thread starts, so that none of them is interrupted instead.
+void reload_block_signals(void);
+int reload_wait(int timeout_ms);
+
+#endif
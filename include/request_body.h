@@ -0,0 +1,50 @@
+#ifndef REQUEST_BODY_H
+#define REQUEST_BODY_H
+
+#include <stddef.h>
+#include "http.h"
+
+typedef enum {
+    BODY_FRAMING_NONE,
+    BODY_FRAMING_LENGTH,    // Content-Length
+    BODY_FRAMING_CHUNKED    // Transfer-Encoding: chunked
+} body_framing_t;
+
+typedef enum {
+    BODY_INCOMPLETE = 0,
+    BODY_DONE = 1,
+    BODY_INVALID = -1,      // malformed chunked framing
+    BODY_TOO_LARGE = -2,    // the decoded body would pass its limit
+    BODY_REJECTED = -3      // the sink returned a status, see body_decoder_t.status
+} body_status_t;
+
+// Receives each run of decoded body bytes. Returns 0 to go on, or an HTTP
+// status code to stop reading the body.
+typedef int (*body_sink_t)(void* context, const char* data, size_t length);
+
+// Resumable request body decoder. Body bytes are handed to the sink as they
+// arrive, straight out of the caller's buffer, so memory use does not grow
+// with the size of the body.
+typedef struct {
+    body_framing_t framing;
+    int state;
+    unsigned long long remaining;   // bytes left of the body or of the current chunk
+    unsigned long long received;    // decoded bytes delivered so far
+    unsigned long long limit;
+    int size_digits;                // hex digits of the chunk size read so far
+    int status;                     // the sink's status after BODY_REJECTED
+} body_decoder_t;
+
+// Work out how the body of request is framed. Returns 0, or the HTTP status
+// to answer with: 400 for contradictory or malformed framing, 501 for a
+// transfer coding other than chunked, 413 when Content-Length passes limit.
+int body_decoder_init(body_decoder_t* decoder, const http_request_t* request,
+                      unsigned long long limit);
+
+// Decode up to length bytes, storing how many were used in *consumed. A NULL
+// sink discards the body. Everything up to the end of the body is consumed,
+// so on BODY_DONE the rest of the buffer belongs to the next request.
+body_status_t body_decoder_execute(body_decoder_t* decoder, const char* data, size_t length,
+                                   size_t* consumed, body_sink_t sink, void* context);
+
+#endif
@@ -2,25 +2,82 @@
 #define ROUTER_H
 
 #include "http.h"
-//
-// Define the route structure
+
+typedef void (*route_handler_t)(http_request_t*, http_response_t*);
+
+// Called with each run of request body bytes as they arrive; the route's
+// handler runs once the whole body has been seen. Returns 0 to go on or an
+// HTTP status (413, 500, ...) to refuse the request. Called once more with
+// data NULL if the body is abandoned part way, so it can release what it holds.
+typedef int (*route_body_handler_t)(http_request_t* request, const char* data, size_t length);
+
+// Define the route structure. Paths are patterns: literal text, ":name"
+// to capture one segment, and a trailing "*" (or "*name") to capture the
+// rest of the path, e.g. "/users/:id" or "/static/*".
 typedef struct {
+    const char* method;
     const char* path;
-    void (*handler)(http_request_t*, http_response_t*);
+    route_handler_t handler;
+    route_body_handler_t on_body;   // NULL: any request body is discarded
+    size_t max_body_size;           // 0: the server-wide limit
+    int offload;                    // handler blocks: always run it on the thread pool
+    const http_prebuilt_t* prebuilt;  // sent as is instead of running a handler
 } route_t;
 
+// request->offload_state
+#define ROUTE_INLINE 0               // running on the event loop
+#define ROUTE_OFFLOAD_REQUESTED 1    // handler asked to continue on the pool
+#define ROUTE_ON_POOL 2              // running on a pool thread
+
 #define MAX_ROUTES 50
 
 // Expose routes array and count as extern
 extern route_t routes[MAX_ROUTES];
 extern int route_count;
 
+// Register a GET route
+void register_route(const char* path, route_handler_t handler);
+void register_method_route(const char* method, const char* path, route_handler_t handler);
+// A route whose handler may block, so it never runs on the event loop
+void register_offload_route(const char* method, const char* path, route_handler_t handler);
+// A route that streams its request body through on_body
+void register_body_route(const char* method, const char* path, route_handler_t handler,
+                         route_body_handler_t on_body, size_t max_body_size);
+
+// A route that always answers with the same pre-serialized response
+void register_prebuilt_route(const char* method, const char* path, const http_prebuilt_t* prebuilt);
+
+// Build the lookup tree from every registered route; call once after registering
+int router_compile(void);
+
+// Match the URI path (the query string is ignored) and method and fill in
+// the route parameters. Stores the index in routes[] in request->route and
+// returns it, or -1 when no route takes the request.
+int route_find(http_request_t* request);
+
+// Run the handler of the matched route, calling route_find() first unless
+// that was already done. Unknown paths get a 404, known paths with another
+// method a 405. Returns the index in routes[] of the route that ran, or -1.
+int handle_route(http_request_t* request, http_response_t* response);
+
+// For handlers that block only sometimes, e.g. on a cache miss. Returns 1
+// when the handler should return at once: it will be called again on a
+// pool thread, where this returns 0 and it can go ahead and block. Also 0
+// when there is no thread pool to move to.
+int route_offload(http_request_t* request);
+
+// Scratch memory for a handler, released in one step once the response has
+// been sent; never free() it. Requests that did not come from a connection
+// have no arena and get malloc()ed memory instead.
+void* route_alloc(http_request_t* request, size_t size);
+char* route_strdup(http_request_t* request, const char* text);
+
+// Use memory from route_alloc() as the response body without copying it
+void route_set_body(http_request_t* request, http_response_t* response, char* body, size_t length);
 
-void register_route(const char* path, void (*handler)(http_request_t*, http_response_t*));
-void handle_route(http_request_t* request, http_response_t* response);
+// A capture of the matched route: "id" for ":id", "*" for a bare "*"
+const char* get_route_param(const http_request_t* request, const char* name, size_t* length);
 
-void handle_home_page(http_request_t* request, http_response_t* response);
-void handle_hello_page(http_request_t* request, http_response_t* response);
-void handle_not_found(http_response_t* response);
+void handle_not_found(http_request_t* request, http_response_t* response);
 
 #endif
@@ -1,10 +1,19 @@
 #ifndef SEND_HTTP_RESPONSE_SUPPLEMENT_H
 #define SEND_HTTP_RESPONSE_SUPPLEMENT_H
 
-void update_status_line(int client_fd, http_response_t* response);
-void add_headers(int client_fd, http_response_t* response);
-void update_headers(int client_fd, http_response_t* response);
-void update_content_length(int client_fd, http_response_t* response);
-void write_body(int client_fd, http_response_t* response);
+#include "http.h"
+#include "connection.h"
+
+const char* get_status_text(int status_code);
+void update_status_line(connection_t* conn, http_response_t* response);
+void add_headers(connection_t* conn, http_response_t* response);
+void update_headers(connection_t* conn, http_response_t* response);
+void update_content_length(connection_t* conn, http_response_t* response);
+void update_connection_header(connection_t* conn, http_response_t* response);
+// Header block in front of one part of a multipart/byteranges body
+int format_part_header(char* buffer, size_t size, const http_response_t* response, int index);
+// The closing delimiter of a multipart/byteranges body
+int format_parts_end(char* buffer, size_t size, const http_response_t* response);
+void write_body(connection_t* conn, http_response_t* response);
 
 #endif
@@ -1,10 +1,14 @@
 #ifndef SERVE_STATIC_FILE_SUPPLEMENT_H
 #define SERVE_STATIC_FILE_SUPPLEMENT_H
 
+#include <sys/stat.h>
+#include <sys/types.h>
 #include "../include/http.h"
 
 
 int validate_file(const char* file_path, struct stat* file_stat);
-void* read_file_content(const char* file_path, size_t file_size, size_t* bytes_read);
+int open_static_file(const char* file_path, struct stat* file_stat);
+void* read_file_descriptor(int fd, size_t file_size);
+void* read_file_content(const char* file_path, size_t file_size, ssize_t* bytes_read);
 
 #endif
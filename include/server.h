@@ -0,0 +1,25 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include "http.h"
+#include "connection.h"
+
+// Route one parsed request and queue its response on the connection.
+// Returns 1 instead when the handler has to continue on the thread pool.
+int handle_request(connection_t* conn, http_request_t* request);
+
+// Run an offloaded request's handler; called on a pool thread. Returns the
+// routes[] index that ran, for complete_request() back on the event loop.
+int handle_offloaded_request(http_request_t* request, http_response_t* response);
+void complete_request(connection_t* conn, http_request_t* request, http_response_t* response,
+                      int route, uint64_t started);
+
+// Refuse a request with an error status and close the connection once the
+// response is out. A NULL request means the client sent something unparseable.
+void handle_request_error(connection_t* conn, http_request_t* request, int status);
+
+// Register every route and build the router; once, before any worker starts
+int setup_routes(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#define DEFAULT_POOL_DEQUE_SIZE 64   // initial tasks per thread deque, grows as needed
+
+struct event_loop;
+
+// A unit of blocking work. run() executes on a pool thread; complete() is
+// then called on the thread of the event loop that submitted it, woken
+// through the loop's eventfd, so it may touch connections freely.
+typedef struct pool_task {
+    void (*run)(struct pool_task* task);
+    void (*complete)(struct pool_task* task);
+    struct event_loop* loop;
+    struct pool_task* next;   // completion list link, owned by the pool
+} pool_task_t;
+
+// Start threads workers, each with its own deque; idle workers steal from
+// the others. Zero threads leaves the pool off.
+int thread_pool_start(int threads);
+void thread_pool_stop(void);
+int thread_pool_running(void);
+
+// Queue a task. Returns -1 if there is no pool; the caller runs it inline.
+int thread_pool_submit(pool_task_t* task);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_TICK_MS 100     // resolution of every deadline
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4        // 64 ticks per slot at level 1, 4096 at level 2, ...
+
+// A deadline embedded in whatever it times out. Entries are linked into one
+// slot of the wheel, so arming, re-arming and cancelling are O(1).
+typedef struct timer_entry {
+    struct timer_entry* next;
+    struct timer_entry* prev;   // NULL while not armed
+    uint64_t expires;           // tick at which it fires
+} timer_entry_t;
+
+// Hierarchical timing wheel: level 0 holds the next 64 ticks one slot each;
+// every higher level holds 64 times the span of the one below, and its
+// slots are redistributed downwards as time reaches them. Advancing visits
+// only the slots whose time has come, never the entries that are not due.
+typedef struct {
+    uint64_t now;               // current tick
+    unsigned int count;         // armed entries
+    timer_entry_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list heads
+} timer_wheel_t;
+
+typedef void (*timer_expire_t)(timer_entry_t* timer, void* context);
+
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t now);
+
+// Arm (or re-arm) a timer to fire at tick expires; the past means the next tick
+void timer_wheel_schedule(timer_wheel_t* wheel, timer_entry_t* timer, uint64_t expires);
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_entry_t* timer);
+
+static inline int timer_armed(const timer_entry_t* timer) {
+    return timer->prev != 0;
+}
+
+// Move the wheel to tick now, calling expire for every timer that came due.
+// The timer is disarmed before its callback, which may arm it again.
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t now, timer_expire_t expire, void* context);
+
+// Milliseconds until the wheel next has work to do, -1 when nothing is armed
+int timer_wheel_timeout_ms(const timer_wheel_t* wheel);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "config.h"
+
+#define TLS_RECORD_SIZE 16384        // largest TLS plaintext record
+#define TLS_SESSION_CACHE_SIZE 20480 // sessions kept for TLS 1.2 resumption by id
+
+struct connection;
+
+// Build the server context from the -c certificate chain and -K key, shared
+// by every worker. Does nothing when neither is given; fails when TLS is
+// asked for but cannot be set up, or the build has no OpenSSL.
+int tls_init(const server_config_t* config);
+int tls_enabled(void);
+void tls_shutdown(void);
+
+// Give a freshly accepted connection a server-side TLS session
+int tls_attach(struct connection* conn);
+
+// Drive the handshake: 1 once it is complete, 0 while waiting on the
+// socket, -1 on failure
+int tls_handshake(struct connection* conn);
+
+// Whether the client and server settled on HTTP/2 through ALPN
+int tls_alpn_is_h2(struct connection* conn);
+
+// The syscalls the connection would otherwise make, over the session:
+// -1 with errno EAGAIN while the socket (or the session) needs to wait,
+// and 0 from tls_read() once the peer has closed
+ssize_t tls_read(struct connection* conn, void* buf, size_t length);
+ssize_t tls_writev(struct connection* conn, const struct iovec* iov, int iov_count);
+
+// Zero-copy through kTLS when the kernel took over the session's record
+// layer, otherwise read into a record-sized buffer and encrypted here
+ssize_t tls_sendfile(struct connection* conn, int fd, off_t offset, size_t length);
+
+// Send close_notify if the socket takes it, then free the session
+void tls_detach(struct connection* conn);
+
+#endif
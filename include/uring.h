@@ -0,0 +1,75 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// A thin io_uring wrapper over the raw system calls: the submission and
+// completion rings mapped from the kernel, plus provided buffer rings that
+// multishot receives pick their buffers from.
+typedef struct uring {
+    int fd;
+    unsigned int features;
+
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int sq_pending;     // sqes filled in but not yet submitted
+
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;               // same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+// Buffers the kernel fills for receives armed with IOSQE_BUFFER_SELECT
+typedef struct {
+    struct io_uring_buf_ring* ring;
+    char* buffers;
+    unsigned int entries;        // power of two
+    unsigned int buffer_size;
+    uint16_t group;
+    uint16_t tail;
+} uring_buf_ring_t;
+
+// Set up a ring with room for entries submissions. Returns -1 when the
+// kernel has no io_uring or lacks the operations this server relies on.
+int uring_init(uring_t* ring, unsigned int entries);
+void uring_destroy(uring_t* ring);
+
+// Next free submission entry, zeroed; submits what is queued when full
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+// Make sure count entries can be taken without a submission in between,
+// as a linked chain must reach the kernel in one piece
+int uring_reserve(uring_t* ring, unsigned int count);
+
+// Submit queued entries and wait for at least one completion, or until
+// timeout_ms passes (-1 waits indefinitely)
+int uring_submit_and_wait(uring_t* ring, int timeout_ms);
+
+// Completions are consumed in order; uring_cqe_seen() releases the oldest
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+void uring_cqe_seen(uring_t* ring);
+
+int uring_buf_ring_init(uring_t* ring, uring_buf_ring_t* buf_ring, uint16_t group,
+                        unsigned int entries, unsigned int buffer_size);
+void uring_buf_ring_destroy(uring_t* ring, uring_buf_ring_t* buf_ring);
+
+static inline char* uring_buffer(const uring_buf_ring_t* buf_ring, unsigned int id) {
+    return buf_ring->buffers + (size_t)id * buf_ring->buffer_size;
+}
+
+// Hand a buffer back to the kernel
+void uring_buf_ring_recycle(uring_buf_ring_t* buf_ring, unsigned int id);
+
+#endif
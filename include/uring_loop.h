@@ -0,0 +1,74 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 4096              // submission queue size per worker
+#define URING_RECV_BUFFERS 512          // provided receive buffers per worker, power of two
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_CONN_MAX_SPILL (16 * 1024) // received bytes a connection holds before its receive pauses
+#define URING_FILE_CHUNK (64 * 1024)    // file bytes read and sent per linked pair
+
+struct connection;
+struct event_loop;
+struct uring_loop;
+struct uring_send;
+
+// A connection's share of the io_uring backend; all zero under epoll
+typedef struct {
+    int ops;                 // operations in flight that refer to the connection
+
+    // Multishot receive into the worker's provided buffers. A buffer is
+    // copied into read_buf while its completion is handled; whatever the
+    // connection is not ready for spills into memory of its own, so the
+    // buffer goes straight back to the kernel.
+    int recv_armed;
+    int recv_cancelling;     // paused because too much has spilled
+    int recv_starved;        // waiting for the worker to get buffers back
+    int recv_eof;            // the peer's EOF is queued behind the data
+    int recv_error;          // errno of a failed receive
+    int recv_buffered;       // the completion being handled has a buffer
+    unsigned int recv_buffer;
+    size_t recv_length;
+    size_t recv_offset;      // bytes of that buffer already copied out
+    char* spill;
+    size_t spill_start;
+    size_t spill_len;
+    size_t spill_cap;
+    struct connection* starved_next;
+
+    // The linked send chain in flight, if any
+    int send_busy;
+    int send_failed;
+    struct uring_send* send;
+    char* retired_write_buf; // write_buf the chain sends from, replaced while it runs
+} uring_conn_t;
+
+// Set up a ring for the loop, or return NULL for the caller to use epoll
+struct uring_loop* uring_loop_create(struct event_loop* loop);
+void uring_loop_destroy(struct uring_loop* ring);
+
+// Submit what the last round queued and wait for completions
+int uring_loop_wait(struct uring_loop* ring, int timeout_ms);
+void uring_loop_dispatch(struct event_loop* loop);
+
+// Cancel the loop's accept and leave it unarmed
+void uring_loop_stop_accepting(struct event_loop* loop);
+
+// Start receiving on a freshly accepted connection
+int uring_watch(struct connection* conn);
+
+// Take received bytes like read(): 0 at EOF, -1 with EAGAIN once drained
+ssize_t uring_recv(struct connection* conn, char* buf, size_t length);
+
+// Send iov followed by length bytes of fd from offset as one linked chain;
+// its progress is reported through connection_sent()
+int uring_send(struct connection* conn, const struct iovec* iov, int iov_count,
+               int fd, off_t offset, size_t length);
+
+// Hand back what a connection still holds once nothing is in flight
+void uring_release(struct connection* conn);
+
+#endif
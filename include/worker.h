@@ -0,0 +1,24 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include "config.h"
+#include "event_loop.h"
+
+// One event loop per thread, each with its own SO_REUSEPORT listener
+typedef struct {
+    int id;
+    int cpu;              // CPU to pin to, or -1
+    int listen_fd;
+    int tls_listen_fd;    // -1 without TLS
+    pthread_t thread;
+    event_loop_t loop;
+} worker_t;
+
+int create_listen_socket(const server_config_t* config, int port);
+
+// Create the listeners (or take over those of a reload), start all workers
+// and block until a reload or stop signal has let them drain
+int run_workers(const server_config_t* config);
+
+#endif
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../include/access_log.h"
+
+static int log_fd = -1;
+static const char* log_path = NULL;
+static off_t rotate_bytes = 0;
+static off_t log_size = 0;
+static int writer_running = 0;
+static pthread_t writer_thread;
+static access_log_ring_t* registered_rings = NULL;
+
+static int open_log_file(void) {
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat file_stat;
+    log_size = fstat(fd, &file_stat) == 0 ? file_stat.st_size : 0;
+    return fd;
+}
+
+// Move the current log aside to "<path>.1" and start a fresh one
+static void rotate_log(void) {
+    char rotated[4096];
+    if (snprintf(rotated, sizeof(rotated), "%s.1", log_path) >= (int)sizeof(rotated)) {
+        return;
+    }
+    if (rename(log_path, rotated) != 0) {
+        return;
+    }
+    int fd = open_log_file();
+    if (fd >= 0) {
+        close(log_fd);
+        log_fd = fd;
+    }
+}
+
+static void write_batch(const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(log_fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;  // Nothing sensible to do with a failing log; lose the batch
+        }
+        data += n;
+        length -= n;
+        log_size += n;
+    }
+    if (rotate_bytes > 0 && log_size >= rotate_bytes) {
+        rotate_log();
+    }
+}
+
+// Quote a URI so the line stays one line and parseable
+static size_t escape_uri(char* out, const char* uri, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = uri[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = 'x';
+            out[n++] = hex[c >> 4];
+            out[n++] = hex[c & 0xf];
+        } else {
+            out[n++] = c;
+        }
+    }
+    return n;
+}
+
+// 2026-01-31T12:00:00.123Z fd "GET /path" status bytes seconds
+static size_t format_record(char* line, size_t size, const access_record_t* record,
+                            time_t* cached_second, char* cached_date) {
+    time_t second = record->timestamp_ns / 1000000000ull;
+    if (second != *cached_second) {
+        struct tm when;
+        gmtime_r(&second, &when);
+        strftime(cached_date, 32, "%Y-%m-%dT%H:%M:%S", &when);
+        *cached_second = second;
+    }
+
+    char uri[ACCESS_LOG_URI_MAX * 4];
+    size_t uri_len = escape_uri(uri, record->uri, record->uri_len);
+    int n = snprintf(line, size, "%s.%03uZ %d \"%.*s %.*s\" %u %llu %.6f\n",
+                     cached_date, (unsigned)(record->timestamp_ns / 1000000 % 1000),
+                     (int)record->fd, (int)record->method_len, record->method,
+                     (int)uri_len, uri, (unsigned)record->status_code,
+                     (unsigned long long)record->bytes, record->duration_ns / 1e9);
+    return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+// Move everything queued so far into the file; returns the records written
+static size_t drain_rings(char* batch, time_t* cached_second, char* cached_date) {
+    size_t used = 0;
+    size_t drained = 0;
+    access_log_ring_t* ring = __atomic_load_n(&registered_rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++) {
+            if (ACCESS_LOG_BATCH_SIZE - used < 1024) {
+                write_batch(batch, used);
+                used = 0;
+            }
+            const access_record_t* record = &ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+            used += format_record(batch + used, ACCESS_LOG_BATCH_SIZE - used, record,
+                                  cached_second, cached_date);
+            drained++;
+        }
+        // Hand the slots back to the worker only once they have been formatted
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (used > 0) {
+        write_batch(batch, used);
+    }
+    return drained;
+}
+
+static void* writer_main(void* arg) {
+    char* batch = arg;
+    time_t cached_second = -1;
+    char cached_date[32];
+    const struct timespec interval = { 0, ACCESS_LOG_DRAIN_INTERVAL_MS * 1000000L };
+
+    while (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        // Keep going while there is a backlog, otherwise wait for more
+        if (drain_rings(batch, &cached_second, cached_date) == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    drain_rings(batch, &cached_second, cached_date);
+    free(batch);
+    return NULL;
+}
+
+int access_log_init(const server_config_t* config) {
+    if (!config->access_log) {
+        return 0;
+    }
+    log_path = config->access_log;
+    rotate_bytes = (off_t)config->access_log_rotate_mb * 1024 * 1024;
+    log_fd = open_log_file();
+    if (log_fd < 0) {
+        perror("Could not open access log");
+        return -1;
+    }
+
+    char* batch = malloc(ACCESS_LOG_BATCH_SIZE);
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    if (!batch || pthread_create(&writer_thread, NULL, writer_main, batch) != 0) {
+        free(batch);
+        close(log_fd);
+        log_fd = -1;
+        writer_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void access_log_shutdown(void) {
+    if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
+
+access_log_ring_t* access_log_register_worker(void) {
+    if (log_fd < 0) {
+        return NULL;
+    }
+    access_log_ring_t* ring;
+    if (posix_memalign((void**)&ring, 64, sizeof(access_log_ring_t)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(access_log_ring_t));
+
+    // Rings are never freed: the writer may be reading one at any time
+    ring->next = __atomic_load_n(&registered_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&registered_rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return ring;
+}
+
+void access_log_record(access_log_ring_t* ring, int fd, const http_request_t* request,
+                       int status_code, size_t bytes, uint64_t duration_ns) {
+    if (!ring) {
+        return;
+    }
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ACCESS_LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    access_record_t* record = &ring->records[head & (ACCESS_LOG_RING_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    record->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    record->duration_ns = duration_ns;
+    record->bytes = bytes;
+    record->fd = fd;
+    record->status_code = status_code;
+
+    const char* method = request ? request->method : "-";
+    size_t method_len = request ? request->method_len : 1;
+    const char* uri = request ? request->uri : "-";
+    size_t uri_len = request ? request->uri_len : 1;
+    record->method_len = method_len < ACCESS_LOG_METHOD_MAX ? method_len : ACCESS_LOG_METHOD_MAX;
+    memcpy(record->method, method, record->method_len);
+    record->uri_len = uri_len < ACCESS_LOG_URI_MAX ? uri_len : ACCESS_LOG_URI_MAX;
+    memcpy(record->uri, uri, record->uri_len);
+
+    // Publish the record to the writer
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t access_log_dropped(void) {
+    uint64_t total = 0;
+    access_log_ring_t* ring = __atomic_load_n(&registered_rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return total;
+}
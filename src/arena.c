@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../include/arena.h"
+
+static void arena_init(arena_t* arena) {
+    arena->pos = arena->initial;
+    arena->end = arena->initial + ARENA_INITIAL_SIZE;
+    arena->chunks = NULL;
+    arena->last_chunk_size = ARENA_INITIAL_SIZE;
+    arena->pins = 0;
+    arena->next_free = NULL;
+}
+
+static void arena_free_chunks(arena_t* arena) {
+    arena_chunk_t* chunk = arena->chunks;
+    while (chunk) {
+        arena_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (size == 0) {
+        size = ARENA_ALIGNMENT;
+    }
+    if ((size_t)(arena->end - arena->pos) >= size) {
+        void* result = arena->pos;
+        arena->pos += size;
+        return result;
+    }
+
+    // Out of room: chain a chunk at least twice the size of the last one
+    size_t header = (sizeof(arena_chunk_t) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size_t chunk_size = arena->last_chunk_size * 2;
+    if (chunk_size < size) {
+        chunk_size = size;
+    }
+    if (chunk_size > SIZE_MAX - header) {
+        return NULL;
+    }
+    arena_chunk_t* chunk;
+    if (posix_memalign((void**)&chunk, ARENA_ALIGNMENT, header + chunk_size) != 0) {
+        return NULL;
+    }
+    chunk->next = arena->chunks;
+    chunk->size = chunk_size;
+    arena->chunks = chunk;
+    arena->last_chunk_size = chunk_size;
+    arena->pos = (char*)chunk + header + size;
+    arena->end = (char*)chunk + header + chunk_size;
+    return (char*)chunk + header;
+}
+
+char* arena_strdup(arena_t* arena, const char* text) {
+    size_t length = strlen(text) + 1;
+    char* copy = arena_alloc(arena, length);
+    if (copy) {
+        memcpy(copy, text, length);
+    }
+    return copy;
+}
+
+void arena_reset(arena_t* arena) {
+    if (arena->pins > 0) {
+        return;  // Output still points here; the next idle moment resets it
+    }
+    arena_free_chunks(arena);
+    arena->pos = arena->initial;
+    arena->end = arena->initial + ARENA_INITIAL_SIZE;
+    arena->last_chunk_size = ARENA_INITIAL_SIZE;
+}
+
+void arena_pin(arena_t* arena) {
+    arena->pins++;
+}
+
+void arena_unpin(void* ptr) {
+    arena_t* arena = ptr;
+    arena->pins--;
+}
+
+arena_t* arena_pool_get(arena_pool_t* pool) {
+    arena_t* arena = pool->free;
+    if (arena) {
+        pool->free = arena->next_free;
+        pool->count--;
+        arena->next_free = NULL;
+        return arena;
+    }
+    if (posix_memalign((void**)&arena, ARENA_ALIGNMENT, sizeof(arena_t)) != 0) {
+        return NULL;
+    }
+    arena_init(arena);
+    return arena;
+}
+
+void arena_pool_put(arena_pool_t* pool, arena_t* arena) {
+    arena->pins = 0;  // Its connection is gone, and every segment with it
+    arena_reset(arena);
+    if (pool->count >= ARENA_POOL_MAX) {
+        free(arena);
+        return;
+    }
+    arena->next_free = pool->free;
+    pool->free = arena;
+    pool->count++;
+}
+
+void arena_pool_destroy(arena_pool_t* pool) {
+    while (pool->free) {
+        arena_t* next = pool->free->next_free;
+        free(pool->free);
+        pool->free = next;
+    }
+    pool->count = 0;
+}
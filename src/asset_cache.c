@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../include/asset_cache.h"
+
+// Each shard is an independent LRU with its own lock and share of the budget
+typedef struct {
+    pthread_mutex_t lock;
+    asset_t* buckets[ASSET_CACHE_BUCKETS];
+    asset_t* lru_head;         // most recently used
+    asset_t* lru_tail;
+    size_t used;
+    size_t budget;
+} asset_shard_t;
+
+static asset_shard_t shards[ASSET_CACHE_SHARDS];
+static size_t total_budget = 0;
+static int revalidate_seconds = 0;
+
+static time_t coarse_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a
+static unsigned int hash_key(const char* key, size_t key_len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static asset_shard_t* shard_for(unsigned int hash) {
+    return &shards[hash % ASSET_CACHE_SHARDS];
+}
+
+static unsigned int bucket_for(unsigned int hash) {
+    return (hash / ASSET_CACHE_SHARDS) % ASSET_CACHE_BUCKETS;
+}
+
+void asset_cache_init(size_t budget, int revalidate_interval) {
+    total_budget = budget;
+    revalidate_seconds = revalidate_interval;
+    for (int i = 0; i < ASSET_CACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(asset_shard_t));
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].budget = budget / ASSET_CACHE_SHARDS;
+    }
+}
+
+int asset_cache_enabled(size_t size) {
+    return size <= ASSET_CACHE_MAX_ENTRY && size <= total_budget / ASSET_CACHE_SHARDS;
+}
+
+static void free_asset(asset_t* asset) {
+    free(asset->key);
+    free(asset->path);
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        free(asset->variants[i].data);
+        free(asset->variants[i].headers);
+    }
+    free(asset);
+}
+
+void asset_release(void* ptr) {
+    asset_t* asset = ptr;
+    if (__atomic_sub_fetch(&asset->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_asset(asset);
+    }
+}
+
+static void lru_unlink(asset_shard_t* shard, asset_t* asset) {
+    if (asset->lru_prev) asset->lru_prev->lru_next = asset->lru_next;
+    else shard->lru_head = asset->lru_next;
+    if (asset->lru_next) asset->lru_next->lru_prev = asset->lru_prev;
+    else shard->lru_tail = asset->lru_prev;
+    asset->lru_prev = NULL;
+    asset->lru_next = NULL;
+}
+
+static void lru_push_front(asset_shard_t* shard, asset_t* asset) {
+    asset->lru_prev = NULL;
+    asset->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = asset;
+    else shard->lru_tail = asset;
+    shard->lru_head = asset;
+}
+
+// Unlink an entry from its shard and drop the cache's reference (lock held)
+static void shard_remove(asset_shard_t* shard, asset_t* asset) {
+    asset_t** link = &shard->buckets[bucket_for(asset->hash)];
+    while (*link && *link != asset) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = asset->hash_next;
+    }
+    lru_unlink(shard, asset);
+    shard->used -= asset->charge;
+    asset_release(asset);
+}
+
+static asset_t* shard_find(asset_shard_t* shard, unsigned int hash, const char* key, size_t key_len) {
+    for (asset_t* asset = shard->buckets[bucket_for(hash)]; asset; asset = asset->hash_next) {
+        if (asset->hash == hash && asset->key_len == key_len && memcmp(asset->key, key, key_len) == 0) {
+            return asset;
+        }
+    }
+    return NULL;
+}
+
+// Has the file behind an entry been replaced or modified since it was loaded?
+static int asset_is_stale(const asset_t* asset) {
+    struct stat file_stat;
+    if (stat(asset->path, &file_stat) != 0) {
+        return 1;
+    }
+    return file_stat.st_dev != asset->dev || file_stat.st_ino != asset->inode ||
+           file_stat.st_size != asset->file_size ||
+           file_stat.st_mtim.tv_sec != asset->mtime.tv_sec ||
+           file_stat.st_mtim.tv_nsec != asset->mtime.tv_nsec;
+}
+
+asset_t* asset_cache_lookup(const char* key, size_t key_len) {
+    if (total_budget == 0) {
+        return NULL;
+    }
+
+    unsigned int hash = hash_key(key, key_len);
+    asset_shard_t* shard = shard_for(hash);
+    time_t now = coarse_now();
+
+    pthread_mutex_lock(&shard->lock);
+    asset_t* asset = shard_find(shard, hash, key, key_len);
+    if (!asset) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    lru_unlink(shard, asset);
+    lru_push_front(shard, asset);
+    __atomic_add_fetch(&asset->refcount, 1, __ATOMIC_RELAXED);
+
+    // Claim the revalidation under the lock so only one thread stats the file
+    int revalidate = now - asset->checked_at >= revalidate_seconds;
+    if (revalidate) {
+        asset->checked_at = now;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (revalidate && asset_is_stale(asset)) {
+        pthread_mutex_lock(&shard->lock);
+        if (shard_find(shard, hash, key, key_len) == asset) {
+            shard_remove(shard, asset);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        asset_release(asset);
+        return NULL;
+    }
+    return asset;
+}
+
+asset_t* asset_cache_insert(const char* key, size_t key_len, const char* path,
+                            char* data, size_t size, char* headers,
+                            const struct stat* file_stat, const mime_type_t* mime) {
+    asset_t* asset = headers ? calloc(1, sizeof(asset_t)) : NULL;
+    if (asset) {
+        asset->key = strndup(key, key_len);
+        asset->path = strdup(path);
+    }
+    if (!asset || !asset->key || !asset->path) {
+        if (asset) {
+            free(asset->key);
+            free(asset->path);
+            free(asset);
+        }
+        free(data);
+        free(headers);
+        return NULL;
+    }
+
+    asset->key_len = key_len;
+    asset->mime = mime;
+    asset->hash = hash_key(key, key_len);
+    asset_variant_t* identity = &asset->variants[ENCODING_IDENTITY];
+    identity->data = data;
+    identity->size = size;
+    identity->headers = headers;
+    identity->headers_len = strlen(headers);
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        asset->variant_state[i] = mime->compressible ? VARIANT_UNKNOWN : VARIANT_NONE;
+    }
+    asset->variant_state[ENCODING_IDENTITY] = VARIANT_READY;
+    asset->dev = file_stat->st_dev;
+    asset->inode = file_stat->st_ino;
+    asset->file_size = file_stat->st_size;
+    asset->mtime = file_stat->st_mtim;
+    asset->checked_at = coarse_now();
+    asset->charge = sizeof(asset_t) + key_len + strlen(path) + size + identity->headers_len;
+    asset->refcount = 1;  // the caller's reference
+
+    asset_shard_t* shard = shard_for(asset->hash);
+    if (total_budget == 0 || asset->charge > shard->budget) {
+        return asset;  // Served once, never cached
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    asset_t* existing = shard_find(shard, asset->hash, key, key_len);
+    if (existing) {
+        shard_remove(shard, existing);
+    }
+    while (shard->used + asset->charge > shard->budget && shard->lru_tail) {
+        shard_remove(shard, shard->lru_tail);
+    }
+
+    asset->refcount++;  // the cache's reference
+    unsigned int bucket = bucket_for(asset->hash);
+    asset->hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = asset;
+    lru_push_front(shard, asset);
+    shard->used += asset->charge;
+    pthread_mutex_unlock(&shard->lock);
+    return asset;
+}
+
+const asset_variant_t* asset_pick_variant(asset_t* asset, unsigned int accepted,
+                                          content_encoding_t* missing) {
+    *missing = ENCODING_IDENTITY;
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        if (!(accepted & (1u << i))) {
+            continue;
+        }
+        int state = __atomic_load_n(&asset->variant_state[i], __ATOMIC_ACQUIRE);
+        if (state == VARIANT_READY) {
+            return &asset->variants[i];
+        }
+        if (state == VARIANT_UNKNOWN && *missing == ENCODING_IDENTITY) {
+            *missing = i;
+        }
+    }
+    return &asset->variants[ENCODING_IDENTITY];
+}
+
+int asset_cache_claim_variant(asset_t* asset, content_encoding_t encoding) {
+    int expected = VARIANT_UNKNOWN;
+    return __atomic_compare_exchange_n(&asset->variant_state[encoding], &expected, VARIANT_PENDING,
+                                       0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+void asset_cache_attach_variant(asset_t* asset, content_encoding_t encoding,
+                                char* data, size_t size, char* headers) {
+    if (!data || !headers) {
+        free(data);
+        free(headers);
+        __atomic_store_n(&asset->variant_state[encoding], VARIANT_NONE, __ATOMIC_RELEASE);
+        return;
+    }
+
+    asset_variant_t* variant = &asset->variants[encoding];
+    variant->data = data;
+    variant->size = size;
+    variant->headers = headers;
+    variant->headers_len = strlen(headers);
+    size_t charge = size + variant->headers_len;
+
+    // Readers only look at the variant once they see READY
+    asset_shard_t* shard = shard_for(asset->hash);
+    pthread_mutex_lock(&shard->lock);
+    __atomic_store_n(&asset->variant_state[encoding], VARIANT_READY, __ATOMIC_RELEASE);
+    if (shard_find(shard, asset->hash, asset->key, asset->key_len) == asset) {
+        // Still cached: the variant counts against the budget like the rest of the entry
+        asset->charge += charge;
+        shard->used += charge;
+        while (shard->used > shard->budget && shard->lru_tail) {
+            shard_remove(shard, shard->lru_tail);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/asset_pack.h"
+#include "../include/file_server.h"
+#include "../include/serve_static_file_supplement.h"
+
+// The open pack; read-only once asset_pack_open() returns
+static char* pack_base;
+static size_t pack_size;
+static const asset_pack_entry_t* pack_entries;
+static uint32_t pack_count;
+static mime_type_t* pack_types;     // one per entry, pointing into the mapping
+
+// Keys sort bytewise, a shorter key before any key it is a prefix of
+static int compare_keys(const char* a, size_t a_len, const char* b, size_t b_len) {
+    int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (order != 0) {
+        return order;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int in_pack(uint64_t offset, uint64_t length) {
+    return offset <= pack_size && length <= pack_size - offset;
+}
+
+static int check_entry(const asset_pack_entry_t* entry) {
+    if (!in_pack(entry->key_offset, entry->key_len) || entry->key_len == 0 ||
+        entry->type_offset >= pack_size ||
+        !memchr(pack_base + entry->type_offset, '\0', pack_size - entry->type_offset)) {
+        return -1;
+    }
+    for (int i = 0; i < ENCODING_COUNT; i++) {
+        const asset_pack_variant_t* variant = &entry->variants[i];
+        if (!in_pack(variant->offset, variant->size) ||
+            !in_pack(variant->headers_offset, variant->headers_len)) {
+            return -1;
+        }
+    }
+    return entry->variants[ENCODING_IDENTITY].headers_len ? 0 : -1;
+}
+
+int asset_pack_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat pack_stat;
+    if (fd < 0 || fstat(fd, &pack_stat) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // Shared with the page cache, so every process serving it uses one copy
+    void* base = (size_t)pack_stat.st_size >= sizeof(asset_pack_header_t) ?
+        mmap(NULL, pack_stat.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "%s: not an asset pack\n", path);
+        return -1;
+    }
+    pack_base = base;
+    pack_size = pack_stat.st_size;
+
+    const asset_pack_header_t* header = base;
+    uint64_t index_length = (uint64_t)header->entry_count * sizeof(asset_pack_entry_t);
+    if (memcmp(header->magic, ASSET_PACK_MAGIC, sizeof(header->magic)) != 0 ||
+        header->encoding_count != ENCODING_COUNT || header->file_size != pack_size ||
+        header->index_offset % ASSET_PACK_ALIGN != 0 ||
+        !in_pack(header->index_offset, index_length)) {
+        fprintf(stderr, "%s: not an asset pack, or built by another version\n", path);
+        asset_pack_close();
+        return -1;
+    }
+    pack_entries = (const asset_pack_entry_t*)(pack_base + header->index_offset);
+    pack_count = header->entry_count;
+
+    pack_types = calloc(pack_count ? pack_count : 1, sizeof(mime_type_t));
+    if (!pack_types) {
+        asset_pack_close();
+        return -1;
+    }
+    for (uint32_t i = 0; i < pack_count; i++) {
+        const asset_pack_entry_t* entry = &pack_entries[i];
+        if (check_entry(entry) != 0 ||
+            (i > 0 && compare_keys(pack_base + pack_entries[i - 1].key_offset,
+                                   pack_entries[i - 1].key_len,
+                                   pack_base + entry->key_offset, entry->key_len) >= 0)) {
+            fprintf(stderr, "%s: corrupt entry %u\n", path, i);
+            asset_pack_close();
+            return -1;
+        }
+        pack_types[i].type = pack_base + entry->type_offset;
+        pack_types[i].compressible = entry->compressible != 0;
+    }
+
+    // Every lookup walks the index, so fault it in now rather than on requests
+    madvise(pack_base + header->index_offset, index_length, MADV_WILLNEED);
+    printf("Serving %u files from asset pack %s\n", pack_count, path);
+    return 0;
+}
+
+void asset_pack_close(void) {
+    if (pack_base) {
+        munmap(pack_base, pack_size);
+    }
+    free(pack_types);
+    pack_base = NULL;
+    pack_size = 0;
+    pack_entries = NULL;
+    pack_count = 0;
+    pack_types = NULL;
+}
+
+const asset_pack_entry_t* asset_pack_find(const char* key, size_t key_len) {
+    uint32_t low = 0, high = pack_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const asset_pack_entry_t* entry = &pack_entries[middle];
+        int order = compare_keys(key, key_len, pack_base + entry->key_offset, entry->key_len);
+        if (order == 0) {
+            return entry;
+        }
+        if (order < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+const char* asset_pack_data(const asset_pack_variant_t* variant) {
+    return pack_base + variant->offset;
+}
+
+const char* asset_pack_headers(const asset_pack_variant_t* variant) {
+    return pack_base + variant->headers_offset;
+}
+
+const mime_type_t* asset_pack_mime(const asset_pack_entry_t* entry) {
+    return &pack_types[entry - pack_entries];
+}
+
+// Files found while walking the tree, before they are sorted and written
+typedef struct {
+    char* key;
+    char* path;
+} pack_file_t;
+
+typedef struct {
+    FILE* out;
+    uint64_t offset;           // where the next blob goes
+    pack_file_t* files;
+    size_t file_count;
+    size_t file_cap;
+} pack_writer_t;
+
+static int add_file(pack_writer_t* writer, const char* key, const char* path) {
+    if (writer->file_count == writer->file_cap) {
+        size_t cap = writer->file_cap ? writer->file_cap * 2 : 64;
+        pack_file_t* files = realloc(writer->files, cap * sizeof(pack_file_t));
+        if (!files) {
+            return -1;
+        }
+        writer->files = files;
+        writer->file_cap = cap;
+    }
+    pack_file_t* file = &writer->files[writer->file_count];
+    file->key = strdup(key);
+    file->path = strdup(path);
+    if (!file->key || !file->path) {
+        free(file->key);
+        free(file->path);
+        return -1;
+    }
+    writer->file_count++;
+    return 0;
+}
+
+// Collect every regular file below dir; key is its URI path so far
+static int collect_files(pack_writer_t* writer, const char* dir, const char* key) {
+    DIR* handle = opendir(dir);
+    if (!handle) {
+        perror(dir);
+        return -1;
+    }
+    int status = 0;
+    struct dirent* entry;
+    while (status == 0 && (entry = readdir(handle))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char path[MAX_URI_SIZE + 64];
+        char child_key[MAX_URI_SIZE];
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= sizeof(path) ||
+            (size_t)snprintf(child_key, sizeof(child_key), "%s/%s", key, entry->d_name) >=
+                sizeof(child_key)) {
+            continue;  // Longer than any request could name
+        }
+        struct stat file_stat;
+        if (stat(path, &file_stat) != 0) {
+            continue;
+        }
+        if (S_ISDIR(file_stat.st_mode)) {
+            status = collect_files(writer, path, child_key);
+        } else if (S_ISREG(file_stat.st_mode)) {
+            status = add_file(writer, child_key, path);
+        }
+    }
+    closedir(handle);
+    return status;
+}
+
+static int compare_files(const void* a, const void* b) {
+    const pack_file_t* file_a = a;
+    const pack_file_t* file_b = b;
+    return compare_keys(file_a->key, strlen(file_a->key), file_b->key, strlen(file_b->key));
+}
+
+// Append a blob at the next aligned offset and return where it went
+static uint64_t write_blob(pack_writer_t* writer, const void* data, size_t length) {
+    static const char padding[ASSET_PACK_ALIGN];
+    size_t pad = (ASSET_PACK_ALIGN - writer->offset % ASSET_PACK_ALIGN) % ASSET_PACK_ALIGN;
+    if (fwrite(padding, 1, pad, writer->out) != pad ||
+        (length && fwrite(data, 1, length, writer->out) != length)) {
+        return 0;
+    }
+    uint64_t offset = writer->offset + pad;
+    writer->offset = offset + length;
+    return offset;
+}
+
+static int write_variant(pack_writer_t* writer, asset_pack_variant_t* variant,
+                         const char* data, size_t size, char* headers) {
+    if (!headers) {
+        return -1;
+    }
+    variant->offset = write_blob(writer, data, size);
+    variant->size = size;
+    variant->headers_len = strlen(headers);
+    variant->headers_offset = write_blob(writer, headers, variant->headers_len);
+    free(headers);
+    return variant->offset && variant->headers_offset ? 0 : -1;
+}
+
+// The coded form of a file: its sibling on disk, else compressed here;
+// NULL when it would not be smaller
+static char* encode_file(const pack_file_t* file, content_encoding_t encoding,
+                         const char* data, size_t size, size_t* encoded_size) {
+    char* encoded = NULL;
+    char sibling[MAX_URI_SIZE + 64];
+    struct stat sibling_stat;
+    int fd = -1;
+    if ((size_t)snprintf(sibling, sizeof(sibling), "%s%s", file->path,
+                         encoding_suffix(encoding)) < sizeof(sibling)) {
+        fd = open_static_file(sibling, &sibling_stat);
+    }
+    if (fd >= 0) {
+        encoded = read_file_descriptor(fd, sibling_stat.st_size);
+        *encoded_size = sibling_stat.st_size;
+        close(fd);
+    } else if (encoding_supported(encoding) && size >= MIN_COMPRESS_SIZE) {
+        encoded = compress_buffer(encoding, data, size, encoded_size);
+    }
+    if (encoded && *encoded_size >= size) {
+        free(encoded);
+        encoded = NULL;
+    }
+    return encoded;
+}
+
+static int write_file(pack_writer_t* writer, const pack_file_t* file, asset_pack_entry_t* entry) {
+    struct stat file_stat;
+    int fd = open_static_file(file->path, &file_stat);
+    if (fd < 0) {
+        perror(file->path);
+        return -1;
+    }
+    char* data = read_file_descriptor(fd, file_stat.st_size);
+    close(fd);
+    if (!data && file_stat.st_size > 0) {
+        perror(file->path);
+        return -1;
+    }
+
+    const mime_type_t* mime = mime_type_for(file->path);
+    memset(entry, 0, sizeof(asset_pack_entry_t));
+    entry->key_len = strlen(file->key);
+    entry->key_offset = write_blob(writer, file->key, entry->key_len);
+    entry->type_offset = write_blob(writer, mime->type, strlen(mime->type) + 1);
+    entry->compressible = mime->compressible;
+    entry->inode = file_stat.st_ino;
+    entry->file_size = file_stat.st_size;
+    entry->mtime_sec = file_stat.st_mtim.tv_sec;
+    entry->mtime_nsec = file_stat.st_mtim.tv_nsec;
+
+    int status = write_variant(writer, &entry->variants[ENCODING_IDENTITY], data,
+                               file_stat.st_size,
+                               static_file_headers(mime, &file_stat, ENCODING_IDENTITY));
+    for (int i = ENCODING_IDENTITY + 1; status == 0 && mime->compressible && i < ENCODING_COUNT; i++) {
+        size_t size;
+        char* encoded = encode_file(file, i, data, file_stat.st_size, &size);
+        if (encoded) {
+            status = write_variant(writer, &entry->variants[i], encoded, size,
+                                   static_file_headers(mime, &file_stat, i));
+            free(encoded);
+        }
+    }
+    free(data);
+    if (status == 0 && (!entry->key_offset || !entry->type_offset)) {
+        status = -1;
+    }
+    return status;
+}
+
+static int write_pack(pack_writer_t* writer, const char* root) {
+    asset_pack_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (collect_files(writer, root, "") != 0 || writer->file_count > UINT32_MAX) {
+        return -1;
+    }
+    qsort(writer->files, writer->file_count, sizeof(pack_file_t), compare_files);
+
+    // The header is rewritten with the index position once that is known
+    if (fwrite(&header, sizeof(header), 1, writer->out) != 1) {
+        return -1;
+    }
+    writer->offset = sizeof(header);
+    asset_pack_entry_t* entries = calloc(writer->file_count ? writer->file_count : 1,
+                                         sizeof(asset_pack_entry_t));
+    if (!entries) {
+        return -1;
+    }
+    int status = 0;
+    for (size_t i = 0; status == 0 && i < writer->file_count; i++) {
+        status = write_file(writer, &writer->files[i], &entries[i]);
+    }
+    if (status == 0) {
+        memcpy(header.magic, ASSET_PACK_MAGIC, sizeof(header.magic));
+        header.entry_count = writer->file_count;
+        header.encoding_count = ENCODING_COUNT;
+        header.index_offset = write_blob(writer, entries, writer->file_count * sizeof(asset_pack_entry_t));
+        header.file_size = writer->offset;
+        if (!header.index_offset || fseek(writer->out, 0, SEEK_SET) != 0 ||
+            fwrite(&header, sizeof(header), 1, writer->out) != 1) {
+            status = -1;
+        }
+    }
+    free(entries);
+    return status;
+}
+
+int asset_pack_write(const char* root, const char* output) {
+    char temporary[4096];
+    if ((size_t)snprintf(temporary, sizeof(temporary), "%s.tmp", output) >= sizeof(temporary)) {
+        return -1;
+    }
+    pack_writer_t writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.out = fopen(temporary, "wb");
+    if (!writer.out) {
+        perror(temporary);
+        return -1;
+    }
+
+    int status = write_pack(&writer, root);
+    if (fflush(writer.out) != 0 || fsync(fileno(writer.out)) != 0) {
+        status = -1;
+    }
+    if (fclose(writer.out) != 0) {
+        status = -1;
+    }
+    if (status == 0 && rename(temporary, output) != 0) {
+        perror(output);
+        status = -1;
+    }
+    if (status != 0) {
+        unlink(temporary);
+    } else {
+        printf("Packed %zu files into %s (%llu bytes)\n", writer.file_count, output,
+               (unsigned long long)writer.offset);
+    }
+    for (size_t i = 0; i < writer.file_count; i++) {
+        free(writer.files[i].key);
+        free(writer.files[i].path);
+    }
+    free(writer.files);
+    return status;
+}
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "../include/buffer_pool.h"
+
+void buffer_pool_init(buffer_pool_t* pool, size_t buffer_size) {
+    memset(pool, 0, sizeof(buffer_pool_t));
+    pool->buffer_size = buffer_size;
+}
+
+// Carve a new slab into free buffers
+static int buffer_pool_grow(buffer_pool_t* pool) {
+    int new_cap = pool->free_cap + BUFFER_SLAB_BUFFERS;
+    char** free_list = realloc(pool->free, new_cap * sizeof(char*));
+    if (!free_list) {
+        return -1;
+    }
+    pool->free = free_list;
+    pool->free_cap = new_cap;
+
+    buffer_slab_t* slab = malloc(sizeof(buffer_slab_t));
+    void* memory = mmap(NULL, pool->buffer_size * BUFFER_SLAB_BUFFERS, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!slab || memory == MAP_FAILED) {
+        free(slab);
+        if (memory != MAP_FAILED) {
+            munmap(memory, pool->buffer_size * BUFFER_SLAB_BUFFERS);
+        }
+        return -1;
+    }
+    slab->memory = memory;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    // Untouched pages cost nothing yet, so the new buffers go to the bottom
+    // of the stack with the released ones
+    memmove(pool->free + BUFFER_SLAB_BUFFERS, pool->free, pool->free_count * sizeof(char*));
+    for (int i = 0; i < BUFFER_SLAB_BUFFERS; i++) {
+        pool->free[i] = slab->memory + i * pool->buffer_size;
+    }
+    pool->free_count += BUFFER_SLAB_BUFFERS;
+    pool->released += BUFFER_SLAB_BUFFERS;
+    return 0;
+}
+
+char* buffer_pool_get(buffer_pool_t* pool) {
+    if (pool->free_count == 0 && buffer_pool_grow(pool) != 0) {
+        return NULL;
+    }
+    char* buffer = pool->free[--pool->free_count];
+    if (pool->released > pool->free_count) {
+        pool->released = pool->free_count;  // Its pages come back as it is used
+    }
+    return buffer;
+}
+
+void buffer_pool_put(buffer_pool_t* pool, char* buffer) {
+    pool->free[pool->free_count++] = buffer;
+
+    // Release the coldest buffer still backed once too many are idle
+    if (pool->free_count - pool->released > BUFFER_POOL_RESIDENT) {
+        madvise(pool->free[pool->released], pool->buffer_size, MADV_DONTNEED);
+        pool->released++;
+    }
+}
+
+void buffer_pool_destroy(buffer_pool_t* pool) {
+    while (pool->slabs) {
+        buffer_slab_t* next = pool->slabs->next;
+        munmap(pool->slabs->memory, pool->buffer_size * BUFFER_SLAB_BUFFERS);
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    free(pool->free);
+    memset(pool, 0, sizeof(buffer_pool_t));
+}
@@ -24,3 +24,67 @@ char* construct_full_path(const char* base_dir, const char* file_path) {
     snprintf(full_path, path_len, "%s%s", base_dir, file_path);
     return full_path;
 }
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int normalize_uri_path(const char* uri, size_t uri_len, char* out, size_t out_size) {
+    if (uri_len == 0 || uri[0] != '/' || out_size < 2) {
+        return -1;
+    }
+    // out[0..length) is always a normalized path ending in a complete
+    // segment or '/'; segment is where the one being decoded starts
+    size_t length = 1;
+    size_t segment = 1;
+    out[0] = '/';
+    for (size_t i = 1;; i++) {
+        int end = i == uri_len || uri[i] == '?' || uri[i] == '#';
+        if (end || uri[i] == '/') {
+            size_t segment_len = length - segment;
+            if (segment_len == 1 && out[segment] == '.') {
+                length = segment;
+            } else if (segment_len == 2 && out[segment] == '.' && out[segment + 1] == '.') {
+                if (segment == 1) {
+                    return -1;  // Above the document root
+                }
+                // Drop the segment before it as well, keeping its leading '/'
+                length = segment - 1;
+                while (out[length - 1] != '/') length--;
+            } else if (!end && segment_len > 0) {
+                if (length + 1 >= out_size) {
+                    return -1;
+                }
+                out[length++] = '/';
+            }
+            if (end) {
+                break;
+            }
+            segment = length;
+            continue;
+        }
+
+        char c = uri[i];
+        if (c == '%') {
+            int high = i + 2 < uri_len ? hex_value(uri[i + 1]) : -1;
+            int low = high >= 0 ? hex_value(uri[i + 2]) : -1;
+            if (low < 0) {
+                return -1;
+            }
+            c = (char)(high * 16 + low);
+            if (c == '\0' || c == '/') {
+                return -1;  // Would smuggle a path separator or end the string
+            }
+            i += 2;
+        }
+        if (length + 1 >= out_size) {
+            return -1;
+        }
+        out[length++] = c;
+    }
+    out[length] = '\0';
+    return (int)length;
+}
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/config.h"
+
+void config_init(server_config_t* config) {
+    memset(config, 0, sizeof(server_config_t));
+    config->port = DEFAULT_PORT;
+    config->tls_port = DEFAULT_TLS_PORT;
+    config->tls_cert = NULL;
+    config->tls_key = NULL;
+    config->workers = DEFAULT_WORKERS;
+    config->backlog = DEFAULT_BACKLOG;
+    config->pin_cpus = 0;
+    config->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    config->header_timeout = DEFAULT_HEADER_TIMEOUT;
+    config->body_timeout = DEFAULT_BODY_TIMEOUT;
+    config->write_timeout = DEFAULT_WRITE_TIMEOUT;
+    config->max_keepalive_requests = DEFAULT_MAX_KEEPALIVE_REQUESTS;
+    config->cache_mb = DEFAULT_CACHE_MB;
+    config->cache_revalidate = DEFAULT_CACHE_REVALIDATE;
+    config->file_cache = DEFAULT_FILE_CACHE;
+    config->access_log = NULL;
+    config->mime_types = NULL;
+    config->asset_pack = NULL;
+    config->access_log_rotate_mb = DEFAULT_ACCESS_LOG_ROTATE_MB;
+    config->max_body_kb = DEFAULT_MAX_BODY_KB;
+    config->pool_threads = DEFAULT_POOL_THREADS;
+    config->io_uring = 0;
+    config->max_connections = DEFAULT_MAX_CONNECTIONS;
+    config->memory_mb = DEFAULT_MEMORY_MB;
+    config->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+}
+
+void config_print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [-p port] [-w workers] [-b backlog] [-a] [-k seconds] [-r requests]\n"
+            "          [-C megabytes] [-V seconds] [-l file] [-L megabytes] [-B kilobytes]\n"
+            "          [-T threads] [-U] [-H seconds] [-D seconds] [-W seconds]\n"
+            "          [-N count] [-M megabytes] [-m file] [-P file] [-O count]\n"
+            "          [-c file -K file] [-s port] [-G seconds]\n"
+            "  -p port      TCP port to listen on (default %d)\n"
+            "  -w workers   number of event-loop workers, 0 = one per CPU (default %d)\n"
+            "  -b backlog   listen() backlog per worker socket (default %d)\n"
+            "  -a           pin each worker to its own CPU\n"
+            "  -k seconds   idle keep-alive timeout (default %d)\n"
+            "  -r requests  requests served per connection before closing (default %d)\n"
+            "  -C megabytes memory budget of the static asset cache, 0 disables (default %d)\n"
+            "  -V seconds   how often a cached file is checked for changes (default %d)\n"
+            "  -l file      write an access log to file (default none)\n"
+            "  -L megabytes rotate the access log to file.1 at this size, 0 never (default %d)\n"
+            "  -B kilobytes largest request body of routes without their own limit (default %d)\n"
+            "  -T threads   threads for blocking handlers and file I/O, 0 = inline (default %d)\n"
+            "  -U           use io_uring instead of epoll, falling back if unavailable\n"
+            "  -H seconds   time a client has to send a request's headers (default %d)\n"
+            "  -D seconds   time a request body may go without new bytes (default %d)\n"
+            "  -W seconds   time pending output may wait for the client (default %d)\n"
+            "  -N count     open connections before new ones get a 503, 0 = no limit (default %d)\n"
+            "  -M megabytes connection and buffer memory before clients get a 503, 0 = no limit (default %d)\n"
+            "  -m file      mime.types file whose mappings extend and override the built-in ones\n"
+            "  -P file      serve the files packed into file (make pack) before the document root\n"
+            "  -O count     open static files kept for reuse, 0 disables (default %d)\n"
+            "  -c file      PEM certificate chain; with -K, also serve HTTPS\n"
+            "  -K file      PEM private key of the certificate\n"
+            "  -s port      TCP port for HTTPS (default %d)\n"
+            "  -G seconds   time open connections get to finish after a reload or stop (default %d)\n",
+            program, DEFAULT_PORT, DEFAULT_WORKERS, DEFAULT_BACKLOG,
+            DEFAULT_KEEPALIVE_TIMEOUT, DEFAULT_MAX_KEEPALIVE_REQUESTS,
+            DEFAULT_CACHE_MB, DEFAULT_CACHE_REVALIDATE, DEFAULT_ACCESS_LOG_ROTATE_MB,
+            DEFAULT_MAX_BODY_KB, DEFAULT_POOL_THREADS, DEFAULT_HEADER_TIMEOUT,
+            DEFAULT_BODY_TIMEOUT, DEFAULT_WRITE_TIMEOUT, DEFAULT_MAX_CONNECTIONS, DEFAULT_MEMORY_MB,
+            DEFAULT_FILE_CACHE, DEFAULT_TLS_PORT, DEFAULT_DRAIN_TIMEOUT);
+}
+
+// Parse a non-negative integer option, rejecting trailing garbage
+static int parse_int_option(const char* text, int* out) {
+    char* end;
+    long value = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || value < 0 || value > 1000000) {
+        return -1;
+    }
+    *out = (int)value;
+    return 0;
+}
+
+int config_parse_args(server_config_t* config, int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:w:b:ak:r:C:V:l:L:B:T:UH:D:W:N:M:m:P:O:c:K:s:G:h")) != -1) {
+        switch (opt) {
+        case 'p':
+            if (parse_int_option(optarg, &config->port) != 0 || config->port == 0 ||
+                config->port > 65535) {
+                return -1;
+            }
+            break;
+        case 's':
+            if (parse_int_option(optarg, &config->tls_port) != 0 || config->tls_port == 0 ||
+                config->tls_port > 65535) {
+                return -1;
+            }
+            break;
+        case 'c':
+            config->tls_cert = optarg;
+            break;
+        case 'K':
+            config->tls_key = optarg;
+            break;
+        case 'w':
+            if (parse_int_option(optarg, &config->workers) != 0) return -1;
+            break;
+        case 'b':
+            if (parse_int_option(optarg, &config->backlog) != 0 || config->backlog == 0) {
+                return -1;
+            }
+            break;
+        case 'a':
+            config->pin_cpus = 1;
+            break;
+        case 'k':
+            if (parse_int_option(optarg, &config->keepalive_timeout) != 0 ||
+                config->keepalive_timeout == 0) {
+                return -1;
+            }
+            break;
+        case 'r':
+            if (parse_int_option(optarg, &config->max_keepalive_requests) != 0 ||
+                config->max_keepalive_requests == 0) {
+                return -1;
+            }
+            break;
+        case 'C':
+            if (parse_int_option(optarg, &config->cache_mb) != 0) return -1;
+            break;
+        case 'V':
+            if (parse_int_option(optarg, &config->cache_revalidate) != 0) return -1;
+            break;
+        case 'l':
+            config->access_log = optarg;
+            break;
+        case 'm':
+            config->mime_types = optarg;
+            break;
+        case 'P':
+            config->asset_pack = optarg;
+            break;
+        case 'O':
+            if (parse_int_option(optarg, &config->file_cache) != 0) return -1;
+            break;
+        case 'L':
+            if (parse_int_option(optarg, &config->access_log_rotate_mb) != 0) return -1;
+            break;
+        case 'B':
+            if (parse_int_option(optarg, &config->max_body_kb) != 0) return -1;
+            break;
+        case 'T':
+            if (parse_int_option(optarg, &config->pool_threads) != 0) return -1;
+            break;
+        case 'U':
+            config->io_uring = 1;
+            break;
+        case 'N':
+            if (parse_int_option(optarg, &config->max_connections) != 0) return -1;
+            break;
+        case 'M':
+            if (parse_int_option(optarg, &config->memory_mb) != 0) return -1;
+            break;
+        case 'G':
+            if (parse_int_option(optarg, &config->drain_timeout) != 0) return -1;
+            break;
+        case 'H':
+        case 'D':
+        case 'W': {
+            int* timeout = opt == 'H' ? &config->header_timeout
+                           : opt == 'D' ? &config->body_timeout : &config->write_timeout;
+            if (parse_int_option(optarg, timeout) != 0 || *timeout == 0) {
+                return -1;
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+
+    // Both listeners use SO_REUSEPORT, so sharing a port would not fail to
+    // bind, it would mix plain and TLS clients
+    if ((config->tls_cert || config->tls_key) && config->tls_port == config->port) {
+        return -1;
+    }
+
+    if (config->workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config->workers = cpus > 0 ? (int)cpus : 1;
+    }
+    return 0;
+}
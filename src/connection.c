@@ -0,0 +1,1113 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../include/connection.h"
+#include "../include/event_loop.h"
+#include "../include/server.h"
+#include "../include/metrics.h"
+#include "../include/arena.h"
+#include "../include/router.h"
+#include "../include/thread_pool.h"
+#include "../include/buffer_pool.h"
+#include "../include/tls.h"
+#include "../include/http2.h"
+
+// Process-wide totals behind the -N and -M limits, shared by every worker
+static long connections_in_use = 0;
+static long long memory_in_use = 0;    // connection objects, read and write buffers, arenas
+
+static void charge_memory(long long bytes) {
+    __atomic_add_fetch(&memory_in_use, bytes, __ATOMIC_RELAXED);
+}
+
+static int over_memory_budget(const server_config_t* config) {
+    return config->memory_mb &&
+           __atomic_load_n(&memory_in_use, __ATOMIC_RELAXED) >= (long long)config->memory_mb << 20;
+}
+
+void connection_charge_memory(long long bytes) {
+    charge_memory(bytes);
+}
+
+int connection_memory_exhausted(const server_config_t* config) {
+    return over_memory_budget(config);
+}
+
+static out_segment_t* connection_push_segment(connection_t* conn) {
+    if (conn->segment_count == conn->segment_cap) {
+        int new_cap = conn->segment_cap ? conn->segment_cap * 2 : 16;
+        out_segment_t* segments = realloc(conn->segments, new_cap * sizeof(out_segment_t));
+        if (!segments) {
+            return NULL;
+        }
+        conn->segments = segments;
+        conn->segment_cap = new_cap;
+    }
+    return &conn->segments[conn->segment_count++];
+}
+
+int connection_write(connection_t* conn, const void* data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    size_t needed = conn->write_len + length;
+    if (needed > conn->write_cap) {
+        size_t new_cap = conn->write_cap ? conn->write_cap : CONN_WRITE_BUFFER_SIZE;
+        while (new_cap < needed) {
+            new_cap *= 2;
+        }
+        char* new_buf;
+        if (conn->ring.send_busy && conn->write_buf && !conn->ring.retired_write_buf) {
+            // The ring is still sending from this buffer: keep it until the
+            // send completes and carry on in a copy
+            new_buf = malloc(new_cap);
+            if (new_buf) {
+                memcpy(new_buf, conn->write_buf, conn->write_len);
+                conn->ring.retired_write_buf = conn->write_buf;
+            }
+        } else {
+            new_buf = realloc(conn->write_buf, new_cap);
+        }
+        if (!new_buf) {
+            return -1;  // Memory allocation failed
+        }
+        charge_memory((long long)(new_cap - conn->write_cap));
+        conn->write_buf = new_buf;
+        conn->write_cap = new_cap;
+    }
+
+    // Grow the last segment when it already ends where these bytes go, so a
+    // status line, its headers and a small body become one contiguous run
+    out_segment_t* last = conn->segment_count > conn->segment_head
+                              ? &conn->segments[conn->segment_count - 1] : NULL;
+    if (last && !last->data && last->fd < 0 && last->offset + last->length == conn->write_len) {
+        last->length += length;
+    } else {
+        out_segment_t* segment = connection_push_segment(conn);
+        if (!segment) {
+            return -1;
+        }
+        segment->data = NULL;
+        segment->offset = conn->write_len;
+        segment->length = length;
+        segment->release = NULL;
+        segment->fd = -1;
+    }
+
+    memcpy(conn->write_buf + conn->write_len, data, length);
+    conn->write_len += length;
+    conn->write_pending += length;
+    return 0;
+}
+
+int connection_write_ref(connection_t* conn, const void* data, size_t length,
+                         void (*release)(void* owner), void* owner) {
+    out_segment_t* segment = length ? connection_push_segment(conn) : NULL;
+    if (!segment) {
+        if (release) {
+            release(owner);
+        }
+        return length ? -1 : 0;
+    }
+    segment->data = data;
+    segment->offset = 0;
+    segment->length = length;
+    segment->release = release;
+    segment->owner = owner;
+    segment->fd = -1;
+    conn->write_pending += length;
+    return 0;
+}
+
+int connection_write_file(connection_t* conn, int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        close(fd);
+        return 0;
+    }
+
+    out_segment_t* segment = connection_push_segment(conn);
+    if (!segment) {
+        close(fd);
+        return -1;
+    }
+    segment->data = NULL;
+    segment->offset = 0;
+    segment->length = length;
+    segment->release = NULL;
+    segment->fd = fd;
+    segment->file_offset = offset;
+    conn->write_pending += length;
+    return 0;
+}
+
+int connection_write_file_ref(connection_t* conn, int fd, off_t offset, size_t length,
+                              void (*release)(void* owner), void* owner) {
+    out_segment_t* segment = length ? connection_push_segment(conn) : NULL;
+    if (!segment) {
+        release(owner);
+        return length ? -1 : 0;
+    }
+    segment->data = NULL;
+    segment->offset = 0;
+    segment->length = length;
+    segment->release = release;
+    segment->owner = owner;
+    segment->fd = fd;
+    segment->file_offset = offset;
+    conn->write_pending += length;
+    return 0;
+}
+
+// Release whatever a segment holds once it is written or abandoned. A file
+// with a release function belongs to its owner, and stays open.
+static void release_segment(out_segment_t* segment) {
+    if (segment->release) {
+        segment->release(segment->owner);
+    } else if (segment->fd >= 0) {
+        close(segment->fd);
+    }
+}
+
+void connection_discard_output(connection_t* conn) {
+    for (int i = conn->segment_head; i < conn->segment_count; i++) {
+        release_segment(&conn->segments[i]);
+    }
+    conn->segment_head = 0;
+    conn->segment_count = 0;
+    conn->head_sent = 0;
+    conn->write_len = 0;
+    conn->write_pending = 0;
+}
+
+int connection_admit(const server_config_t* config) {
+    if (config->max_connections &&
+        __atomic_load_n(&connections_in_use, __ATOMIC_RELAXED) >= config->max_connections) {
+        return 0;
+    }
+    return !over_memory_budget(config);
+}
+
+void connection_refuse(int fd) {
+    static const char response[] =
+        "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\n"
+        "Content-Length: 19\r\nRetry-After: 1\r\nConnection: close\r\n\r\n"
+        "Service Unavailable";
+    // Fits any empty send buffer; if not, the client just sees the close
+    ssize_t sent = send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)sent;
+    close(fd);
+}
+
+// The read buffer and the arena are only held while a request is under way,
+// see connection_shrink()
+static int connection_take_read_buffer(connection_t* conn) {
+    if (over_memory_budget(conn->loop->config)) {
+        return -1;
+    }
+    conn->read_buf = buffer_pool_get(&conn->loop->read_buffers);
+    if (!conn->read_buf) {
+        return -1;
+    }
+    charge_memory(CONN_READ_BUFFER_SIZE);
+    return 0;
+}
+
+static int connection_take_arena(connection_t* conn) {
+    if (over_memory_budget(conn->loop->config)) {
+        return -1;
+    }
+    conn->arena = arena_pool_get(&conn->loop->arenas);
+    if (!conn->arena) {
+        return -1;
+    }
+    charge_memory(sizeof(arena_t));
+    return 0;
+}
+
+// A persistent connection waiting for its next request gives its buffers
+// back to the worker's pools; idle connections then cost little more than
+// their connection object
+static void connection_shrink(connection_t* conn) {
+    event_loop_t* loop = conn->loop;
+    if (conn->read_buf) {
+        buffer_pool_put(&loop->read_buffers, conn->read_buf);
+        conn->read_buf = NULL;
+        charge_memory(-CONN_READ_BUFFER_SIZE);
+    }
+    if (conn->arena && conn->arena->pins == 0) {
+        arena_pool_put(&loop->arenas, conn->arena);
+        conn->arena = NULL;
+        charge_memory(-(long long)sizeof(arena_t));
+    }
+    if (conn->write_buf && conn->write_pending == 0 && !conn->ring.send_busy &&
+        !conn->ring.retired_write_buf) {
+        free(conn->write_buf);
+        charge_memory(-(long long)conn->write_cap);
+        conn->write_buf = NULL;
+        conn->write_cap = 0;
+        conn->write_len = 0;
+        free(conn->segments);
+        conn->segments = NULL;
+        conn->segment_cap = 0;
+        conn->segment_head = 0;
+        conn->segment_count = 0;
+    }
+}
+
+// The deadline the connection is up against right now
+static int connection_timeout_phase(const connection_t* conn) {
+    if (conn->lingering) {
+        return CONN_TIMEOUT_LINGER;
+    }
+    if (conn->offloaded) {
+        return CONN_TIMEOUT_NONE;
+    }
+    if (conn->write_pending > 0 || conn->streaming) {
+        return CONN_TIMEOUT_WRITE;
+    }
+    if (conn->h2) {
+        return http2_timeout_phase(conn);
+    }
+    if (conn->body_active) {
+        return CONN_TIMEOUT_BODY;
+    }
+    if (conn->read_len > conn->read_start || conn->request_count == 0) {
+        return CONN_TIMEOUT_HEADER;
+    }
+    return CONN_TIMEOUT_IDLE;
+}
+
+int connection_drain(connection_t* conn) {
+    if (conn->h2) {
+        http2_shutdown(conn);
+        return connection_on_ready(conn);
+    }
+    // Between requests nothing is lost by closing; a request under way
+    // finishes first and its response says Connection: close
+    return connection_timeout_phase(conn) == CONN_TIMEOUT_IDLE ? -1 : 0;
+}
+
+// Re-arm the timer when the connection enters another phase, or when bytes
+// moved in a phase whose deadline is about progress. Headers get a single
+// deadline from their first byte however slowly they trickle in, so a
+// slowloris client cannot hold a connection open indefinitely.
+static void connection_update_timeout(connection_t* conn) {
+    int phase = connection_timeout_phase(conn);
+    int progress = conn->progress;
+    conn->progress = 0;
+    if (phase == CONN_TIMEOUT_IDLE) {
+        connection_shrink(conn);
+    }
+    if (phase == conn->timeout_phase &&
+        !(progress && (phase == CONN_TIMEOUT_BODY || phase == CONN_TIMEOUT_WRITE))) {
+        return;
+    }
+    conn->timeout_phase = phase;
+
+    const server_config_t* config = conn->loop->config;
+    int seconds;
+    switch (phase) {
+    case CONN_TIMEOUT_HEADER: seconds = config->header_timeout; break;
+    case CONN_TIMEOUT_BODY:   seconds = config->body_timeout; break;
+    case CONN_TIMEOUT_IDLE:   seconds = config->keepalive_timeout; break;
+    case CONN_TIMEOUT_WRITE:  seconds = config->write_timeout; break;
+    case CONN_TIMEOUT_LINGER: seconds = CONN_LINGER_TIMEOUT; break;
+    default:
+        timer_wheel_cancel(&conn->loop->timers, &conn->timer);
+        return;
+    }
+    event_loop_set_timeout(conn->loop, conn, seconds);
+}
+
+connection_t* connection_create(event_loop_t* loop, int fd) {
+    // Reuse a closed connection's object when the worker has one
+    connection_t* conn = loop->free_connections;
+    if (conn) {
+        loop->free_connections = conn->next;
+        loop->free_connection_count--;
+        memset(conn, 0, sizeof(connection_t));
+    } else {
+        conn = calloc(1, sizeof(connection_t));
+        if (!conn) {
+            return NULL;
+        }
+    }
+    __atomic_add_fetch(&connections_in_use, 1, __ATOMIC_RELAXED);
+    charge_memory(sizeof(connection_t));
+
+    conn->fd = fd;
+    conn->loop = loop;
+    http_parser_init(&conn->parser);
+    event_loop_track(loop, conn);
+    conn->timeout_phase = CONN_TIMEOUT_UNSET;
+    connection_update_timeout(conn);
+    return conn;
+}
+
+void connection_pool_destroy(event_loop_t* loop) {
+    while (loop->free_connections) {
+        connection_t* next = loop->free_connections->next;
+        free(loop->free_connections);
+        loop->free_connections = next;
+    }
+    loop->free_connection_count = 0;
+}
+
+static void connection_end_stream(connection_t* conn) {
+    if (conn->stream.release) {
+        conn->stream.release(conn->stream.context);
+    }
+    conn->streaming = 0;
+    arena_unpin(conn->arena);
+}
+
+// Free everything a closed connection still holds and give its object back
+static void connection_release(connection_t* conn) {
+    // A body handler still waiting for the rest gets to clean up
+    if (conn->body_active && conn->body_route >= 0) {
+        routes[conn->body_route].on_body(&conn->request, NULL, 0);
+    }
+    if (conn->streaming) {
+        connection_end_stream(conn);
+    }
+    if (conn->loop->uring) {
+        uring_release(conn);
+    }
+    connection_discard_output(conn);
+    http2_destroy(conn);
+    connection_shrink(conn);
+    if (conn->arena) {
+        arena_pool_put(&conn->loop->arenas, conn->arena);  // Pinned by output now discarded
+        charge_memory(-(long long)sizeof(arena_t));
+    }
+    free(conn->segments);
+    free(conn->write_buf);
+    charge_memory(-(long long)(conn->write_cap + sizeof(connection_t)));
+    __atomic_sub_fetch(&connections_in_use, 1, __ATOMIC_RELAXED);
+
+    event_loop_t* loop = conn->loop;
+    metrics_connection_closed(loop->metrics);
+    if (loop->free_connection_count < CONN_POOL_MAX) {
+        conn->next = loop->free_connections;
+        loop->free_connections = conn;
+        loop->free_connection_count++;
+    } else {
+        free(conn);
+    }
+}
+
+void connection_destroy(connection_t* conn) {
+    if (conn->reaping) {
+        return;  // Already closed, freed at the end of the batch
+    }
+    event_loop_forget(conn->loop, conn);
+    if (conn->fd >= 0) {
+        if (conn->loop->uring) {
+            // Ends the receive and any send the ring still has on the socket
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        tls_detach(conn);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    if (conn->offloaded || conn->ring.ops > 0) {
+        // A pool thread still has the request, or the ring is not done with
+        // the connection; the rest waits until they hand it back, see
+        // complete_offload_job() and uring_loop_dispatch()
+        return;
+    }
+    if (conn->loop->dispatching) {
+        // Later events of the batch may still point here, see connection_reap()
+        conn->reaping = 1;
+        conn->next = conn->loop->closed;
+        conn->loop->closed = conn;
+        return;
+    }
+    connection_release(conn);
+}
+
+void connection_reap(event_loop_t* loop) {
+    while (loop->closed) {
+        connection_t* conn = loop->closed;
+        loop->closed = conn->next;
+        conn->next = NULL;
+        connection_release(conn);
+    }
+}
+
+// Check a comma-separated header value such as "keep-alive, Upgrade" for a token
+static int header_has_token(const char* value, const char* token) {
+    size_t token_len = strlen(token);
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') value++;
+        const char* end = value;
+        while (*end && *end != ',') end++;
+        const char* last = end;
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t')) last--;
+        if ((size_t)(last - value) == token_len && strncasecmp(value, token, token_len) == 0) {
+            return 1;
+        }
+        value = end;
+    }
+    return 0;
+}
+
+int connection_keep_alive(connection_t* conn, const http_request_t* request) {
+    conn->request_count++;
+    if (request->stream) {
+        return 1;  // HTTP/2 ends the connection with GOAWAY instead
+    }
+
+    // HTTP/1.1 is persistent unless told otherwise; HTTP/1.0 only on request
+    const char* connection = get_known_header(request, HTTP_HEADER_CONNECTION);
+    int keep_alive;
+    if (strcmp(request->version, "HTTP/1.1") == 0) {
+        keep_alive = !header_has_token(connection, "close");
+    } else {
+        keep_alive = header_has_token(connection, "keep-alive");
+    }
+
+    if (conn->request_count >= conn->loop->config->max_keepalive_requests || conn->peer_closed ||
+        conn->loop->draining) {
+        keep_alive = 0;
+    }
+    return keep_alive;
+}
+
+// A cleartext HTTP/1.1 request asking to carry on in HTTP/2 (RFC 7540 3.2).
+// Only one without a body is taken up, so nothing else is left to read as
+// HTTP/1.1 once the connection has switched.
+static int connection_wants_h2c(const connection_t* conn, const http_request_t* request) {
+    const char* upgrade = get_known_header(request, HTTP_HEADER_UPGRADE);
+    const char* connection = get_known_header(request, HTTP_HEADER_CONNECTION);
+    return !conn->tls && upgrade && header_has_token(upgrade, "h2c") &&
+           header_has_token(connection, "upgrade") &&
+           header_has_token(connection, "http2-settings") &&
+           strcmp(request->version, "HTTP/1.1") == 0 &&
+           !get_known_header(request, HTTP_HEADER_CONTENT_LENGTH) &&
+           !get_known_header(request, HTTP_HEADER_TRANSFER_ENCODING);
+}
+
+static void connection_consume(connection_t* conn, size_t length) {
+    conn->read_start += length;
+    if (conn->read_start == conn->read_len) {
+        conn->read_start = 0;
+        conn->read_len = 0;
+    }
+}
+
+static int connection_backpressured(connection_t* conn) {
+    return conn->write_pending >= CONN_WRITE_HIGH_WATERMARK;
+}
+
+void connection_start_stream(connection_t* conn, http_response_t* response) {
+    http_stream_t* stream = &conn->stream;
+    stream->conn = conn;
+    stream->producer = response->stream_producer;
+    stream->context = response->stream_context;
+    stream->release = response->stream_release;
+    stream->remaining = response->stream_length;
+    stream->chunked = response->stream_length < 0 && response->keep_alive;
+    stream->failed = 0;
+    stream->h2 = NULL;
+    response->stream_producer = NULL;
+    // The producer's context may live in the request arena
+    arena_pin(conn->arena);
+    conn->streaming = 1;
+}
+
+// Run the producer until the stream ends or a batch of output is pending.
+// Returns 1 while the stream goes on, 0 once it has ended.
+static int connection_pump_stream(connection_t* conn) {
+    http_stream_t* stream = &conn->stream;
+    size_t start = conn->write_pending;
+    while (!connection_backpressured(conn) && conn->write_pending - start < STREAM_BATCH_SIZE) {
+        int status = stream->producer(stream, stream->context);
+        if (status == HTTP_STREAM_MORE && !stream->failed) {
+            continue;
+        }
+
+        if (status == HTTP_STREAM_DONE && !stream->failed && stream->remaining <= 0) {
+            if (stream->chunked && connection_write(conn, "0\r\n\r\n", 5) != 0) {
+                conn->close_after_write = 1;
+            }
+        } else {
+            // Without its end the client can tell the body is incomplete
+            conn->close_after_write = 1;
+        }
+        connection_end_stream(conn);
+        return 0;
+    }
+    return 1;
+}
+
+static int connection_body_sink(void* context, const char* data, size_t length) {
+    connection_t* conn = context;
+    return routes[conn->body_route].on_body(&conn->request, data, length);
+}
+
+// Copy a waiting request's bytes out of the read buffer before it is reused
+static int connection_detach_request(connection_t* conn) {
+    char* copy = arena_alloc(conn->arena, conn->head_len);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, conn->head, conn->head_len);
+    http_request_relocate(&conn->request, conn->head, conn->head_len, copy);
+    conn->head = NULL;
+    return 0;
+}
+
+// The request is answered: get ready for the next one
+static void connection_end_request(connection_t* conn) {
+    conn->head = NULL;
+    // Everything the request allocated goes at once (later, if output still uses it)
+    arena_reset(conn->arena);
+    http_parser_init(&conn->parser);
+}
+
+// The handler of an offloaded request is done with it
+static void connection_finish_offloaded(connection_t* conn, http_request_t* request) {
+    if (request->stream) {
+        http2_request_done(conn, request);
+    } else {
+        connection_end_request(conn);
+    }
+}
+
+// A request handed to the thread pool. An HTTP/1.1 connection stops taking
+// requests until it comes back, so the pool thread has the request and its
+// arena to itself; an HTTP/2 stream has both of its own.
+typedef struct {
+    pool_task_t task;
+    connection_t* conn;
+    http_request_t* request;
+    http_response_t response;
+    int route;
+    uint64_t started;
+} offload_job_t;
+
+static void run_offload_job(pool_task_t* task) {
+    offload_job_t* job = (offload_job_t*)task;
+    job->route = handle_offloaded_request(job->request, &job->response);
+}
+
+static void complete_offload_job(pool_task_t* task) {
+    offload_job_t* job = (offload_job_t*)task;
+    connection_t* conn = job->conn;
+    http_request_t* request = job->request;
+    conn->offloaded--;
+    if (conn->fd < 0) {
+        // The client went away in the meantime
+        free_http_request(request);
+        free_http_response(&job->response);
+        free(job);
+        if (request->stream) {
+            http2_request_done(conn, request);
+        }
+        if (!conn->offloaded) {
+            connection_destroy(conn);
+        }
+        return;
+    }
+
+    complete_request(conn, request, &job->response, job->route, job->started);
+    free(job);
+    connection_finish_offloaded(conn, request);
+    // Pick up whatever arrived while the handler ran
+    if (connection_on_ready(conn) != 0) {
+        connection_destroy(conn);
+    }
+}
+
+void connection_offload_request(connection_t* conn, http_request_t* request) {
+    offload_job_t* job = malloc(sizeof(offload_job_t));
+    if (!job || (conn->head && connection_detach_request(conn) != 0)) {
+        free(job);
+        handle_request_error(conn, request, 500);
+        connection_finish_offloaded(conn, request);
+        return;
+    }
+    job->task.run = run_offload_job;
+    job->task.complete = complete_offload_job;
+    job->task.loop = conn->loop;
+    job->conn = conn;
+    job->request = request;
+    job->started = metrics_now_ns();
+    init_http_response(&job->response);
+
+    conn->offloaded++;
+    if (thread_pool_submit(&job->task) != 0) {
+        // Nowhere to send it: block this once rather than fail the request
+        conn->offloaded--;
+        job->route = handle_offloaded_request(request, &job->response);
+        complete_request(conn, request, &job->response, job->route, job->started);
+        free(job);
+        connection_finish_offloaded(conn, request);
+    }
+}
+
+// Run the handler of a request that has all it needs, inline or on the pool
+static void connection_run_request(connection_t* conn) {
+    if (handle_request(conn, &conn->request) != 0) {
+        connection_offload_request(conn, &conn->request);
+        return;
+    }
+    connection_end_request(conn);
+}
+
+// Finish the request whose headers were just parsed, or leave it waiting
+// for its body. Returns 0, or -1 once the request has been refused.
+static int connection_start_request(connection_t* conn, size_t request_length) {
+    conn->timeout_phase = CONN_TIMEOUT_UNSET;  // The next request's headers start their own clock
+    http_request_t* request = &conn->request;
+    if (!conn->arena && connection_take_arena(conn) != 0) {
+        handle_request_error(conn, request, 503);
+        return -1;
+    }
+    request->arena = conn->arena;
+    int route = route_find(request);
+    const route_t* matched = route >= 0 ? &routes[route] : NULL;
+
+    size_t max_body = matched && matched->max_body_size
+                          ? matched->max_body_size
+                          : (size_t)conn->loop->config->max_body_kb * 1024;
+    int status = body_decoder_init(&conn->body, request, max_body);
+    if (status != 0) {
+        handle_request_error(conn, request, status);
+        return -1;
+    }
+    const char* expect = get_known_header(request, HTTP_HEADER_EXPECT);
+    int has_body = conn->body.framing != BODY_FRAMING_NONE;
+
+    if (has_body && matched && matched->on_body) {
+        // The handler runs once the body is in; until then the request's views
+        // must survive the read buffer being compacted, see connection_fill()
+        // HTTP/1.0 has no interim responses (RFC 9110 15.2), so its clients
+        // are never told to continue; they send the body regardless
+        if (expect && strcasecmp(expect, "100-continue") == 0 &&
+            strcmp(request->version, "HTTP/1.1") == 0) {
+            connection_write(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+        }
+        conn->body_active = 1;
+        conn->body_route = route;
+        conn->head = conn->read_buf + conn->read_start;
+        conn->head_len = request_length;
+        connection_consume(conn, request_length);
+        return 0;
+    }
+
+    conn->head = conn->read_buf + conn->read_start;
+    conn->head_len = request_length;
+    connection_run_request(conn);
+    connection_consume(conn, request_length);
+    if (has_body) {
+        if (expect) {
+            // The client is waiting to hear before it sends the body; rather
+            // than guess whether it will, end the connection after the answer
+            conn->close_after_write = 1;
+        }
+        conn->body_active = 1;
+        conn->body_route = -1;
+    }
+    return 0;
+}
+
+// Feed buffered body bytes through the decoder. Returns 1 when the body is
+// complete, 0 when more is needed, -1 once the connection is done for.
+static int connection_read_body(connection_t* conn) {
+    size_t consumed;
+    body_sink_t sink = conn->body_route >= 0 ? connection_body_sink : NULL;
+    body_status_t status = body_decoder_execute(&conn->body, conn->read_buf + conn->read_start,
+                                                conn->read_len - conn->read_start, &consumed,
+                                                sink, conn);
+    connection_consume(conn, consumed);
+    if (status == BODY_INCOMPLETE) {
+        return 0;
+    }
+
+    conn->body_active = 0;
+    if (conn->body_route < 0) {
+        // Skipped after its response was queued: just stop if it went wrong
+        if (status != BODY_DONE) {
+            conn->close_after_write = 1;
+            return -1;
+        }
+        return 1;
+    }
+
+    http_request_t* request = &conn->request;
+    if (status != BODY_DONE) {
+        if (status != BODY_REJECTED) {
+            routes[conn->body_route].on_body(request, NULL, 0);
+        }
+        int error = status == BODY_REJECTED ? conn->body.status
+                    : status == BODY_TOO_LARGE ? 413 : 400;
+        handle_request_error(conn, request, error);
+        return -1;
+    }
+
+    request->body_length = conn->body.received;
+    connection_run_request(conn);
+    return 1;
+}
+
+// Handle every complete request already buffered, in arrival order, so that
+// pipelined responses are queued in the order the requests were sent.
+// Returns 1 if it stopped early because too much output is pending.
+static int connection_process(connection_t* conn) {
+    while (!conn->close_after_write || conn->streaming) {
+        if (conn->h2) {
+            return http2_process(conn);
+        }
+        if (conn->offloaded) {
+            return 0;  // Resumed by complete_offload_job()
+        }
+        if (connection_backpressured(conn)) {
+            return 1;
+        }
+
+        if (conn->streaming) {
+            if (connection_pump_stream(conn)) {
+                return 1;  // Let this batch go out before producing more
+            }
+            continue;
+        }
+
+        if (conn->body_active) {
+            if (connection_read_body(conn) <= 0) {
+                return 0;
+            }
+        }
+        if (conn->read_start == conn->read_len) {
+            return 0;
+        }
+
+        if (conn->request_count == 0 && conn->read_start == 0 &&
+            http2_match_preface(conn->read_buf, conn->read_len)) {
+            // HTTP/2 with prior knowledge: the client opened with its preface
+            if (conn->read_len < HTTP2_PREFACE_LEN) {
+                return 0;
+            }
+            if (http2_start(conn) != 0) {
+                conn->close_after_write = 1;
+                return 0;
+            }
+            continue;
+        }
+
+        char* request_start = conn->read_buf + conn->read_start;
+        http_parse_status_t status = http_parser_execute(&conn->parser, &conn->request,
+                                                         request_start,
+                                                         conn->read_len - conn->read_start);
+        if (status == HTTP_PARSE_INCOMPLETE) {
+            if (conn->read_start == 0 && conn->read_len == CONN_READ_BUFFER_SIZE) {
+                // Headers do not fit in the buffer; answer and give up on the client
+                handle_request_error(conn, NULL, 431);
+            }
+            return 0;
+        }
+        if (status < 0) {
+            handle_request_error(conn, NULL,
+                                 status == HTTP_PARSE_URI_TOO_LONG ? 414
+                                 : status == HTTP_PARSE_TOO_MANY_HEADERS ? 431
+                                 : status == HTTP_PARSE_VERSION_UNSUPPORTED ? 505 : 400);
+            return 0;
+        }
+
+        if (connection_wants_h2c(conn, &conn->request) &&
+            http2_upgrade(conn, &conn->request)) {
+            // The request lives on as stream 1; the rest of the input is HTTP/2
+            connection_consume(conn, conn->parser.offset);
+            http_parser_init(&conn->parser);
+            continue;
+        }
+        if (connection_start_request(conn, conn->parser.offset) != 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Advance the queue past bytes the kernel accepted, freeing finished segments
+static void connection_advance_segments(connection_t* conn, size_t written) {
+    conn->write_pending -= written;
+    while (written > 0) {
+        out_segment_t* segment = &conn->segments[conn->segment_head];
+        size_t remaining = segment->length - conn->head_sent;
+        if (written < remaining) {
+            conn->head_sent += written;
+            return;
+        }
+        written -= remaining;
+        release_segment(segment);
+        conn->segment_head++;
+        conn->head_sent = 0;
+    }
+}
+
+void connection_sent(connection_t* conn, size_t written) {
+    connection_advance_segments(conn, written);
+    conn->progress = 1;
+}
+
+static void connection_set_cork(connection_t* conn, int on) {
+    if (conn->corked != on) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        conn->corked = on;
+    }
+}
+
+// Send the file segment at the head of the queue straight from the page cache
+static ssize_t connection_send_file(connection_t* conn) {
+    const out_segment_t* segment = &conn->segments[conn->segment_head];
+    off_t offset = segment->file_offset + conn->head_sent;
+    size_t length = segment->length - conn->head_sent;
+    ssize_t n = conn->tls ? tls_sendfile(conn, segment->fd, offset, length)
+                          : sendfile(conn->fd, segment->fd, &offset, length);
+    if (n == 0) {
+        errno = EIO;  // File shrank under us; the promised length can't be met
+        return -1;
+    }
+    return n;
+}
+
+// Gather consecutive memory segments from the head of the queue, up to the
+// first file segment. Returns the iovec count; *next is the segment after.
+static int connection_gather(connection_t* conn, struct iovec* iov, int* next) {
+    int iov_count = 0;
+    int i = conn->segment_head;
+    for (; i < conn->segment_count && iov_count < CONN_MAX_IOVECS; i++) {
+        const out_segment_t* segment = &conn->segments[i];
+        if (segment->fd >= 0) {
+            break;
+        }
+        const char* base = segment->data ? segment->data : conn->write_buf + segment->offset;
+        size_t skip = (i == conn->segment_head) ? conn->head_sent : 0;
+        iov[iov_count].iov_base = (void*)(base + skip);
+        iov[iov_count].iov_len = segment->length - skip;
+        iov_count++;
+    }
+    *next = i;
+    return iov_count;
+}
+
+// Send the memory segments at the head of the queue with one writev()
+static ssize_t connection_send_memory(connection_t* conn) {
+    struct iovec iov[CONN_MAX_IOVECS];
+    int i;
+    int iov_count = connection_gather(conn, iov, &i);
+
+    // Headers followed by a file: hold them back so they leave in the same
+    // packet as the start of the file instead of a runt segment of their own
+    if (i < conn->segment_count && conn->segments[i].fd >= 0) {
+        connection_set_cork(conn, 1);
+    }
+    return conn->tls ? tls_writev(conn, iov, iov_count) : writev(conn->fd, iov, iov_count);
+}
+
+// Under io_uring the queue goes out as a linked send chain: memory segments
+// in one sendmsg, then a chunk of the file behind them read and sent. Its
+// completion advances the queue and comes back through connection_on_ready().
+static int connection_flush_ring(connection_t* conn) {
+    if (conn->ring.send_busy) {
+        return 1;
+    }
+    if (conn->segment_head == conn->segment_count) {
+        connection_discard_output(conn);
+        return 0;
+    }
+
+    struct iovec iov[CONN_MAX_IOVECS];
+    int i;
+    int iov_count = connection_gather(conn, iov, &i);
+    int fd = -1;
+    off_t offset = 0;
+    size_t length = 0;
+    if (i < conn->segment_count && conn->segments[i].fd >= 0) {
+        const out_segment_t* segment = &conn->segments[i];
+        size_t skip = (i == conn->segment_head) ? conn->head_sent : 0;
+        fd = segment->fd;
+        offset = segment->file_offset + skip;
+        length = segment->length - skip;
+    }
+    return uring_send(conn, iov, iov_count, fd, offset, length) == 0 ? 1 : -1;
+}
+
+// Write as much pending output as the socket accepts. Headers and bodies of
+// all pipelined responses go out in one writev(); file bodies use sendfile().
+// Returns 0 when everything is flushed, 1 if the socket is full, -1 on error.
+static int connection_flush(connection_t* conn) {
+    if (conn->loop->uring) {
+        return connection_flush_ring(conn);
+    }
+    while (conn->segment_head < conn->segment_count) {
+        int is_file = conn->segments[conn->segment_head].fd >= 0;
+        ssize_t n = is_file ? connection_send_file(conn) : connection_send_memory(conn);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+
+        connection_advance_segments(conn, n);
+        conn->progress = 1;
+    }
+
+    // Everything is out: let the tail packet go, and recycle the write
+    // buffer from the start. Uncorking only here keeps HTTP/2 frame headers
+    // between file chunks from going out as runts of their own.
+    connection_set_cork(conn, 0);
+    connection_discard_output(conn);
+    return 0;
+}
+
+// Read until the socket is drained or the buffer is full.
+// Returns the number of bytes read, or -1 on error.
+static ssize_t connection_fill(connection_t* conn) {
+    if (conn->peer_closed) {
+        return 0;
+    }
+
+    // A request waiting for its body still points into the buffer
+    if (conn->head && connection_detach_request(conn) != 0) {
+        return -1;
+    }
+
+    // Move a partially received request to the front to make room. Its views
+    // would go stale, so parse it again from the start; the bytes are untouched
+    // because views are only terminated once a request is complete.
+    if (conn->read_start > 0) {
+        size_t pending = conn->read_len - conn->read_start;
+        memmove(conn->read_buf, conn->read_buf + conn->read_start, pending);
+        conn->read_start = 0;
+        conn->read_len = pending;
+        http_parser_init(&conn->parser);
+    }
+
+    ssize_t total = 0;
+    while (conn->read_len < CONN_READ_BUFFER_SIZE) {
+        char* buf = conn->read_buf + conn->read_len;
+        size_t room = CONN_READ_BUFFER_SIZE - conn->read_len;
+        ssize_t n = conn->loop->uring ? uring_recv(conn, buf, room)
+                    : conn->tls       ? tls_read(conn, buf, room)
+                                      : read(conn->fd, buf, room);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (n == 0) {
+            conn->peer_closed = 1;
+            break;
+        }
+        conn->read_len += n;
+        total += n;
+    }
+
+    if (total > 0) {
+        conn->progress = 1;
+    }
+    return total;
+}
+
+// Throw away whatever arrives on a lingering connection. Returns -1 once
+// the peer has closed too.
+static int connection_discard_input(connection_t* conn) {
+    char discard[4096];
+    while (1) {
+        ssize_t n = conn->loop->uring ? uring_recv(conn, discard, sizeof(discard))
+                                      : read(conn->fd, discard, sizeof(discard));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+    }
+}
+
+// An HTTP/2 peer keeps sending frames (window updates, pings) until it has
+// read our GOAWAY. Closing with them unread would reset the connection and
+// could wipe out the last response on its way, so only our side is shut
+// down, and the connection closes when the peer's does.
+static int connection_linger(connection_t* conn) {
+    conn->lingering = 1;
+    tls_detach(conn);
+    shutdown(conn->fd, SHUT_WR);
+    return connection_discard_input(conn);
+}
+
+static int connection_run(connection_t* conn) {
+    if (conn->lingering) {
+        return connection_discard_input(conn);
+    }
+
+    // Nothing is read or written in the clear until the handshake is done;
+    // it counts against the header timeout of the first request
+    if (conn->tls && !conn->tls_ready) {
+        int done = tls_handshake(conn);
+        if (done <= 0) {
+            return done;
+        }
+        if (tls_alpn_is_h2(conn) && http2_start(conn) != 0) {
+            return -1;
+        }
+    }
+
+    while (1) {
+        int more = connection_process(conn);
+
+        int status = connection_flush(conn);
+        if (status < 0) {
+            return -1;
+        }
+        if (status > 0) {
+            return 0;  // Socket is full; EPOLLOUT or the send's completion brings us back
+        }
+
+        if (conn->close_after_write && !conn->streaming) {
+            return conn->h2 ? connection_linger(conn) : -1;
+        }
+        if (more) {
+            continue;  // Output drained, keep working through pipelined requests
+        }
+
+        if (!conn->read_buf && connection_take_read_buffer(conn) != 0) {
+            if (conn->h2) {
+                return -1;  // No HTTP/1.1 response to send it mid-session
+            }
+            // Over the memory budget: turn the client away rather than grow
+            handle_request_error(conn, NULL, 503);
+            continue;
+        }
+        ssize_t got = connection_fill(conn);
+        if (got < 0) {
+            return -1;
+        }
+        if (got == 0) {
+            // Nothing new: either wait for the next request or, if the peer has
+            // gone, drop whatever partial request is left
+            return conn->peer_closed ? -1 : 0;
+        }
+    }
+}
+
+int connection_on_ready(connection_t* conn) {
+    if (connection_run(conn) != 0) {
+        return -1;
+    }
+    connection_update_timeout(conn);
+    return 0;
+}
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#include "../include/content_encoding.h"
+
+#define GZIP_LEVEL 9         // variants are compressed once and cached
+#define BROTLI_QUALITY 9
+
+const char* encoding_name(content_encoding_t encoding) {
+    switch (encoding) {
+    case ENCODING_BROTLI: return "br";
+    case ENCODING_GZIP:   return "gzip";
+    default:              return "identity";
+    }
+}
+
+const char* encoding_suffix(content_encoding_t encoding) {
+    switch (encoding) {
+    case ENCODING_BROTLI: return ".br";
+    case ENCODING_GZIP:   return ".gz";
+    default:              return "";
+    }
+}
+
+int encoding_supported(content_encoding_t encoding) {
+    switch (encoding) {
+#ifdef HAVE_BROTLI
+    case ENCODING_BROTLI: return 1;
+#endif
+#ifdef HAVE_ZLIB
+    case ENCODING_GZIP:   return 1;
+#endif
+    case ENCODING_IDENTITY: return 1;
+    default:              return 0;
+    }
+}
+
+// "q=0", "q=0.0" and so on reject a coding; any other weight accepts it
+static int weight_is_zero(const char* params, const char* end) {
+    while (params < end) {
+        while (params < end && (*params == ';' || *params == ' ' || *params == '\t')) params++;
+        if (end - params >= 2 && (params[0] == 'q' || params[0] == 'Q') && params[1] == '=') {
+            const char* value = params + 2;
+            if (value == end || *value != '0') return 0;
+            value++;
+            if (value < end && *value == '.') {
+                value++;
+                while (value < end && *value == '0') value++;
+            }
+            return value == end || *value == ' ' || *value == ';';
+        }
+        while (params < end && *params != ';') params++;
+    }
+    return 0;
+}
+
+unsigned int parse_accept_encoding(const char* accept_encoding) {
+    unsigned int accepted = 1u << ENCODING_IDENTITY;
+    if (!accept_encoding) {
+        return accepted;
+    }
+
+    unsigned int explicit_codings = 0;
+    unsigned int rejected = 0;
+    int wildcard = 0;
+    const char* element = accept_encoding;
+    while (*element) {
+        while (*element == ' ' || *element == '\t' || *element == ',') element++;
+        if (!*element) break;
+
+        const char* end = element;
+        while (*end && *end != ',') end++;
+        const char* name_end = element;
+        while (name_end < end && *name_end != ';' && *name_end != ' ' && *name_end != '\t') name_end++;
+        size_t name_len = name_end - element;
+        int zero = weight_is_zero(name_end, end);
+
+        int coding = -1;
+        if (name_len == 2 && strncasecmp(element, "br", 2) == 0) {
+            coding = ENCODING_BROTLI;
+        } else if ((name_len == 4 && strncasecmp(element, "gzip", 4) == 0) ||
+                   (name_len == 6 && strncasecmp(element, "x-gzip", 6) == 0)) {
+            coding = ENCODING_GZIP;
+        } else if (name_len == 1 && *element == '*') {
+            wildcard = zero ? -1 : 1;
+        }
+
+        if (coding >= 0) {
+            explicit_codings |= 1u << coding;
+            if (zero) {
+                rejected |= 1u << coding;
+            } else {
+                accepted |= 1u << coding;
+            }
+        }
+        element = end;
+    }
+
+    // "*" covers every coding not named explicitly
+    if (wildcard > 0) {
+        for (int coding = ENCODING_IDENTITY + 1; coding < ENCODING_COUNT; coding++) {
+            if (!(explicit_codings & (1u << coding))) {
+                accepted |= 1u << coding;
+            }
+        }
+    }
+    return accepted & ~rejected;
+}
+
+#ifdef HAVE_ZLIB
+static char* gzip_buffer(const char* data, size_t size, size_t* compressed_size) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // windowBits 15 + 16 selects the gzip wrapper
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&stream, size);
+    char* out = malloc(bound);
+    if (!out) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (unsigned char*)data;
+    stream.avail_in = size;
+    stream.next_out = (unsigned char*)out;
+    stream.avail_out = bound;
+    int status = deflate(&stream, Z_FINISH);
+    *compressed_size = stream.total_out;
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+static char* brotli_buffer(const char* data, size_t size, size_t* compressed_size) {
+    size_t bound = BrotliEncoderMaxCompressedSize(size);
+    char* out = bound ? malloc(bound) : NULL;
+    if (!out) {
+        return NULL;
+    }
+    *compressed_size = bound;
+    if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               size, (const uint8_t*)data, compressed_size, (uint8_t*)out)) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+char* compress_buffer(content_encoding_t encoding, const char* data, size_t size,
+                      size_t* compressed_size) {
+    (void)data;
+    (void)size;
+    (void)compressed_size;
+    switch (encoding) {
+#ifdef HAVE_BROTLI
+    case ENCODING_BROTLI: return brotli_buffer(data, size, compressed_size);
+#endif
+#ifdef HAVE_ZLIB
+    case ENCODING_GZIP:   return gzip_buffer(data, size, compressed_size);
+#endif
+    default:              return NULL;
+    }
+}
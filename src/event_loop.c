@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../include/event_loop.h"
+#include "../include/connection.h"
+#include "../include/metrics.h"
+#include "../include/access_log.h"
+#include "../include/thread_pool.h"
+#include "../include/uring_loop.h"
+#include "../include/tls.h"
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void event_loop_track(event_loop_t* loop, connection_t* conn) {
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    if (loop->connections) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+}
+
+void event_loop_forget(event_loop_t* loop, connection_t* conn) {
+    timer_wheel_cancel(&loop->timers, &conn->timer);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else if (loop->connections == conn) {
+        loop->connections = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+}
+
+void event_loop_set_timeout(event_loop_t* loop, connection_t* conn, int seconds) {
+    uint64_t deadline = loop->now_ms + (uint64_t)seconds * 1000;
+    // Rounded up, so a deadline never fires early
+    timer_wheel_schedule(&loop->timers, &conn->timer,
+                         (deadline + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS);
+}
+
+static void expire_connection(timer_entry_t* timer, void* context) {
+    (void)context;
+    connection_t* conn = (connection_t*)((char*)timer - offsetof(connection_t, timer));
+    connection_destroy(conn);
+}
+
+// Close every connection whose deadline has passed; only due slots are visited
+static void expire_connections(event_loop_t* loop) {
+    timer_wheel_advance(&loop->timers, loop->now_ms / TIMER_WHEEL_TICK_MS, expire_connection, loop);
+}
+
+int event_loop_init(event_loop_t* loop, int listen_fd, int tls_listen_fd,
+                    const server_config_t* config) {
+    memset(loop, 0, sizeof(event_loop_t));
+    loop->listen_fd = listen_fd;
+    loop->tls_listen_fd = tls_listen_fd;
+    loop->config = config;
+    loop->running = 1;
+    loop->now_ms = monotonic_ms();
+    timer_wheel_init(&loop->timers, loop->now_ms / TIMER_WHEEL_TICK_MS);
+    buffer_pool_init(&loop->read_buffers, CONN_READ_BUFFER_SIZE);
+
+    loop->metrics = metrics_register_worker();
+    if (!loop->metrics) {
+        return -1;
+    }
+    loop->access_log = access_log_register_worker();
+
+    loop->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->completion_fd < 0) {
+        return -1;
+    }
+
+    if (config->io_uring) {
+        loop->uring = uring_loop_create(loop);
+        if (loop->uring) {
+            loop->epoll_fd = -1;
+            return 0;
+        }
+        static int fallback_reported = 0;
+        if (!__atomic_exchange_n(&fallback_reported, 1, __ATOMIC_RELAXED)) {
+            fprintf(stderr, "io_uring is not available, using epoll\n");
+        }
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        close(loop->completion_fd);
+        return -1;
+    }
+
+    // The listening socket is the only entry registered with a NULL pointer
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        close(loop->completion_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    // ...and the completion eventfd the only one registered with the loop itself
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->completion_fd, &ev) < 0) {
+        close(loop->completion_fd);
+        close(loop->epoll_fd);
+        return -1;
+    }
+
+    // The TLS listener is told apart by a pointer to its descriptor
+    if (tls_listen_fd >= 0) {
+        ev.data.ptr = &loop->tls_listen_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, tls_listen_fd, &ev) < 0) {
+            close(loop->completion_fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Stop accepting and let every connection finish what it is doing. Idle
+// ones close now; the rest close once their response is out, or HTTP/2
+// sessions once the GOAWAY they are sent here has let open streams finish.
+static void event_loop_start_drain(event_loop_t* loop) {
+    loop->draining = 1;
+    loop->drain_deadline_ms = loop->now_ms + (uint64_t)loop->config->drain_timeout * 1000;
+    if (loop->uring) {
+        uring_loop_stop_accepting(loop);
+    } else {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+        if (loop->tls_listen_fd >= 0) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->tls_listen_fd, NULL);
+        }
+    }
+
+    connection_t* conn = loop->connections;
+    while (conn) {
+        connection_t* next = conn->next;
+        if (connection_drain(conn) != 0) {
+            connection_destroy(conn);
+        }
+        conn = next;
+    }
+}
+
+void event_loop_drain(event_loop_t* loop) {
+    __atomic_store_n(&loop->drain_requested, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    while (write(loop->completion_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+// Whether a draining loop is done: no connections left, or out of time
+static int event_loop_drained(const event_loop_t* loop) {
+    return loop->draining && (!loop->connections || loop->now_ms >= loop->drain_deadline_ms);
+}
+
+// The wait until the next connection deadline, or the drain deadline if sooner
+static int event_loop_timeout(event_loop_t* loop) {
+    int timeout = timer_wheel_timeout_ms(&loop->timers);
+    if (loop->draining) {
+        uint64_t left = loop->drain_deadline_ms > loop->now_ms
+                            ? loop->drain_deadline_ms - loop->now_ms : 0;
+        if (timeout < 0 || (uint64_t)timeout > left) {
+            timeout = (int)left;
+        }
+    }
+    return timeout;
+}
+
+void event_loop_post(event_loop_t* loop, pool_task_t* task) {
+    // Lock-free push; only the first task onto an empty list needs a wakeup
+    pool_task_t* head = __atomic_load_n(&loop->completions, __ATOMIC_RELAXED);
+    do {
+        task->next = head;
+    } while (!__atomic_compare_exchange_n(&loop->completions, &head, task, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head) {
+        uint64_t one = 1;
+        while (write(loop->completion_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+// Complete every posted task, oldest first
+void event_loop_run_completions(event_loop_t* loop) {
+    uint64_t count;
+    while (read(loop->completion_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+    pool_task_t* task = __atomic_exchange_n(&loop->completions, NULL, __ATOMIC_ACQUIRE);
+    pool_task_t* ordered = NULL;
+    while (task) {
+        pool_task_t* next = task->next;
+        task->next = ordered;
+        ordered = task;
+        task = next;
+    }
+    while (ordered) {
+        pool_task_t* next = ordered->next;
+        ordered->complete(ordered);
+        ordered = next;
+    }
+}
+
+// A drain asked for through event_loop_drain() begins only between batches,
+// once every event already returned has been dispatched
+static void event_loop_check_drain(event_loop_t* loop) {
+    if (!loop->draining && __atomic_load_n(&loop->drain_requested, __ATOMIC_ACQUIRE)) {
+        event_loop_start_drain(loop);
+    }
+}
+
+connection_t* event_loop_add_connection(event_loop_t* loop, int client_fd, int tls) {
+    if (!connection_admit(loop->config)) {
+        metrics_connection_rejected(loop->metrics);
+        if (tls) {
+            close(client_fd);  // A plain-text 503 would only be a protocol error
+        } else {
+            connection_refuse(client_fd);
+        }
+        return NULL;
+    }
+    metrics_connection_accepted(loop->metrics);
+
+    // Responses go out in one writev(), so Nagle would only add latency
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    connection_t* conn = connection_create(loop, client_fd);
+    if (!conn) {
+        close(client_fd);
+        return NULL;
+    }
+    if (tls && tls_attach(conn) != 0) {
+        connection_destroy(conn);
+        return NULL;
+    }
+
+    if (loop->uring) {
+        if (uring_watch(conn) != 0) {
+            connection_destroy(conn);
+            return NULL;
+        }
+        return conn;
+    }
+
+    // Register for both directions once; edge-triggered means no later epoll_ctl
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        connection_destroy(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+static void accept_connections(event_loop_t* loop, int listen_fd, int tls) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(listen_fd, (struct sockaddr*)&client_addr,
+                                &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Accept failed");
+            return;
+        }
+        event_loop_add_connection(loop, client_fd, tls);
+    }
+}
+
+static void dispatch_event(connection_t* conn, uint32_t events) {
+    if (conn->fd < 0) {
+        return;  // Closed earlier in this batch
+    }
+    int result = (events & EPOLLERR) ? -1 : connection_on_ready(conn);
+    if (result != 0) {
+        // close() also removes the descriptor from the epoll set
+        connection_destroy(conn);
+    }
+}
+
+// Completions instead of readiness: accepts, receives and sends are all in
+// flight on the ring, and one io_uring_enter() submits and waits for them
+static void event_loop_run_uring(event_loop_t* loop) {
+    while (loop->running && !event_loop_drained(loop)) {
+        if (uring_loop_wait(loop->uring, event_loop_timeout(loop)) < 0) {
+            perror("io_uring_enter failed");
+            break;
+        }
+        loop->now_ms = monotonic_ms();
+        uring_loop_dispatch(loop);
+        event_loop_check_drain(loop);
+        expire_connections(loop);
+    }
+}
+
+void event_loop_run(event_loop_t* loop) {
+    if (loop->uring) {
+        event_loop_run_uring(loop);
+        return;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (loop->running && !event_loop_drained(loop)) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, event_loop_timeout(loop));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        loop->now_ms = monotonic_ms();
+
+        loop->dispatching = 1;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(loop, loop->listen_fd, 0);
+            } else if (events[i].data.ptr == &loop->tls_listen_fd) {
+                accept_connections(loop, loop->tls_listen_fd, 1);
+            } else if (events[i].data.ptr == loop) {
+                event_loop_run_completions(loop);
+            } else {
+                dispatch_event(events[i].data.ptr, events[i].events);
+            }
+        }
+        loop->dispatching = 0;
+        connection_reap(loop);
+        event_loop_check_drain(loop);
+        expire_connections(loop);
+    }
+}
+
+void event_loop_destroy(event_loop_t* loop) {
+    while (loop->connections) {
+        connection_destroy(loop->connections);
+    }
+    connection_pool_destroy(loop);
+    arena_pool_destroy(&loop->arenas);
+    buffer_pool_destroy(&loop->read_buffers);
+    close(loop->completion_fd);
+    if (loop->uring) {
+        uring_loop_destroy(loop->uring);
+    } else {
+        close(loop->epoll_fd);
+    }
+}
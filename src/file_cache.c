@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include "../include/file_cache.h"
+
+typedef struct file_entry {
+    struct file_entry* hash_next;
+    struct file_entry* lru_prev;
+    struct file_entry* lru_next;
+    unsigned int hash;
+    int fd;                    // -1 when the path named no regular file
+    int error;                 // errno of that failed open
+    struct stat file_stat;
+    time_t checked_at;
+    size_t key_len;
+    char key[];
+} file_entry_t;
+
+// Each shard is an independent LRU with its own lock and share of the capacity
+typedef struct {
+    pthread_mutex_t lock;
+    file_entry_t* buckets[FILE_CACHE_BUCKETS];
+    file_entry_t* lru_head;    // most recently used
+    file_entry_t* lru_tail;
+    int count;
+    int capacity;
+} file_shard_t;
+
+static file_shard_t shards[FILE_CACHE_SHARDS];
+static int root_fd = -1;
+static int revalidate_seconds = 0;
+
+static time_t coarse_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a
+static unsigned int hash_key(const char* key, size_t key_len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < key_len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static file_shard_t* shard_for(unsigned int hash) {
+    return &shards[hash % FILE_CACHE_SHARDS];
+}
+
+static unsigned int bucket_for(unsigned int hash) {
+    return (hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS;
+}
+
+int file_cache_init(const char* root, int capacity, int revalidate_interval) {
+    revalidate_seconds = revalidate_interval;
+
+    // Connections need descriptors more than the cache does
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        (rlim_t)capacity > limit.rlim_cur / 4) {
+        capacity = (int)(limit.rlim_cur / 4);
+    }
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(file_shard_t));
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].capacity = (capacity + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS;
+    }
+    root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        perror(root);
+        return -1;
+    }
+    return 0;
+}
+
+static void lru_unlink(file_shard_t* shard, file_entry_t* entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(file_shard_t* shard, file_entry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    else shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+// Unlink an entry from its shard and close its descriptor (lock held).
+// Descriptors handed out are duplicates, so responses still using the
+// file are not affected.
+static void shard_remove(file_shard_t* shard, file_entry_t* entry) {
+    file_entry_t** link = &shard->buckets[bucket_for(entry->hash)];
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = entry->hash_next;
+    }
+    lru_unlink(shard, entry);
+    shard->count--;
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry);
+}
+
+static file_entry_t* shard_find(file_shard_t* shard, unsigned int hash, const char* key,
+                                size_t key_len) {
+    for (file_entry_t* entry = shard->buckets[bucket_for(hash)]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void file_cache_shutdown(void) {
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        file_shard_t* shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_head) {
+            shard_remove(shard, shard->lru_head);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (root_fd >= 0) {
+        close(root_fd);
+        root_fd = -1;
+    }
+}
+
+// Without openat2(): one component at a time, refusing every symlink.
+// Slower, and stricter than RESOLVE_BENEATH, which allows links that stay
+// below the root.
+static int open_components(const char* path) {
+    int dir_fd = root_fd;
+    const char* component = path;
+    while (1) {
+        while (*component == '/') component++;
+        const char* end = strchr(component, '/');
+        size_t length = end ? (size_t)(end - component) : strlen(component);
+        char name[NAME_MAX + 1];
+        if (length > NAME_MAX) {
+            errno = ENAMETOOLONG;
+            break;
+        }
+        memcpy(name, length ? component : ".", length ? length : 1);
+        name[length ? length : 1] = '\0';
+        if (strcmp(name, "..") == 0) {
+            errno = ENOENT;
+            break;
+        }
+        while (end && *end == '/') end++;
+        int last = !end || *end == '\0';
+        int fd = openat(dir_fd, name,
+                        last ? O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC
+                             : O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir_fd != root_fd) {
+            close(dir_fd);
+        }
+        if (fd < 0 || last) {
+            return fd;
+        }
+        dir_fd = fd;
+        component = end;
+    }
+    if (dir_fd != root_fd) {
+        int error = errno;
+        close(dir_fd);
+        errno = error;
+    }
+    return -1;
+}
+
+// The path walk the cache saves: relative to the root, so it never depends
+// on the working directory, and kept beneath it, so a symlink cannot lead a
+// request out of the document root. Opened non-blocking, so a FIFO there
+// cannot hold the thread before fstat() turns it away; for regular files
+// the flag changes nothing.
+static int open_below_root(const char* path, struct stat* file_stat) {
+    static int have_openat2 = 1;
+    const char* relative = path[1] ? path + 1 : ".";
+    int fd = -1;
+    if (__atomic_load_n(&have_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        fd = (int)syscall(SYS_openat2, root_fd, relative, &how, sizeof(how));
+        if (fd < 0 && (errno == ENOSYS || errno == EPERM)) {
+            // Older kernel, or a seccomp filter that does not know the call
+            __atomic_store_n(&have_openat2, 0, __ATOMIC_RELAXED);
+        }
+    }
+    if (!__atomic_load_n(&have_openat2, __ATOMIC_RELAXED)) {
+        fd = open_components(relative);
+    }
+    if (fd < 0) {
+        if (errno == EXDEV) {
+            errno = ENOENT;  // Resolved outside the root: as good as absent
+        }
+        return -1;
+    }
+    if (fstat(fd, file_stat) != 0 || !S_ISREG(file_stat->st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return -1;
+    }
+    return fd;
+}
+
+// Failures that say something about the path rather than about the process
+static int is_lasting_error(int error) {
+    return error == ENOENT || error == ENOTDIR || error == EACCES || error == ENAMETOOLONG ||
+           error == ELOOP;
+}
+
+static int duplicate_entry(const file_entry_t* entry, struct stat* file_stat) {
+    if (entry->fd < 0) {
+        errno = entry->error;
+        return -1;
+    }
+    *file_stat = entry->file_stat;
+    return fcntl(entry->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+int file_cache_open(const char* path, size_t path_len, struct stat* file_stat) {
+    unsigned int hash = hash_key(path, path_len);
+    file_shard_t* shard = shard_for(hash);
+    if (shard->capacity == 0) {
+        return open_below_root(path, file_stat);
+    }
+
+    time_t now = coarse_now();
+    pthread_mutex_lock(&shard->lock);
+    file_entry_t* entry = shard_find(shard, hash, path, path_len);
+    if (entry && now - entry->checked_at < revalidate_seconds) {
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        int fd = duplicate_entry(entry, file_stat);
+        int error = errno;
+        pthread_mutex_unlock(&shard->lock);
+        errno = error;
+        return fd;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // A miss, or an entry due for a check: opening again picks up a file
+    // that was replaced, created or removed since
+    struct stat opened_stat;
+    memset(&opened_stat, 0, sizeof(opened_stat));
+    int fd = open_below_root(path, &opened_stat);
+    int error = errno;
+    if (fd < 0 && !is_lasting_error(error)) {
+        errno = error;
+        return -1;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    entry = shard_find(shard, hash, path, path_len);
+    if (entry) {
+        if (entry->fd >= 0) {
+            close(entry->fd);
+        }
+        lru_unlink(shard, entry);
+    } else {
+        entry = malloc(sizeof(file_entry_t) + path_len + 1);
+        if (!entry) {
+            pthread_mutex_unlock(&shard->lock);
+            if (fd >= 0) {
+                *file_stat = opened_stat;
+            }
+            errno = error;
+            return fd;  // Uncached, but the caller can still use it
+        }
+        while (shard->count >= shard->capacity && shard->lru_tail) {
+            shard_remove(shard, shard->lru_tail);
+        }
+        entry->hash = hash;
+        entry->key_len = path_len;
+        memcpy(entry->key, path, path_len);
+        entry->key[path_len] = '\0';
+        unsigned int bucket = bucket_for(hash);
+        entry->hash_next = shard->buckets[bucket];
+        shard->buckets[bucket] = entry;
+        shard->count++;
+    }
+    entry->fd = fd;
+    entry->error = error;
+    entry->file_stat = opened_stat;
+    entry->checked_at = now;
+    lru_push_front(shard, entry);
+    fd = duplicate_entry(entry, file_stat);
+    error = errno;
+    pthread_mutex_unlock(&shard->lock);
+    errno = error;
+    return fd;
+}
@@ -7,134 +7,621 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <stdint.h>
 #include "../include/http.h"
 #include "../include/build_file_path_supplement.h"
 #include "../include/serve_static_file_supplement.h"
+#include "../include/asset_cache.h"
+#include "../include/asset_pack.h"
+#include "../include/file_cache.h"
+#include "../include/content_encoding.h"
+#include "../include/mime_types.h"
+#include "../include/file_server.h"
+#include "../include/router.h"
 
 #define DOCUMENT_ROOT "./static"
+#define STATIC_CACHE_CONTROL "public, max-age=3600"
+#define VALIDATOR_SIZE 64
+#define HTTP_DATE_SIZE 32
 
-// MIME type mapping
+// Cache validators for one version of a file. The entity tag is derived from
+// inode, size and mtime so it can be produced without reading the contents;
+// each content coding appends its name ("...-br") to keep the tag strong.
 typedef struct {
-    const char* extension;
-    const char* mime_type;
-} mime_mapping_t;
-
-static mime_mapping_t mime_types[] = {
-    {".html", "text/html"},
-    {".htm", "text/html"},
-    {".css", "text/css"},
-    {".js", "application/javascript"},
-    {".json", "application/json"},
-    {".png", "image/png"},
-    {".jpg", "image/jpeg"},
-    {".jpeg", "image/jpeg"},
-    {".gif", "image/gif"},
-    {".svg", "image/svg+xml"},
-    {".txt", "text/plain"},
-    {".pdf", "application/pdf"},
-    {NULL, "application/octet-stream"} // Default
-};
+    char tag[VALIDATOR_SIZE];         // unquoted, without a coding suffix
+    char last_modified[HTTP_DATE_SIZE];
+    time_t mtime;
+} file_validators_t;
 
 const char* get_mime_type(const char* filename) {
-    const char* extension = strrchr(filename, '.');
-    if (!extension) {
-        return "application/octet-stream";
-    }
-    
-    for (int i = 0; mime_types[i].extension; i++) {
-        if (strcasecmp(extension, mime_types[i].extension) == 0) {
-            return mime_types[i].mime_type;
-        }
+    return mime_type_for(filename)->type;
+}
+
+static void init_validators(file_validators_t* validators, ino_t inode, off_t size,
+                            const struct timespec* mtime) {
+    snprintf(validators->tag, sizeof(validators->tag), "%lx-%llx-%llx",
+             (unsigned long)inode, (unsigned long long)size,
+             (unsigned long long)mtime->tv_sec * 1000000000ull + (unsigned long long)mtime->tv_nsec);
+    struct tm modified;
+    gmtime_r(&mtime->tv_sec, &modified);
+    strftime(validators->last_modified, sizeof(validators->last_modified), HTTP_DATE_FORMAT, &modified);
+    validators->mtime = mtime->tv_sec;
+}
+
+static void format_etag(char* etag, size_t size, const file_validators_t* validators,
+                        content_encoding_t encoding) {
+    if (encoding == ENCODING_IDENTITY) {
+        snprintf(etag, size, "\"%s\"", validators->tag);
+    } else {
+        snprintf(etag, size, "\"%s-%s\"", validators->tag, encoding_name(encoding));
     }
-    
-    return "application/octet-stream";
 }
 
-int is_safe_path(const char* path) {
-    // Prevent directory traversal attacks
-    if (strstr(path, "..") != NULL) {
-        return 0;
+// Does an entity tag from the client name some coding of this file version?
+// All variants are derived from the same bytes, so any of them is still fresh.
+static int etag_matches(const char* etag, size_t etag_len, const file_validators_t* validators) {
+    if (etag_len >= 2 && etag[0] == 'W' && etag[1] == '/') {
+        etag += 2;  // If-None-Match uses the weak comparison
+        etag_len -= 2;
     }
-    if (strstr(path, "//") != NULL) {
+    size_t tag_len = strlen(validators->tag);
+    if (etag_len < tag_len + 2 || etag[0] != '"' || etag[etag_len - 1] != '"' ||
+        memcmp(etag + 1, validators->tag, tag_len) != 0) {
         return 0;
     }
-    return 1;
+    return etag_len == tag_len + 2 || etag[tag_len + 1] == '-';
 }
 
+// Evaluate If-None-Match, or If-Modified-Since when there is no If-None-Match
+static int is_not_modified(const http_request_t* request, const file_validators_t* validators) {
+    const char* if_none_match = get_known_header(request, HTTP_HEADER_IF_NONE_MATCH);
+    if (if_none_match) {
+        const char* element = if_none_match;
+        while (*element) {
+            while (*element == ' ' || *element == '\t' || *element == ',') element++;
+            if (!*element) break;
+            const char* end = element;
+            while (*end && *end != ',') end++;
+            size_t length = end - element;
+            while (length && (element[length - 1] == ' ' || element[length - 1] == '\t')) length--;
+            if (length == 1 && *element == '*') {
+                return 1;
+            }
+            if (etag_matches(element, length, validators)) {
+                return 1;
+            }
+            element = end;
+        }
+        return 0;
+    }
 
-char* build_file_path(const char* uri) {
-    // Security check
-    if (!is_safe_path(uri)) {
-        return NULL;
+    const char* if_modified_since = get_known_header(request, HTTP_HEADER_IF_MODIFIED_SINCE);
+    if (if_modified_since) {
+        struct tm since;
+        memset(&since, 0, sizeof(since));
+        const char* end = strptime(if_modified_since, HTTP_DATE_FORMAT, &since);
+        if (end && *end == '\0') {
+            return validators->mtime <= timegm(&since);
+        }
+    }
+    return 0;
+}
+
+// A 304 repeats the validators and caching headers of the 200 it stands for,
+// including the tag of the coding that 200 would have been sent in
+static void set_not_modified(http_response_t* response, const mime_type_t* mime,
+                             const file_validators_t* validators, content_encoding_t encoding) {
+    response->status_code = 304;
+    http_response_clear_headers(response);
+    char etag[VALIDATOR_SIZE + 16];
+    format_etag(etag, sizeof(etag), validators, encoding);
+    http_response_add_header(response, "ETag", etag);
+    http_response_add_header(response, "Last-Modified", validators->last_modified);
+    http_response_add_header(response, "Cache-Control", STATIC_CACHE_CONTROL);
+    if (mime->compressible) {
+        http_response_add_header(response, "Vary", "Accept-Encoding");
     }
-    // Get the file path, possibly applying default file rules
-    const char* file_path = get_default_file_path(uri);
-    // Construct the full path by combining document root and file path
-    return construct_full_path(DOCUMENT_ROOT, file_path);
 }
 
 // Set response headers for static file
-void set_static_file_headers(http_response_t* response, const char* file_path) {
+void set_static_file_headers(http_response_t* response, const mime_type_t* mime,
+                             const file_validators_t* validators, content_encoding_t encoding) {
     // Content-Type header
-    const char* mime_type = get_mime_type(file_path);
-    strcpy(response->headers[response->header_count][0], "Content-Type");
-    strcpy(response->headers[response->header_count][1], mime_type);
-    response->header_count++;
+    http_response_add_header(response, "Content-Type", mime->type);
     
     // Cache-Control header for static files
-    strcpy(response->headers[response->header_count][0], "Cache-Control");
-    strcpy(response->headers[response->header_count][1], "public, max-age=3600");
-    response->header_count++;
+    http_response_add_header(response, "Cache-Control", STATIC_CACHE_CONTROL);
+
+    // Validators let clients revalidate with a 304 instead of a full download
+    char etag[96];
+    format_etag(etag, sizeof(etag), validators, encoding);
+    http_response_add_header(response, "ETag", etag);
+    http_response_add_header(response, "Last-Modified", validators->last_modified);
+    http_response_add_header(response, "Accept-Ranges", "bytes");
+
+    if (encoding != ENCODING_IDENTITY) {
+        http_response_add_header(response, "Content-Encoding", encoding_name(encoding));
+    }
+
+    // The body depends on Accept-Encoding, so shared caches must key on it
+    if (mime->compressible) {
+        http_response_add_header(response, "Vary", "Accept-Encoding");
+    }
+}
+
+int init_file_server(const server_config_t* config) {
+    asset_cache_init((size_t)config->cache_mb * 1024 * 1024, config->cache_revalidate);
+    if (mime_types_init(config->mime_types) != 0) {
+        return -1;
+    }
+    // Without a document root every file is a 404, as it always was
+    file_cache_init(DOCUMENT_ROOT, config->file_cache, config->cache_revalidate);
+    return config->asset_pack ? asset_pack_open(config->asset_pack) : 0;
+}
+
+// The same headers as set_static_file_headers(), serialized once per cache entry
+static char* build_cached_headers(const mime_type_t* mime, const file_validators_t* validators,
+                                  content_encoding_t encoding) {
+    size_t length = strlen(mime->type) + sizeof(STATIC_CACHE_CONTROL) + 256;
+    char* headers = malloc(length);
+    if (!headers) {
+        return NULL;
+    }
+    char etag[VALIDATOR_SIZE + 16];
+    format_etag(etag, sizeof(etag), validators, encoding);
+    int used = snprintf(headers, length,
+                        "Content-Type: %s\r\nCache-Control: %s\r\nETag: %s\r\nLast-Modified: %s\r\n"
+                        "Accept-Ranges: bytes\r\n",
+                        mime->type, STATIC_CACHE_CONTROL, etag, validators->last_modified);
+    if (encoding != ENCODING_IDENTITY) {
+        used += snprintf(headers + used, length - used, "Content-Encoding: %s\r\n",
+                         encoding_name(encoding));
+    }
+    if (mime->compressible) {
+        snprintf(headers + used, length - used, "Vary: Accept-Encoding\r\n");
+    }
+    return headers;
+}
+
+char* static_file_headers(const mime_type_t* mime, const struct stat* file_stat,
+                          content_encoding_t encoding) {
+    file_validators_t validators;
+    init_validators(&validators, file_stat->st_ino, file_stat->st_size, &file_stat->st_mtim);
+    return build_cached_headers(mime, &validators, encoding);
+}
+
+// Open the precompressed sibling of a file ("app.js.br" next to "app.js")
+// by its normalized path; a missing one is remembered by the file cache
+static int open_encoded_sibling(const char* path, content_encoding_t encoding,
+                                struct stat* file_stat) {
+    char sibling[MAX_URI_SIZE + 64];
+    int length = snprintf(sibling, sizeof(sibling), "%s%s", path, encoding_suffix(encoding));
+    if (length < 0 || (size_t)length >= sizeof(sibling)) {
+        return -1;
+    }
+    return file_cache_open(sibling, length, file_stat);
+}
+
+// Build one encoded variant of a cached file: a sibling file on disk wins,
+// otherwise the identity bytes are compressed. Variants that are not smaller
+// than the original are recorded as not worth offering.
+static void build_asset_variant(asset_t* asset, content_encoding_t encoding) {
+    file_validators_t validators;
+    init_validators(&validators, asset->inode, asset->file_size, &asset->mtime);
+    const asset_variant_t* identity = &asset->variants[ENCODING_IDENTITY];
+    char* data = NULL;
+    size_t size = 0;
+
+    struct stat sibling_stat;
+    int fd = open_encoded_sibling(asset->key, encoding, &sibling_stat);
+    if (fd >= 0) {
+        if (asset_cache_enabled(sibling_stat.st_size)) {
+            data = read_file_descriptor(fd, sibling_stat.st_size);
+            size = sibling_stat.st_size;
+        }
+        close(fd);
+    } else if (encoding_supported(encoding) && identity->size >= MIN_COMPRESS_SIZE) {
+        data = compress_buffer(encoding, identity->data, identity->size, &size);
+    }
+
+    if (data && size >= identity->size) {
+        free(data);
+        data = NULL;
+    }
+    asset_cache_attach_variant(asset, encoding, data, size,
+                               data ? build_cached_headers(asset->mime, &validators, encoding) : NULL);
+}
+
+// Parse one non-negative decimal byte position
+static const char* parse_byte_position(const char* p, off_t* value) {
+    if (*p < '0' || *p > '9') {
+        return NULL;
+    }
+    off_t result = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (result > (INT64_MAX - 9) / 10) {
+            return NULL;
+        }
+        result = result * 10 + (*p - '0');
+    }
+    *value = result;
+    return p;
+}
+
+// Resolve the Range header against a representation of size bytes. Returns
+// the number of ranges to send, 0 when none is satisfiable (416), or -1 to
+// ignore the header and send the whole body: no or malformed Range, a stale
+// If-Range, or ranges that add up to more than the file (overlap abuse).
+static int select_byte_ranges(const http_request_t* request, const file_validators_t* validators,
+                              off_t size, byte_range_t* ranges) {
+    const char* range = get_known_header(request, HTTP_HEADER_RANGE);
+    if (!range || strncasecmp(range, "bytes=", 6) != 0) {
+        return -1;
+    }
+
+    // If-Range needs a strong match: the identity tag or the exact date
+    const char* if_range = get_known_header(request, HTTP_HEADER_IF_RANGE);
+    if (if_range) {
+        char etag[VALIDATOR_SIZE + 16];
+        format_etag(etag, sizeof(etag), validators, ENCODING_IDENTITY);
+        if (strcmp(if_range, etag) != 0 && strcmp(if_range, validators->last_modified) != 0) {
+            return -1;
+        }
+    }
+
+    int count = 0;
+    off_t total = 0;
+    const char* p = range + 6;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        off_t first = 0, last = -1;
+        if (*p == '-') {
+            // Suffix range: the final N bytes
+            off_t suffix;
+            if (!(p = parse_byte_position(p + 1, &suffix))) {
+                return -1;
+            }
+            if (suffix > 0 && size > 0) {
+                first = suffix < size ? size - suffix : 0;
+                last = size - 1;
+            }
+        } else {
+            if (!(p = parse_byte_position(p, &first)) || *p++ != '-') {
+                return -1;
+            }
+            last = size - 1;
+            if (*p >= '0' && *p <= '9') {
+                off_t end;
+                if (!(p = parse_byte_position(p, &end)) || end < first) {
+                    return -1;
+                }
+                if (end < last) {
+                    last = end;
+                }
+            }
+            if (first >= size) {
+                last = -1;  // Unsatisfiable, but the others may still be served
+            }
+        }
+
+        if (last >= first) {
+            if (count == MAX_BYTE_RANGES) {
+                return -1;
+            }
+            ranges[count].offset = first;
+            ranges[count].length = last - first + 1;
+            total += last - first + 1;
+            count++;
+        }
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') {
+            break;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+    return total > size ? -1 : count;
+}
+
+static void set_range_not_satisfiable(http_response_t* response, off_t size) {
+    response->status_code = 416;
+    http_response_clear_headers(response);
+    response->raw_headers = NULL;
+    response->raw_headers_len = 0;
+    http_response_add_headerf(response, "Content-Range", "bytes */%lld", (long long)size);
+    http_response_add_header(response, "Content-Type", "text/plain");
+    response->body = strdup("Range not satisfiable");
+    response->body_length = response->body ? strlen(response->body) : 0;
+}
+
+// Answer a Range request from a file held in memory. Ranges always address
+// the identity representation, so Accept-Encoding is not consulted. Returns
+// 0 when the request has no usable Range and a full response is needed;
+// otherwise the owner's reference has moved to the response.
+static int respond_range_from_memory(const http_request_t* request, http_response_t* response,
+                                     const char* data, size_t size, const mime_type_t* mime,
+                                     const file_validators_t* validators,
+                                     void (*release)(void* owner), void* owner) {
+    byte_range_t ranges[MAX_BYTE_RANGES];
+    int count = select_byte_ranges(request, validators, size, ranges);
+    if (count < 0) {
+        return 0;
+    }
+    if (count == 0) {
+        set_range_not_satisfiable(response, size);
+        release(owner);
+        return 1;
+    }
+
+    set_static_file_headers(response, mime, validators, ENCODING_IDENTITY);
+    response->body = (char*)data;
+    response->body_release = release;
+    response->body_owner = owner;
+    set_byte_ranges(response, ranges, count, size, mime->type);
+    return 1;
+}
+
+static int respond_range_from_asset(const http_request_t* request, http_response_t* response,
+                                    asset_t* asset, const file_validators_t* validators) {
+    const asset_variant_t* identity = &asset->variants[ENCODING_IDENTITY];
+    return respond_range_from_memory(request, response, identity->data, identity->size,
+                                     asset->mime, validators, asset_release, asset);
+}
+
+// The best variant of a cache entry the client accepts, building a missing
+// one on first demand
+static const asset_variant_t* settle_asset_variant(asset_t* asset, unsigned int accepted) {
+    content_encoding_t missing;
+    const asset_variant_t* variant = asset_pick_variant(asset, accepted, &missing);
+    if (missing != ENCODING_IDENTITY && asset_cache_claim_variant(asset, missing)) {
+        build_asset_variant(asset, missing);
+        variant = asset_pick_variant(asset, accepted, &missing);
+    }
+    return variant;
+}
+
+// Point the response at that variant. The reference moves to the response.
+static void respond_from_asset(http_response_t* response, asset_t* asset, unsigned int accepted) {
+    const asset_variant_t* variant = settle_asset_variant(asset, accepted);
+
+    response->status_code = 200;
+    response->raw_headers = variant->headers;
+    response->raw_headers_len = variant->headers_len;
+    if (variant->size == 0) {
+        asset_release(asset);
+        return;
+    }
+    response->body = variant->data;
+    response->body_length = variant->size;
+    response->body_release = asset_release;
+    response->body_owner = asset;
+}
+
+static void keep_packed(void* owner) {
+    (void)owner;  // The mapping outlives every response
+}
+
+// Everything a packed file needs was computed when the pack was built; only
+// the choice of variant and the conditional headers are left for here
+static void respond_from_pack(const http_request_t* request, http_response_t* response,
+                              const asset_pack_entry_t* entry, unsigned int accepted) {
+    const mime_type_t* mime = asset_pack_mime(entry);
+    struct timespec mtime = {(time_t)entry->mtime_sec, (long)entry->mtime_nsec};
+    file_validators_t validators;
+    init_validators(&validators, entry->inode, entry->file_size, &mtime);
+    content_encoding_t encoding = ENCODING_IDENTITY;
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        if ((accepted & (1u << i)) && entry->variants[i].headers_len) {
+            encoding = i;
+            break;
+        }
+    }
+    if (is_not_modified(request, &validators)) {
+        set_not_modified(response, mime, &validators, encoding);
+        return;
+    }
+
+    const asset_pack_variant_t* variant = &entry->variants[ENCODING_IDENTITY];
+    if (respond_range_from_memory(request, response, asset_pack_data(variant), variant->size,
+                                  mime, &validators, keep_packed, NULL)) {
+        return;
+    }
+    variant = &entry->variants[encoding];
+
+    response->status_code = 200;
+    response->raw_headers = asset_pack_headers(variant);
+    response->raw_headers_len = variant->headers_len;
+    if (variant->size) {
+        response->body = (char*)asset_pack_data(variant);
+        response->body_length = variant->size;
+        response->body_release = keep_packed;
+        response->body_owner = NULL;
+    }
+}
+
+// Answer from a cache entry: 304, the requested ranges, or the whole of the
+// best variant. The reference moves to the response.
+static void respond_with_asset(const http_request_t* request, http_response_t* response,
+                               asset_t* asset, unsigned int accepted) {
+    file_validators_t validators;
+    init_validators(&validators, asset->inode, asset->file_size, &asset->mtime);
+    if (is_not_modified(request, &validators)) {
+        const asset_variant_t* variant = settle_asset_variant(asset, accepted);
+        set_not_modified(response, asset->mime, &validators,
+                         (content_encoding_t)(variant - asset->variants));
+        asset_release(asset);
+        return;
+    }
+    if (!respond_range_from_asset(request, response, asset, &validators)) {
+        respond_from_asset(response, asset, accepted);
+    }
+}
+
+// The precompressed sibling a large file is streamed from instead, if the
+// client accepts its coding; returns its descriptor or -1
+static int open_accepted_sibling(const char* key, const mime_type_t* mime, unsigned int accepted,
+                                 struct stat* file_stat, content_encoding_t* encoding) {
+    *encoding = ENCODING_IDENTITY;
+    if (!mime->compressible) {
+        return -1;
+    }
+    for (int i = ENCODING_IDENTITY + 1; i < ENCODING_COUNT; i++) {
+        int fd = (accepted & (1u << i)) ? open_encoded_sibling(key, i, file_stat) : -1;
+        if (fd >= 0) {
+            *encoding = i;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static void set_file_not_found(http_response_t* response) {
+    response->status_code = 404;
+    response->body = strdup("File not found");
+    response->body_length = response->body ? strlen(response->body) : 0;
+    http_response_add_header(response, "Content-Type", "text/plain");
 }
+
 void serve_static_file_handler(http_request_t* request, http_response_t* response) {
     const char* uri = request->uri;
-    char* file_path = build_file_path(uri);
-    if (!file_path) {
-        // Invalid path - set 404 response
-        response->status_code = 404;
-        response->body = strdup("File not found");
-        response->body_length = strlen(response->body);
-        strcpy(response->headers[0][0], "Content-Type");
-        strcpy(response->headers[0][1], "text/plain");
-        response->header_count = 1;
+    unsigned int accepted = parse_accept_encoding(get_known_header(request, HTTP_HEADER_ACCEPT_ENCODING));
+
+    // Under a mount such as "/static/*" the file is the captured rest of the
+    // path, otherwise the whole URI path; the query string never selects a
+    // file. Either is decoded and normalized once, and that names the file
+    // in the pack, the caches and on disk alike.
+    char mounted[MAX_URI_SIZE + 2];
+    const char* source = uri;
+    size_t source_len = request->uri_len;
+    size_t capture_len;
+    const char* capture = get_route_param(request, "*", &capture_len);
+    if (capture && capture_len + 1 < sizeof(mounted)) {
+        mounted[0] = '/';
+        memcpy(mounted + 1, capture, capture_len);
+        source = mounted;
+        source_len = capture_len + 1;
+    } else if (capture) {
+        source_len = 0;  // Too long to name a file
+    }
+    char path[MAX_URI_SIZE + 2];
+    if (normalize_uri_path(source, source_len, path, sizeof(path)) < 0) {
+        set_file_not_found(response);
         return;
     }
-    
-    // Validate the file
+
+    const char* key = get_default_file_path(path);
+    size_t key_len = strlen(key);
+    const asset_pack_entry_t* packed = asset_pack_find(key, key_len);
+    if (packed) {
+        respond_from_pack(request, response, packed, accepted);
+        return;
+    }
+
+    // Hot assets are answered from memory without touching the filesystem.
+    // A variant not built yet means compressing, or reading a sibling from
+    // disk; only hits that are ready are answered on the event loop.
+    asset_t* asset = asset_cache_lookup(key, key_len);
+    if (asset) {
+        content_encoding_t missing;
+        asset_pick_variant(asset, accepted, &missing);
+        if (missing != ENCODING_IDENTITY && route_offload(request)) {
+            asset_release(asset);
+            return;
+        }
+        respond_with_asset(request, response, asset, accepted);
+        return;
+    }
+
+    // Everything from here on may wait for the disk; leave the event loop to it
+    if (route_offload(request)) {
+        return;
+    }
+
+    // Opened relative to the document root through the file cache, which is
+    // usually a dup() of a descriptor it already holds
+    const mime_type_t* mime = mime_type_for(key);
     struct stat file_stat;
-    if (validate_file(file_path, &file_stat) != 0) {
-        free(file_path);
-        // File validation failed - set 404 response
-        response->status_code = 404;
-        response->body = strdup("File not found");
-        response->body_length = strlen(response->body);
-        strcpy(response->headers[0][0], "Content-Type");
-        strcpy(response->headers[0][1], "text/plain");
-        response->header_count = 1;
+    file_validators_t validators;
+    int fd = file_cache_open(key, key_len, &file_stat);
+    if (fd < 0) {
+        set_file_not_found(response);
+        return;
+    }
+    init_validators(&validators, file_stat.st_ino, file_stat.st_size, &file_stat.st_mtim);
+
+    // Small enough to keep: load it once and serve it from memory from now on
+    if (asset_cache_enabled(file_stat.st_size)) {
+        char* data = read_file_descriptor(fd, file_stat.st_size);
+        close(fd);
+        char file_path[sizeof(DOCUMENT_ROOT) + MAX_URI_SIZE + 2];
+        snprintf(file_path, sizeof(file_path), "%s%s", DOCUMENT_ROOT, key);
+        if (data) {
+            asset = asset_cache_insert(key, key_len, file_path, data, file_stat.st_size,
+                                       build_cached_headers(mime, &validators, ENCODING_IDENTITY),
+                                       &file_stat, mime);
+        }
+        if (!asset) {
+            // Failed to read file - set 500 response
+            response->status_code = 500;
+            response->body = strdup("Internal server error");
+            response->body_length = strlen(response->body);
+            http_response_add_header(response, "Content-Type", "text/plain");
+            return;
+        }
+        respond_with_asset(request, response, asset, accepted);
+        return;
+    }
+
+    if (is_not_modified(request, &validators)) {
+        struct stat sibling_stat;
+        content_encoding_t encoding;
+        int sibling_fd = open_accepted_sibling(key, mime, accepted, &sibling_stat, &encoding);
+        if (sibling_fd >= 0) {
+            close(sibling_fd);
+        }
+        close(fd);
+        set_not_modified(response, mime, &validators, encoding);
         return;
     }
     
-    // Read the file content
-    size_t bytes_read;
-    response->body = read_file_content(file_path, file_stat.st_size, &bytes_read);
-    if (!response->body) {
-        free(file_path);
-        // Failed to read file - set 500 response
-        response->status_code = 500;
-        response->body = strdup("Internal server error");
-        response->body_length = strlen(response->body);
-        strcpy(response->headers[0][0], "Content-Type");
-        strcpy(response->headers[0][1], "text/plain");
-        response->header_count = 1;
+    // Seeks and resumed downloads stream just the requested bytes
+    byte_range_t ranges[MAX_BYTE_RANGES];
+    int range_count = select_byte_ranges(request, &validators, file_stat.st_size, ranges);
+    if (range_count == 0) {
+        close(fd);
+        set_range_not_satisfiable(response, file_stat.st_size);
+        return;
+    }
+    if (range_count > 0) {
+        response->body_fd = fd;
+        response->body_offset = 0;
+        set_static_file_headers(response, mime, &validators, ENCODING_IDENTITY);
+        set_byte_ranges(response, ranges, range_count, file_stat.st_size, mime->type);
         return;
     }
-    response->body_length = bytes_read;
+
+    // Large files are never compressed on the fly, but a precompressed
+    // sibling is streamed instead when the client accepts its coding
+    content_encoding_t encoding;
+    struct stat sibling_stat;
+    int sibling_fd = open_accepted_sibling(key, mime, accepted, &sibling_stat, &encoding);
+    if (sibling_fd >= 0) {
+        close(fd);
+        fd = sibling_fd;
+        file_stat = sibling_stat;
+    }
+
+    // The body is streamed from the page cache with sendfile() when sent
+    response->body_fd = fd;
+    response->body_offset = 0;
+    response->body_length = file_stat.st_size;
     
     // Set response status and headers
     response->status_code = 200;
-    set_static_file_headers(response, file_path);
-    
-    free(file_path);
+    set_static_file_headers(response, mime, &validators, encoding);
 }
 // Main function to serve a static file
 int serve_static_file(const char* uri, http_response_t* response) {
@@ -142,9 +629,9 @@ int serve_static_file(const char* uri, http_response_t* response) {
     http_request_t dummy_request;
     memset(&dummy_request, 0, sizeof(http_request_t));
     
-    // Copy the URI into the request's URI field instead of assigning
-    strncpy(dummy_request.uri, uri, MAX_URI_SIZE - 1);
-    dummy_request.uri[MAX_URI_SIZE - 1] = '\0'; // Ensure null termination
+    // Request strings are views, so the URI can be referenced directly
+    dummy_request.uri = uri;
+    dummy_request.uri_len = strlen(uri);
     
     // Save the current status code to check if it changes
     //int original_status = response->status_code;
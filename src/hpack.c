@@ -0,0 +1,607 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "../include/hpack.h"
+
+struct hpack_entry {
+    size_t name_len;
+    size_t value_len;
+    char data[];               // name, then value
+};
+
+// RFC 7541 Appendix A
+static const struct {
+    const char* name;
+    const char* value;
+} static_table[HPACK_STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// RFC 7541 Appendix B: the code of every octet, then of EOS (256)
+static const struct {
+    unsigned int code;
+    unsigned char bits;
+} huffman_codes[257] = {
+    { 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+    { 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+    { 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+    { 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+    { 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+    { 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+    { 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+    { 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+    { 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+    { 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+    { 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+    { 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+    { 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+    { 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+    { 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+    { 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+    { 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+    { 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+    { 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+    { 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+    { 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+    { 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+    { 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+    { 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+    { 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+    { 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+    { 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+    { 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+    { 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+    { 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+    { 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+    { 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+    { 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+    { 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+    { 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+    { 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+    { 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+    { 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+    { 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+    { 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+    { 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+    { 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+    { 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+    { 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+    { 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+    { 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+    { 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+    { 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+    { 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+    { 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+    { 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+    { 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+    { 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+    { 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+    { 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+    { 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+    { 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+    { 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+    { 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+    { 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+    { 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+    { 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+    { 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+    { 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+// Decoding tree built from the codes: a non-negative child is another
+// node, a negative one the leaf of symbol -child - 1
+#define HUFFMAN_NODES 256
+static short huffman_tree[HUFFMAN_NODES][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_huffman_tree(void) {
+    int nodes = 1;
+    for (int symbol = 0; symbol < 257; symbol++) {
+        int node = 0;
+        for (int bit = huffman_codes[symbol].bits - 1; bit >= 0; bit--) {
+            int branch = (huffman_codes[symbol].code >> bit) & 1;
+            if (bit == 0) {
+                huffman_tree[node][branch] = (short)(-symbol - 1);
+            } else {
+                if (huffman_tree[node][branch] == 0) {
+                    huffman_tree[node][branch] = (short)nodes++;
+                }
+                node = huffman_tree[node][branch];
+            }
+        }
+    }
+}
+
+// Decode into out, which has room for the longest possible result (every
+// code is at least 5 bits). Returns the decoded length, or -1.
+static long huffman_decode(const unsigned char* in, size_t length, char* out) {
+    pthread_once(&huffman_once, build_huffman_tree);
+    long written = 0;
+    int node = 0;
+    int depth = 0;       // bits since the last symbol
+    int all_ones = 1;    // and whether they were all 1, as padding must be
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int branch = (in[i] >> bit) & 1;
+            int next = huffman_tree[node][branch];
+            depth++;
+            all_ones &= branch;
+            if (next < 0) {
+                int symbol = -next - 1;
+                if (symbol == 256) {
+                    return -1;  // EOS inside a string
+                }
+                out[written++] = (char)symbol;
+                node = 0;
+                depth = 0;
+                all_ones = 1;
+            } else {
+                node = next;
+            }
+        }
+    }
+    // What is left must be a prefix of EOS shorter than an octet
+    if (depth > 7 || !all_ones) {
+        return -1;
+    }
+    return written;
+}
+
+static size_t huffman_length(const char* text, size_t length) {
+    size_t bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        bits += huffman_codes[(unsigned char)text[i]].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+void hpack_table_init(hpack_table_t* table, size_t limit) {
+    memset(table, 0, sizeof(hpack_table_t));
+    table->limit = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+    table->max_size = table->limit;
+}
+
+// Newest first, from 1; the caller checks index against count
+static hpack_entry_t* table_entry(const hpack_table_t* table, size_t index) {
+    return table->entries[(table->first + index - 1) % table->capacity];
+}
+
+static void evict_oldest(hpack_table_t* table) {
+    int position = (table->first + table->count - 1) % table->capacity;
+    hpack_entry_t* entry = table->entries[position];
+    table->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    free(entry);
+    table->entries[position] = NULL;
+    table->count--;
+}
+
+static void table_fit(hpack_table_t* table, size_t room) {
+    while (table->count > 0 && table->size + room > table->max_size) {
+        evict_oldest(table);
+    }
+}
+
+void hpack_table_destroy(hpack_table_t* table) {
+    while (table->count > 0) {
+        evict_oldest(table);
+    }
+    free(table->entries);
+    table->entries = NULL;
+}
+
+void hpack_table_set_limit(hpack_table_t* table, size_t limit) {
+    table->limit = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+    if (!table->update_pending || table->limit < table->update_min) {
+        table->update_min = table->limit;
+    }
+    table->max_size = table->limit;
+    table_fit(table, 0);
+    table->update_pending = 1;
+}
+
+// Make an entry ready to insert; allocated up front so that a field is only
+// ever announced as indexed once it can be
+static hpack_entry_t* entry_create(const char* name, size_t name_len, const char* value,
+                                   size_t value_len, int lowercase) {
+    hpack_entry_t* entry = malloc(sizeof(hpack_entry_t) + name_len + value_len);
+    if (!entry) {
+        return NULL;
+    }
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    for (size_t i = 0; i < name_len; i++) {
+        char c = name[i];
+        entry->data[i] = (lowercase && c >= 'A' && c <= 'Z') ? (char)(c + 32) : c;
+    }
+    memcpy(entry->data + name_len, value, value_len);
+    return entry;
+}
+
+// Evictions first, so the name may still come from the entry it replaces:
+// entry is a copy by now. Fails only if the ring cannot be allocated.
+static int table_insert(hpack_table_t* table, hpack_entry_t* entry) {
+    size_t size = entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    if (size > table->max_size) {
+        // Too big for any table: it just empties this one (RFC 7541 4.4)
+        table_fit(table, table->max_size + 1);
+        free(entry);
+        return 0;
+    }
+    if (!table->entries) {
+        table->capacity = HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD + 1;
+        table->entries = calloc(table->capacity, sizeof(hpack_entry_t*));
+        if (!table->entries) {
+            free(entry);
+            return -1;
+        }
+    }
+    table_fit(table, size);
+    table->first = (table->first + table->capacity - 1) % table->capacity;
+    table->entries[table->first] = entry;
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+// Prefix-coded integer (RFC 7541 5.1), bounded well below any real limit
+static int decode_integer(const unsigned char** pos, const unsigned char* end, int prefix_bits,
+                          size_t* out) {
+    if (*pos >= end) {
+        return -1;
+    }
+    size_t max_prefix = (1u << prefix_bits) - 1;
+    size_t value = *(*pos)++ & max_prefix;
+    if (value < max_prefix) {
+        *out = value;
+        return 0;
+    }
+    for (int shift = 0; *pos < end && shift <= 21; shift += 7) {
+        unsigned char octet = *(*pos)++;
+        value += (size_t)(octet & 0x7f) << shift;
+        if (!(octet & 0x80)) {
+            *out = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// A string literal, left in place or Huffman-decoded into scratch
+static int decode_string(const unsigned char** pos, const unsigned char* end, char** scratch,
+                         const char** out, size_t* out_len) {
+    if (*pos >= end) {
+        return -1;
+    }
+    int huffman = **pos & 0x80;
+    size_t length;
+    if (decode_integer(pos, end, 7, &length) != 0 || length > (size_t)(end - *pos)) {
+        return -1;
+    }
+    if (!huffman) {
+        *out = (const char*)*pos;
+        *out_len = length;
+    } else {
+        long decoded = huffman_decode(*pos, length, *scratch);
+        if (decoded < 0) {
+            return -1;
+        }
+        *out = *scratch;
+        *out_len = (size_t)decoded;
+        *scratch += decoded;
+    }
+    *pos += length;
+    return 0;
+}
+
+// A field's name (and value, when value is set) by table index
+static int lookup(const hpack_table_t* table, size_t index, const char** name, size_t* name_len,
+                  const char** value, size_t* value_len) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        if (value) {
+            *value = static_table[index - 1].value;
+            *value_len = strlen(*value);
+        }
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES;
+    if (index > (size_t)table->count) {
+        return -1;
+    }
+    const hpack_entry_t* entry = table_entry(table, index);
+    *name = entry->data;
+    *name_len = entry->name_len;
+    if (value) {
+        *value = entry->data + entry->name_len;
+        *value_len = entry->value_len;
+    }
+    return 0;
+}
+
+int hpack_decode(hpack_table_t* table, const unsigned char* block, size_t length,
+                 hpack_field_t field, void* context) {
+    // Huffman codes are at least 5 bits, so no string grows past 8/5 its size
+    char* scratch_base = malloc(length * 2 + 1);
+    if (!scratch_base) {
+        return -1;
+    }
+    const unsigned char* pos = block;
+    const unsigned char* end = block + length;
+    int fields = 0;
+    int status = 0;
+    while (pos < end && status == 0) {
+        char* scratch = scratch_base;
+        const char* name;
+        const char* value;
+        size_t name_len, value_len, index;
+        unsigned char first = *pos;
+
+        if (first & 0x80) {
+            // Indexed field
+            status = decode_integer(&pos, end, 7, &index) != 0 ||
+                     lookup(table, index, &name, &name_len, &value, &value_len) != 0 ? -1 : 0;
+            if (status == 0) {
+                field(context, name, name_len, value, value_len);
+            }
+        } else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, only ahead of the first field
+            status = fields > 0 || decode_integer(&pos, end, 5, &index) != 0 ||
+                     index > table->limit ? -1 : 0;
+            if (status == 0) {
+                table->max_size = index;
+                table_fit(table, 0);
+            }
+            continue;
+        } else {
+            // Literal, with incremental indexing (01), without (0000) or never (0001)
+            int incremental = (first & 0xc0) == 0x40;
+            status = decode_integer(&pos, end, incremental ? 6 : 4, &index);
+            if (status == 0) {
+                status = index ? lookup(table, index, &name, &name_len, NULL, NULL)
+                               : decode_string(&pos, end, &scratch, &name, &name_len);
+            }
+            if (status == 0) {
+                status = decode_string(&pos, end, &scratch, &value, &value_len);
+            }
+            if (status == 0) {
+                field(context, name, name_len, value, value_len);
+                if (incremental) {
+                    hpack_entry_t* entry = entry_create(name, name_len, value, value_len, 0);
+                    status = entry ? table_insert(table, entry) : -1;
+                }
+            }
+        }
+        fields++;
+    }
+    free(scratch_base);
+    return status;
+}
+
+static int block_reserve(hpack_block_t* block, size_t extra) {
+    if (block->length + extra <= block->capacity) {
+        return 0;
+    }
+    size_t capacity = block->capacity ? block->capacity : 256;
+    while (capacity < block->length + extra) {
+        capacity *= 2;
+    }
+    unsigned char* data = realloc(block->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    block->data = data;
+    block->capacity = capacity;
+    return 0;
+}
+
+void hpack_block_free(hpack_block_t* block) {
+    free(block->data);
+    block->data = NULL;
+    block->length = 0;
+    block->capacity = 0;
+}
+
+// The caller has reserved room: at most 1 + ceil(64 / 7) octets
+static void encode_integer(hpack_block_t* block, unsigned char flags, int prefix_bits, size_t value) {
+    size_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        block->data[block->length++] = (unsigned char)(flags | value);
+        return;
+    }
+    block->data[block->length++] = (unsigned char)(flags | max_prefix);
+    value -= max_prefix;
+    while (value >= 0x80) {
+        block->data[block->length++] = (unsigned char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    block->data[block->length++] = (unsigned char)value;
+}
+
+static unsigned char lower(char c) {
+    return (unsigned char)((c >= 'A' && c <= 'Z') ? c + 32 : c);
+}
+
+static int encode_string(hpack_block_t* block, const char* text, size_t length, int lowercase) {
+    size_t huffman = huffman_length(text, length);
+    int use_huffman = huffman < length;
+    size_t encoded = use_huffman ? huffman : length;
+    if (block_reserve(block, encoded + 12) != 0) {
+        return -1;
+    }
+    encode_integer(block, use_huffman ? 0x80 : 0, 7, encoded);
+    if (!use_huffman) {
+        for (size_t i = 0; i < length; i++) {
+            block->data[block->length++] = lowercase ? lower(text[i]) : (unsigned char)text[i];
+        }
+        return 0;
+    }
+
+    unsigned long long bits = 0;   // pending bits, right-aligned
+    int pending = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char symbol = lowercase ? lower(text[i]) : (unsigned char)text[i];
+        bits = (bits << huffman_codes[symbol].bits) | huffman_codes[symbol].code;
+        pending += huffman_codes[symbol].bits;
+        while (pending >= 8) {
+            pending -= 8;
+            block->data[block->length++] = (unsigned char)(bits >> pending);
+        }
+    }
+    if (pending > 0) {
+        // Padded with the most significant bits of EOS, all ones
+        block->data[block->length++] = (unsigned char)((bits << (8 - pending)) | (0xff >> pending));
+    }
+    return 0;
+}
+
+// Look a field up in both tables: the index of an exact match, or 0 with
+// *name_index set to the first entry of that name (0 when there is none)
+static size_t find_field(const hpack_table_t* table, const char* name, size_t name_len,
+                         const char* value, size_t value_len, size_t* name_index) {
+    *name_index = 0;
+    for (size_t i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        const char* entry_name = static_table[i].name;
+        if (strlen(entry_name) != name_len || strncasecmp(entry_name, name, name_len) != 0) {
+            continue;
+        }
+        if (!*name_index) {
+            *name_index = i + 1;
+        }
+        const char* entry_value = static_table[i].value;
+        if (strlen(entry_value) == value_len && memcmp(entry_value, value, value_len) == 0) {
+            return i + 1;
+        }
+    }
+    for (int i = 1; i <= table->count; i++) {
+        const hpack_entry_t* entry = table_entry(table, i);
+        if (entry->name_len != name_len || strncasecmp(entry->data, name, name_len) != 0) {
+            continue;
+        }
+        if (!*name_index) {
+            *name_index = HPACK_STATIC_ENTRIES + i;
+        }
+        if (entry->value_len == value_len &&
+            memcmp(entry->data + entry->name_len, value, value_len) == 0) {
+            return HPACK_STATIC_ENTRIES + i;
+        }
+    }
+    return 0;
+}
+
+int hpack_encode(hpack_table_t* table, hpack_block_t* block, const char* name, size_t name_len,
+                 const char* value, size_t value_len, int indexing) {
+    if (block_reserve(block, 32) != 0) {
+        return -1;
+    }
+    if (table->update_pending && block->length == 0) {
+        // A block after a SETTINGS change starts with the sizes it went through
+        if (table->update_min < table->max_size) {
+            encode_integer(block, 0x20, 5, table->update_min);
+        }
+        encode_integer(block, 0x20, 5, table->max_size);
+        table->update_pending = 0;
+    }
+
+    size_t name_index;
+    size_t index = indexing == HPACK_NEVER_INDEX
+                       ? 0 : find_field(table, name, name_len, value, value_len, &name_index);
+    if (index) {
+        encode_integer(block, 0x80, 7, index);
+        return 0;
+    }
+    if (indexing == HPACK_NEVER_INDEX) {
+        find_field(table, name, name_len, "", 0, &name_index);
+    }
+
+    hpack_entry_t* entry = NULL;
+    if (indexing == HPACK_INDEX &&
+        name_len + value_len + HPACK_ENTRY_OVERHEAD <= table->max_size) {
+        entry = entry_create(name, name_len, value, value_len, 1);
+    }
+    if (entry) {
+        encode_integer(block, 0x40, 6, name_index);
+    } else {
+        encode_integer(block, indexing == HPACK_NEVER_INDEX ? 0x10 : 0, 4, name_index);
+    }
+    if ((!name_index && encode_string(block, name, name_len, 1) != 0) ||
+        encode_string(block, value, value_len, 0) != 0) {
+        free(entry);
+        return -1;
+    }
+    // Fails only with the ring unallocated, in which case nothing is evicted
+    // and the peer's copy will have the one entry ours lacks; rather than
+    // drift, send nothing more from this table
+    if (entry && table_insert(table, entry) != 0) {
+        table->max_size = 0;
+        table->update_pending = 1;
+        table->update_min = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,1821 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../include/http2.h"
+#include "../include/hpack.h"
+#include "../include/connection.h"
+#include "../include/event_loop.h"
+#include "../include/server.h"
+#include "../include/router.h"
+#include "../include/arena.h"
+#include "../include/send_http_response_supplement.h"
+
+// Frame types, flags, settings and error codes (RFC 9113 6, 7)
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+#define ERROR_NONE 0x0
+#define ERROR_PROTOCOL 0x1
+#define ERROR_INTERNAL 0x2
+#define ERROR_FLOW_CONTROL 0x3
+#define ERROR_STREAM_CLOSED 0x5
+#define ERROR_FRAME_SIZE 0x6
+#define ERROR_REFUSED_STREAM 0x7
+#define ERROR_COMPRESSION 0x9
+#define ERROR_ENHANCE_YOUR_CALM 0xb
+
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffffLL
+#define MAX_FRAME_SIZE_LIMIT 16777215
+
+// DATA payloads up to this size are copied next to their frame header
+// rather than queued by reference, as small HTTP/1.1 bodies are
+#define INLINE_DATA_SIZE 2048
+
+#define BODY_PIECES (2 * MAX_BYTE_RANGES + 1)   // parts, their headers and the closing boundary
+
+// A run of the response body still to be framed: of the body buffer (or a
+// multipart header in the arena) when data is set, of the body file otherwise
+typedef struct {
+    const char* data;
+    off_t offset;
+    size_t length;
+} body_piece_t;
+
+typedef struct http2_stream {
+    struct http2_stream* prev;
+    struct http2_stream* next;
+    struct http2_session* session;
+    uint32_t id;
+    // Held by the open stream, by its handler while that runs, and by every
+    // queued DATA payload that points into its body or file
+    int refs;
+    int open;                // in the session's list of streams
+    int remote_done;         // the client has sent END_STREAM
+    int responded;           // response headers are queued
+    int local_done;          // END_STREAM is queued
+    long long send_window;
+    long long recv_window;
+    size_t recv_unacked;     // body bytes taken since the last WINDOW_UPDATE
+
+    arena_t* arena;
+    http_request_t request;  // its views point into the arena
+    int body_route;          // routes[] index the body goes to while it arrives, -1 otherwise
+    unsigned long long body_received;
+    unsigned long long body_limit;
+    long long content_length;  // -1 when the request gave none
+
+    // The response body, owned until the stream is freed
+    char* body;
+    void (*body_release)(void* owner);
+    void* body_owner;
+    int body_fd;
+    body_piece_t pieces[BODY_PIECES];
+    int piece_head;
+    int piece_count;
+    size_t piece_sent;       // bytes of the head piece already framed
+
+    // A streamed body: produced into pending as long as that stays below a
+    // batch, and sent from there as windows open
+    int streamed;
+    int producing;
+    http_stream_t stream;
+    char* pending;
+    size_t pending_start;
+    size_t pending_len;
+    size_t pending_cap;
+} http2_stream_t;
+
+// Where reading the input has got to
+enum {
+    READ_PREFACE,
+    READ_FRAME_HEADER,
+    READ_FRAME,              // a frame larger than the read buffer, gathered in frame_buf
+    READ_DATA,               // a DATA payload, handed on as it arrives
+    READ_CLOSED              // after a connection error: nothing more is read
+};
+
+typedef struct http2_session {
+    connection_t* conn;
+    int read_state;
+    int settings_seen;       // the client's first frame must be SETTINGS
+
+    // Frame being read
+    uint32_t frame_length;
+    uint8_t frame_type;
+    uint8_t frame_flags;
+    uint32_t frame_stream;
+    unsigned char* frame_buf;
+    size_t frame_got;
+
+    // DATA frame being read; data_stream is NULL when its payload is dropped
+    http2_stream_t* data_stream;
+    int data_pad_pending;    // the pad length octet is still to come
+    size_t data_left;
+    size_t data_pad;
+
+    // A header block continued over CONTINUATION frames
+    uint32_t block_stream;   // 0 when no block is open
+    int block_end_stream;
+    uint32_t block_refusal;
+    unsigned char* block;
+    size_t block_len;
+    size_t block_cap;
+
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+    hpack_block_t out_block;
+
+    http2_stream_t* streams;
+    int stream_count;
+    int streams_opened;
+    uint32_t last_stream_id; // highest the client has opened
+    int goaway_sent;
+    int goaway_received;
+
+    // What the client allows us to send
+    uint32_t peer_max_frame;
+    long long peer_initial_window;
+    long long send_window;
+
+    // What we allow the client to send
+    long long recv_window;
+    size_t recv_unacked;
+} http2_session_t;
+
+static uint32_t read_u32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u32(unsigned char* p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void put_frame_header(unsigned char* out, size_t length, int type, int flags,
+                             uint32_t stream_id) {
+    out[0] = (unsigned char)(length >> 16);
+    out[1] = (unsigned char)(length >> 8);
+    out[2] = (unsigned char)length;
+    out[3] = (unsigned char)type;
+    out[4] = (unsigned char)flags;
+    put_u32(out + 5, stream_id & 0x7fffffff);
+}
+
+static void consume(connection_t* conn, size_t length) {
+    conn->read_start += length;
+    if (conn->read_start == conn->read_len) {
+        conn->read_start = 0;
+        conn->read_len = 0;
+    }
+}
+
+// Output could not be queued, so what went out is no longer a valid
+// stream of frames: stop and close once the client has what there is
+static void session_broken(http2_session_t* session) {
+    session->read_state = READ_CLOSED;
+    session->conn->close_after_write = 1;
+}
+
+static void write_frame(http2_session_t* session, int type, int flags, uint32_t stream_id,
+                        const unsigned char* payload, size_t length) {
+    unsigned char frame[HTTP2_FRAME_HEADER_SIZE + 64];
+    put_frame_header(frame, length, type, flags, stream_id);
+    if (length) {
+        memcpy(frame + HTTP2_FRAME_HEADER_SIZE, payload, length);
+    }
+    if (connection_write(session->conn, frame, HTTP2_FRAME_HEADER_SIZE + length) != 0) {
+        session_broken(session);
+    }
+}
+
+static void send_rst_stream(http2_session_t* session, uint32_t stream_id, uint32_t error) {
+    unsigned char payload[4];
+    put_u32(payload, error);
+    write_frame(session, FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_window_update(http2_session_t* session, uint32_t stream_id, size_t increment) {
+    unsigned char payload[4];
+    put_u32(payload, (uint32_t)increment);
+    write_frame(session, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void send_goaway(http2_session_t* session, uint32_t error) {
+    unsigned char payload[8];
+    put_u32(payload, session->last_stream_id);
+    put_u32(payload + 4, error);
+    write_frame(session, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    session->goaway_sent = 1;
+}
+
+// Once GOAWAY has gone either way the connection ends with its last stream
+static void session_check_done(http2_session_t* session) {
+    if ((session->goaway_sent || session->goaway_received) && session->stream_count == 0) {
+        session->conn->close_after_write = 1;
+    }
+}
+
+// The whole connection is unusable: say why and stop reading (RFC 9113 5.4.1)
+static void connection_error(http2_session_t* session, uint32_t error) {
+    if (session->read_state == READ_CLOSED) {
+        return;
+    }
+    send_goaway(session, error);
+    session->read_state = READ_CLOSED;
+    session->conn->close_after_write = 1;
+}
+
+static http2_stream_t* find_stream(const http2_session_t* session, uint32_t id) {
+    for (http2_stream_t* stream = session->streams; stream; stream = stream->next) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// A stream id the client has not used yet, which only HEADERS may open
+static int is_idle_stream(const http2_session_t* session, uint32_t id) {
+    return id > session->last_stream_id;
+}
+
+static void stream_end_producer(http2_stream_t* stream) {
+    if (stream->producing) {
+        if (stream->stream.release) {
+            stream->stream.release(stream->stream.context);
+        }
+        stream->producing = 0;
+    }
+}
+
+static void stream_free(http2_stream_t* stream) {
+    connection_t* conn = stream->session->conn;
+    stream_end_producer(stream);
+    free_http_request(&stream->request);
+    if (stream->body) {
+        if (stream->body_release) {
+            stream->body_release(stream->body_owner);
+        } else {
+            free(stream->body);
+        }
+    }
+    if (stream->body_fd >= 0) {
+        close(stream->body_fd);
+    }
+    free(stream->pending);
+    connection_charge_memory(-(long long)(sizeof(http2_stream_t) + sizeof(arena_t) +
+                                          stream->pending_cap));
+    arena_pool_put(&conn->loop->arenas, stream->arena);
+    free(stream);
+}
+
+static void stream_unref(http2_stream_t* stream) {
+    if (--stream->refs == 0) {
+        stream_free(stream);
+    }
+}
+
+// Release function of queued DATA payloads
+static void release_stream_ref(void* owner) {
+    stream_unref(owner);
+}
+
+static http2_stream_t* stream_create(http2_session_t* session, uint32_t id) {
+    connection_t* conn = session->conn;
+    if (connection_memory_exhausted(conn->loop->config)) {
+        return NULL;
+    }
+    http2_stream_t* stream = malloc(sizeof(http2_stream_t));
+    if (!stream) {
+        return NULL;
+    }
+    stream->arena = arena_pool_get(&conn->loop->arenas);
+    if (!stream->arena) {
+        free(stream);
+        return NULL;
+    }
+    connection_charge_memory(sizeof(http2_stream_t) + sizeof(arena_t));
+
+    // Field by field, like init_http_request(): the request's header slots
+    // and the body pieces are only read up to their counts
+    stream->session = session;
+    stream->id = id;
+    stream->refs = 1;
+    stream->open = 1;
+    stream->remote_done = 0;
+    stream->responded = 0;
+    stream->local_done = 0;
+    stream->send_window = session->peer_initial_window;
+    stream->recv_window = HTTP2_STREAM_WINDOW;
+    stream->recv_unacked = 0;
+    init_http_request(&stream->request);
+    stream->request.arena = stream->arena;
+    stream->request.stream = stream;
+    stream->body_route = -1;
+    stream->body_received = 0;
+    stream->body_limit = 0;
+    stream->content_length = -1;
+    stream->body = NULL;
+    stream->body_release = NULL;
+    stream->body_fd = -1;
+    stream->piece_head = 0;
+    stream->piece_count = 0;
+    stream->piece_sent = 0;
+    stream->streamed = 0;
+    stream->producing = 0;
+    stream->pending = NULL;
+    stream->pending_start = 0;
+    stream->pending_len = 0;
+    stream->pending_cap = 0;
+
+    stream->prev = NULL;
+    stream->next = session->streams;
+    if (session->streams) {
+        session->streams->prev = stream;
+    }
+    session->streams = stream;
+    session->stream_count++;
+    session->streams_opened++;
+    return stream;
+}
+
+// Take the stream out of the session. Its object lives on until the last
+// queued payload and any running handler let go of it.
+static void stream_close(http2_session_t* session, http2_stream_t* stream) {
+    if (!stream->open) {
+        return;
+    }
+    if (stream->prev) stream->prev->next = stream->next;
+    else session->streams = stream->next;
+    if (stream->next) stream->next->prev = stream->prev;
+    stream->open = 0;
+    session->stream_count--;
+    if (session->data_stream == stream) {
+        session->data_stream = NULL;
+    }
+
+    // A body handler still waiting for the rest gets to clean up
+    if (stream->body_route >= 0) {
+        routes[stream->body_route].on_body(&stream->request, NULL, 0);
+        stream->body_route = -1;
+    }
+    stream_end_producer(stream);
+    stream->piece_head = stream->piece_count;
+    session_check_done(session);
+    stream_unref(stream);
+}
+
+// A stream error (RFC 9113 5.4.2): the stream ends, the connection goes on
+static void stream_reset(http2_session_t* session, http2_stream_t* stream, uint32_t error) {
+    send_rst_stream(session, stream->id, error);
+    stream_close(session, stream);
+}
+
+// END_STREAM is queued. A client still sending is told to stop, since the
+// response no longer depends on it (RFC 9113 8.1).
+static void stream_local_end(http2_session_t* session, http2_stream_t* stream) {
+    stream->local_done = 1;
+    if (stream->remote_done) {
+        stream_close(session, stream);
+    } else {
+        stream_reset(session, stream, ERROR_NONE);
+    }
+}
+
+// Answer a request the server refuses, e.g. 431 or 413
+static void stream_fail_request(http2_session_t* session, http2_stream_t* stream, int status) {
+    http_request_t* request = &stream->request;
+    if (!request->method) {
+        request->method = "";  // For the access log; the block may have lacked it
+    }
+    if (!request->uri) {
+        request->uri = "";
+    }
+    stream->refs++;
+    handle_request_error(session->conn, request, status);
+    stream_unref(stream);
+}
+
+static void stream_run_handler(http2_session_t* session, http2_stream_t* stream) {
+    connection_t* conn = session->conn;
+    // The handler holds the stream, which its response may close, for as
+    // long as it runs, on the thread pool too
+    stream->refs++;
+    if (handle_request(conn, &stream->request) != 0) {
+        connection_offload_request(conn, &stream->request);
+        return;
+    }
+    stream_unref(stream);
+}
+
+void http2_request_done(connection_t* conn, http_request_t* request) {
+    (void)conn;
+    stream_unref(request->stream);
+}
+
+// ---- Request headers ----
+
+static char* arena_copy(arena_t* arena, const char* data, size_t length) {
+    char* copy = arena_alloc(arena, length + 1);
+    if (copy) {
+        memcpy(copy, data, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+// Returns 0, or the status to refuse the request with
+static int request_add_header(http2_stream_t* stream, const char* name, size_t name_len,
+                              const char* value, size_t value_len) {
+    http_request_t* request = &stream->request;
+    http_header_id_t id = http_header_intern(name, name_len);
+    if (id == HTTP_HEADER_COOKIE && request->known_headers[id]) {
+        // Cookies may come split into one field per pair; rejoin them (RFC 9113 8.2.3)
+        http_header_t* cookie = &request->headers[request->known_headers[id] - 1];
+        char* joined = arena_alloc(stream->arena, cookie->value_len + 2 + value_len + 1);
+        if (!joined) {
+            return 500;
+        }
+        memcpy(joined, cookie->value, cookie->value_len);
+        memcpy(joined + cookie->value_len, "; ", 2);
+        memcpy(joined + cookie->value_len + 2, value, value_len);
+        cookie->value_len += 2 + value_len;
+        joined[cookie->value_len] = '\0';
+        cookie->value = joined;
+        return 0;
+    }
+
+    if (request->header_count >= MAX_HEADERS) {
+        return 431;
+    }
+    char* name_copy = arena_copy(stream->arena, name, name_len);
+    char* value_copy = arena_copy(stream->arena, value, value_len);
+    if (!name_copy || !value_copy) {
+        return 500;
+    }
+    http_header_t* header = &request->headers[request->header_count++];
+    header->name = name_copy;
+    header->name_len = name_len;
+    header->value = value_copy;
+    header->value_len = value_len;
+    header->id = id;
+    if (id != HTTP_HEADER_UNKNOWN && !request->known_headers[id]) {
+        request->known_headers[id] = (uint8_t)request->header_count;
+    }
+    return 0;
+}
+
+// Headers that only mean something to one HTTP/1.1 hop
+static int is_connection_header(const char* name, size_t name_len) {
+    static const char* const names[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == name_len && strncasecmp(names[i], name, name_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Field values may not smuggle in what HTTP/1.1 would read as framing
+static int is_valid_value(const char* value, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct {
+    http2_stream_t* stream;   // NULL when the block is decoded only to keep HPACK in step
+    size_t list_size;
+    int status;               // 0, or the status to refuse the request with
+    int malformed;            // a stream error instead (RFC 9113 8.1.1)
+    int regular_seen;         // pseudo-headers have to come first
+    const char* scheme;
+    const char* authority;
+    size_t authority_len;
+} header_collector_t;
+
+static int name_is(const char* name, size_t name_len, const char* expected) {
+    return strlen(expected) == name_len && memcmp(name, expected, name_len) == 0;
+}
+
+static void collect_pseudo_header(header_collector_t* collector, const char* name,
+                                  size_t name_len, const char* value, size_t value_len) {
+    http_request_t* request = &collector->stream->request;
+    const char** slot;
+    size_t* slot_len = NULL;
+    size_t ignored_len;
+    if (name_is(name, name_len, ":method")) {
+        slot = &request->method;
+        slot_len = &request->method_len;
+    } else if (name_is(name, name_len, ":path")) {
+        slot = &request->uri;
+        slot_len = &request->uri_len;
+        if (value_len >= MAX_URI_SIZE) {
+            collector->status = 414;
+            return;
+        }
+    } else if (name_is(name, name_len, ":scheme")) {
+        slot = &collector->scheme;
+        slot_len = &ignored_len;
+    } else if (name_is(name, name_len, ":authority")) {
+        slot = &collector->authority;
+        slot_len = &collector->authority_len;
+    } else {
+        collector->malformed = 1;  // :status, or one this server does not know
+        return;
+    }
+    if (collector->regular_seen || *slot) {
+        collector->malformed = 1;
+        return;
+    }
+    char* copy = arena_copy(collector->stream->arena, value, value_len);
+    if (!copy) {
+        collector->status = 500;
+        return;
+    }
+    *slot = copy;
+    *slot_len = value_len;
+}
+
+static void collect_field(void* context, const char* name, size_t name_len, const char* value,
+                          size_t value_len) {
+    header_collector_t* collector = context;
+    collector->list_size += name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (!collector->stream || collector->status || collector->malformed) {
+        return;
+    }
+    if (collector->list_size > HTTP2_MAX_HEADER_LIST_SIZE) {
+        collector->status = 431;
+        return;
+    }
+    if (name_len == 0 || !is_valid_value(value, value_len)) {
+        collector->malformed = 1;
+        return;
+    }
+    if (name[0] == ':') {
+        collect_pseudo_header(collector, name, name_len, value, value_len);
+        return;
+    }
+
+    collector->regular_seen = 1;
+    for (size_t i = 0; i < name_len; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') {
+            collector->malformed = 1;  // HTTP/2 names are lowercase
+            return;
+        }
+    }
+    if (is_connection_header(name, name_len) ||
+        (name_is(name, name_len, "te") && !(value_len == 8 && memcmp(value, "trailers", 8) == 0))) {
+        collector->malformed = 1;
+        return;
+    }
+    collector->status = request_add_header(collector->stream, name, name_len, value, value_len);
+}
+
+// What the block left out or got wrong as a whole. Returns 0 when the
+// request can go ahead.
+static int finish_request_headers(header_collector_t* collector) {
+    http2_stream_t* stream = collector->stream;
+    http_request_t* request = &stream->request;
+    if (collector->malformed || !request->method || !request->uri || request->uri_len == 0 ||
+        !collector->scheme) {
+        collector->malformed = 1;  // CONNECT, with neither :scheme nor :path, included
+        return -1;
+    }
+    if (collector->status) {
+        return -1;
+    }
+    // The rest of the server looks for the authority where HTTP/1.1 has it
+    if (collector->authority && !request->known_headers[HTTP_HEADER_HOST]) {
+        collector->status = request_add_header(stream, "host", 4, collector->authority,
+                                               collector->authority_len);
+        if (collector->status) {
+            return -1;
+        }
+    }
+    request->version = "HTTP/2.0";
+    request->version_len = 8;
+
+    const char* content_length = get_known_header(request, HTTP_HEADER_CONTENT_LENGTH);
+    if (content_length) {
+        char* end;
+        stream->content_length = strtoll(content_length, &end, 10);
+        if (end == content_length || *end != '\0' || stream->content_length < 0 ||
+            content_length[0] == '-' || content_length[0] == '+') {
+            collector->malformed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ---- Requests ----
+
+static void send_interim_continue(http2_session_t* session, http2_stream_t* stream);
+
+// The request's headers are in: run its handler now, or once it has the
+// body when its route takes one
+static void stream_begin_request(http2_session_t* session, http2_stream_t* stream) {
+    http_request_t* request = &stream->request;
+    int route = route_find(request);
+    const route_t* matched = route >= 0 ? &routes[route] : NULL;
+    if (stream->remote_done || !matched || !matched->on_body) {
+        // Any body is not wanted and just dropped as it arrives
+        stream_run_handler(session, stream);
+        return;
+    }
+
+    stream->body_limit = matched->max_body_size
+                             ? matched->max_body_size
+                             : (size_t)session->conn->loop->config->max_body_kb * 1024;
+    if (stream->content_length >= 0 &&
+        (unsigned long long)stream->content_length > stream->body_limit) {
+        stream_fail_request(session, stream, 413);
+        return;
+    }
+    stream->body_route = route;
+    const char* expect = get_known_header(request, HTTP_HEADER_EXPECT);
+    if (expect && strcasecmp(expect, "100-continue") == 0) {
+        send_interim_continue(session, stream);
+    }
+}
+
+// Body bytes of a stream, straight from the read buffer
+static void stream_take_body(http2_session_t* session, http2_stream_t* stream,
+                             const char* data, size_t length) {
+    stream->body_received += length;
+    if (stream->body_route < 0) {
+        return;
+    }
+    http_request_t* request = &stream->request;
+    int route = stream->body_route;
+    int status;
+    if (stream->body_received > stream->body_limit) {
+        routes[route].on_body(request, NULL, 0);
+        status = 413;
+    } else {
+        status = routes[route].on_body(request, data, length);
+    }
+    if (status != 0) {
+        stream->body_route = -1;
+        stream_fail_request(session, stream, status);
+    }
+}
+
+static void stream_remote_end(http2_session_t* session, http2_stream_t* stream) {
+    stream->remote_done = 1;
+    if (stream->body_route < 0) {
+        if (stream->local_done) {
+            stream_close(session, stream);
+        }
+        return;
+    }
+    if (stream->content_length >= 0 &&
+        (unsigned long long)stream->content_length != stream->body_received) {
+        stream_reset(session, stream, ERROR_PROTOCOL);  // Closing it cleans up the body
+        return;
+    }
+    stream->body_route = -1;
+    stream->request.body_length = stream->body_received;
+    stream_run_handler(session, stream);
+}
+
+// Decode a complete header block for the stream it opens, or for nobody.
+// A refusal already found in the frames stops it from opening one.
+static void header_block_done(http2_session_t* session, const unsigned char* block,
+                              size_t length, uint32_t id, int end_stream, uint32_t refusal) {
+    connection_t* conn = session->conn;
+    header_collector_t collector;
+    memset(&collector, 0, sizeof(collector));
+
+    http2_stream_t* stream = find_stream(session, id);
+    int opens = !stream && is_idle_stream(session, id) && !session->goaway_sent;
+    if (opens) {
+        session->last_stream_id = id;
+        if (!refusal && (session->stream_count >= HTTP2_MAX_CONCURRENT_STREAMS ||
+                         !(collector.stream = stream_create(session, id)))) {
+            refusal = ERROR_REFUSED_STREAM;
+        }
+    }
+
+    // Every block changes the decoder's table, whether anyone needs it or not
+    if (hpack_decode(&session->decoder, block, length, collect_field, &collector) != 0) {
+        if (collector.stream) {
+            stream_close(session, collector.stream);
+        }
+        connection_error(session, ERROR_COMPRESSION);
+        return;
+    }
+
+    if (stream) {
+        // Trailers, the one other place a block may appear; their fields
+        // are not passed on
+        if (refusal) {
+            stream_reset(session, stream, refusal);
+        } else if (!stream->remote_done && end_stream) {
+            stream_remote_end(session, stream);
+        } else {
+            stream_reset(session, stream, stream->remote_done ? ERROR_STREAM_CLOSED : ERROR_PROTOCOL);
+        }
+        return;
+    }
+    if (!opens) {
+        if (!is_idle_stream(session, id) && !session->goaway_sent) {
+            connection_error(session, ERROR_STREAM_CLOSED);
+        }
+        return;  // After GOAWAY new streams are ignored
+    }
+    if (refusal) {
+        send_rst_stream(session, id, refusal);
+        return;
+    }
+
+    stream = collector.stream;
+    stream->remote_done = end_stream;
+    if (finish_request_headers(&collector) != 0) {
+        if (collector.malformed) {
+            stream_reset(session, stream, ERROR_PROTOCOL);
+        } else {
+            stream_fail_request(session, stream, collector.status);
+        }
+    } else {
+        stream_begin_request(session, stream);
+    }
+
+    // -r caps requests per connection for HTTP/2 too
+    if (session->streams_opened >= conn->loop->config->max_keepalive_requests &&
+        !session->goaway_sent && session->read_state != READ_CLOSED) {
+        send_goaway(session, ERROR_NONE);
+        session_check_done(session);
+    }
+}
+
+static int block_append(http2_session_t* session, const unsigned char* data, size_t length) {
+    if (session->block_len + length > HTTP2_MAX_HEADER_BLOCK) {
+        return -1;
+    }
+    if (session->block_len + length > session->block_cap) {
+        size_t capacity = session->block_cap ? session->block_cap : HTTP2_MAX_FRAME_SIZE;
+        while (capacity < session->block_len + length) {
+            capacity *= 2;
+        }
+        unsigned char* block = realloc(session->block, capacity);
+        if (!block) {
+            return -1;
+        }
+        session->block = block;
+        session->block_cap = capacity;
+    }
+    memcpy(session->block + session->block_len, data, length);
+    session->block_len += length;
+    return 0;
+}
+
+static void block_release(http2_session_t* session) {
+    free(session->block);
+    session->block = NULL;
+    session->block_len = 0;
+    session->block_cap = 0;
+    session->block_stream = 0;
+}
+
+static void on_headers(http2_session_t* session, const unsigned char* payload, size_t length) {
+    uint32_t id = session->frame_stream;
+    uint8_t flags = session->frame_flags;
+    if (id == 0 || id % 2 == 0) {
+        connection_error(session, ERROR_PROTOCOL);  // Clients open odd streams
+        return;
+    }
+    const unsigned char* pos = payload;
+    const unsigned char* end = payload + length;
+    size_t pad = 0;
+    if (flags & FLAG_PADDED) {
+        if (pos >= end) {
+            connection_error(session, ERROR_FRAME_SIZE);
+            return;
+        }
+        pad = *pos++;
+    }
+    uint32_t refusal = 0;
+    if (flags & FLAG_PRIORITY) {
+        // Priorities are advisory and not followed: streams share the
+        // connection round robin. Only a stream depending on itself matters.
+        if (end - pos < 5) {
+            connection_error(session, ERROR_FRAME_SIZE);
+            return;
+        }
+        if ((read_u32(pos) & 0x7fffffff) == id) {
+            refusal = ERROR_PROTOCOL;
+        }
+        pos += 5;
+    }
+    if (pad > (size_t)(end - pos)) {
+        connection_error(session, ERROR_PROTOCOL);
+        return;
+    }
+    end -= pad;
+
+    if (flags & FLAG_END_HEADERS) {
+        header_block_done(session, pos, end - pos, id, flags & FLAG_END_STREAM, refusal);
+        return;
+    }
+    session->block_stream = id;
+    session->block_end_stream = flags & FLAG_END_STREAM;
+    session->block_refusal = refusal;
+    session->block_len = 0;
+    if (block_append(session, pos, end - pos) != 0) {
+        connection_error(session, ERROR_ENHANCE_YOUR_CALM);
+    }
+}
+
+static void on_continuation(http2_session_t* session, const unsigned char* payload,
+                            size_t length) {
+    if (block_append(session, payload, length) != 0) {
+        block_release(session);
+        connection_error(session, ERROR_ENHANCE_YOUR_CALM);
+        return;
+    }
+    if (session->frame_flags & FLAG_END_HEADERS) {
+        uint32_t id = session->block_stream;
+        session->block_stream = 0;
+        header_block_done(session, session->block, session->block_len, id,
+                          session->block_end_stream, session->block_refusal);
+        block_release(session);
+    }
+}
+
+// ---- Control frames ----
+
+// Apply a SETTINGS payload; returns 0 or the connection error it is
+static uint32_t apply_settings(http2_session_t* session, const unsigned char* payload,
+                               size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        unsigned int id = (unsigned int)payload[i] << 8 | payload[i + 1];
+        uint32_t value = read_u32(payload + i + 2);
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_table_set_limit(&session->encoder, value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return ERROR_PROTOCOL;
+            }
+            break;  // Nothing is pushed either way
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > MAX_WINDOW) {
+                return ERROR_FLOW_CONTROL;
+            }
+            // Applies to the windows of open streams as a difference
+            long long delta = (long long)value - session->peer_initial_window;
+            for (http2_stream_t* stream = session->streams; stream; stream = stream->next) {
+                stream->send_window += delta;
+                if (stream->send_window > MAX_WINDOW) {
+                    return ERROR_FLOW_CONTROL;
+                }
+            }
+            session->peer_initial_window = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < HTTP2_MAX_FRAME_SIZE || value > MAX_FRAME_SIZE_LIMIT) {
+                return ERROR_PROTOCOL;
+            }
+            session->peer_max_frame = value;
+            break;
+        default:
+            break;  // MAX_CONCURRENT_STREAMS only limits pushes; unknown ones are ignored
+        }
+    }
+    return 0;
+}
+
+static void on_settings(http2_session_t* session, const unsigned char* payload, size_t length) {
+    if (session->frame_stream != 0) {
+        connection_error(session, ERROR_PROTOCOL);
+        return;
+    }
+    if (session->frame_flags & FLAG_ACK) {
+        if (length != 0) {
+            connection_error(session, ERROR_FRAME_SIZE);
+        }
+        return;
+    }
+    if (length % 6 != 0) {
+        connection_error(session, ERROR_FRAME_SIZE);
+        return;
+    }
+    uint32_t error = apply_settings(session, payload, length);
+    if (error) {
+        connection_error(session, error);
+        return;
+    }
+    write_frame(session, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static void on_window_update(http2_session_t* session, const unsigned char* payload,
+                             size_t length) {
+    if (length != 4) {
+        connection_error(session, ERROR_FRAME_SIZE);
+        return;
+    }
+    uint32_t increment = read_u32(payload) & 0x7fffffff;
+    uint32_t id = session->frame_stream;
+    if (id == 0) {
+        session->send_window += increment;
+        if (increment == 0) {
+            connection_error(session, ERROR_PROTOCOL);
+        } else if (session->send_window > MAX_WINDOW) {
+            connection_error(session, ERROR_FLOW_CONTROL);
+        }
+        return;
+    }
+    http2_stream_t* stream = find_stream(session, id);
+    if (!stream) {
+        if (is_idle_stream(session, id)) {
+            connection_error(session, ERROR_PROTOCOL);
+        }
+        return;  // Closed already: a late update is harmless
+    }
+    stream->send_window += increment;
+    if (increment == 0) {
+        stream_reset(session, stream, ERROR_PROTOCOL);
+    } else if (stream->send_window > MAX_WINDOW) {
+        stream_reset(session, stream, ERROR_FLOW_CONTROL);
+    }
+}
+
+static void on_frame(http2_session_t* session, const unsigned char* payload, size_t length) {
+    uint32_t id = session->frame_stream;
+    switch (session->frame_type) {
+    case FRAME_HEADERS:
+        on_headers(session, payload, length);
+        break;
+    case FRAME_CONTINUATION:
+        on_continuation(session, payload, length);
+        break;
+    case FRAME_SETTINGS:
+        on_settings(session, payload, length);
+        break;
+    case FRAME_WINDOW_UPDATE:
+        on_window_update(session, payload, length);
+        break;
+    case FRAME_PING:
+        if (id != 0) {
+            connection_error(session, ERROR_PROTOCOL);
+        } else if (length != 8) {
+            connection_error(session, ERROR_FRAME_SIZE);
+        } else if (!(session->frame_flags & FLAG_ACK)) {
+            write_frame(session, FRAME_PING, FLAG_ACK, 0, payload, length);
+        }
+        break;
+    case FRAME_RST_STREAM: {
+        if (id == 0 || is_idle_stream(session, id)) {
+            connection_error(session, ERROR_PROTOCOL);
+        } else if (length != 4) {
+            connection_error(session, ERROR_FRAME_SIZE);
+        } else {
+            http2_stream_t* stream = find_stream(session, id);
+            if (stream) {
+                stream_close(session, stream);
+            }
+        }
+        break;
+    }
+    case FRAME_PRIORITY:
+        if (id == 0) {
+            connection_error(session, ERROR_PROTOCOL);
+        } else if (length != 5 || (read_u32(payload) & 0x7fffffff) == id) {
+            http2_stream_t* stream = find_stream(session, id);
+            uint32_t error = length != 5 ? ERROR_FRAME_SIZE : ERROR_PROTOCOL;
+            if (stream) {
+                stream_reset(session, stream, error);
+            } else {
+                send_rst_stream(session, id, error);
+            }
+        }
+        break;
+    case FRAME_GOAWAY:
+        if (id != 0) {
+            connection_error(session, ERROR_PROTOCOL);
+        } else if (length < 8) {
+            connection_error(session, ERROR_FRAME_SIZE);
+        } else {
+            // The client opens nothing more; what it has open is finished
+            session->goaway_received = 1;
+            session_check_done(session);
+        }
+        break;
+    case FRAME_PUSH_PROMISE:
+        connection_error(session, ERROR_PROTOCOL);  // Only servers push
+        break;
+    default:
+        break;  // Extension frames are ignored (RFC 9113 4.1)
+    }
+}
+
+// ---- DATA ----
+
+static void credit_window(http2_session_t* session, http2_stream_t* stream, size_t length) {
+    // Bytes are taken as they arrive, so the windows reopen at once, in
+    // steps of half a window to keep WINDOW_UPDATE frames few
+    session->recv_unacked += length;
+    if (session->recv_unacked >= HTTP2_CONNECTION_WINDOW / 2) {
+        send_window_update(session, 0, session->recv_unacked);
+        session->recv_window += session->recv_unacked;
+        session->recv_unacked = 0;
+    }
+    if (stream && stream->open && !stream->remote_done) {
+        stream->recv_unacked += length;
+        if (stream->recv_unacked >= HTTP2_STREAM_WINDOW / 2) {
+            send_window_update(session, stream->id, stream->recv_unacked);
+            stream->recv_window += stream->recv_unacked;
+            stream->recv_unacked = 0;
+        }
+    }
+}
+
+static void begin_data(http2_session_t* session) {
+    uint32_t id = session->frame_stream;
+    size_t length = session->frame_length;
+    if (id == 0 || is_idle_stream(session, id)) {
+        connection_error(session, ERROR_PROTOCOL);
+        return;
+    }
+    if ((long long)length > session->recv_window) {
+        connection_error(session, ERROR_FLOW_CONTROL);
+        return;
+    }
+    session->recv_window -= length;
+
+    http2_stream_t* stream = find_stream(session, id);
+    if (stream && stream->remote_done) {
+        stream_reset(session, stream, ERROR_STREAM_CLOSED);
+        stream = NULL;
+    } else if (stream && (long long)length > stream->recv_window) {
+        stream_reset(session, stream, ERROR_FLOW_CONTROL);
+        stream = NULL;
+    } else if (stream) {
+        stream->recv_window -= length;
+    }
+    // A stream that is gone keeps getting DATA until the client hears of
+    // it; that is counted against the connection and dropped
+
+    session->data_stream = stream;
+    session->data_pad_pending = (session->frame_flags & FLAG_PADDED) != 0;
+    session->data_left = session->data_pad_pending ? 0 : length;
+    session->data_pad = 0;
+    session->read_state = READ_DATA;
+    if (session->data_pad_pending && length == 0) {
+        connection_error(session, ERROR_FRAME_SIZE);
+    }
+}
+
+static void end_data(http2_session_t* session) {
+    http2_stream_t* stream = session->data_stream;
+    session->data_stream = NULL;
+    session->read_state = READ_FRAME_HEADER;
+    if (stream && (session->frame_flags & FLAG_END_STREAM)) {
+        credit_window(session, NULL, session->frame_length);
+        stream_remote_end(session, stream);
+        return;
+    }
+    credit_window(session, stream, session->frame_length);
+}
+
+// Take what there is of the DATA payload. Returns the bytes used.
+static size_t read_data(http2_session_t* session, const unsigned char* data, size_t available) {
+    if (session->data_pad_pending) {
+        size_t pad = data[0];
+        if (pad >= session->frame_length) {
+            connection_error(session, ERROR_PROTOCOL);
+            return 1;
+        }
+        session->data_pad_pending = 0;
+        session->data_pad = pad;
+        session->data_left = session->frame_length - 1 - pad;
+        return 1;
+    }
+    size_t used;
+    if (session->data_left > 0) {
+        used = available < session->data_left ? available : session->data_left;
+        session->data_left -= used;
+        if (session->data_stream) {
+            stream_take_body(session, session->data_stream, (const char*)data, used);
+        }
+    } else {
+        used = available < session->data_pad ? available : session->data_pad;
+        session->data_pad -= used;
+    }
+    return used;
+}
+
+static int data_finished(const http2_session_t* session) {
+    return !session->data_pad_pending && session->data_left == 0 && session->data_pad == 0;
+}
+
+// ---- Reading ----
+
+// Act on a frame header. Returns 0 once it is consumed, 1 to wait for the
+// whole frame to be in the read buffer.
+static int begin_frame(http2_session_t* session, const unsigned char* header, size_t available) {
+    uint32_t length = (uint32_t)header[0] << 16 | (uint32_t)header[1] << 8 | header[2];
+    session->frame_length = length;
+    session->frame_type = header[3];
+    session->frame_flags = header[4];
+    session->frame_stream = read_u32(header + 5) & 0x7fffffff;
+    if (length > HTTP2_MAX_FRAME_SIZE) {
+        connection_error(session, ERROR_FRAME_SIZE);
+        return 0;
+    }
+    if (!session->settings_seen) {
+        if (session->frame_type != FRAME_SETTINGS || (session->frame_flags & FLAG_ACK)) {
+            connection_error(session, ERROR_PROTOCOL);
+            return 0;
+        }
+        session->settings_seen = 1;
+    }
+    // Nothing may come between the parts of a header block
+    if ((session->block_stream != 0) != (session->frame_type == FRAME_CONTINUATION) ||
+        (session->block_stream != 0 && session->frame_stream != session->block_stream)) {
+        connection_error(session, ERROR_PROTOCOL);
+        return 0;
+    }
+
+    if (session->frame_type == FRAME_DATA) {
+        return 0;
+    }
+    // Small frames wait in the read buffer until they are whole
+    if (available < HTTP2_FRAME_HEADER_SIZE + length &&
+        HTTP2_FRAME_HEADER_SIZE + length <= CONN_READ_BUFFER_SIZE) {
+        return 1;
+    }
+    return 0;
+}
+
+static void read_frames(http2_session_t* session) {
+    connection_t* conn = session->conn;
+    while (session->read_state != READ_CLOSED && conn->write_pending < CONN_WRITE_HIGH_WATERMARK) {
+        const unsigned char* data = (const unsigned char*)conn->read_buf + conn->read_start;
+        size_t available = conn->read_len - conn->read_start;
+
+        switch (session->read_state) {
+        case READ_PREFACE:
+            if (available < HTTP2_PREFACE_LEN) {
+                if (!http2_match_preface((const char*)data, available)) {
+                    session_broken(session);  // Not HTTP/2 at all; no GOAWAY
+                }
+                return;
+            }
+            if (memcmp(data, HTTP2_PREFACE, HTTP2_PREFACE_LEN) != 0) {
+                session_broken(session);
+                return;
+            }
+            consume(conn, HTTP2_PREFACE_LEN);
+            session->read_state = READ_FRAME_HEADER;
+            break;
+
+        case READ_FRAME_HEADER:
+            if (available < HTTP2_FRAME_HEADER_SIZE) {
+                return;
+            }
+            if (begin_frame(session, data, available)) {
+                return;
+            }
+            if (session->read_state == READ_CLOSED) {
+                return;
+            }
+            consume(conn, HTTP2_FRAME_HEADER_SIZE);
+            available -= HTTP2_FRAME_HEADER_SIZE;
+            data += HTTP2_FRAME_HEADER_SIZE;
+            if (session->frame_type == FRAME_DATA) {
+                begin_data(session);
+                if (session->read_state == READ_DATA && data_finished(session)) {
+                    end_data(session);
+                }
+            } else if (available >= session->frame_length) {
+                // The common case: handled in place
+                on_frame(session, data, session->frame_length);
+                consume(conn, session->frame_length);
+            } else {
+                session->frame_buf = malloc(HTTP2_MAX_FRAME_SIZE);
+                if (!session->frame_buf) {
+                    connection_error(session, ERROR_INTERNAL);
+                    return;
+                }
+                session->frame_got = 0;
+                session->read_state = READ_FRAME;
+            }
+            break;
+
+        case READ_FRAME: {
+            size_t take = session->frame_length - session->frame_got;
+            if (take > available) {
+                take = available;
+            }
+            memcpy(session->frame_buf + session->frame_got, data, take);
+            session->frame_got += take;
+            consume(conn, take);
+            if (session->frame_got < session->frame_length) {
+                return;
+            }
+            session->read_state = READ_FRAME_HEADER;
+            on_frame(session, session->frame_buf, session->frame_length);
+            free(session->frame_buf);
+            session->frame_buf = NULL;
+            break;
+        }
+
+        case READ_DATA:
+            if (available == 0) {
+                return;
+            }
+            consume(conn, read_data(session, data, available));
+            if (session->read_state == READ_DATA && data_finished(session)) {
+                end_data(session);
+            }
+            break;
+
+        default:
+            return;
+        }
+        if (conn->read_start == conn->read_len && session->read_state != READ_DATA) {
+            return;
+        }
+    }
+}
+
+// ---- Responses ----
+
+static int field_indexing(const char* name, size_t name_len) {
+    switch (http_header_intern(name, name_len)) {
+    case HTTP_HEADER_DATE:
+    case HTTP_HEADER_ETAG:
+    case HTTP_HEADER_LAST_MODIFIED:
+    case HTTP_HEADER_CONTENT_LENGTH:
+    case HTTP_HEADER_CONTENT_RANGE:
+        return HPACK_NO_INDEX;   // Different for nearly every response
+    case HTTP_HEADER_SET_COOKIE:
+        return HPACK_NEVER_INDEX;
+    default:
+        return HPACK_INDEX;
+    }
+}
+
+// Returns -1 once the block cannot grow, which leaves the encoder's table
+// ahead of the client's
+static int encode_header(http2_session_t* session, const char* name, size_t name_len,
+                         const char* value, size_t value_len) {
+    // Content-Length is the server's to set, and HTTP/1.1 framing has no place
+    if (is_connection_header(name, name_len) ||
+        (name_len == 14 && strncasecmp(name, "content-length", 14) == 0)) {
+        return 0;
+    }
+    return hpack_encode(&session->encoder, &session->out_block, name, name_len, value, value_len,
+                        field_indexing(name, name_len));
+}
+
+// Pre-serialized "Name: value\r\n" lines, as the file server keeps them
+static int encode_raw_headers(http2_session_t* session, const char* raw, size_t length) {
+    const char* end = raw + length;
+    while (raw < end) {
+        const char* line_end = memchr(raw, '\n', end - raw);
+        if (!line_end) {
+            line_end = end;
+        }
+        const char* colon = memchr(raw, ':', line_end - raw);
+        if (colon) {
+            const char* value = colon + 1;
+            const char* value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ')) value_end--;
+            if (encode_header(session, raw, colon - raw, value, value_end - value) != 0) {
+                return -1;
+            }
+        }
+        raw = line_end + 1;
+    }
+    return 0;
+}
+
+// HEADERS, then as many CONTINUATION frames as the client's frame size needs
+static int write_header_block(http2_session_t* session, uint32_t stream_id, int end_stream) {
+    connection_t* conn = session->conn;
+    const unsigned char* block = session->out_block.data;
+    size_t length = session->out_block.length;
+    int status = 0;
+    int type = FRAME_HEADERS;
+    do {
+        size_t chunk = length < session->peer_max_frame ? length : session->peer_max_frame;
+        int flags = (chunk == length ? FLAG_END_HEADERS : 0) |
+                    (type == FRAME_HEADERS && end_stream ? FLAG_END_STREAM : 0);
+        unsigned char header[HTTP2_FRAME_HEADER_SIZE];
+        put_frame_header(header, chunk, type, flags, stream_id);
+        status |= connection_write(conn, header, sizeof(header));
+        status |= connection_write(conn, block, chunk);
+        block += chunk;
+        length -= chunk;
+        type = FRAME_CONTINUATION;
+    } while (length > 0);
+    return status;
+}
+
+static void send_interim_continue(http2_session_t* session, http2_stream_t* stream) {
+    session->out_block.length = 0;
+    if (hpack_encode(&session->encoder, &session->out_block, ":status", 7, "100", 3,
+                     HPACK_INDEX) != 0 ||
+        write_header_block(session, stream->id, 0) != 0) {
+        session_broken(session);
+    }
+}
+
+static void add_piece(http2_stream_t* stream, const char* data, off_t offset, size_t length) {
+    if (length == 0 || stream->piece_count == BODY_PIECES) {
+        return;
+    }
+    body_piece_t* piece = &stream->pieces[stream->piece_count++];
+    piece->data = data;
+    piece->offset = offset;
+    piece->length = length;
+}
+
+static void add_body_piece(http2_stream_t* stream, off_t body_offset, off_t offset, size_t length) {
+    if (stream->body) {
+        add_piece(stream, stream->body + offset, 0, length);
+    } else {
+        add_piece(stream, NULL, body_offset + offset, length);
+    }
+}
+
+// Hand the body over to the stream and cut it into the pieces to frame
+static void stream_take_response_body(http2_stream_t* stream, http_response_t* response) {
+    stream->body = response->body;
+    stream->body_release = response->body_release;
+    stream->body_owner = response->body_owner;
+    stream->body_fd = response->body_fd;
+    response->body = NULL;
+    response->body_fd = -1;
+
+    off_t base = response->body_offset;
+    if (response->range_count == 0) {
+        add_body_piece(stream, base, 0, response->body_length);
+        return;
+    }
+    if (response->range_count == 1) {
+        add_body_piece(stream, base, response->ranges[0].offset, response->ranges[0].length);
+        return;
+    }
+    // The same multipart/byteranges body HTTP/1.1 sends, part headers in the arena
+    for (int i = 0; i < response->range_count; i++) {
+        char part_header[256];
+        int length = format_part_header(part_header, sizeof(part_header), response, i);
+        char* copy = arena_copy(stream->arena, part_header, length);
+        if (copy) {
+            add_piece(stream, copy, 0, length);
+        }
+        add_body_piece(stream, base, response->ranges[i].offset, response->ranges[i].length);
+    }
+    char end[64];
+    int length = format_parts_end(end, sizeof(end), response);
+    char* copy = arena_copy(stream->arena, end, length);
+    if (copy) {
+        add_piece(stream, copy, 0, length);
+    }
+}
+
+void http2_send_response(connection_t* conn, http_request_t* request, http_response_t* response) {
+    http2_session_t* session = conn->h2;
+    http2_stream_t* stream = request->stream;
+    if (!stream->open || stream->responded || session->read_state == READ_CLOSED) {
+        return;  // Reset while the handler ran; the caller frees the response
+    }
+    stream->responded = 1;
+
+    // 1xx, 204 and 304 responses never have a body (RFC 9110 6.4.1)
+    int status = response->status_code;
+    int bodyless = (status >= 100 && status < 200) || status == 204 || status == 304;
+    long long length = -1;
+    if (!bodyless) {
+        if (response->stream_producer) {
+            length = response->stream_length;
+        } else {
+            int has_body = response->body || response->body_fd >= 0;
+            length = has_body ? (long long)response->body_length : 0;
+        }
+    }
+    int ends = bodyless || (length == 0 && !response->stream_producer);
+
+    // Fields are added in response order; :status has to come first
+    char digits[24];
+    int digits_len = snprintf(digits, sizeof(digits), "%d", status);
+    session->out_block.length = 0;
+    int failed = hpack_encode(&session->encoder, &session->out_block, ":status", 7, digits,
+                              digits_len, HPACK_INDEX);
+    for (int i = 0; i < response->header_count && !failed; i++) {
+        size_t name_len, value_len;
+        const char* name = http_response_header_name(response, i, &name_len);
+        const char* value = http_response_header_value(response, i, &value_len);
+        failed = encode_header(session, name, name_len, value, value_len);
+    }
+    if (!failed && response->raw_headers_len) {
+        failed = encode_raw_headers(session, response->raw_headers, response->raw_headers_len);
+    }
+    if (!failed && length >= 0) {
+        digits_len = snprintf(digits, sizeof(digits), "%lld", length);
+        failed = hpack_encode(&session->encoder, &session->out_block, "content-length", 14,
+                              digits, digits_len, HPACK_NO_INDEX);
+    }
+    if (failed || write_header_block(session, stream->id, ends) != 0) {
+        session_broken(session);
+        return;
+    }
+    if (ends) {
+        stream_local_end(session, stream);
+        return;
+    }
+
+    if (response->stream_producer) {
+        http_stream_t* body_stream = &stream->stream;
+        body_stream->conn = conn;
+        body_stream->producer = response->stream_producer;
+        body_stream->context = response->stream_context;
+        body_stream->release = response->stream_release;
+        body_stream->remaining = response->stream_length;
+        body_stream->chunked = 0;
+        body_stream->failed = 0;
+        body_stream->h2 = stream;
+        response->stream_producer = NULL;
+        stream->streamed = 1;
+        stream->producing = 1;
+        return;
+    }
+    stream_take_response_body(stream, response);
+}
+
+int http2_stream_write(http2_stream_t* stream, const void* data, size_t length) {
+    if (stream->pending_len + length > stream->pending_cap) {
+        size_t capacity = stream->pending_cap ? stream->pending_cap : CONN_WRITE_BUFFER_SIZE;
+        while (capacity < stream->pending_len + length) {
+            capacity *= 2;
+        }
+        char* pending = realloc(stream->pending, capacity);
+        if (!pending) {
+            return -1;
+        }
+        connection_charge_memory((long long)(capacity - stream->pending_cap));
+        stream->pending = pending;
+        stream->pending_cap = capacity;
+    }
+    memcpy(stream->pending + stream->pending_len, data, length);
+    stream->pending_len += length;
+    return 0;
+}
+
+// ---- Sending ----
+
+// Run a stream's producer until a batch is waiting, as
+// connection_pump_stream() does for HTTP/1.1
+static void pump_stream(http2_session_t* session, http2_stream_t* stream) {
+    if (stream->pending_start > 0) {
+        memmove(stream->pending, stream->pending + stream->pending_start,
+                stream->pending_len - stream->pending_start);
+        stream->pending_len -= stream->pending_start;
+        stream->pending_start = 0;
+    }
+    http_stream_t* body_stream = &stream->stream;
+    while (stream->pending_len < STREAM_BATCH_SIZE) {
+        int status = body_stream->producer(body_stream, body_stream->context);
+        if (status == HTTP_STREAM_MORE && !body_stream->failed) {
+            continue;
+        }
+        stream_end_producer(stream);
+        if (status != HTTP_STREAM_DONE || body_stream->failed || body_stream->remaining > 0) {
+            // The client can tell the body is incomplete from the reset
+            stream_reset(session, stream, ERROR_INTERNAL);
+        }
+        return;
+    }
+}
+
+static size_t send_limit(const http2_session_t* session, const http2_stream_t* stream,
+                         size_t wanted) {
+    long long window = stream->send_window < session->send_window ? stream->send_window
+                                                                  : session->send_window;
+    size_t frame_max = session->peer_max_frame < HTTP2_SEND_FRAME_MAX ? session->peer_max_frame
+                                                                     : HTTP2_SEND_FRAME_MAX;
+    if (window <= 0) {
+        return 0;
+    }
+    if ((unsigned long long)window < wanted) {
+        wanted = (size_t)window;
+    }
+    return wanted < frame_max ? wanted : frame_max;
+}
+
+static int write_data_header(http2_session_t* session, http2_stream_t* stream, size_t length,
+                             int end_stream) {
+    unsigned char header[HTTP2_FRAME_HEADER_SIZE];
+    put_frame_header(header, length, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream->id);
+    stream->send_window -= length;
+    session->send_window -= length;
+    return connection_write(session->conn, header, sizeof(header));
+}
+
+// One DATA frame of a streamed body. Returns 1 when something was queued.
+static int emit_streamed(http2_session_t* session, http2_stream_t* stream) {
+    if (stream->producing && stream->pending_len - stream->pending_start < STREAM_BATCH_SIZE) {
+        pump_stream(session, stream);
+        if (!stream->open) {
+            return 1;
+        }
+    }
+    size_t available = stream->pending_len - stream->pending_start;
+    size_t chunk = available ? send_limit(session, stream, available) : 0;
+    if (available && chunk == 0) {
+        return 0;  // Waiting for a window
+    }
+    if (!available && stream->producing) {
+        return 0;
+    }
+    int last = !stream->producing && chunk == available;
+    int status = write_data_header(session, stream, chunk, last);
+    status |= connection_write(session->conn, stream->pending + stream->pending_start, chunk);
+    if (status != 0) {
+        session_broken(session);
+        return 0;
+    }
+    stream->pending_start += chunk;
+    if (stream->pending_start == stream->pending_len) {
+        stream->pending_start = 0;
+        stream->pending_len = 0;
+    }
+    if (last) {
+        stream_local_end(session, stream);
+    }
+    return 1;
+}
+
+// One DATA frame of a stream's body pieces. Returns 1 when something was queued.
+static int emit_pieces(http2_session_t* session, http2_stream_t* stream) {
+    connection_t* conn = session->conn;
+    const body_piece_t* piece = &stream->pieces[stream->piece_head];
+    size_t remaining = piece->length - stream->piece_sent;
+    size_t chunk = send_limit(session, stream, remaining);
+    if (chunk == 0) {
+        return 0;
+    }
+    int last = stream->piece_head == stream->piece_count - 1 && chunk == remaining;
+    int status = write_data_header(session, stream, chunk, last);
+    size_t sent = stream->piece_sent;
+    if (piece->data && chunk <= INLINE_DATA_SIZE) {
+        status |= connection_write(conn, piece->data + sent, chunk);
+    } else if (piece->data) {
+        stream->refs++;
+        status |= connection_write_ref(conn, piece->data + sent, chunk, release_stream_ref, stream);
+    } else {
+        // Straight from the page cache, as for HTTP/1.1; the stream keeps the descriptor
+        stream->refs++;
+        status |= connection_write_file_ref(conn, stream->body_fd, piece->offset + sent, chunk,
+                                            release_stream_ref, stream);
+    }
+    if (status != 0) {
+        session_broken(session);
+        return 0;
+    }
+    stream->piece_sent += chunk;
+    if (stream->piece_sent == piece->length) {
+        stream->piece_head++;
+        stream->piece_sent = 0;
+    }
+    if (last) {
+        stream_local_end(session, stream);
+    }
+    return 1;
+}
+
+// Frame the bodies of all responses under way, a frame per stream in
+// turn, until the windows close or enough output is pending
+static void emit_data(http2_session_t* session) {
+    connection_t* conn = session->conn;
+    int progress = 1;
+    while (progress && session->read_state != READ_CLOSED &&
+           conn->write_pending < CONN_WRITE_HIGH_WATERMARK) {
+        progress = 0;
+        http2_stream_t* next;
+        for (http2_stream_t* stream = session->streams; stream; stream = next) {
+            next = stream->next;
+            if (!stream->responded || stream->local_done) {
+                continue;
+            }
+            progress |= stream->streamed ? emit_streamed(session, stream)
+                                         : emit_pieces(session, stream);
+            if (conn->write_pending >= CONN_WRITE_HIGH_WATERMARK ||
+                session->read_state == READ_CLOSED) {
+                break;
+            }
+        }
+    }
+}
+
+int http2_process(connection_t* conn) {
+    http2_session_t* session = conn->h2;
+    if (conn->read_buf) {
+        read_frames(session);
+    }
+    emit_data(session);
+    return conn->write_pending >= CONN_WRITE_HIGH_WATERMARK;
+}
+
+// ---- Setup ----
+
+int http2_match_preface(const char* data, size_t length) {
+    size_t compare = length < HTTP2_PREFACE_LEN ? length : HTTP2_PREFACE_LEN;
+    return memcmp(data, HTTP2_PREFACE, compare) == 0;
+}
+
+int http2_start(connection_t* conn) {
+    http2_session_t* session = calloc(1, sizeof(http2_session_t));
+    if (!session) {
+        return -1;
+    }
+    connection_charge_memory(sizeof(http2_session_t));
+    session->conn = conn;
+    session->read_state = READ_PREFACE;
+    hpack_table_init(&session->decoder, HPACK_TABLE_SIZE);
+    hpack_table_init(&session->encoder, HPACK_TABLE_SIZE);
+    session->peer_max_frame = HTTP2_MAX_FRAME_SIZE;
+    session->peer_initial_window = DEFAULT_WINDOW;
+    session->send_window = DEFAULT_WINDOW;
+    session->recv_window = HTTP2_CONNECTION_WINDOW;
+    conn->h2 = session;
+
+    // The server's connection preface: its SETTINGS, and a connection
+    // window as large as every stream's together may use
+    static const unsigned char settings[] = {
+        0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, HTTP2_MAX_CONCURRENT_STREAMS,
+        0, SETTINGS_INITIAL_WINDOW_SIZE,
+        (HTTP2_STREAM_WINDOW >> 24) & 0xff, (HTTP2_STREAM_WINDOW >> 16) & 0xff,
+        (HTTP2_STREAM_WINDOW >> 8) & 0xff, HTTP2_STREAM_WINDOW & 0xff,
+        0, SETTINGS_MAX_HEADER_LIST_SIZE,
+        (HTTP2_MAX_HEADER_LIST_SIZE >> 24) & 0xff, (HTTP2_MAX_HEADER_LIST_SIZE >> 16) & 0xff,
+        (HTTP2_MAX_HEADER_LIST_SIZE >> 8) & 0xff, HTTP2_MAX_HEADER_LIST_SIZE & 0xff,
+    };
+    write_frame(session, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    send_window_update(session, 0, HTTP2_CONNECTION_WINDOW - DEFAULT_WINDOW);
+    return 0;
+}
+
+// HTTP2-Settings is a SETTINGS payload in unpadded base64url
+static long decode_base64url(const char* text, unsigned char* out, size_t out_size) {
+    unsigned int bits = 0;
+    int count = 0;
+    size_t length = 0;
+    for (; *text && *text != '='; text++) {
+        int c = (unsigned char)*text;
+        int value = c >= 'A' && c <= 'Z' ? c - 'A'
+                    : c >= 'a' && c <= 'z' ? c - 'a' + 26
+                    : c >= '0' && c <= '9' ? c - '0' + 52
+                    : c == '-' ? 62 : c == '_' ? 63 : -1;
+        if (value < 0) {
+            return -1;
+        }
+        bits = (bits << 6) | (unsigned int)value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            if (length == out_size) {
+                return -1;
+            }
+            out[length++] = (unsigned char)(bits >> count);
+        }
+    }
+    return (long)length;
+}
+
+int http2_upgrade(connection_t* conn, http_request_t* request) {
+    unsigned char settings[HTTP2_MAX_FRAME_SIZE];
+    const char* encoded = get_http_header(request, "HTTP2-Settings");
+    long settings_len = encoded ? decode_base64url(encoded, settings, sizeof(settings)) : -1;
+    if (settings_len < 0 || settings_len % 6 != 0) {
+        return 0;  // Not an upgrade we can make; answer over HTTP/1.1
+    }
+
+    static const char switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    if (connection_write(conn, switching, sizeof(switching) - 1) != 0 || http2_start(conn) != 0) {
+        conn->close_after_write = 1;
+        return 1;
+    }
+    http2_session_t* session = conn->h2;
+    if (apply_settings(session, settings, (size_t)settings_len) != 0) {
+        connection_error(session, ERROR_PROTOCOL);
+        return 1;
+    }
+
+    // The request becomes stream 1, half closed: it had no body
+    session->last_stream_id = 1;
+    http2_stream_t* stream = stream_create(session, 1);
+    if (!stream) {
+        connection_error(session, ERROR_INTERNAL);
+        return 1;
+    }
+    stream->remote_done = 1;
+    http_request_t* upgraded = &stream->request;
+    upgraded->method = arena_copy(stream->arena, request->method, request->method_len);
+    upgraded->method_len = request->method_len;
+    upgraded->uri = arena_copy(stream->arena, request->uri, request->uri_len);
+    upgraded->uri_len = request->uri_len;
+    upgraded->version = "HTTP/2.0";
+    upgraded->version_len = 8;
+    int status = upgraded->method && upgraded->uri ? 0 : 500;
+    for (int i = 0; i < request->header_count && !status; i++) {
+        const http_header_t* header = &request->headers[i];
+        if (is_connection_header(header->name, header->name_len) ||
+            (header->name_len == 14 && strncasecmp(header->name, "HTTP2-Settings", 14) == 0)) {
+            continue;
+        }
+        status = request_add_header(stream, header->name, header->name_len, header->value,
+                                    header->value_len);
+    }
+    if (status) {
+        stream_fail_request(session, stream, status);
+    } else {
+        stream_run_handler(session, stream);
+    }
+    return 1;
+}
+
+int http2_timeout_phase(const connection_t* conn) {
+    const http2_session_t* session = conn->h2;
+    if (!session->settings_seen) {
+        return CONN_TIMEOUT_HEADER;  // The preface counts as the first request's headers
+    }
+    for (const http2_stream_t* stream = session->streams; stream; stream = stream->next) {
+        if (stream->responded && !stream->local_done) {
+            return CONN_TIMEOUT_WRITE;  // The client is holding back its windows
+        }
+    }
+    if (session->stream_count > 0 || conn->read_len > conn->read_start ||
+        session->read_state != READ_FRAME_HEADER) {
+        return CONN_TIMEOUT_BODY;
+    }
+    return CONN_TIMEOUT_IDLE;
+}
+
+void http2_shutdown(connection_t* conn) {
+    http2_session_t* session = conn->h2;
+    if (!session->goaway_sent && session->read_state != READ_CLOSED) {
+        send_goaway(session, ERROR_NONE);
+    }
+    session_check_done(session);
+}
+
+void http2_destroy(connection_t* conn) {
+    http2_session_t* session = conn->h2;
+    if (!session) {
+        return;
+    }
+    while (session->streams) {
+        stream_close(session, session->streams);
+    }
+    hpack_table_destroy(&session->decoder);
+    hpack_table_destroy(&session->encoder);
+    hpack_block_free(&session->out_block);
+    free(session->block);
+    free(session->frame_buf);
+    free(session);
+    connection_charge_memory(-(long long)sizeof(http2_session_t));
+    conn->h2 = NULL;
+}
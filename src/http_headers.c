@@ -0,0 +1,231 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "../include/http.h"
+
+// Canonical spelling of each interned name, indexed by http_header_id_t
+static const struct {
+    const char* name;
+    size_t length;
+} known_names[HTTP_HEADER_KNOWN_COUNT] = {
+    [HTTP_HEADER_UNKNOWN]           = { "", 0 },
+    [HTTP_HEADER_ACCEPT_ENCODING]   = { "Accept-Encoding", 15 },
+    [HTTP_HEADER_ACCEPT_RANGES]     = { "Accept-Ranges", 13 },
+    [HTTP_HEADER_ALLOW]             = { "Allow", 5 },
+    [HTTP_HEADER_CACHE_CONTROL]     = { "Cache-Control", 13 },
+    [HTTP_HEADER_CONNECTION]        = { "Connection", 10 },
+    [HTTP_HEADER_CONTENT_ENCODING]  = { "Content-Encoding", 16 },
+    [HTTP_HEADER_CONTENT_LENGTH]    = { "Content-Length", 14 },
+    [HTTP_HEADER_CONTENT_RANGE]     = { "Content-Range", 13 },
+    [HTTP_HEADER_CONTENT_TYPE]      = { "Content-Type", 12 },
+    [HTTP_HEADER_COOKIE]            = { "Cookie", 6 },
+    [HTTP_HEADER_DATE]              = { "Date", 4 },
+    [HTTP_HEADER_ETAG]              = { "ETag", 4 },
+    [HTTP_HEADER_EXPECT]            = { "Expect", 6 },
+    [HTTP_HEADER_HOST]              = { "Host", 4 },
+    [HTTP_HEADER_IF_MODIFIED_SINCE] = { "If-Modified-Since", 17 },
+    [HTTP_HEADER_IF_NONE_MATCH]     = { "If-None-Match", 13 },
+    [HTTP_HEADER_IF_RANGE]          = { "If-Range", 8 },
+    [HTTP_HEADER_LAST_MODIFIED]     = { "Last-Modified", 13 },
+    [HTTP_HEADER_LOCATION]          = { "Location", 8 },
+    [HTTP_HEADER_RANGE]             = { "Range", 5 },
+    [HTTP_HEADER_SERVER]            = { "Server", 6 },
+    [HTTP_HEADER_SET_COOKIE]        = { "Set-Cookie", 10 },
+    [HTTP_HEADER_TRANSFER_ENCODING] = { "Transfer-Encoding", 17 },
+    [HTTP_HEADER_UPGRADE]           = { "Upgrade", 7 },
+    [HTTP_HEADER_USER_AGENT]        = { "User-Agent", 10 },
+    [HTTP_HEADER_VARY]              = { "Vary", 4 },
+};
+
+// Names are bucketed by length and lowercased first letter; no bucket holds
+// more than two names, so interning costs a couple of comparisons at most
+#define INTERN_MAX_LENGTH 17
+#define INTERN_BUCKET_SLOTS 2
+static uint8_t intern_buckets[INTERN_MAX_LENGTH + 1][26][INTERN_BUCKET_SLOTS];
+static pthread_once_t intern_once = PTHREAD_ONCE_INIT;
+
+static void build_intern_buckets(void) {
+    for (int id = 1; id < HTTP_HEADER_KNOWN_COUNT; id++) {
+        size_t length = known_names[id].length;
+        int letter = (known_names[id].name[0] | 0x20) - 'a';
+        uint8_t* slots = intern_buckets[length][letter];
+        for (int slot = 0; slot < INTERN_BUCKET_SLOTS; slot++) {
+            if (!slots[slot]) {
+                slots[slot] = (uint8_t)id;
+                break;
+            }
+        }
+    }
+}
+
+http_header_id_t http_header_intern(const char* name, size_t length) {
+    pthread_once(&intern_once, build_intern_buckets);
+    if (length == 0 || length > INTERN_MAX_LENGTH) {
+        return HTTP_HEADER_UNKNOWN;
+    }
+    int letter = (name[0] | 0x20) - 'a';
+    if (letter < 0 || letter >= 26) {
+        return HTTP_HEADER_UNKNOWN;
+    }
+    const uint8_t* slots = intern_buckets[length][letter];
+    for (int slot = 0; slot < INTERN_BUCKET_SLOTS && slots[slot]; slot++) {
+        if (strncasecmp(name, known_names[slots[slot]].name, length) == 0) {
+            return (http_header_id_t)slots[slot];
+        }
+    }
+    return HTTP_HEADER_UNKNOWN;
+}
+
+const char* http_header_name(http_header_id_t id) {
+    return known_names[id].name;
+}
+
+static char* header_storage(http_response_t* response) {
+    return response->header_buf ? response->header_buf : response->header_inline;
+}
+
+static const char* header_storage_const(const http_response_t* response) {
+    return response->header_buf ? response->header_buf : response->header_inline;
+}
+
+// Make room for length more bytes, moving to the heap once the inline space is full
+static char* reserve_header_bytes(http_response_t* response, size_t length) {
+    size_t capacity = response->header_buf ? response->header_cap : RESPONSE_HEADER_INLINE;
+    if (response->header_len + length > UINT32_MAX) {
+        return NULL;
+    }
+    if (response->header_len + length > capacity) {
+        size_t new_cap = capacity * 2;
+        while (new_cap < response->header_len + length) {
+            new_cap *= 2;
+        }
+        char* grown = response->header_buf ? realloc(response->header_buf, new_cap) : malloc(new_cap);
+        if (!grown) {
+            return NULL;
+        }
+        if (!response->header_buf) {
+            memcpy(grown, response->header_inline, response->header_len);
+        }
+        response->header_buf = grown;
+        response->header_cap = new_cap;
+    }
+    return header_storage(response) + response->header_len;
+}
+
+// Append name (unless it is interned) and value as a new entry
+static int add_header_entry(http_response_t* response, const char* name,
+                            const char* value, size_t value_len) {
+    if (response->header_count >= MAX_HEADERS) {
+        return -1;
+    }
+    size_t name_len = strlen(name);
+    http_header_id_t id = http_header_intern(name, name_len);
+    size_t stored_name = id == HTTP_HEADER_UNKNOWN ? name_len : 0;
+
+    char* dest = reserve_header_bytes(response, stored_name + value_len);
+    if (!dest) {
+        return -1;
+    }
+    http_response_header_t* header = &response->headers[response->header_count++];
+    header->id = (uint8_t)id;
+    header->name_offset = (uint32_t)response->header_len;
+    header->name_len = (uint16_t)(id == HTTP_HEADER_UNKNOWN ? name_len : 0);
+    memcpy(dest, name, stored_name);
+    header->value_offset = (uint32_t)(response->header_len + stored_name);
+    header->value_len = (uint32_t)value_len;
+    memcpy(dest + stored_name, value, value_len);
+    response->header_len += stored_name + value_len;
+    return 0;
+}
+
+int http_response_add_header_len(http_response_t* response, const char* name,
+                                 const char* value, size_t value_len) {
+    return add_header_entry(response, name, value, value_len);
+}
+
+int http_response_add_header(http_response_t* response, const char* name, const char* value) {
+    return add_header_entry(response, name, value, strlen(value));
+}
+
+int http_response_add_headerf(http_response_t* response, const char* name, const char* format, ...) {
+    char value[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(value, sizeof(value), format, args);
+    va_end(args);
+    if (length < 0) {
+        return -1;
+    }
+    if ((size_t)length < sizeof(value)) {
+        return add_header_entry(response, name, value, length);
+    }
+
+    // Too long for the stack buffer: format again into a heap copy
+    char* long_value = malloc(length + 1);
+    if (!long_value) {
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(long_value, length + 1, format, args);
+    va_end(args);
+    int result = add_header_entry(response, name, long_value, length);
+    free(long_value);
+    return result;
+}
+
+static int header_matches(const http_response_t* response, int index, const char* name,
+                          size_t name_len, http_header_id_t id) {
+    const http_response_header_t* header = &response->headers[index];
+    if (id != HTTP_HEADER_UNKNOWN || header->id != HTTP_HEADER_UNKNOWN) {
+        return header->id == id;
+    }
+    return header->name_len == name_len &&
+           strncasecmp(header_storage_const(response) + header->name_offset, name, name_len) == 0;
+}
+
+int http_response_set_header(http_response_t* response, const char* name, const char* value) {
+    size_t name_len = strlen(name);
+    http_header_id_t id = http_header_intern(name, name_len);
+    for (int i = 0; i < response->header_count; i++) {
+        if (!header_matches(response, i, name, name_len, id)) {
+            continue;
+        }
+        // The old value's bytes are simply abandoned in the buffer
+        size_t value_len = strlen(value);
+        char* dest = reserve_header_bytes(response, value_len);
+        if (!dest) {
+            return -1;
+        }
+        memcpy(dest, value, value_len);
+        response->headers[i].value_offset = (uint32_t)response->header_len;
+        response->headers[i].value_len = (uint32_t)value_len;
+        response->header_len += value_len;
+        return 0;
+    }
+    return add_header_entry(response, name, value, strlen(value));
+}
+
+void http_response_clear_headers(http_response_t* response) {
+    response->header_count = 0;
+    response->header_len = 0;
+}
+
+const char* http_response_header_name(const http_response_t* response, int index, size_t* length) {
+    const http_response_header_t* header = &response->headers[index];
+    if (header->id != HTTP_HEADER_UNKNOWN) {
+        *length = known_names[header->id].length;
+        return known_names[header->id].name;
+    }
+    *length = header->name_len;
+    return header_storage_const(response) + header->name_offset;
+}
+
+const char* http_response_header_value(const http_response_t* response, int index, size_t* length) {
+    const http_response_header_t* header = &response->headers[index];
+    *length = header->value_len;
+    return header_storage_const(response) + header->value_offset;
+}
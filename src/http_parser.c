@@ -1,17 +1,33 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include "../include/http.h"
 #include "../include/parse_http_request_supplement.h"
+#include "../include/connection.h"
 #include "../include/send_http_response_supplement.h"
 
 
 void init_http_request(http_request_t* request) {
-    memset(request, 0, sizeof(http_request_t));
+    // Only the scalar fields: header slots are written before they are counted
+    request->method = NULL;
+    request->method_len = 0;
+    request->uri = NULL;
+    request->uri_len = 0;
+    request->version = NULL;
+    request->version_len = 0;
+    request->header_count = 0;
+    memset(request->known_headers, 0, sizeof(request->known_headers));
+    request->param_count = 0;
+    request->route = ROUTE_UNMATCHED;
+    request->body_context = NULL;
+    request->offload_state = 0;
+    request->arena = NULL;
     request->body = NULL;
+    request->stream = NULL;
     request->body_length = 0;
-    request->header_count = 0;
 }
 
 
@@ -23,90 +39,277 @@ void free_http_request(http_request_t* request) {
 }
 
 
+// Value of the first header with this interned name, NULL when absent
+const char* get_known_header(const http_request_t* request, http_header_id_t id) {
+    int slot = request->known_headers[id];
+    return slot ? request->headers[slot - 1].value : NULL;
+}
+
+
+// Case-insensitive header lookup; returns NULL when the header is absent
+const char* get_http_header(const http_request_t* request, const char* name) {
+    size_t name_len = strlen(name);
+    http_header_id_t id = http_header_intern(name, name_len);
+    if (id != HTTP_HEADER_UNKNOWN) {
+        return get_known_header(request, id);
+    }
+    for (int i = 0; i < request->header_count; i++) {
+        const http_header_t* header = &request->headers[i];
+        if (header->name_len == name_len && strncasecmp(header->name, name, name_len) == 0) {
+            return header->value;
+        }
+    }
+    return NULL;
+}
+
+
+static void relocate_view(const char** view, const char* old_base, size_t length,
+                          char* new_base) {
+    if (*view >= old_base && *view < old_base + length) {
+        *view = new_base + (*view - old_base);
+    }
+}
+
+void http_request_relocate(http_request_t* request, const char* old_base, size_t length,
+                           char* new_base) {
+    relocate_view(&request->method, old_base, length, new_base);
+    relocate_view(&request->uri, old_base, length, new_base);
+    relocate_view(&request->version, old_base, length, new_base);
+    for (int i = 0; i < request->header_count; i++) {
+        relocate_view(&request->headers[i].name, old_base, length, new_base);
+        relocate_view(&request->headers[i].value, old_base, length, new_base);
+    }
+    // Capture names point into route patterns and stay put
+    for (int i = 0; i < request->param_count; i++) {
+        relocate_view(&request->params[i].value, old_base, length, new_base);
+    }
+}
+
+
 void init_http_response(http_response_t* response) {
-    memset(response, 0, sizeof(http_response_t));
+    // Field by field: the header table and inline buffer are only read up to
+    // header_count and header_len, so there is no need to clear them
+    response->status_code = 200;
+    response->keep_alive = 0;
+    response->header_count = 0;
+    response->header_buf = NULL;
+    response->header_len = 0;
+    response->header_cap = 0;
+    response->raw_headers = NULL;
+    response->raw_headers_len = 0;
     response->body = NULL;
     response->body_length = 0;
-    response->header_count = 0;
-    response->status_code = 200;
+    response->body_release = NULL;
+    response->body_owner = NULL;
+    response->body_fd = -1;
+    response->body_offset = 0;
+    response->range_count = 0;
+    response->range_complete_length = 0;
+    response->range_content_type = NULL;
+    response->stream_producer = NULL;
+    response->stream_context = NULL;
+    response->stream_release = NULL;
+    response->stream_length = -1;
 }
 
 
 void free_http_response(http_response_t* response) {
     if (response->body) {
-        free(response->body);
+        if (response->body_release) {
+            response->body_release(response->body_owner);
+        } else {
+            free(response->body);
+        }
         response->body = NULL;
     }
+    if (response->body_fd >= 0) {
+        close(response->body_fd);
+        response->body_fd = -1;
+    }
+    free(response->header_buf);
+    response->header_buf = NULL;
+    // A stream that never got to a connection still owns its context
+    if (response->stream_producer && response->stream_release) {
+        response->stream_release(response->stream_context);
+    }
+    response->stream_producer = NULL;
+}
+
+
+
+// Parser states, in the order they occur in a request
+enum {
+    PARSE_METHOD,
+    PARSE_URI,
+    PARSE_VERSION,
+    PARSE_REQUEST_LINE_LF,
+    PARSE_HEADER_START,
+    PARSE_HEADER_NAME,
+    PARSE_HEADER_VALUE_START,
+    PARSE_HEADER_VALUE,
+    PARSE_HEADER_LF,
+    PARSE_HEADERS_END_LF
+};
+
+void http_parser_init(http_parser_t* parser) {
+    parser->state = PARSE_METHOD;
+    parser->offset = 0;
+    parser->mark = 0;
 }
 
+http_parse_status_t http_parser_execute(http_parser_t* parser, http_request_t* request,
+                                        char* buffer, size_t length) {
+    if (parser->offset == 0) {
+        init_http_request(request);
+    }
+
+    const char* p = buffer + parser->offset;
+    const char* end = buffer + length;
+    const char* mark = buffer + parser->mark;
+
+    // Each state scans as far as it can and stops at the end of the data,
+    // so a later call resumes exactly where this one left off
+    while (p < end) {
+        switch (parser->state) {
+        case PARSE_METHOD:
+            if (p == mark && (*p == '\r' || *p == '\n')) {
+                mark = ++p;  // Tolerate empty lines before the request line
+                break;
+            }
+            p = scan_token(p, end);
+            if (p == end) break;
+            if (*p != ' ' || p == mark) return HTTP_PARSE_ERROR;
+            request->method = mark;
+            request->method_len = p - mark;
+            mark = ++p;
+            parser->state = PARSE_URI;
+            break;
+
+        case PARSE_URI:
+            p = scan_uri(p, end);
+            if ((size_t)(p - mark) >= MAX_URI_SIZE) return HTTP_PARSE_URI_TOO_LONG;
+            if (p == end) break;
+            if (*p != ' ' || p == mark) return HTTP_PARSE_ERROR;
+            request->uri = mark;
+            request->uri_len = p - mark;
+            mark = ++p;
+            parser->state = PARSE_VERSION;
+            break;
+
+        case PARSE_VERSION:
+            p = scan_header_value(p, end);
+            if (p == end) break;
+            if (*p != '\r' && *p != '\n') return HTTP_PARSE_ERROR;
+            if (p - mark != 8 || strncmp(mark, "HTTP/", 5) != 0 || mark[5] < '0' ||
+                mark[5] > '9' || mark[6] != '.' || mark[7] < '0' || mark[7] > '9') {
+                return HTTP_PARSE_ERROR;
+            }
+            if (mark[5] != '1' || (mark[7] != '0' && mark[7] != '1')) {
+                return HTTP_PARSE_VERSION_UNSUPPORTED;
+            }
+            request->version = mark;
+            request->version_len = p - mark;
+            parser->state = (*p == '\r') ? PARSE_REQUEST_LINE_LF : PARSE_HEADER_START;
+            p++;
+            break;
+
+        case PARSE_REQUEST_LINE_LF:
+        case PARSE_HEADER_LF:
+            if (*p != '\n') return HTTP_PARSE_ERROR;
+            p++;
+            parser->state = PARSE_HEADER_START;
+            break;
 
+        case PARSE_HEADER_START:
+            if (*p == '\r') {
+                p++;
+                parser->state = PARSE_HEADERS_END_LF;
+                break;
+            }
+            if (*p == '\n') {
+                p++;
+                goto done;
+            }
+            if (request->header_count >= MAX_HEADERS) return HTTP_PARSE_TOO_MANY_HEADERS;
+            mark = p;
+            parser->state = PARSE_HEADER_NAME;
+            break;
 
-int parse_http_request(const char* raw_request, http_request_t* request) {
-    init_http_request(request);
-    
-    // Find the end of headers (double CRLF)
-    const char* header_end = find_header_end(raw_request);
-    if (!header_end) return -1;
- 
-    // Parse request line
-    char* line_end = find_request_line_end(raw_request);
-    if (!line_end) return -1;
-    
-    // Copy request line for parsing
-    char* request_line = copy_line(raw_request, line_end);
-    if (!request_line) return -1;  // Memory allocation failed
-
-    // Parse method, URI, version
-    char* token = strtok(request_line, " ");
-    if (!token) return -1;
-    strncpy(request->method, token, MAX_METHOD_SIZE - 1);
-    
-    token = strtok(NULL, " ");
-    if (!token) return -1;
-    strncpy(request->uri, token, MAX_URI_SIZE - 1);
-    
-    token = strtok(NULL, " ");
-    if (!token) return -1;
-    strncpy(request->version, token, MAX_VERSION_SIZE - 1);
-    
-    // Parse headers
-    const char* current = strchr(raw_request, '\n') + 1;
-    while (current < header_end && request->header_count < MAX_HEADERS) {
-        line_end = strchr(current, '\n');
-        if (!line_end) break;
-        
-        size_t line_length = line_end - current;
-        if (line_length <= 1) break; // Empty line
-        
-        char* header_line = copy_line(current, line_end);
-        if (!header_line) return -1;
-        
-        int result = parse_header(header_line, request);
-        free(header_line);
-        
-        if (result != 0) {
-           // Option 1: Strict - Fail the entire request
-           return -1;
-        
-           // Option 2: Lenient - Just continue to next header
-           // continue;
-           
-           // Option 3: Hybrid - Count errors
-           // request->error_count++;
-           // if (request->error_count > MAX_ALLOWED_ERRORS) return -1;
-              // Handle error or just continue to next header
+        case PARSE_HEADER_NAME:
+            p = scan_token(p, end);
+            if (p == end) break;
+            // Rejects "Name :" and obsolete line folding as well as a missing colon
+            if (*p != ':' || p == mark) return HTTP_PARSE_ERROR;
+            request->headers[request->header_count].name = mark;
+            request->headers[request->header_count].name_len = p - mark;
+            request->headers[request->header_count].id = http_header_intern(mark, p - mark);
+            p++;
+            parser->state = PARSE_HEADER_VALUE_START;
+            break;
+
+        case PARSE_HEADER_VALUE_START:
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            if (p == end) break;
+            mark = p;
+            parser->state = PARSE_HEADER_VALUE;
+            break;
+
+        case PARSE_HEADER_VALUE: {
+            p = scan_header_value(p, end);
+            if (p == end) break;
+            if (*p != '\r' && *p != '\n') return HTTP_PARSE_ERROR;
+
+            const char* value_end = p;
+            while (value_end > mark && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            http_header_t* header = &request->headers[request->header_count++];
+            header->value = mark;
+            header->value_len = value_end - mark;
+            if (header->id != HTTP_HEADER_UNKNOWN && !request->known_headers[header->id]) {
+                request->known_headers[header->id] = (uint8_t)request->header_count;
+            }
+
+            parser->state = (*p == '\r') ? PARSE_HEADER_LF : PARSE_HEADER_START;
+            p++;
+            break;
+        }
+
+        case PARSE_HEADERS_END_LF:
+            if (*p != '\n') return HTTP_PARSE_ERROR;
+            p++;
+            goto done;
         }
-        
-        current = line_end + 1;
     }
-    
-    return 0; // Success
+
+    parser->offset = p - buffer;
+    parser->mark = mark - buffer;
+    return HTTP_PARSE_INCOMPLETE;
+
+done:
+    parser->offset = p - buffer;
+    parser->mark = parser->offset;
+    terminate_request_views(buffer, request);
+    return HTTP_PARSE_DONE;
+}
+
+// Parse a request that is already complete in memory
+int parse_http_request(char* raw_request, size_t length, http_request_t* request) {
+    http_parser_t parser;
+    http_parser_init(&parser);
+    if (http_parser_execute(&parser, request, raw_request, length) != HTTP_PARSE_DONE) {
+        return -1;
+    }
+    return 0;
 }
 
-int send_http_response(int client_fd, http_response_t* response) {
-    update_status_line(client_fd, response); 
-    add_headers(client_fd, response); 
-    write_body(client_fd, response);    
+// Serialize the response into the connection's output queue. Nothing is
+// written here: the connection flushes every queued response with a single
+// writev() once the current batch of requests has been handled.
+int send_http_response(connection_t* conn, http_response_t* response) {
+    update_status_line(conn, response); 
+    add_headers(conn, response); 
+    write_body(conn, response);    
     return 0;
 }
 
@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/http.h"
+#include "../include/connection.h"
+#include "../include/event_loop.h"
+#include "../include/send_http_response_supplement.h"
+
+// Responses up to this size are copied whole into the output buffer; past
+// it the body is queued by reference, as send_http_response() does
+#define PREBUILT_COPY_SIZE 4096
+
+#define DATE_VALUE_LEN 29   // "Tue, 07 May 2024 09:12:44 GMT"
+
+// Both flavours are the status line and headers followed by the body, in
+// one buffer each; they differ only in the Connection header
+struct http_prebuilt {
+    int status_code;
+    int flags;
+    char* content_type;
+    const char* body;           // inside the keep-alive flavour
+    size_t body_length;
+    char* data[2];              // [0] close, [1] keep-alive
+    size_t head_length[2];
+    size_t date_offset;         // where the Date value starts in either head
+};
+
+static void keep_prebuilt(void* owner) {
+    (void)owner;  // Lives until exit; the connection only borrows it
+}
+
+// The loop's wall clock as an IMF-fixdate, formatted once per second
+static const char* loop_date(event_loop_t* loop) {
+    time_t now = time(NULL);
+    if (now != loop->date_second || !loop->date[0]) {
+        struct tm when;
+        gmtime_r(&now, &when);
+        strftime(loop->date, sizeof(loop->date), HTTP_DATE_FORMAT, &when);
+        loop->date_second = now;
+    }
+    return loop->date;
+}
+
+static char* serialize(const http_prebuilt_t* prebuilt, int keep_alive, int has_body,
+                       const char* body, size_t* head_length, size_t* date_offset) {
+    char head[512];
+    int length = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n", prebuilt->status_code,
+                          get_status_text(prebuilt->status_code));
+    if (prebuilt->flags & HTTP_PREBUILT_DATE) {
+        // A placeholder of the right length, overwritten as it is sent
+        *date_offset = length + 6;
+        length += snprintf(head + length, sizeof(head) - length, "Date: %-*s\r\n",
+                           DATE_VALUE_LEN, "");
+    }
+    if (prebuilt->content_type) {
+        length += snprintf(head + length, sizeof(head) - length, "Content-Type: %s\r\n",
+                           prebuilt->content_type);
+    }
+    if (has_body) {
+        length += snprintf(head + length, sizeof(head) - length, "Content-Length: %zu\r\n",
+                           prebuilt->body_length);
+    }
+    length += snprintf(head + length, sizeof(head) - length, "Connection: %s\r\n\r\n",
+                       keep_alive ? "keep-alive" : "close");
+    if (length >= (int)sizeof(head)) {
+        return NULL;
+    }
+
+    size_t body_length = has_body ? prebuilt->body_length : 0;
+    char* data = malloc(length + body_length);
+    if (data) {
+        memcpy(data, head, length);
+        if (body_length) {
+            memcpy(data + length, body, body_length);
+        }
+        *head_length = length;
+    }
+    return data;
+}
+
+http_prebuilt_t* http_prebuilt_create(int status_code, const char* content_type,
+                                      const char* body, size_t body_length, int flags) {
+    http_prebuilt_t* prebuilt = calloc(1, sizeof(http_prebuilt_t));
+    if (!prebuilt) {
+        return NULL;
+    }
+    prebuilt->status_code = status_code;
+    prebuilt->flags = flags;
+
+    // 1xx, 204 and 304 responses never have a body (RFC 9112 6.3)
+    int has_body = !((status_code >= 100 && status_code < 200) || status_code == 204 ||
+                     status_code == 304);
+    prebuilt->body_length = has_body ? body_length : 0;
+    prebuilt->content_type = content_type ? strdup(content_type) : NULL;
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        prebuilt->data[keep_alive] = serialize(prebuilt, keep_alive, has_body, body,
+                                               &prebuilt->head_length[keep_alive],
+                                               &prebuilt->date_offset);
+    }
+    if ((content_type && !prebuilt->content_type) || !prebuilt->data[0] || !prebuilt->data[1]) {
+        http_prebuilt_destroy(prebuilt);
+        return NULL;
+    }
+    prebuilt->body = prebuilt->data[1] + prebuilt->head_length[1];
+    return prebuilt;
+}
+
+void http_prebuilt_destroy(http_prebuilt_t* prebuilt) {
+    if (prebuilt) {
+        free(prebuilt->data[0]);
+        free(prebuilt->data[1]);
+        free(prebuilt->content_type);
+        free(prebuilt);
+    }
+}
+
+int http_prebuilt_status(const http_prebuilt_t* prebuilt) {
+    return prebuilt->status_code;
+}
+
+size_t http_prebuilt_body_length(const http_prebuilt_t* prebuilt) {
+    return prebuilt->body_length;
+}
+
+int http_prebuilt_send(connection_t* conn, const http_prebuilt_t* prebuilt, int keep_alive) {
+    keep_alive = keep_alive ? 1 : 0;
+    const char* data = prebuilt->data[keep_alive];
+    size_t head_length = prebuilt->head_length[keep_alive];
+    size_t length = head_length + prebuilt->body_length;
+    size_t copy_length = length <= PREBUILT_COPY_SIZE ? length : head_length;
+
+    // The shared bytes are never written to: the current date goes into
+    // the connection's copy of the head
+    int status = 0;
+    size_t done = 0;
+    if (prebuilt->flags & HTTP_PREBUILT_DATE) {
+        status |= connection_write(conn, data, prebuilt->date_offset);
+        status |= connection_write(conn, loop_date(conn->loop), DATE_VALUE_LEN);
+        done = prebuilt->date_offset + DATE_VALUE_LEN;
+    }
+    status |= connection_write(conn, data + done, copy_length - done);
+    if (copy_length < length) {
+        status |= connection_write_ref(conn, data + copy_length, length - copy_length,
+                                       keep_prebuilt, NULL);
+    }
+    return status ? -1 : 0;
+}
+
+void http_prebuilt_fill(const http_prebuilt_t* prebuilt, http_response_t* response) {
+    response->status_code = prebuilt->status_code;
+    if (prebuilt->flags & HTTP_PREBUILT_DATE) {
+        char date[32];
+        time_t now = time(NULL);
+        struct tm when;
+        gmtime_r(&now, &when);
+        strftime(date, sizeof(date), HTTP_DATE_FORMAT, &when);
+        http_response_add_header(response, "Date", date);
+    }
+    if (prebuilt->content_type) {
+        http_response_add_header(response, "Content-Type", prebuilt->content_type);
+    }
+    response->body = (char*)prebuilt->body;
+    response->body_length = prebuilt->body_length;
+    response->body_release = keep_prebuilt;
+    response->body_owner = NULL;
+}
@@ -0,0 +1,78 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "../include/http.h"
+#include "../include/connection.h"
+#include "../include/http2.h"
+
+void http_response_stream(http_response_t* response, http_stream_producer_t producer,
+                          void* context, void (*release)(void* context), long long length) {
+    response->stream_producer = producer;
+    response->stream_context = context;
+    response->stream_release = release;
+    response->stream_length = length;
+}
+
+int http_stream_write(http_stream_t* stream, const void* data, size_t length) {
+    if (stream->failed) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;  // An empty chunk would end a chunked body
+    }
+
+    connection_t* conn = stream->conn;
+    int status = 0;
+    if (stream->remaining >= 0) {
+        if ((unsigned long long)length > (unsigned long long)stream->remaining) {
+            stream->failed = 1;  // More than the Content-Length promised
+            return -1;
+        }
+        stream->remaining -= length;
+    }
+    if (stream->h2) {
+        status = http2_stream_write(stream->h2, data, length);  // Framed as flow control allows
+    } else if (stream->chunked) {
+        char size_line[24];
+        int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+        status |= connection_write(conn, size_line, size_len);
+        status |= connection_write(conn, data, length);
+        status |= connection_write(conn, "\r\n", 2);
+    } else {
+        status = connection_write(conn, data, length);
+    }
+
+    if (status != 0) {
+        stream->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int http_stream_printf(http_stream_t* stream, const char* format, ...) {
+    char text[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length < 0) {
+        return -1;
+    }
+    if ((size_t)length < sizeof(text)) {
+        return http_stream_write(stream, text, length);
+    }
+
+    // Too long for the stack buffer: format again into a heap copy
+    char* long_text = malloc(length + 1);
+    if (!long_text) {
+        stream->failed = 1;
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(long_text, length + 1, format, args);
+    va_end(args);
+    int result = http_stream_write(stream, long_text, length);
+    free(long_text);
+    return result;
+}
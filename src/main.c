@@ -0,0 +1,61 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include "../include/config.h"
+#include "../include/server.h"
+#include "../include/file_server.h"
+#include "../include/access_log.h"
+#include "../include/thread_pool.h"
+#include "../include/worker.h"
+#include "../include/tls.h"
+#include "../include/reload.h"
+
+int main(int argc, char** argv) {
+    // Reload and stop signals are waited for by the main thread, see run_workers()
+    reload_block_signals();
+
+    server_config_t config;
+    config_init(&config);
+    if (config_parse_args(&config, argc, argv) != 0) {
+        config_print_usage(argv[0]);
+        exit(1);
+    }
+    if (tls_init(&config) != 0) {
+        exit(1);
+    }
+    if (tls_enabled() && config.io_uring) {
+        // Handshakes and records need the socket itself, not ring completions
+        fprintf(stderr, "TLS connections need epoll, not using io_uring\n");
+        config.io_uring = 0;
+    }
+    // Started by a reload: take over the listeners of the process it replaces
+    if (reload_init(argv, &config) != 0) {
+        exit(1);
+    }
+
+    printf("Starting server on port %d...\n", config.port);
+
+    // A client vanishing mid-write must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // Routes are registered once and shared read-only by every worker
+    if (setup_routes() != 0) {
+        exit(1);
+    }
+    if (init_file_server(&config) != 0) {
+        exit(1);
+    }
+    if (access_log_init(&config) != 0) {
+        exit(1);
+    }
+    if (thread_pool_start(config.pool_threads) != 0) {
+        exit(1);
+    }
+
+    int status = run_workers(&config);
+    thread_pool_stop();
+    access_log_shutdown();
+    tls_shutdown();
+    return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,298 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "../include/metrics.h"
+#include "../include/access_log.h"
+#include "../include/tls.h"
+
+#define METRICS_BODY_INITIAL (64 * 1024)
+
+static worker_metrics_t* registered_workers = NULL;
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define QUANTILE_COUNT (sizeof(quantiles) / sizeof(quantiles[0]))
+
+// Single writer per counter: a relaxed load and store is enough and keeps
+// readers from seeing torn values, without a locked read-modify-write
+static inline void counter_add(uint64_t* counter, uint64_t amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_read(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+worker_metrics_t* metrics_register_worker(void) {
+    worker_metrics_t* metrics;
+    if (posix_memalign((void**)&metrics, 64, sizeof(worker_metrics_t)) != 0) {
+        return NULL;
+    }
+    memset(metrics, 0, sizeof(worker_metrics_t));
+
+    metrics->next = __atomic_load_n(&registered_workers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&registered_workers, &metrics->next, metrics, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return metrics;
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_connection_accepted(worker_metrics_t* metrics) {
+    counter_add(&metrics->connections_accepted, 1);
+}
+
+void metrics_connection_closed(worker_metrics_t* metrics) {
+    counter_add(&metrics->connections_closed, 1);
+}
+
+void metrics_connection_rejected(worker_metrics_t* metrics) {
+    counter_add(&metrics->connections_rejected, 1);
+}
+
+void metrics_tls_handshake(worker_metrics_t* metrics, int kind) {
+    counter_add(&metrics->tls_handshakes[kind], 1);
+}
+
+static int bucket_index(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude >= METRICS_MAX_VALUE_BITS) {
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = magnitude - METRICS_SUB_BUCKET_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + (int)(value >> shift) - METRICS_SUB_BUCKETS;
+}
+
+// Highest value that lands in a bucket
+static uint64_t bucket_upper_bound(int index) {
+    if (index < METRICS_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / METRICS_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+static void histogram_record(latency_histogram_t* histogram, uint64_t value) {
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum_ns, value);
+    counter_add(&histogram->buckets[bucket_index(value)], 1);
+}
+
+void metrics_record_request(worker_metrics_t* metrics, int route, int status_code,
+                            size_t bytes, uint64_t duration_ns) {
+    if (route < 0 || route > METRICS_UNROUTED) {
+        route = METRICS_UNROUTED;
+    }
+    histogram_record(&metrics->routes[route], duration_ns);
+    if (status_code >= 100 && status_code < METRICS_STATUS_CODES) {
+        counter_add(&metrics->status_counts[status_code], 1);
+        histogram_record(&metrics->status_classes[status_code / 100 - 1], duration_ns);
+    }
+    counter_add(&metrics->response_bytes, bytes);
+}
+
+// Growable text buffer for the exposition output
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} text_buffer_t;
+
+static void append(text_buffer_t* text, const char* format, ...) {
+    if (!text->data) {
+        return;
+    }
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < text->capacity - text->length) {
+            text->length += n;
+            return;
+        }
+        char* grown = realloc(text->data, text->capacity * 2 + n);
+        if (!grown) {
+            free(text->data);
+            text->data = NULL;
+            return;
+        }
+        text->data = grown;
+        text->capacity = text->capacity * 2 + n;
+    }
+}
+
+// Route paths become label values, which must escape quotes and backslashes
+static void format_label_value(char* out, size_t size, const char* value) {
+    size_t n = 0;
+    for (; *value && n + 3 < size; value++) {
+        if (*value == '"' || *value == '\\') {
+            out[n++] = '\\';
+            out[n++] = *value;
+        } else if (*value == '\n') {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else {
+            out[n++] = *value;
+        }
+    }
+    out[n] = '\0';
+}
+
+// Sum one histogram across all workers
+typedef enum { HISTOGRAM_ROUTE, HISTOGRAM_STATUS_CLASS } histogram_kind_t;
+
+static void merge_histograms(latency_histogram_t* merged, histogram_kind_t kind, int index) {
+    memset(merged, 0, sizeof(latency_histogram_t));
+    worker_metrics_t* metrics = __atomic_load_n(&registered_workers, __ATOMIC_ACQUIRE);
+    for (; metrics; metrics = metrics->next) {
+        const latency_histogram_t* histogram = kind == HISTOGRAM_ROUTE ?
+            &metrics->routes[index] : &metrics->status_classes[index];
+        merged->sum_ns += counter_read(&histogram->sum_ns);
+        for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+            uint64_t count = counter_read(&histogram->buckets[i]);
+            merged->buckets[i] += count;
+            merged->count += count;  // consistent with the buckets even mid-update
+        }
+    }
+}
+
+static double quantile_seconds(const latency_histogram_t* histogram, double quantile) {
+    if (histogram->count == 0) {
+        return 0.0;
+    }
+    uint64_t rank = (uint64_t)(quantile * histogram->count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            return bucket_upper_bound(i) / 1e9;
+        }
+    }
+    return bucket_upper_bound(METRICS_HISTOGRAM_BUCKETS - 1) / 1e9;
+}
+
+// labels is already formatted, e.g. class="2xx"
+static void append_summary(text_buffer_t* text, const char* name, const char* labels,
+                           const latency_histogram_t* histogram) {
+    for (size_t q = 0; q < QUANTILE_COUNT; q++) {
+        append(text, "%s{%s,quantile=\"%g\"} %.9f\n", name, labels, quantiles[q],
+               quantile_seconds(histogram, quantiles[q]));
+    }
+    append(text, "%s_sum{%s} %.9f\n", name, labels, histogram->sum_ns / 1e9);
+    append(text, "%s_count{%s} %llu\n", name, labels, (unsigned long long)histogram->count);
+}
+
+static uint64_t sum_counter(size_t offset) {
+    uint64_t total = 0;
+    worker_metrics_t* metrics = __atomic_load_n(&registered_workers, __ATOMIC_ACQUIRE);
+    for (; metrics; metrics = metrics->next) {
+        total += counter_read((const uint64_t*)((const char*)metrics + offset));
+    }
+    return total;
+}
+
+void handle_metrics_request(http_request_t* request, http_response_t* response) {
+    (void)request; // Unused parameter
+    text_buffer_t text = { malloc(METRICS_BODY_INITIAL), 0, METRICS_BODY_INITIAL };
+    latency_histogram_t* merged = malloc(sizeof(latency_histogram_t));
+
+    if (merged) {
+        uint64_t accepted = sum_counter(offsetof(worker_metrics_t, connections_accepted));
+        uint64_t closed = sum_counter(offsetof(worker_metrics_t, connections_closed));
+        append(&text, "# HELP http_connections_accepted_total Connections accepted.\n"
+                      "# TYPE http_connections_accepted_total counter\n"
+                      "http_connections_accepted_total %llu\n", (unsigned long long)accepted);
+        append(&text, "# HELP http_connections_open Connections currently open.\n"
+                      "# TYPE http_connections_open gauge\n"
+                      "http_connections_open %lld\n", (long long)(accepted - closed));
+        append(&text, "# HELP http_connections_rejected_total Connections turned away with a 503 at a limit.\n"
+                      "# TYPE http_connections_rejected_total counter\n"
+                      "http_connections_rejected_total %llu\n",
+               (unsigned long long)sum_counter(offsetof(worker_metrics_t, connections_rejected)));
+        if (tls_enabled()) {
+            static const char* const kinds[METRICS_TLS_KINDS] = { "full", "resumed", "failed", "ktls" };
+            append(&text, "# HELP http_tls_handshakes_total TLS handshakes, by outcome; ktls also counts\n"
+                          "# TYPE http_tls_handshakes_total counter\n");
+            for (int kind = 0; kind < METRICS_TLS_KINDS; kind++) {
+                append(&text, "http_tls_handshakes_total{result=\"%s\"} %llu\n", kinds[kind],
+                       (unsigned long long)sum_counter(offsetof(worker_metrics_t, tls_handshakes) +
+                                                       kind * sizeof(uint64_t)));
+            }
+        }
+        append(&text, "# HELP http_response_bytes_total Response body bytes queued.\n"
+                      "# TYPE http_response_bytes_total counter\n"
+                      "http_response_bytes_total %llu\n",
+               (unsigned long long)sum_counter(offsetof(worker_metrics_t, response_bytes)));
+
+        append(&text, "# HELP http_access_log_dropped_total Access log records dropped on a full ring.\n"
+                      "# TYPE http_access_log_dropped_total counter\n"
+                      "http_access_log_dropped_total %llu\n", (unsigned long long)access_log_dropped());
+
+        append(&text, "# HELP http_responses_total Responses sent, by status code.\n"
+                      "# TYPE http_responses_total counter\n");
+        for (int code = 100; code < METRICS_STATUS_CODES; code++) {
+            uint64_t count = sum_counter(offsetof(worker_metrics_t, status_counts) +
+                                         code * sizeof(uint64_t));
+            if (count) {
+                append(&text, "http_responses_total{code=\"%d\"} %llu\n", code, (unsigned long long)count);
+            }
+        }
+
+        append(&text, "# HELP http_request_duration_seconds Time to handle a request, by route.\n"
+                      "# TYPE http_request_duration_seconds summary\n");
+        for (int i = 0; i <= route_count && i <= METRICS_UNROUTED; i++) {
+            char labels[2 * MAX_URI_SIZE];
+            char path[MAX_URI_SIZE];
+            if (i < route_count) {
+                format_label_value(path, sizeof(path), routes[i].path);
+                snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\"", routes[i].method, path);
+            } else {
+                snprintf(labels, sizeof(labels), "route=\"unmatched\"");
+            }
+            merge_histograms(merged, HISTOGRAM_ROUTE, i < route_count ? i : METRICS_UNROUTED);
+            append_summary(&text, "http_request_duration_seconds", labels, merged);
+        }
+
+        append(&text, "# HELP http_status_duration_seconds Time to handle a request, by status class.\n"
+                      "# TYPE http_status_duration_seconds summary\n");
+        for (int i = 0; i < METRICS_STATUS_CLASSES; i++) {
+            char labels[16];
+            snprintf(labels, sizeof(labels), "class=\"%dxx\"", i + 1);
+            merge_histograms(merged, HISTOGRAM_STATUS_CLASS, i);
+            append_summary(&text, "http_status_duration_seconds", labels, merged);
+        }
+        free(merged);
+    }
+
+    if (!merged || !text.data) {
+        free(text.data);
+        response->status_code = 500;
+        response->body = strdup("Internal server error");
+        response->body_length = strlen(response->body);
+        http_response_add_header(response, "Content-Type", "text/plain");
+        return;
+    }
+
+    response->status_code = 200;
+    response->body = text.data;
+    response->body_length = text.length;
+    http_response_add_header(response, "Content-Type", "text/plain; version=0.0.4");
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "../include/mime_types.h"
+
+// The types every build knows, in mime.types syntax
+static const char* const builtin_types[] = {
+    "text/html html htm shtml",
+    "text/css css",
+    "application/javascript js mjs",
+    "application/json json map",
+    "application/ld+json jsonld",
+    "application/manifest+json webmanifest",
+    "application/xml xml xsl",
+    "application/rss+xml rss",
+    "application/atom+xml atom",
+    "application/yaml yaml yml",
+    "application/toml toml",
+    "text/plain txt text log conf ini",
+    "text/csv csv",
+    "text/markdown md markdown",
+    "text/calendar ics",
+    "text/vtt vtt",
+    "image/png png",
+    "image/apng apng",
+    "image/jpeg jpg jpeg jpe",
+    "image/gif gif",
+    "image/webp webp",
+    "image/avif avif",
+    "image/heic heic",
+    "image/svg+xml svg",
+    "image/x-icon ico",
+    "image/bmp bmp",
+    "image/tiff tif tiff",
+    "font/woff woff",
+    "font/woff2 woff2",
+    "font/ttf ttf",
+    "font/otf otf",
+    "application/vnd.ms-fontobject eot",
+    "application/wasm wasm",
+    "application/pdf pdf",
+    "application/rtf rtf",
+    "application/epub+zip epub",
+    "application/zip zip",
+    "application/gzip gz tgz",
+    "application/x-tar tar",
+    "application/x-bzip2 bz2",
+    "application/x-xz xz",
+    "application/zstd zst",
+    "application/x-7z-compressed 7z",
+    "application/vnd.rar rar",
+    "application/java-archive jar",
+    "application/x-sh sh",
+    "application/msword doc",
+    "application/vnd.ms-excel xls",
+    "application/vnd.ms-powerpoint ppt",
+    "application/vnd.openxmlformats-officedocument.wordprocessingml.document docx",
+    "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet xlsx",
+    "application/vnd.openxmlformats-officedocument.presentationml.presentation pptx",
+    "application/vnd.oasis.opendocument.text odt",
+    "application/vnd.oasis.opendocument.spreadsheet ods",
+    "application/vnd.oasis.opendocument.presentation odp",
+    "application/vnd.apple.mpegurl m3u8",
+    "application/dash+xml mpd",
+    "audio/mpeg mp3",
+    "audio/ogg ogg oga",
+    "audio/opus opus",
+    "audio/wav wav",
+    "audio/aac aac",
+    "audio/flac flac",
+    "audio/mp4 m4a",
+    "audio/webm weba",
+    "audio/midi mid midi",
+    "video/mp4 mp4 m4v",
+    "video/webm webm",
+    "video/ogg ogv",
+    "video/quicktime mov",
+    "video/x-msvideo avi",
+    "video/mpeg mpeg mpg",
+    "video/mp2t ts",
+    "video/x-matroska mkv",
+    "video/3gpp 3gp",
+};
+#define BUILTIN_TYPE_COUNT (sizeof(builtin_types) / sizeof(builtin_types[0]))
+
+// Types outside text/, +xml and +json that still shrink well
+static const char* const compressible_types[] = {
+    "application/javascript", "application/json", "application/xml", "application/wasm",
+    "application/yaml", "application/toml", "application/rtf", "application/x-sh",
+    "application/vnd.apple.mpegurl", "application/vnd.ms-fontobject",
+    "image/x-icon", "image/bmp", "image/tiff", "font/ttf", "font/otf", NULL
+};
+
+// Open-addressing slot; an empty slot has length 0
+typedef struct {
+    char extension[MIME_EXTENSION_MAX];    // lowercase, without the dot
+    size_t length;
+    const mime_type_t* mime;
+} mime_slot_t;
+
+static const mime_type_t default_type = {"application/octet-stream", 0};
+
+static mime_slot_t* slots;
+static size_t slot_mask;                   // capacity - 1, a power of two minus one
+static size_t slot_count;
+
+// Every type created while loading, for mime_types_shutdown()
+static mime_type_t** types;
+static size_t type_count;
+static size_t type_cap;
+
+static unsigned int hash_extension(const char* extension, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)extension[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int is_compressible(const char* type) {
+    size_t length = strlen(type);
+    if (strncasecmp(type, "text/", 5) == 0 ||
+        (length > 4 && strcasecmp(type + length - 4, "+xml") == 0) ||
+        (length > 5 && strcasecmp(type + length - 5, "+json") == 0)) {
+        return 1;
+    }
+    for (int i = 0; compressible_types[i]; i++) {
+        if (strcasecmp(type, compressible_types[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Linear probing from the hash; returns the slot holding the extension or
+// the empty one where it would go
+static mime_slot_t* find_slot(mime_slot_t* table, size_t mask, const char* extension,
+                              size_t length) {
+    size_t i = hash_extension(extension, length) & mask;
+    while (table[i].length &&
+           (table[i].length != length || memcmp(table[i].extension, extension, length) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+// Double the table, keeping it at most half full so probes stay short
+static int grow_slots(void) {
+    size_t capacity = slots ? (slot_mask + 1) * 2 : 256;
+    mime_slot_t* table = calloc(capacity, sizeof(mime_slot_t));
+    if (!table) {
+        return -1;
+    }
+    if (slots) {
+        for (size_t i = 0; i <= slot_mask; i++) {
+            if (slots[i].length) {
+                *find_slot(table, capacity - 1, slots[i].extension, slots[i].length) = slots[i];
+            }
+        }
+        free(slots);
+    }
+    slots = table;
+    slot_mask = capacity - 1;
+    return 0;
+}
+
+// Map one extension to a type; a later mapping replaces an earlier one
+static int add_extension(const char* extension, size_t length, const mime_type_t* mime) {
+    if (length == 0 || length >= MIME_EXTENSION_MAX) {
+        return 0;  // Could never be looked up
+    }
+    if (!slots || (slot_count + 1) * 2 > slot_mask + 1) {
+        if (grow_slots() != 0) {
+            return -1;
+        }
+    }
+    char lower[MIME_EXTENSION_MAX];
+    for (size_t i = 0; i < length; i++) {
+        lower[i] = (char)tolower((unsigned char)extension[i]);
+    }
+    mime_slot_t* slot = find_slot(slots, slot_mask, lower, length);
+    if (!slot->length) {
+        memcpy(slot->extension, lower, length);
+        slot->length = length;
+        slot_count++;
+    }
+    slot->mime = mime;
+    return 0;
+}
+
+static mime_type_t* create_type(const char* type, size_t length) {
+    if (type_count == type_cap) {
+        size_t cap = type_cap ? type_cap * 2 : 128;
+        mime_type_t** grown = realloc(types, cap * sizeof(mime_type_t*));
+        if (!grown) {
+            return NULL;
+        }
+        types = grown;
+        type_cap = cap;
+    }
+    // The string lives right after the struct
+    mime_type_t* mime = malloc(sizeof(mime_type_t) + length + 1);
+    if (!mime) {
+        return NULL;
+    }
+    char* name = (char*)(mime + 1);
+    memcpy(name, type, length);
+    name[length] = '\0';
+    mime->type = name;
+    mime->compressible = is_compressible(name);
+    types[type_count++] = mime;
+    return mime;
+}
+
+// Next whitespace-separated word of a line, stopping at a comment
+static const char* next_word(const char** cursor, size_t* length) {
+    const char* p = *cursor;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    if (*p == '\0' || *p == '#') {
+        return NULL;
+    }
+    const char* word = p;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#') p++;
+    *length = p - word;
+    *cursor = p;
+    return word;
+}
+
+// One "type ext1 ext2 ..." line; lines naming no extension are ignored
+static int add_line(const char* line) {
+    size_t type_length, length;
+    const char* type = next_word(&line, &type_length);
+    if (!type) {
+        return 0;
+    }
+    const char* extension = next_word(&line, &length);
+    if (!extension || !memchr(type, '/', type_length)) {
+        return 0;
+    }
+    const mime_type_t* mime = create_type(type, type_length);
+    if (!mime) {
+        return -1;
+    }
+    for (; extension; extension = next_word(&line, &length)) {
+        if (add_extension(extension, length, mime) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int load_file(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    int status = 0;
+    while (status == 0 && getline(&line, &capacity, file) != -1) {
+        status = add_line(line);
+    }
+    free(line);
+    fclose(file);
+    return status;
+}
+
+int mime_types_init(const char* path) {
+    mime_types_shutdown();
+    for (size_t i = 0; i < BUILTIN_TYPE_COUNT; i++) {
+        if (add_line(builtin_types[i]) != 0) {
+            return -1;
+        }
+    }
+    return path ? load_file(path) : 0;
+}
+
+void mime_types_shutdown(void) {
+    for (size_t i = 0; i < type_count; i++) {
+        free(types[i]);
+    }
+    free(types);
+    free(slots);
+    types = NULL;
+    type_count = type_cap = 0;
+    slots = NULL;
+    slot_mask = slot_count = 0;
+}
+
+const mime_type_t* mime_type_for(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    if (!dot || !slots || strchr(dot, '/')) {
+        return &default_type;
+    }
+
+    // Lowercase and hash the extension in one pass
+    const char* extension = dot + 1;
+    char lower[MIME_EXTENSION_MAX];
+    unsigned int hash = 2166136261u;
+    size_t length = 0;
+    for (; extension[length]; length++) {
+        if (length == MIME_EXTENSION_MAX - 1) {
+            return &default_type;
+        }
+        lower[length] = (char)tolower((unsigned char)extension[length]);
+        hash = (hash ^ (unsigned char)lower[length]) * 16777619u;
+    }
+    if (length == 0) {
+        return &default_type;
+    }
+
+    for (size_t i = hash & slot_mask; slots[i].length; i = (i + 1) & slot_mask) {
+        if (slots[i].length == length && memcmp(slots[i].extension, lower, length) == 0) {
+            return slots[i].mime;
+        }
+    }
+    return &default_type;
+}
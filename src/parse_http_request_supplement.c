@@ -1,62 +1,269 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "../include/http.h"
+#include "../include/parse_http_request_supplement.h"
 
+// RFC 7230 tchar: the characters allowed in methods and header names
+static const unsigned char token_chars[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1,
+    ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1,
+    ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1,
+    ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1,
+    ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1,
+    ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1,
+    ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
+    ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1,
+    ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1,
+    ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
 
-char* find_header_end(const char* raw_request) {
-    const char* header_end = strstr(raw_request, "\r\n\r\n");
-    if (!header_end) {
-        header_end = strstr(raw_request, "\n\n");
-    }
-    return (char*)header_end;
-}
-
-char* find_request_line_end(const char* raw_request) {
-    return strchr(raw_request, '\n');
-}
-
-char* copy_line(const char* start, const char* end) {
-    size_t length = end - start;
-    char* line = malloc(length + 1);
-    if (!line) return NULL;
-    
-    strncpy(line, start, length);
-    line[length] = '\0';
-    
-    // Remove \r if present
-    if (length > 0 && line[length - 1] == '\r') {
-        line[length - 1] = '\0';
-    }
-    
-    return line;
-}
-
-int parse_header(const char* header_line, http_request_t* request) {
-    // Check if we've reached the maximum number of headers
-    if (request->header_count >= MAX_HEADERS) {
-        return -1;
-    }
-    
-    // Parse header key: value
-    char* colon = strchr(header_line, ':');
-    if (!colon) {
-        return -1;  // Invalid header format
-    }
-    
-    // Split the header into key and value
-    *colon = '\0';  // Temporarily modify the string to split it
-    char* key = (char*)header_line;
-    char* value = colon + 1;
-    
-    // Skip leading whitespace in value
-    while (*value == ' ' || *value == '\t') value++;
-    
-    // Copy key and value to the request structure
-    strncpy(request->headers[request->header_count][0], key, MAX_HEADER_SIZE - 1);
-    strncpy(request->headers[request->header_count][1], value, MAX_HEADER_SIZE - 1);
-    request->header_count++;
-    
-    return 0;
+static const char* scan_token_scalar(const char* start, const char* end) {
+    while (start < end && token_chars[(unsigned char)*start]) {
+        start++;
+    }
+    return start;
+}
+
+// The request target ends at the first space; control characters are invalid
+static const char* scan_uri_scalar(const char* start, const char* end) {
+    while (start < end) {
+        unsigned char c = *start;
+        if (c <= ' ' || c == 0x7f) break;
+        start++;
+    }
+    return start;
+}
+
+// A header value runs until CR/LF; any other control character except HT is invalid
+static const char* scan_header_value_scalar(const char* start, const char* end) {
+    while (start < end) {
+        unsigned char c = *start;
+        if ((c < ' ' && c != '\t') || c == 0x7f) break;
+        start++;
+    }
+    return start;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// SSE4.2: PCMPESTRI finds the first byte falling in any of up to eight ranges
+__attribute__((target("sse4.2")))
+static const char* scan_ranges_sse42(const char* start, const char* end,
+                                     const char* ranges, int ranges_len) {
+    __m128i set = _mm_loadu_si128((const __m128i*)ranges);
+    while (end - start >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)start);
+        int index = _mm_cmpestri(set, ranges_len, block, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16) {
+            return start + index;
+        }
+        start += 16;
+    }
+    return start;
+}
+
+// Every byte outside tchar falls in one of these ranges, as do '|' and '~';
+// the scalar check after each stop steps over those two
+static const char token_stop_ranges[16] = {
+    0x00, ' ', '"', '"', '(', ')', ',', ',', '/', '/', ':', '@', '[', ']', '{', (char)0xff
+};
+static const char uri_stop_ranges[16] = { 0x00, ' ', 0x7f, 0x7f };
+static const char value_stop_ranges[16] = { 0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f };
+
+__attribute__((target("sse4.2")))
+static const char* scan_token_sse42(const char* start, const char* end) {
+    while (end - start >= 16) {
+        start = scan_ranges_sse42(start, end, token_stop_ranges, 16);
+        if (start == end || !token_chars[(unsigned char)*start]) {
+            return start;
+        }
+        start++;  // '|' or '~'
+    }
+    return scan_token_scalar(start, end);
+}
+
+__attribute__((target("sse4.2")))
+static const char* scan_uri_sse42(const char* start, const char* end) {
+    return scan_uri_scalar(scan_ranges_sse42(start, end, uri_stop_ranges, 4), end);
+}
+
+__attribute__((target("sse4.2")))
+static const char* scan_header_value_sse42(const char* start, const char* end) {
+    return scan_header_value_scalar(scan_ranges_sse42(start, end, value_stop_ranges, 6), end);
+}
+
+// AVX2: classify 32 bytes at a time with unsigned compares built from max_epu8
+__attribute__((target("avx2")))
+static const char* scan_uri_avx2(const char* start, const char* end) {
+    const __m256i first_visible = _mm256_set1_epi8(0x21);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    while (end - start >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)start);
+        __m256i visible = _mm256_cmpeq_epi8(_mm256_max_epu8(block, first_visible), block);
+        __m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(block, del), visible);
+        unsigned int stops = ~(unsigned int)_mm256_movemask_epi8(ok);
+        if (stops) {
+            return start + __builtin_ctz(stops);
+        }
+        start += 32;
+    }
+    return scan_uri_scalar(start, end);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_header_value_avx2(const char* start, const char* end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    while (end - start >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)start);
+        __m256i printable = _mm256_cmpeq_epi8(_mm256_max_epu8(block, space), block);
+        __m256i allowed = _mm256_or_si256(printable, _mm256_cmpeq_epi8(block, tab));
+        __m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(block, del), allowed);
+        unsigned int stops = ~(unsigned int)_mm256_movemask_epi8(ok);
+        if (stops) {
+            return start + __builtin_ctz(stops);
+        }
+        start += 32;
+    }
+    return scan_header_value_scalar(start, end);
+}
+
+#elif defined(__aarch64__)
+
+// Collapse a 16-byte compare result to one nibble per byte and find the first hit
+static const char* first_neon_match(const char* start, uint8x16_t matches) {
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+    return bits ? start + (__builtin_ctzll(bits) >> 2) : NULL;
+}
+
+static const char* scan_uri_neon(const char* start, const char* end) {
+    const uint8x16_t first_visible = vdupq_n_u8(0x21);
+    const uint8x16_t del = vdupq_n_u8(0x7f);
+    while (end - start >= 16) {
+        uint8x16_t block = vld1q_u8((const uint8_t*)start);
+        uint8x16_t stops = vorrq_u8(vcltq_u8(block, first_visible), vceqq_u8(block, del));
+        const char* hit = first_neon_match(start, stops);
+        if (hit) {
+            return hit;
+        }
+        start += 16;
+    }
+    return scan_uri_scalar(start, end);
+}
+
+static const char* scan_header_value_neon(const char* start, const char* end) {
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t del = vdupq_n_u8(0x7f);
+    while (end - start >= 16) {
+        uint8x16_t block = vld1q_u8((const uint8_t*)start);
+        uint8x16_t control = vbicq_u8(vcltq_u8(block, space), vceqq_u8(block, tab));
+        const char* hit = first_neon_match(start, vorrq_u8(control, vceqq_u8(block, del)));
+        if (hit) {
+            return hit;
+        }
+        start += 16;
+    }
+    return scan_header_value_scalar(start, end);
+}
+
+#endif
+
+typedef const char* (*scanner_fn)(const char* start, const char* end);
+
+static scanner_fn token_scanner;
+static scanner_fn uri_scanner;
+static scanner_fn value_scanner;
+static const char* scanner_names;
+
+// Pick the widest implementation this CPU supports
+void select_request_scanners(void) {
+    scanner_fn token = scan_token_scalar;
+    scanner_fn uri = scan_uri_scalar;
+    scanner_fn value = scan_header_value_scalar;
+    const char* name = "scalar";
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        token = scan_token_sse42;
+        uri = scan_uri_sse42;
+        value = scan_header_value_sse42;
+        name = "sse4.2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        uri = scan_uri_avx2;
+        value = scan_header_value_avx2;
+        name = __builtin_cpu_supports("sse4.2") ? "avx2+sse4.2" : "avx2";
+    }
+#elif defined(__aarch64__)
+    // NEON is always there on AArch64; header names are short so stay scalar
+    uri = scan_uri_neon;
+    value = scan_header_value_neon;
+    name = "neon";
+#endif
+
+    __atomic_store_n(&token_scanner, token, __ATOMIC_RELEASE);
+    __atomic_store_n(&uri_scanner, uri, __ATOMIC_RELEASE);
+    __atomic_store_n(&value_scanner, value, __ATOMIC_RELEASE);
+    __atomic_store_n(&scanner_names, name, __ATOMIC_RELEASE);
+}
+
+const char* request_scanner_name(void) {
+    if (!__atomic_load_n(&scanner_names, __ATOMIC_ACQUIRE)) {
+        select_request_scanners();
+    }
+    return scanner_names;
+}
+
+// The first call from any thread resolves the implementation; racing
+// threads all store the same pointers
+static scanner_fn resolve(scanner_fn* slot) {
+    scanner_fn fn = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!fn) {
+        select_request_scanners();
+        fn = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    }
+    return fn;
+}
+
+const char* scan_token(const char* start, const char* end) {
+    return resolve(&token_scanner)(start, end);
+}
+
+const char* scan_uri(const char* start, const char* end) {
+    return resolve(&uri_scanner)(start, end);
+}
+
+const char* scan_header_value(const char* start, const char* end) {
+    return resolve(&value_scanner)(start, end);
+}
+
+static void terminate_view(char* buffer, const char* view, size_t length) {
+    buffer[(view - buffer) + length] = '\0';
+}
+
+// Every view is followed by a delimiter we no longer need, so overwrite it
+void terminate_request_views(char* buffer, http_request_t* request) {
+    terminate_view(buffer, request->method, request->method_len);
+    terminate_view(buffer, request->uri, request->uri_len);
+    terminate_view(buffer, request->version, request->version_len);
+    for (int i = 0; i < request->header_count; i++) {
+        http_header_t* header = &request->headers[i];
+        terminate_view(buffer, header->name, header->name_len);
+        terminate_view(buffer, header->value, header->value_len);
+    }
 }
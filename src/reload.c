@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include "../include/reload.h"
+#include "../include/tls.h"
+
+extern char** environ;
+
+// What each message on the handover socket carries, besides its descriptor
+#define LISTENER_PLAIN 0
+#define LISTENER_TLS 1
+#define LISTENER_END -1    // no descriptor: all are sent
+
+typedef struct {
+    int fd;
+    int tls;
+} inherited_listener_t;
+
+static char** saved_argv;
+static int parent_fd = -1;    // handover socket of the process being replaced
+static inherited_listener_t* inherited;
+static int inherited_count;
+
+static int listener_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &length) != 0 || addr.sin_family != AF_INET) {
+        return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+// One message: its kind, and the descriptor that came with it or -1
+static int receive_listener(int channel, int32_t* kind) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = kind, .iov_len = sizeof(*kind)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t n;
+    while ((n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n != (ssize_t)sizeof(*kind)) {
+        return -2;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    return fd;
+}
+
+static int receive_listeners(int channel, const server_config_t* config) {
+    for (;;) {
+        int32_t kind;
+        int fd = receive_listener(channel, &kind);
+        if (fd == -2) {
+            fprintf(stderr, "Reload: listener handover broke off\n");
+            return -1;
+        }
+        if (kind == LISTENER_END) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return 0;
+        }
+        if (fd < 0 || (kind != LISTENER_PLAIN && kind != LISTENER_TLS)) {
+            fprintf(stderr, "Reload: malformed listener handover\n");
+            return -1;
+        }
+
+        // The inherited sockets stay bound where they are; a reload keeps the ports
+        int port = kind == LISTENER_TLS ? config->tls_port : config->port;
+        int bound = listener_port(fd);
+        if (bound != port) {
+            fprintf(stderr, "Reload: inherited listener is on port %d, not %d; "
+                    "ports cannot change across a reload\n", bound, port);
+            close(fd);
+            return -1;
+        }
+
+        inherited_listener_t* grown = realloc(inherited, (inherited_count + 1) * sizeof(*grown));
+        if (!grown) {
+            close(fd);
+            return -1;
+        }
+        inherited = grown;
+        inherited[inherited_count].fd = fd;
+        inherited[inherited_count].tls = kind == LISTENER_TLS;
+        inherited_count++;
+    }
+}
+
+int reload_init(char** argv, server_config_t* config) {
+    saved_argv = argv;
+
+    const char* handover = getenv(RELOAD_ENV);
+    if (!handover) {
+        return 0;
+    }
+    char* end;
+    long fd = strtol(handover, &end, 10);
+    unsetenv(RELOAD_ENV);
+    if (*handover == '\0' || *end != '\0' || fd < 0 || fd > INT32_MAX ||
+        fcntl((int)fd, F_SETFD, FD_CLOEXEC) != 0) {
+        fprintf(stderr, "Reload: %s does not name an open descriptor\n", RELOAD_ENV);
+        return -1;
+    }
+    parent_fd = (int)fd;
+    if (receive_listeners(parent_fd, config) != 0) {
+        return -1;
+    }
+
+    // Every inherited listener keeps an accept queue the kernel fills; each
+    // needs a worker, so a reload can add workers but not take them away
+    int plain = 0;
+    int tls = 0;
+    for (int i = 0; i < inherited_count; i++) {
+        if (inherited[i].tls) {
+            tls++;
+        } else {
+            plain++;
+        }
+    }
+    int needed = plain;
+    if (tls_enabled() && tls > needed) {
+        needed = tls;
+    }
+    if (needed > config->workers) {
+        fprintf(stderr, "Reload: running %d workers, one for each inherited listener\n", needed);
+        config->workers = needed;
+    }
+    return 0;
+}
+
+int reload_take_listener(int tls) {
+    for (int i = 0; i < inherited_count; i++) {
+        if (inherited[i].fd >= 0 && inherited[i].tls == tls) {
+            int fd = inherited[i].fd;
+            inherited[i].fd = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+void reload_ready(void) {
+    for (int i = 0; i < inherited_count; i++) {
+        if (inherited[i].fd >= 0) {
+            close(inherited[i].fd);
+        }
+    }
+    free(inherited);
+    inherited = NULL;
+    inherited_count = 0;
+
+    if (parent_fd >= 0) {
+        char ready = 1;
+        while (write(parent_fd, &ready, 1) < 0 && errno == EINTR) {
+        }
+        close(parent_fd);
+        parent_fd = -1;
+    }
+}
+
+static int send_listener(int channel, int fd, int32_t kind) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = &kind, .iov_len = sizeof(kind)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    }
+
+    ssize_t n;
+    while ((n = sendmsg(channel, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    return n == (ssize_t)sizeof(kind) ? 0 : -1;
+}
+
+static int hand_over(int channel, const int* listen_fds, const int* tls_listen_fds, int count) {
+    for (int i = 0; i < count; i++) {
+        if (send_listener(channel, listen_fds[i], LISTENER_PLAIN) != 0) {
+            return -1;
+        }
+        if (tls_listen_fds[i] >= 0 && send_listener(channel, tls_listen_fds[i], LISTENER_TLS) != 0) {
+            return -1;
+        }
+    }
+    if (send_listener(channel, -1, LISTENER_END) != 0) {
+        return -1;
+    }
+
+    // The new process answers once its workers accept, or closes the socket by exiting
+    struct pollfd pfd = {.fd = channel, .events = POLLIN};
+    int ready;
+    while ((ready = poll(&pfd, 1, RELOAD_READY_TIMEOUT * 1000)) < 0 && errno == EINTR) {
+    }
+    char answer;
+    return ready == 1 && read(channel, &answer, 1) == 1 ? 0 : -1;
+}
+
+int reload_spawn(const int* listen_fds, const int* tls_listen_fds, int count) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+        perror("Reload: socketpair failed");
+        return -1;
+    }
+
+    // Everything the child needs is built before fork(): other threads may
+    // hold locks, so between fork() and exec only async-signal-safe calls run
+    char variable[64];
+    snprintf(variable, sizeof(variable), "%s=%d", RELOAD_ENV, pair[1]);
+    size_t inherited_env = 0;
+    while (environ[inherited_env]) {
+        inherited_env++;
+    }
+    char** envp = malloc((inherited_env + 2) * sizeof(char*));
+    if (!envp) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    size_t n = 0;
+    size_t prefix = strlen(RELOAD_ENV) + 1;
+    for (size_t i = 0; i < inherited_env; i++) {
+        if (strncmp(environ[i], variable, prefix) != 0) {
+            envp[n++] = environ[i];
+        }
+    }
+    envp[n++] = variable;
+    envp[n] = NULL;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        if (fcntl(pair[1], F_SETFD, 0) == 0) {
+            execvpe(saved_argv[0], saved_argv, envp);
+        }
+        _exit(127);
+    }
+    free(envp);
+    close(pair[1]);
+    if (pid < 0) {
+        perror("Reload: fork failed");
+        close(pair[0]);
+        return -1;
+    }
+
+    int status = hand_over(pair[0], listen_fds, tls_listen_fds, count);
+    close(pair[0]);
+    if (status != 0) {
+        // It never said it was serving; it cannot have taken over anything
+        fprintf(stderr, "Reload failed: process %d did not start serving, carrying on\n", (int)pid);
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        return -1;
+    }
+    printf("Reloaded: process %d is serving, draining connections\n", (int)pid);
+    fflush(stdout);
+    return 0;
+}
+
+static void control_signals(sigset_t* set) {
+    sigemptyset(set);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGUSR2);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+}
+
+void reload_block_signals(void) {
+    sigset_t set;
+    control_signals(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+int reload_wait(int timeout_ms) {
+    sigset_t set;
+    control_signals(&set);
+    struct timespec timeout = {.tv_sec = timeout_ms / 1000,
+                               .tv_nsec = (long)(timeout_ms % 1000) * 1000000};
+    int signo = sigtimedwait(&set, NULL, &timeout);
+    if (signo == SIGHUP || signo == SIGUSR2) {
+        return RELOAD_RELOAD;
+    }
+    if (signo == SIGTERM || signo == SIGINT) {
+        return RELOAD_STOP;
+    }
+    return RELOAD_NONE;
+}
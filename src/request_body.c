@@ -0,0 +1,268 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "../include/request_body.h"
+
+// Chunked decoder states, in the order they occur in a body
+enum {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,     // ";name=value" after the size, ignored
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER,       // trailer fields are read and dropped
+    CHUNK_TRAILER_LF,
+    CHUNK_END_LF
+};
+
+#define MAX_CHUNK_SIZE_DIGITS 15   // keeps the size well clear of overflow
+
+// Content-Length must be plain digits; a repeated header must agree
+static int parse_content_length(const http_request_t* request, unsigned long long* length) {
+    const char* first = get_known_header(request, HTTP_HEADER_CONTENT_LENGTH);
+    for (int i = 0; i < request->header_count; i++) {
+        const http_header_t* header = &request->headers[i];
+        if (header->id != HTTP_HEADER_CONTENT_LENGTH) {
+            continue;
+        }
+        if (strcmp(header->value, first) != 0) {
+            return -1;
+        }
+    }
+
+    if (!isdigit((unsigned char)*first) || strlen(first) > 19) {
+        return -1;
+    }
+    char* end;
+    *length = strtoull(first, &end, 10);
+    return *end == '\0' ? 0 : -1;
+}
+
+// Transfer-Encoding must be one header whose only coding is chunked. Repeated
+// lines are refused rather than combined, since a proxy joining them may
+// frame the body differently; chunked anywhere but last leaves the length
+// unknowable (RFC 9112 6.3), and codings before it are not supported.
+static int check_transfer_encoding(const http_request_t* request) {
+    const char* value = NULL;
+    for (int i = 0; i < request->header_count; i++) {
+        const http_header_t* header = &request->headers[i];
+        if (header->id != HTTP_HEADER_TRANSFER_ENCODING) {
+            continue;
+        }
+        if (value) {
+            return 400;
+        }
+        value = header->value;
+    }
+    if (strcasecmp(value, "chunked") == 0) {
+        return 0;
+    }
+
+    const char* last = strrchr(value, ',');
+    last = last ? last + 1 : value;
+    while (*last == ' ' || *last == '\t') last++;
+    size_t length = strlen(last);
+    while (length > 0 && (last[length - 1] == ' ' || last[length - 1] == '\t')) length--;
+    if (length != 7 || strncasecmp(last, "chunked", 7) != 0) {
+        return 400;
+    }
+    return 501;
+}
+
+int body_decoder_init(body_decoder_t* decoder, const http_request_t* request,
+                      unsigned long long limit) {
+    memset(decoder, 0, sizeof(body_decoder_t));
+    decoder->limit = limit;
+
+    const char* transfer_encoding = get_known_header(request, HTTP_HEADER_TRANSFER_ENCODING);
+    const char* content_length = get_known_header(request, HTTP_HEADER_CONTENT_LENGTH);
+    if (transfer_encoding) {
+        // Both at once is how requests get smuggled past proxies (RFC 9112 6.1)
+        if (content_length) {
+            return 400;
+        }
+        int status = check_transfer_encoding(request);
+        if (status != 0) {
+            return status;
+        }
+        decoder->framing = BODY_FRAMING_CHUNKED;
+        decoder->state = CHUNK_SIZE;
+        return 0;
+    }
+
+    if (content_length) {
+        unsigned long long length;
+        if (parse_content_length(request, &length) != 0) {
+            return 400;
+        }
+        if (length > limit) {
+            return 413;
+        }
+        decoder->framing = length ? BODY_FRAMING_LENGTH : BODY_FRAMING_NONE;
+        decoder->remaining = length;
+    }
+    return 0;
+}
+
+// Hand a run of body bytes to the sink
+static body_status_t deliver(body_decoder_t* decoder, const char* data, size_t length,
+                             body_sink_t sink, void* context) {
+    decoder->received += length;
+    if (sink && length) {
+        int status = sink(context, data, length);
+        if (status != 0) {
+            decoder->status = status;
+            return BODY_REJECTED;
+        }
+    }
+    return BODY_INCOMPLETE;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static body_status_t decode_chunked(body_decoder_t* decoder, const char* data, size_t length,
+                                    size_t* consumed, body_sink_t sink, void* context) {
+    const char* p = data;
+    const char* end = data + length;
+    body_status_t status = BODY_INCOMPLETE;
+
+    while (p < end && status == BODY_INCOMPLETE) {
+        switch (decoder->state) {
+        case CHUNK_SIZE: {
+            int digit = hex_value(*p);
+            if (digit >= 0) {
+                if (++decoder->size_digits > MAX_CHUNK_SIZE_DIGITS) {
+                    return BODY_INVALID;
+                }
+                decoder->remaining = decoder->remaining * 16 + digit;
+                p++;
+                break;
+            }
+            if (decoder->size_digits == 0) {
+                return BODY_INVALID;
+            }
+            if (decoder->received + decoder->remaining > decoder->limit) {
+                return BODY_TOO_LARGE;
+            }
+            if (*p == ';' || *p == ' ' || *p == '\t') {
+                decoder->state = CHUNK_EXTENSION;
+            } else if (*p == '\r') {
+                decoder->state = CHUNK_SIZE_LF;
+            } else if (*p == '\n') {
+                decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+            } else {
+                return BODY_INVALID;
+            }
+            p++;
+            break;
+        }
+
+        case CHUNK_EXTENSION: {
+            const char* newline = memchr(p, '\n', end - p);
+            if (!newline) {
+                p = end;
+                break;
+            }
+            p = newline + 1;
+            decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+            break;
+        }
+
+        case CHUNK_SIZE_LF:
+            if (*p++ != '\n') return BODY_INVALID;
+            decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER_START;
+            break;
+
+        case CHUNK_DATA: {
+            size_t available = end - p;
+            size_t take = decoder->remaining < available ? decoder->remaining : available;
+            status = deliver(decoder, p, take, sink, context);
+            p += take;
+            decoder->remaining -= take;
+            if (decoder->remaining == 0) {
+                decoder->state = CHUNK_DATA_CR;
+            }
+            break;
+        }
+
+        case CHUNK_DATA_CR:
+            if (*p == '\r') {
+                p++;
+                decoder->state = CHUNK_DATA_LF;
+                break;
+            }
+            decoder->state = CHUNK_DATA_LF;
+            break;
+
+        case CHUNK_DATA_LF:
+            if (*p++ != '\n') return BODY_INVALID;
+            decoder->size_digits = 0;
+            decoder->state = CHUNK_SIZE;
+            break;
+
+        case CHUNK_TRAILER_START:
+            if (*p == '\r') {
+                p++;
+                decoder->state = CHUNK_END_LF;
+            } else if (*p == '\n') {
+                p++;
+                status = BODY_DONE;
+            } else {
+                decoder->state = CHUNK_TRAILER;
+            }
+            break;
+
+        case CHUNK_TRAILER: {
+            const char* newline = memchr(p, '\n', end - p);
+            if (!newline) {
+                p = end;
+                break;
+            }
+            p = newline + 1;
+            decoder->state = CHUNK_TRAILER_START;
+            break;
+        }
+
+        case CHUNK_END_LF:
+            if (*p++ != '\n') return BODY_INVALID;
+            status = BODY_DONE;
+            break;
+        }
+    }
+
+    *consumed = p - data;
+    return status;
+}
+
+body_status_t body_decoder_execute(body_decoder_t* decoder, const char* data, size_t length,
+                                   size_t* consumed, body_sink_t sink, void* context) {
+    *consumed = 0;
+    switch (decoder->framing) {
+    case BODY_FRAMING_NONE:
+        return BODY_DONE;
+
+    case BODY_FRAMING_LENGTH: {
+        size_t take = decoder->remaining < length ? decoder->remaining : length;
+        body_status_t status = deliver(decoder, data, take, sink, context);
+        *consumed = take;
+        decoder->remaining -= take;
+        if (status != BODY_INCOMPLETE) {
+            return status;
+        }
+        return decoder->remaining == 0 ? BODY_DONE : BODY_INCOMPLETE;
+    }
+
+    case BODY_FRAMING_CHUNKED:
+        return decode_chunked(decoder, data, length, consumed, sink, context);
+    }
+    return BODY_INVALID;
+}
@@ -3,66 +3,387 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "../include/http.h"
+#include "../include/router.h"
+#include "../include/arena.h"
+#include "../include/thread_pool.h"
 
-typedef struct {
-    const char* path;
-    void (*handler)(http_request_t*, http_response_t*);
-} route_t;
-
-#define MAX_ROUTES 50
 route_t routes[MAX_ROUTES];
 int route_count = 0;
 
-void handle_home_page(http_request_t* request, http_response_t* response) {
-    (void)request; // Unused parameter
-    response->status_code = 200;
-    response->body = strdup("<html><body><h1>Welcome to our HTTP Server!</h1></body></html>");
-    response->body_length = strlen(response->body);
-    strcpy(response->headers[0][0], "Content-Type");
-    strcpy(response->headers[0][1], "text/html");
-    response->header_count = 1;
+// Radix tree of route patterns. Each node consumes its literal prefix; a
+// node reached with nothing left to match answers with routes[] entries,
+// one per method. Lookup walks the URI once: literal children are found
+// by their first byte, so the cost grows with the URI, not the route count.
+typedef struct route_node {
+    const char* prefix;
+    size_t prefix_len;
+    struct route_node** children;
+    int child_count;
+    unsigned char child_index[256];    // first byte -> 1 + position in children
+
+    // Matches one non-empty segment, then continues in param_child
+    struct route_node* param_child;
+    const char* param_name;
+    size_t param_name_len;
+
+    // Matches whatever is left of the path
+    struct route_node* wildcard_child;
+    const char* wildcard_name;
+    size_t wildcard_name_len;
+
+    int* route_ids;
+    int route_id_count;
+} route_node_t;
+
+static route_node_t* route_tree = NULL;
+
+void* route_alloc(http_request_t* request, size_t size) {
+    return request->arena ? arena_alloc(request->arena, size) : malloc(size);
 }
 
-void handle_hello_page(http_request_t* request, http_response_t* response) {
-    (void)request; // Unused parameter
-    response->status_code = 200;
-    response->body = strdup("Hello, World!");
-    response->body_length = strlen(response->body);
-    strcpy(response->headers[0][0], "Content-Type");
-    strcpy(response->headers[0][1], "text/plain");
-    response->header_count = 1;
+char* route_strdup(http_request_t* request, const char* text) {
+    return request->arena ? arena_strdup(request->arena, text) : strdup(text);
+}
+
+void route_set_body(http_request_t* request, http_response_t* response, char* body, size_t length) {
+    response->body = body;
+    response->body_length = body ? length : 0;
+    if (body && request->arena) {
+        // Keep the arena from being reset until the body has been sent
+        arena_pin(request->arena);
+        response->body_release = arena_unpin;
+        response->body_owner = request->arena;
+    }
 }
 
 void handle_not_found(http_request_t* request, http_response_t* response) {
-    (void)request; // Unused parameter
     response->status_code = 404;
-    response->body = strdup("Page not found");
-    response->body_length = strlen(response->body);
-    strcpy(response->headers[0][0], "Content-Type");
-    strcpy(response->headers[0][1], "text/plain");
-    response->header_count = 1;
+    char* body = route_strdup(request, "Page not found");
+    route_set_body(request, response, body, body ? strlen(body) : 0);
+    http_response_add_header(response, "Content-Type", "text/plain");
+}
+
+// The path exists, just not for this method; Allow lists the ones that do
+static void handle_method_not_allowed(http_request_t* request, const route_node_t* node,
+                                      http_response_t* response) {
+    response->status_code = 405; // Method not allowed
+    char* body = route_strdup(request, "Method not allowed");
+    route_set_body(request, response, body, body ? strlen(body) : 0);
+    http_response_add_header(response, "Content-Type", "text/plain");
+    char allow[256];
+    size_t used = 0;
+    allow[0] = '\0';
+    for (int i = 0; i < node->route_id_count; i++) {
+        int n = snprintf(allow + used, sizeof(allow) - used, "%s%s",
+                         i ? ", " : "", routes[node->route_ids[i]].method);
+        if (n < 0 || (size_t)n >= sizeof(allow) - used) {
+            break;
+        }
+        used += n;
+    }
+    http_response_add_header_len(response, "Allow", allow, used);
 }
 
-void register_route(const char* path, void (*handler)(http_request_t*, http_response_t*)) {
+void register_body_route(const char* method, const char* path, route_handler_t handler,
+                         route_body_handler_t on_body, size_t max_body_size) {
     if (route_count < MAX_ROUTES) {
+        routes[route_count].method = method;
         routes[route_count].path = path;
         routes[route_count].handler = handler;
+        routes[route_count].on_body = on_body;
+        routes[route_count].max_body_size = max_body_size;
+        routes[route_count].offload = 0;
+        routes[route_count].prebuilt = NULL;
         route_count++;
+    } else {
+        fprintf(stderr, "Too many routes, ignoring %s %s\n", method, path);
+    }
+}
+
+void register_method_route(const char* method, const char* path, route_handler_t handler) {
+    register_body_route(method, path, handler, NULL, 0);
+}
+
+void register_offload_route(const char* method, const char* path, route_handler_t handler) {
+    int before = route_count;
+    register_body_route(method, path, handler, NULL, 0);
+    if (route_count > before) {
+        routes[before].offload = 1;
+    }
+}
+
+// Only reached without a connection to send the bytes themselves to
+static void handle_prebuilt_route(http_request_t* request, http_response_t* response) {
+    http_prebuilt_fill(routes[request->route].prebuilt, response);
+}
+
+void register_prebuilt_route(const char* method, const char* path, const http_prebuilt_t* prebuilt) {
+    int before = route_count;
+    register_body_route(method, path, handle_prebuilt_route, NULL, 0);
+    if (route_count > before) {
+        routes[before].prebuilt = prebuilt;
+    }
+}
+
+int route_offload(http_request_t* request) {
+    // Requests that did not come from a connection have nowhere to resume
+    if (request->offload_state == ROUTE_ON_POOL || !request->arena || !thread_pool_running()) {
+        return 0;
+    }
+    request->offload_state = ROUTE_OFFLOAD_REQUESTED;
+    return 1;
+}
+
+void register_route(const char* path, route_handler_t handler) {
+    register_method_route("GET", path, handler);
+}
+
+static route_node_t* new_node(const char* prefix, size_t prefix_len) {
+    route_node_t* node = calloc(1, sizeof(route_node_t));
+    if (node) {
+        node->prefix = prefix;
+        node->prefix_len = prefix_len;
+    }
+    return node;
+}
+
+static int add_child(route_node_t* node, route_node_t* child) {
+    route_node_t** children = realloc(node->children, (node->child_count + 1) * sizeof(route_node_t*));
+    if (!children) {
+        return -1;
+    }
+    node->children = children;
+    children[node->child_count++] = child;
+    node->child_index[(unsigned char)child->prefix[0]] = (unsigned char)node->child_count;
+    return 0;
+}
+
+static route_node_t* find_child(const route_node_t* node, char first) {
+    unsigned char slot = node->child_index[(unsigned char)first];
+    return slot ? node->children[slot - 1] : NULL;
+}
+
+static int add_route_id(route_node_t* node, int id) {
+    for (int i = 0; i < node->route_id_count; i++) {
+        if (strcmp(routes[node->route_ids[i]].method, routes[id].method) == 0) {
+            fprintf(stderr, "Duplicate route %s %s\n", routes[id].method, routes[id].path);
+            return -1;
+        }
+    }
+    int* ids = realloc(node->route_ids, (node->route_id_count + 1) * sizeof(int));
+    if (!ids) {
+        return -1;
+    }
+    node->route_ids = ids;
+    ids[node->route_id_count++] = id;
+    return 0;
+}
+
+// Same capture name at the same position, or the patterns are ambiguous
+static int check_capture_name(const char* existing, size_t existing_len,
+                              const char* name, size_t name_len, int id) {
+    if (existing_len != name_len || memcmp(existing, name, name_len) != 0) {
+        fprintf(stderr, "Route %s conflicts with another capture name at the same position\n",
+                routes[id].path);
+        return -1;
+    }
+    return 0;
+}
+
+// Insert the rest of a pattern below a node whose own prefix is consumed
+static int insert_pattern(route_node_t* node, const char* pattern, int id) {
+    while (*pattern) {
+        if (*pattern == ':') {
+            const char* name = pattern + 1;
+            size_t name_len = strcspn(name, "/");
+            if (name_len == 0) {
+                fprintf(stderr, "Route %s has an unnamed ':' capture\n", routes[id].path);
+                return -1;
+            }
+            if (!node->param_child) {
+                node->param_child = new_node("", 0);
+                if (!node->param_child) return -1;
+                node->param_name = name;
+                node->param_name_len = name_len;
+            } else if (check_capture_name(node->param_name, node->param_name_len,
+                                          name, name_len, id) != 0) {
+                return -1;
+            }
+            node = node->param_child;
+            pattern = name + name_len;
+            continue;
+        }
+
+        if (*pattern == '*') {
+            const char* name = pattern[1] ? pattern + 1 : pattern;
+            size_t name_len = strlen(name);
+            if (strchr(name, '/')) {
+                fprintf(stderr, "Route %s: '*' must end the pattern\n", routes[id].path);
+                return -1;
+            }
+            if (!node->wildcard_child) {
+                node->wildcard_child = new_node("", 0);
+                if (!node->wildcard_child) return -1;
+                node->wildcard_name = name;
+                node->wildcard_name_len = name_len;
+            } else if (check_capture_name(node->wildcard_name, node->wildcard_name_len,
+                                          name, name_len, id) != 0) {
+                return -1;
+            }
+            return add_route_id(node->wildcard_child, id);
+        }
+
+        // Literal text runs up to a capture starting a segment
+        size_t literal_len = 0;
+        while (pattern[literal_len] &&
+               !(literal_len > 0 && pattern[literal_len - 1] == '/' &&
+                 (pattern[literal_len] == ':' || pattern[literal_len] == '*'))) {
+            literal_len++;
+        }
+
+        route_node_t* child = find_child(node, *pattern);
+        if (!child) {
+            child = new_node(pattern, literal_len);
+            if (!child || add_child(node, child) != 0) return -1;
+            node = child;
+            pattern += literal_len;
+            continue;
+        }
+
+        size_t common = 0;
+        while (common < literal_len && common < child->prefix_len &&
+               pattern[common] == child->prefix[common]) {
+            common++;
+        }
+        if (common < child->prefix_len) {
+            // Split the edge: the shared part becomes a new parent of the old child
+            route_node_t* parent = new_node(child->prefix, common);
+            if (!parent) return -1;
+            child->prefix += common;
+            child->prefix_len -= common;
+            if (add_child(parent, child) != 0) return -1;
+            node->children[node->child_index[(unsigned char)parent->prefix[0]] - 1] = parent;
+            child = parent;
+        }
+        node = child;
+        pattern += common;
     }
+    return add_route_id(node, id);
 }
 
-void handle_route(http_request_t* request, http_response_t* response) {
-    // Try to find a matching route 
+int router_compile(void) {
+    route_tree = new_node("", 0);
+    if (!route_tree) {
+        return -1;
+    }
     for (int i = 0; i < route_count; i++) {
-        if (strcmp(request->uri, routes[i].path) == 0) {
-            // Call the registered handler for this route
-            routes[i].handler(request, response);
-            return;
+        if (routes[i].path[0] != '/' || insert_pattern(route_tree, routes[i].path, i) != 0) {
+            fprintf(stderr, "Invalid route %s %s\n", routes[i].method, routes[i].path);
+            return -1;
         }
     }
-    
-    // No route found, handle 404
-    handle_not_found(request, response);
+    return 0;
 }
 
+static void push_param(http_request_t* request, const char* name, size_t name_len,
+                       const char* value, size_t value_len) {
+    if (request->param_count < MAX_ROUTE_PARAMS) {
+        route_param_t* param = &request->params[request->param_count++];
+        param->name = name;
+        param->name_len = name_len;
+        param->value = value;
+        param->value_len = value_len;
+    }
+}
+
+// Find the node answering the rest of the path below node. Literal matches
+// win over captures, and a failed branch drops the captures it pushed.
+static const route_node_t* match_node(const route_node_t* node, const char* path, size_t length,
+                                      http_request_t* request) {
+    if (length == 0 && node->route_id_count > 0) {
+        return node;
+    }
+
+    if (length > 0) {
+        const route_node_t* child = find_child(node, *path);
+        if (child && child->prefix_len <= length &&
+            memcmp(child->prefix, path, child->prefix_len) == 0) {
+            const route_node_t* found = match_node(child, path + child->prefix_len,
+                                                   length - child->prefix_len, request);
+            if (found) {
+                return found;
+            }
+        }
+    }
 
+    int saved_params = request->param_count;
+    if (node->param_child && length > 0 && *path != '/') {
+        size_t segment = 0;
+        while (segment < length && path[segment] != '/') segment++;
+        push_param(request, node->param_name, node->param_name_len, path, segment);
+        const route_node_t* found = match_node(node->param_child, path + segment,
+                                               length - segment, request);
+        if (found) {
+            return found;
+        }
+        request->param_count = saved_params;
+    }
+
+    if (node->wildcard_child) {
+        push_param(request, node->wildcard_name, node->wildcard_name_len, path, length);
+        return node->wildcard_child;
+    }
+    return NULL;
+}
+
+static const route_node_t* match_path(http_request_t* request) {
+    size_t path_len = strcspn(request->uri, "?");
+    request->param_count = 0;
+    return route_tree ? match_node(route_tree, request->uri, path_len, request) : NULL;
+}
+
+int route_find(http_request_t* request) {
+    const route_node_t* node = match_path(request);
+    request->route = -1;
+    for (int i = 0; node && i < node->route_id_count; i++) {
+        if (strcmp(request->method, routes[node->route_ids[i]].method) == 0) {
+            request->route = node->route_ids[i];
+            break;
+        }
+    }
+    return request->route;
+}
+
+int handle_route(http_request_t* request, http_response_t* response) {
+    int route = request->route == ROUTE_UNMATCHED ? route_find(request) : request->route;
+    if (route >= 0) {
+        if (routes[route].offload && route_offload(request)) {
+            return route;
+        }
+        // Call the registered handler for this route
+        routes[route].handler(request, response);
+        return route;
+    }
+
+    // Walk again to tell an unknown path from a known one with another method
+    const route_node_t* node = match_path(request);
+    if (!node) {
+        // No route found, handle 404
+        handle_not_found(request, response);
+    } else {
+        handle_method_not_allowed(request, node, response);
+    }
+    return -1;
+}
+
+const char* get_route_param(const http_request_t* request, const char* name, size_t* length) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < request->param_count; i++) {
+        const route_param_t* param = &request->params[i];
+        if (param->name_len == name_len && memcmp(param->name, name, name_len) == 0) {
+            *length = param->value_len;
+            return param->value;
+        }
+    }
+    return NULL;
+}
@@ -1,54 +1,248 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/random.h>
 #include "../include/http.h"
+#include "../include/connection.h"
+#include "../include/send_http_response_supplement.h"
 
-void update_headers(int client_fd, http_response_t* response) {
-    // Headers
+// Bodies up to this size are copied next to the headers rather than queued
+// as a separate segment; the copy is cheaper than tracking another buffer
+#define INLINE_BODY_SIZE 2048
+
+const char* get_status_text(int status_code) {
+    switch (status_code) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 411: return "Length Required";
+    case 412: return "Precondition Failed";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+    default:  return "Unknown";
+    }
+}
+
+int format_part_header(char* buffer, size_t size, const http_response_t* response, int index) {
+    const byte_range_t* range = &response->ranges[index];
+    return snprintf(buffer, size,
+                    "\r\n--%s\r\nContent-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    response->range_boundary, response->range_content_type,
+                    (long long)range->offset,
+                    (long long)(range->offset + range->length - 1),
+                    (long long)response->range_complete_length);
+}
+
+int format_parts_end(char* buffer, size_t size, const http_response_t* response) {
+    return snprintf(buffer, size, "\r\n--%s--\r\n", response->range_boundary);
+}
+
+// A fresh boundary for every multipart response: a fixed one could turn up
+// inside a served file and split the body in the wrong places
+static void generate_boundary(char* boundary) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char bytes[BYTERANGES_BOUNDARY_LEN / 2];
+    if (getrandom(bytes, sizeof(bytes), GRND_NONBLOCK) != (ssize_t)sizeof(bytes)) {
+        // No entropy yet, early in boot: distinct per response is what matters
+        static unsigned long long counter = 0;
+        unsigned long long seed = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed ^= ((unsigned long long)ts.tv_sec << 32) ^ (unsigned long long)ts.tv_nsec ^
+                ((unsigned long long)getpid() << 48);
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            bytes[i] = (unsigned char)(seed >> 56);
+        }
+    }
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        boundary[2 * i] = hex[bytes[i] >> 4];
+        boundary[2 * i + 1] = hex[bytes[i] & 0x0f];
+    }
+    boundary[BYTERANGES_BOUNDARY_LEN] = '\0';
+}
+
+void set_byte_ranges(http_response_t* response, const byte_range_t* ranges, int count,
+                     off_t complete_length, const char* content_type) {
+    response->status_code = 206;
+    memcpy(response->ranges, ranges, count * sizeof(byte_range_t));
+    response->range_count = count;
+    response->range_complete_length = complete_length;
+    response->range_content_type = content_type;
+
+    if (count == 1) {
+        http_response_add_headerf(response, "Content-Range", "bytes %lld-%lld/%lld",
+                                  (long long)ranges[0].offset,
+                                  (long long)(ranges[0].offset + ranges[0].length - 1),
+                                  (long long)complete_length);
+        response->body_length = ranges[0].length;
+        return;
+    }
+
+    // The parts carry the real type; the response itself is multipart
+    generate_boundary(response->range_boundary);
+    char multipart_type[64];
+    snprintf(multipart_type, sizeof(multipart_type), "multipart/byteranges; boundary=%s",
+             response->range_boundary);
+    http_response_set_header(response, "Content-Type", multipart_type);
+
+    char part_header[256];
+    size_t length = format_parts_end(part_header, sizeof(part_header), response);
+    for (int i = 0; i < count; i++) {
+        length += format_part_header(part_header, sizeof(part_header), response, i);
+        length += ranges[i].length;
+    }
+    response->body_length = length;
+}
+
+void update_headers(connection_t* conn, http_response_t* response) {
+    // Headers, appended piecewise straight into the output buffer
     for (int i = 0; i < response->header_count; i++) {
-        char header_line[1024];
-        snprintf(header_line, sizeof(header_line), "%s: %s\r\n",
-                response->headers[i][0], response->headers[i][1]);
-        write(client_fd, header_line, strlen(header_line));
+        size_t length;
+        const char* name = http_response_header_name(response, i, &length);
+        connection_write(conn, name, length);
+        connection_write(conn, ": ", 2);
+        const char* value = http_response_header_value(response, i, &length);
+        connection_write(conn, value, length);
+        connection_write(conn, "\r\n", 2);
     }
+    connection_write(conn, response->raw_headers, response->raw_headers_len);
 }
 
-void update_content_length(int client_fd, http_response_t* response) {
-    // Content-Length header if we have a body
-    if (response->body && response->body_length > 0) {
-        char content_length[64];
-        snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", 
-                response->body_length);
-        write(client_fd, content_length, strlen(content_length));
+void update_content_length(connection_t* conn, http_response_t* response) {
+    // 1xx, 204 and 304 responses never have a body (RFC 9112 6.3)
+    int status = response->status_code;
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        return;
+    }
+
+    // A streamed body of unknown length is chunked on a persistent connection
+    // and otherwise runs until the connection closes
+    if (response->stream_producer && response->stream_length < 0) {
+        if (response->keep_alive) {
+            connection_write(conn, "Transfer-Encoding: chunked\r\n", 28);
+        }
+        return;
+    }
+
+    // Otherwise always frame the body, even when empty, so a persistent connection
+    // can tell where the next response starts
+    char content_length[64];
+    int has_body = response->body || response->body_fd >= 0;
+    size_t body_length = has_body ? response->body_length : 0;
+    if (response->stream_producer) {
+        body_length = response->stream_length;
     }
+    int length = snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n",
+                          body_length);
+    connection_write(conn, content_length, length);
 }
 
-void add_headers(int client_fd, http_response_t* response){
-   update_headers(client_fd, response);
-   update_content_length(client_fd, response);
+void update_connection_header(connection_t* conn, http_response_t* response) {
+    // Tell the client whether it may send another request on this connection
+    if (response->keep_alive) {
+        connection_write(conn, "Connection: keep-alive\r\n", 24);
+    } else {
+        connection_write(conn, "Connection: close\r\n", 19);
+    }
+}
+
+void add_headers(connection_t* conn, http_response_t* response){
+   update_headers(conn, response);
+   update_content_length(conn, response);
+   update_connection_header(conn, response);
    // End of headers
-   write(client_fd, "\r\n", 2);
+   connection_write(conn, "\r\n", 2);
 }
 
-void update_status_line(int client_fd, http_response_t* response) {
-    // Update status line based on response code
-    char status_line[256];
-    const char* status_text = "OK";
-    if (response->status_code == 404) status_text = "Not Found";
-    else if (response->status_code == 500) status_text = "Internal Server Error";
-    
-    snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %s\r\n", 
-             response->status_code, status_text);
-    write(client_fd, status_line, strlen(status_line));
+void update_status_line(connection_t* conn, http_response_t* response) {
+    char status_line[128];
+    int length = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %s\r\n",
+                          response->status_code, get_status_text(response->status_code));
+    connection_write(conn, status_line, length);
 }
 
+// Queue length bytes of the body starting at offset. The last slice takes
+// over the body itself; earlier ones copy it or use a duplicate descriptor.
+static void write_body_slice(connection_t* conn, http_response_t* response,
+                             off_t offset, size_t length, int last) {
+    // File bodies are sent later with sendfile(); the connection owns the fd now
+    if (response->body_fd >= 0) {
+        int fd = last ? response->body_fd : fcntl(response->body_fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) {
+            conn->close_after_write = 1;  // cannot frame the rest; end the response here
+            return;
+        }
+        connection_write_file(conn, fd, response->body_offset + offset, length);
+        if (last) {
+            response->body_fd = -1;
+        }
+        return;
+    }
+
+    if (!response->body || length == 0) {
+        return;
+    }
 
+    if (length <= INLINE_BODY_SIZE || !last) {
+        connection_write(conn, response->body + offset, length);
+        return;
+    }
 
-void write_body(int client_fd, http_response_t* response) {
-    // Body
-    if (response->body && response->body_length > 0) {
-        write(client_fd, response->body, response->body_length);
+    // Hand the buffer to the connection; it is released once the socket has it
+    if (response->body_release) {
+        connection_write_ref(conn, response->body + offset, length,
+                             response->body_release, response->body_owner);
+    } else {
+        connection_write_ref(conn, response->body + offset, length, free, response->body);
     }
+    response->body = NULL;
 }
 
+void write_body(connection_t* conn, http_response_t* response) {
+    if (response->stream_producer) {
+        int status = response->status_code;
+        if (!((status >= 100 && status < 200) || status == 204 || status == 304)) {
+            connection_start_stream(conn, response);
+        }
+        return;
+    }
+    if (response->range_count == 0) {
+        write_body_slice(conn, response, 0, response->body_length, 1);
+        return;
+    }
+    if (response->range_count == 1) {
+        write_body_slice(conn, response, response->ranges[0].offset, response->ranges[0].length, 1);
+        return;
+    }
+
+    for (int i = 0; i < response->range_count && !conn->close_after_write; i++) {
+        char part_header[256];
+        int length = format_part_header(part_header, sizeof(part_header), response, i);
+        connection_write(conn, part_header, length);
+        write_body_slice(conn, response, response->ranges[i].offset, response->ranges[i].length,
+                         i == response->range_count - 1);
+    }
+    char end[64];
+    connection_write(conn, end, format_parts_end(end, sizeof(end), response));
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,31 +24,56 @@ int validate_file(const char* file_path, struct stat* file_stat) {
     return 0; // File is valid
 }
 
-// Read file content into memory
-void* read_file_content(const char* file_path, size_t file_size, ssize_t* bytes_read) {
-    // Open file
-    int fd = open(file_path, O_RDONLY);
+// Open a regular file for sending; returns the descriptor or -1
+int open_static_file(const char* file_path, struct stat* file_stat) {
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
-        return NULL; // Cannot open file
+        return -1; // File not found
     }
     
-    // Allocate buffer for file content
-    void* content = malloc(file_size);
-    if (!content) {
+    if (fstat(fd, file_stat) != 0 || !S_ISREG(file_stat->st_mode)) {
         close(fd);
-        return NULL; // Memory allocation failed
+        return -1; // Not a regular file
     }
     
-    // Read file content
-    *bytes_read = read(fd, content, file_size);
-    close(fd);
+    return fd;
+}
+
+// Read exactly file_size bytes from an open file into a new buffer
+void* read_file_descriptor(int fd, size_t file_size) {
+    // Allocate buffer for file content (at least one byte so an empty file
+    // still yields a buffer)
+    char* content = malloc(file_size ? file_size : 1);
+    if (!content) {
+        return NULL; // Memory allocation failed
+    }
     
-    if (*bytes_read != (ssize_t)file_size) {
-        free(content);
-        return NULL; // Read error
+    size_t total = 0;
+    while (total < file_size) {
+        ssize_t n = pread(fd, content + total, file_size - total, total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(content);
+            return NULL; // Read error or file shrank
+        }
+        total += n;
     }
     
     return content;
 }
 
-
+// Read file content into memory
+void* read_file_content(const char* file_path, size_t file_size, ssize_t* bytes_read) {
+    // Open file
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL; // Cannot open file
+    }
+    
+    void* content = read_file_descriptor(fd, file_size);
+    close(fd);
+    *bytes_read = content ? (ssize_t)file_size : -1;
+    return content;
+}
@@ -4,161 +4,240 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include "../include/http.h"
 #include "../include/router.h"
 #include "../include/file_server.h"
+#include "../include/connection.h"
+#include "../include/config.h"
+#include "../include/server.h"
+#include "../include/metrics.h"
+#include "../include/access_log.h"
+#include "../include/event_loop.h"
+#include "../include/http2.h"
+#include "../include/send_http_response_supplement.h"
 
-#define PORT 8080
-#define BUFFER_SIZE 4096
+#define UPLOAD_MAX_BODY_SIZE (64 * 1024 * 1024)
 
-void handle_method_not_allowed(http_response_t* response) {
-    response->status_code = 405; // Method not allowed
-    response->body = strdup("Method not allowed");
-    response->body_length = strlen(response->body);
-    strcpy(response->headers[0][0], "Content-Type");
-    strcpy(response->headers[0][1], "text/plain");
-    response->header_count = 1;
+void handle_error_response(http_response_t* response, int status) {
+    response->status_code = status;
+    response->body = strdup(get_status_text(status));
+    response->body_length = response->body ? strlen(response->body) : 0;
+    http_response_add_header(response, "Content-Type", "text/plain");
 }
 
-void handle_bad_request(http_response_t* response) {
-    response->status_code = 400; // Bad request
-    response->body = strdup("Bad request");
-    response->body_length = strlen(response->body);
-    strcpy(response->headers[0][0], "Content-Type");
-    strcpy(response->headers[0][1], "text/plain");
-    response->header_count = 1;
-}
-
-void handle_good_request(http_request_t* request, http_response_t* response) {
-    printf("Method: %s\n", request->method);
-    printf("URI: %s\n", request->uri);
-    printf("Version: %s\n", request->version);
-    printf("Headers: %d\n", request->header_count);
-    
-    // Simple routing
-    if (strcmp(request->method, "GET") == 0) {
-        printf("Calling handle_route for GET request\n");
-        handle_route(request, response);
-        printf("Returned from handle_route\n");
-
-    } else {
-        handle_method_not_allowed(response);
-    }
+// Returns the index of the route that handled the request, or -1
+int handle_good_request(http_request_t* request, http_response_t* response) {
+    // The router dispatches on method too, answering 405 for known paths
+    return handle_route(request, response);
 }
 void handle_api_time_request(http_request_t* request, http_response_t* response) {
-    (void)request; // Unused parameter
-    
     // Dynamic content example
     time_t now = time(NULL);
-    char* time_str = ctime(&now);
-    time_str[strlen(time_str) - 1] = '\0'; // Remove newline
+    // ctime()'s format, but into our own buffer: ctime() shares one between
+    // the worker and pool threads
+    struct tm local;
+    char time_str[64];
+    localtime_r(&now, &local);
+    strftime(time_str, sizeof(time_str), "%a %b %e %H:%M:%S %Y", &local);
     
-    char json_response[256];
-    snprintf(json_response, sizeof(json_response), 
-            "{\"current_time\": \"%s\"}", time_str);
+    char* json_response = route_alloc(request, 256);
+    int length = json_response ? snprintf(json_response, 256,
+                                          "{\"current_time\": \"%s\"}", time_str) : 0;
     
     response->status_code = 200;
-    response->body = strdup(json_response);
-    response->body_length = strlen(response->body);
-    strcpy(response->headers[0][0], "Content-Type");
-    strcpy(response->headers[0][1], "application/json");
-    response->header_count = 1;
+    route_set_body(request, response, json_response, length);
+    http_response_add_header(response, "Content-Type", "application/json");
 }   
 
-void handle_request(int client_fd, const char* raw_request) {
-    http_request_t request;
-    http_response_t response;
-    init_http_response(&response);
-    if (parse_http_request(raw_request, &request) == 0) {
-        handle_good_request(&request, &response);
-    } else {
-        handle_bad_request(&response);
+// Streaming response example: the lines are generated as the client takes them
+#define STREAM_EXAMPLE_LINES 100000
+#define STREAM_EXAMPLE_BATCH 256
+
+static int produce_stream_lines(http_stream_t* stream, void* context) {
+    int* next_line = context;
+    for (int i = 0; i < STREAM_EXAMPLE_BATCH && *next_line < STREAM_EXAMPLE_LINES; i++) {
+        if (http_stream_printf(stream, "{\"line\": %d}\n", *next_line) != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        (*next_line)++;
     }
-    send_http_response(client_fd, &response);
-    free_http_request(&request);
-    free_http_response(&response);
+    return *next_line < STREAM_EXAMPLE_LINES ? HTTP_STREAM_MORE : HTTP_STREAM_DONE;
 }
 
-void setup_routes() {
-    // Register routes
-    register_route("/", handle_home_page);
-    register_route("/hello", handle_hello_page);
-    register_route("/api/time", handle_api_time_request);
+void handle_api_stream_request(http_request_t* request, http_response_t* response) {
+    int* next_line = route_alloc(request, sizeof(int));
+    if (!next_line) {
+        handle_error_response(response, 500);
+        return;
+    }
+    *next_line = 0;
+    response->status_code = 200;
+    http_response_add_header(response, "Content-Type", "application/x-ndjson");
+    http_response_stream(response, produce_stream_lines, next_line,
+                         request->arena ? NULL : free, -1);
+}
 
-    register_route("/index.html", serve_static_file_handler);
-    register_route("/css/style.css", serve_static_file_handler);
-    register_route("/js/script.js", serve_static_file_handler);
-    register_route("/images/logo.png", serve_static_file_handler);
+// Streaming upload example: the body is counted and hashed as it arrives
+// and never held in memory
+typedef struct {
+    unsigned long long bytes;
+    uint32_t hash;   // FNV-1a
+} upload_state_t;
 
+static int handle_upload_body(http_request_t* request, const char* data, size_t length) {
+    upload_state_t* state = request->body_context;
+    if (!data) {
+        return 0;  // Abandoned; the state lives in the request arena
+    }
+    if (!state) {
+        state = route_alloc(request, sizeof(upload_state_t));
+        if (!state) {
+            return 500;
+        }
+        state->bytes = 0;
+        state->hash = 2166136261u;
+        request->body_context = state;
+    }
+    for (size_t i = 0; i < length; i++) {
+        state->hash = (state->hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    state->bytes += length;
+    return 0;
 }
 
+void handle_upload_request(http_request_t* request, http_response_t* response) {
+    const upload_state_t* state = request->body_context;
+    char* json_response = route_alloc(request, 128);
+    int length = json_response ? snprintf(json_response, 128,
+                                          "{\"bytes\": %llu, \"fnv1a\": \"%08x\"}",
+                                          state ? state->bytes : 0ULL,
+                                          state ? state->hash : 2166136261u) : 0;
 
+    response->status_code = 200;
+    route_set_body(request, response, json_response, length);
+    http_response_add_header(response, "Content-Type", "application/json");
+}
 
-int main() {
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
-    
-    printf("Starting server on port %d...\n", PORT);
-
-    printf("Raw request first 100 chars: %.100s\n", buffer);   
-    // Step 1: Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Socket creation failed");
-        exit(1);
+static void record_request(connection_t* conn, const http_request_t* request, int route,
+                           int status_code, size_t bytes, uint64_t started) {
+    uint64_t duration = metrics_now_ns() - started;
+    metrics_record_request(conn->loop->metrics, route < 0 ? METRICS_UNROUTED : route,
+                           status_code, bytes, duration);
+    access_log_record(conn->loop->access_log, conn->fd, request, status_code, bytes, duration);
+}
+
+// Queue the response, account for it and release both sides
+static void finish_request(connection_t* conn, http_request_t* request,
+                           http_response_t* response, int route, uint64_t started) {
+    if (request && request->stream) {
+        // Framed on its stream; the connection carries on regardless
+        http2_send_response(conn, request, response);
+    } else {
+        send_http_response(conn, response);
+        if (!response->keep_alive) {
+            conn->close_after_write = 1;
+        }
     }
-    
-    // Step 2: Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-    
-    // Step 3: Bind socket to address
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        exit(1);
+    record_request(conn, request, route, response->status_code, response->body_length, started);
+    if (request) {
+        free_http_request(request);
     }
-    
-    // Step 4: Listen for connections
-    if (listen(server_fd, 5) < 0) {
-        perror("Listen failed");
-        close(server_fd);
-        exit(1);
+    free_http_response(response);
+}
+
+// A route with a fixed answer skips the handler and the response object
+static void finish_prebuilt_request(connection_t* conn, http_request_t* request, int route,
+                                    uint64_t started) {
+    const http_prebuilt_t* prebuilt = routes[route].prebuilt;
+    if (request->stream) {
+        // Its serialized form is HTTP/1.1; HTTP/2 takes the fields instead
+        http_response_t response;
+        init_http_response(&response);
+        http_prebuilt_fill(prebuilt, &response);
+        connection_keep_alive(conn, request);
+        finish_request(conn, request, &response, route, started);
+        return;
     }
-    
-    printf("Server listening on port %d\n", PORT);
-    setup_routes();
-    while (1) {
-        printf("Waiting for connection...\n");
-        
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd < 0) {
-            perror("Accept failed");
-            continue;
-        }
-        
-        printf("Client connected from %s\n", inet_ntoa(client_addr.sin_addr));
-        
-        // Read HTTP request
-        int bytes_read = read(client_fd, buffer, BUFFER_SIZE - 1);
-        if (bytes_read > 0) {
-            buffer[bytes_read] = '\0';
-            printf("Raw request:\n%s\n", buffer);
-            
-            handle_request(client_fd, buffer);
-        }
-        
-        close(client_fd);
-        printf("Client disconnected\n");
+    int keep_alive = connection_keep_alive(conn, request);
+    if (http_prebuilt_send(conn, prebuilt, keep_alive) != 0 || !keep_alive) {
+        conn->close_after_write = 1;
     }
-    
+    record_request(conn, request, route, http_prebuilt_status(prebuilt),
+                   http_prebuilt_body_length(prebuilt), started);
+    free_http_request(request);
+}
+
+void complete_request(connection_t* conn, http_request_t* request, http_response_t* response,
+                      int route, uint64_t started) {
+    response->keep_alive = connection_keep_alive(conn, request);
+    if (response->stream_producer && response->stream_length < 0 &&
+        strcmp(request->version, "HTTP/1.1") != 0) {
+        // No chunked coding before HTTP/1.1: the body ends with the connection
+        response->keep_alive = 0;
+    }
+    finish_request(conn, request, response, route, started);
+}
+
+int handle_request(connection_t* conn, http_request_t* request) {
+    uint64_t started = metrics_now_ns();
+    int route = request->route == ROUTE_UNMATCHED ? route_find(request) : request->route;
+    if (route >= 0 && routes[route].prebuilt) {
+        finish_prebuilt_request(conn, request, route, started);
+        return 0;
+    }
+
+    http_response_t response;
+    init_http_response(&response);
+    route = handle_good_request(request, &response);
+    if (request->offload_state == ROUTE_OFFLOAD_REQUESTED) {
+        free_http_response(&response);
+        return 1;
+    }
+    complete_request(conn, request, &response, route, started);
     return 0;
 }
 
+int handle_offloaded_request(http_request_t* request, http_response_t* response) {
+    request->offload_state = ROUTE_ON_POOL;
+    return handle_good_request(request, response);
+}
+
+void handle_request_error(connection_t* conn, http_request_t* request, int status) {
+    uint64_t started = metrics_now_ns();
+    http_response_t response;
+    init_http_response(&response);
+    handle_error_response(&response, status);
+    response.keep_alive = 0;  // We cannot tell where the next request would start
+    finish_request(conn, request, &response, request ? request->route : -1, started);
+}
+
+int setup_routes(void) {
+    // Register routes
+    // Fixed answers, serialized once
+    static const char home_page[] = "<html><body><h1>Welcome to our HTTP Server!</h1></body></html>";
+    static const char hello_page[] = "Hello, World!";
+    static const char health[] = "{\"status\": \"ok\"}";
+    http_prebuilt_t* home = http_prebuilt_create(200, "text/html", home_page, sizeof(home_page) - 1, 0);
+    http_prebuilt_t* hello = http_prebuilt_create(200, "text/plain", hello_page, sizeof(hello_page) - 1, 0);
+    http_prebuilt_t* healthy = http_prebuilt_create(200, "application/json", health, sizeof(health) - 1,
+                                                    HTTP_PREBUILT_DATE);
+    if (!home || !hello || !healthy) {
+        return -1;
+    }
+    register_prebuilt_route("GET", "/", home);
+    register_prebuilt_route("GET", "/hello", hello);
+    register_prebuilt_route("GET", "/health", healthy);
+    register_route("/api/time", handle_api_time_request);
+    register_route("/metrics", handle_metrics_request);
+    register_route("/api/stream", handle_api_stream_request);
+    register_body_route("POST", "/api/upload", handle_upload_request, handle_upload_body,
+                        UPLOAD_MAX_BODY_SIZE);
+
+    // The document root is served under /static/, and any other path falls
+    // back to it so top-level files (/index.html, /css/style.css) keep working
+    register_route("/static/*", serve_static_file_handler);
+    register_route("/*", serve_static_file_handler);
+
+    return router_compile();
+}
+
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/thread_pool.h"
+#include "../include/event_loop.h"
+
+// Each thread owns a deque of tasks, guarded by its own lock. Submissions
+// are spread round-robin onto the back of the deques. The owner pops the
+// newest task, whose request is still warm in cache; a thread with nothing
+// to do steals the oldest task from another deque, so one slow handler does
+// not hold up the tasks queued behind it and nothing waits for long.
+typedef struct {
+    pool_task_t** tasks;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} task_deque_t;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    pthread_mutex_t lock;    // guards deque and parked
+    pthread_cond_t wakeup;   // signalled when the thread is parked and has work
+    task_deque_t deque;
+    int parked;              // waiting on wakeup; read without the lock by submitters
+} pool_thread_t;
+
+static pool_thread_t* pool_threads = NULL;
+static int pool_size = 0;
+static unsigned int next_deque = 0;
+static int stopping = 0;
+
+static int deque_push(task_deque_t* deque, pool_task_t* task) {
+    if (deque->count == deque->capacity) {
+        size_t new_cap = deque->capacity ? deque->capacity * 2 : DEFAULT_POOL_DEQUE_SIZE;
+        pool_task_t** tasks = malloc(new_cap * sizeof(pool_task_t*));
+        if (!tasks) {
+            return -1;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity = new_cap;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    deque->count++;
+    return 0;
+}
+
+// The owner's end: newest first
+static pool_task_t* deque_pop(task_deque_t* deque) {
+    if (deque->count == 0) {
+        return NULL;
+    }
+    deque->count--;
+    return deque->tasks[(deque->head + deque->count) % deque->capacity];
+}
+
+// The thieves' end: oldest first
+static pool_task_t* deque_steal(task_deque_t* deque) {
+    if (deque->count == 0) {
+        return NULL;
+    }
+    pool_task_t* task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+    return task;
+}
+
+static pool_task_t* steal_task(pool_thread_t* self) {
+    for (int i = 1; i < pool_size; i++) {
+        pool_thread_t* victim = &pool_threads[(self->index + i) % pool_size];
+        pthread_mutex_lock(&victim->lock);
+        pool_task_t* task = deque_steal(&victim->deque);
+        pthread_mutex_unlock(&victim->lock);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// The next task for self: its own newest, else one stolen, else it parks
+// until a task is pushed onto its deque or it is woken to steal one.
+// Returns NULL once the pool is stopping.
+static pool_task_t* next_task(pool_thread_t* self) {
+    while (1) {
+        pthread_mutex_lock(&self->lock);
+        pool_task_t* task = deque_pop(&self->deque);
+        pthread_mutex_unlock(&self->lock);
+        if (task) {
+            return task;
+        }
+        if ((task = steal_task(self)) != NULL) {
+            return task;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        // Submissions to this deque are seen under its lock, so none is missed
+        if (self->deque.count == 0 && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&self->parked, 1, __ATOMIC_RELAXED);
+            pthread_cond_wait(&self->wakeup, &self->lock);
+            __atomic_store_n(&self->parked, 0, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&self->lock);
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+    }
+}
+
+static void* pool_thread_main(void* arg) {
+    pool_thread_t* self = arg;
+    pool_task_t* task;
+    while ((task = next_task(self)) != NULL) {
+        task->run(task);
+        event_loop_post(task->loop, task);
+    }
+    return NULL;
+}
+
+// Wake a thread if it is parked; returns whether it was
+static int wake_thread(pool_thread_t* thread) {
+    int woken = 0;
+    pthread_mutex_lock(&thread->lock);
+    if (thread->parked) {
+        __atomic_store_n(&thread->parked, 0, __ATOMIC_RELAXED);  // Not woken twice for one task
+        pthread_cond_signal(&thread->wakeup);
+        woken = 1;
+    }
+    pthread_mutex_unlock(&thread->lock);
+    return woken;
+}
+
+int thread_pool_start(int threads) {
+    if (threads <= 0) {
+        return 0;
+    }
+    pool_threads = calloc(threads, sizeof(pool_thread_t));
+    if (!pool_threads) {
+        return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        pool_threads[i].index = i;
+        pthread_mutex_init(&pool_threads[i].lock, NULL);
+        pthread_cond_init(&pool_threads[i].wakeup, NULL);
+    }
+    pool_size = threads;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool_threads[i].thread, NULL, pool_thread_main, &pool_threads[i]) != 0) {
+            perror("pthread_create failed");
+            pool_size = i;
+            thread_pool_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void thread_pool_stop(void) {
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < pool_size; i++) {
+        pthread_mutex_lock(&pool_threads[i].lock);
+        pthread_cond_signal(&pool_threads[i].wakeup);
+        pthread_mutex_unlock(&pool_threads[i].lock);
+    }
+    for (int i = 0; i < pool_size; i++) {
+        pthread_join(pool_threads[i].thread, NULL);
+        free(pool_threads[i].deque.tasks);
+        pthread_cond_destroy(&pool_threads[i].wakeup);
+        pthread_mutex_destroy(&pool_threads[i].lock);
+    }
+    free(pool_threads);
+    pool_threads = NULL;
+    pool_size = 0;
+}
+
+int thread_pool_running(void) {
+    return pool_size > 0;
+}
+
+int thread_pool_submit(pool_task_t* task) {
+    if (pool_size == 0) {
+        return -1;
+    }
+    unsigned int slot = __atomic_fetch_add(&next_deque, 1, __ATOMIC_RELAXED) % pool_size;
+    pool_thread_t* owner = &pool_threads[slot];
+
+    pthread_mutex_lock(&owner->lock);
+    if (deque_push(&owner->deque, task) != 0) {
+        pthread_mutex_unlock(&owner->lock);
+        return -1;
+    }
+    int owner_parked = owner->parked;
+    if (owner_parked) {
+        __atomic_store_n(&owner->parked, 0, __ATOMIC_RELAXED);
+        pthread_cond_signal(&owner->wakeup);
+    }
+    pthread_mutex_unlock(&owner->lock);
+
+    // The owner is busy: let an idle thread steal the task rather than wait
+    if (!owner_parked) {
+        for (int i = 1; i < pool_size; i++) {
+            pool_thread_t* thief = &pool_threads[(slot + i) % pool_size];
+            if (__atomic_load_n(&thief->parked, __ATOMIC_RELAXED) && wake_thread(thief)) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <stddef.h>
+#include "../include/timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define MAX_DELTA ((1ull << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            timer_entry_t* head = &wheel->slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+static void unlink_timer(timer_entry_t* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// The lowest level whose span covers the distance to the deadline, and its
+// slot there. A deadline of now itself lands in the slot being expired.
+static void place_timer(timer_wheel_t* wheel, timer_entry_t* timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << LEVEL_SHIFT(level + 1))) {
+        level++;
+    }
+    timer_entry_t* head = &wheel->slots[level][(timer->expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void timer_wheel_schedule(timer_wheel_t* wheel, timer_entry_t* timer, uint64_t expires) {
+    if (timer_armed(timer)) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;  // This tick's slot has already been expired
+    } else if (expires - wheel->now > MAX_DELTA) {
+        expires = wheel->now + MAX_DELTA;
+    }
+    timer->expires = expires;
+    place_timer(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, timer_entry_t* timer) {
+    if (timer_armed(timer)) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+// Hand a higher-level slot's entries down now that its span has begun
+static void cascade(timer_wheel_t* wheel, int level) {
+    timer_entry_t* head = &wheel->slots[level][(wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK];
+    timer_entry_t* timer = head->next;
+    head->next = head;
+    head->prev = head;
+    while (timer != head) {
+        timer_entry_t* next = timer->next;
+        place_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t now, timer_expire_t expire, void* context) {
+    if (wheel->count == 0) {
+        // Nothing to visit on the way
+        if (now > wheel->now) {
+            wheel->now = now;
+        }
+        return;
+    }
+
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // Every level whose slot boundary this tick crosses, highest first
+        int top = 0;
+        while (top < TIMER_WHEEL_LEVELS - 1 &&
+               (wheel->now & ((1ull << LEVEL_SHIFT(top + 1)) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            cascade(wheel, level);
+        }
+
+        // One at a time, since a callback may cancel or arm other timers
+        timer_entry_t* head = &wheel->slots[0][wheel->now & SLOT_MASK];
+        while (head->next != head) {
+            timer_entry_t* timer = head->next;
+            unlink_timer(timer);
+            wheel->count--;
+            expire(timer, context);
+        }
+        if (wheel->count == 0) {
+            wheel->now = now;
+            return;
+        }
+    }
+}
+
+int timer_wheel_timeout_ms(const timer_wheel_t* wheel) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    // The next occupied level-0 slot before the next cascade, or that cascade
+    uint64_t ticks = 1;
+    for (; ticks < TIMER_WHEEL_SLOTS; ticks++) {
+        uint64_t tick = wheel->now + ticks;
+        const timer_entry_t* head = &wheel->slots[0][tick & SLOT_MASK];
+        if (head->next != head || (tick & SLOT_MASK) == 0) {
+            break;
+        }
+    }
+    return (int)(ticks * TIMER_WHEEL_TICK_MS);
+}
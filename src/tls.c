@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../include/tls.h"
+#include "../include/connection.h"
+#include "../include/event_loop.h"
+#include "../include/metrics.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static SSL_CTX* server_ctx = NULL;
+
+// Protocols offered through ALPN, in order of preference
+static const unsigned char alpn_protocols[] = "\x02h2\x08http/1.1";
+
+static int select_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_len,
+                       const unsigned char* in, unsigned int in_len, void* arg) {
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char**)out, out_len, alpn_protocols,
+                              sizeof(alpn_protocols) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;  // Carry on without ALPN rather than fail
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(const server_config_t* config) {
+    if (!config->tls_cert && !config->tls_key) {
+        return 0;
+    }
+    if (!config->tls_cert || !config->tls_key) {
+        fprintf(stderr, "TLS needs both a certificate (-c) and a private key (-K)\n");
+        return -1;
+    }
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // Sessions are resumed rather than renegotiated; a client closing without
+    // close_notify is an ordinary EOF. kTLS is taken whenever the kernel has it.
+    long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+
+    // The output queue retries a blocked write at a moved, possibly longer
+    // buffer, and takes partial writes like writev(); idle sessions give
+    // their record buffers back
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    // Resumption: by session id from the shared cache, or from a ticket
+    // sealed with keys the context made at startup, so any worker can take
+    // a session another one issued
+    static const unsigned char session_context[] = "http-server";
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, config->tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, config->tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        fprintf(stderr, "Could not load TLS certificate %s and key %s\n", config->tls_cert,
+                config->tls_key);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    server_ctx = ctx;
+    return 0;
+}
+
+int tls_enabled(void) {
+    return server_ctx != NULL;
+}
+
+void tls_shutdown(void) {
+    SSL_CTX_free(server_ctx);
+    server_ctx = NULL;
+}
+
+int tls_attach(connection_t* conn) {
+    SSL* ssl = SSL_new(server_ctx);
+    if (!ssl) {
+        ERR_clear_error();
+        return -1;
+    }
+    if (SSL_set_fd(ssl, conn->fd) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return -1;
+    }
+    SSL_set_accept_state(ssl);
+    conn->tls = ssl;
+    return 0;
+}
+
+// Map a failed SSL_* call onto the errno the plain syscall would have left
+static ssize_t tls_failed(SSL* ssl, int result) {
+    switch (SSL_get_error(ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) {
+            errno = EIO;
+        }
+        break;
+    default:
+        errno = EIO;
+        break;
+    }
+    int error = errno;
+    ERR_clear_error();
+    errno = error;
+    return -1;
+}
+
+int tls_handshake(connection_t* conn) {
+    SSL* ssl = conn->tls;
+    errno = 0;
+    int result = SSL_do_handshake(ssl);
+    if (result != 1) {
+        if (tls_failed(ssl, result) < 0 && errno == EAGAIN) {
+            return 0;
+        }
+        metrics_tls_handshake(conn->loop->metrics, METRICS_TLS_FAILED);
+        return -1;
+    }
+
+    conn->tls_ready = 1;
+#ifndef OPENSSL_NO_KTLS
+    conn->tls_ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0;
+#endif
+    metrics_tls_handshake(conn->loop->metrics,
+                          SSL_session_reused(ssl) ? METRICS_TLS_RESUMED : METRICS_TLS_FULL);
+    if (conn->tls_ktls) {
+        metrics_tls_handshake(conn->loop->metrics, METRICS_TLS_KTLS);
+    }
+    return 1;
+}
+
+ssize_t tls_read(connection_t* conn, void* buf, size_t length) {
+    errno = 0;
+    int n = SSL_read(conn->tls, buf, length > INT32_MAX ? INT32_MAX : (int)length);
+    return n > 0 ? n : tls_failed(conn->tls, n);
+}
+
+static ssize_t tls_write(connection_t* conn, const void* data, size_t length) {
+    errno = 0;
+    int n = SSL_write(conn->tls, data, length > INT32_MAX ? INT32_MAX : (int)length);
+    if (n > 0) {
+        return n;
+    }
+    ssize_t result = tls_failed(conn->tls, n);
+    if (result == 0) {
+        errno = EPIPE;  // close_notify while we were still sending
+        return -1;
+    }
+    return result;
+}
+
+// Every SSL_write() is at least one record, so small segments (headers,
+// chunk framing) are gathered into one record's worth first
+ssize_t tls_writev(connection_t* conn, const struct iovec* iov, int iov_count) {
+    if (iov_count == 1 || iov[0].iov_len >= TLS_RECORD_SIZE) {
+        return tls_write(conn, iov[0].iov_base, iov[0].iov_len);
+    }
+    char record[TLS_RECORD_SIZE];
+    size_t length = 0;
+    for (int i = 0; i < iov_count && length < sizeof(record); i++) {
+        size_t take = iov[i].iov_len;
+        if (take > sizeof(record) - length) {
+            take = sizeof(record) - length;
+        }
+        memcpy(record + length, iov[i].iov_base, take);
+        length += take;
+    }
+    return tls_write(conn, record, length);
+}
+
+ssize_t tls_sendfile(connection_t* conn, int fd, off_t offset, size_t length) {
+#ifndef OPENSSL_NO_KTLS
+    if (conn->tls_ktls) {
+        errno = 0;
+        ossl_ssize_t n = SSL_sendfile(conn->tls, fd, offset, length, 0);
+        if (n > 0) {
+            return n;
+        }
+        if (n == 0) {
+            errno = EIO;  // File shrank under us
+            return -1;
+        }
+        return tls_failed(conn->tls, (int)n);
+    }
+#endif
+    // Without kTLS the bytes have to pass through user space to be encrypted
+    char record[TLS_RECORD_SIZE];
+    if (length > sizeof(record)) {
+        length = sizeof(record);
+    }
+    ssize_t got = pread(fd, record, length, offset);
+    if (got <= 0) {
+        if (got == 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    return tls_write(conn, record, (size_t)got);
+}
+
+int tls_alpn_is_h2(connection_t* conn) {
+    const unsigned char* protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(conn->tls, &protocol, &length);
+    return length == 2 && memcmp(protocol, "h2", 2) == 0;
+}
+
+void tls_detach(connection_t* conn) {
+    if (!conn->tls) {
+        return;
+    }
+    // Best effort: a full socket just means the client misses close_notify
+    if (conn->tls_ready && conn->fd >= 0) {
+        SSL_shutdown(conn->tls);
+    }
+    ERR_clear_error();
+    SSL_free(conn->tls);
+    conn->tls = NULL;
+}
+
+#else
+
+int tls_init(const server_config_t* config) {
+    if (config->tls_cert || config->tls_key) {
+        fprintf(stderr, "TLS was asked for, but the server was built without OpenSSL\n");
+        return -1;
+    }
+    return 0;
+}
+
+int tls_enabled(void) {
+    return 0;
+}
+
+void tls_shutdown(void) {
+}
+
+int tls_attach(connection_t* conn) {
+    (void)conn;
+    return -1;
+}
+
+int tls_handshake(connection_t* conn) {
+    (void)conn;
+    return -1;
+}
+
+ssize_t tls_read(connection_t* conn, void* buf, size_t length) {
+    (void)conn;
+    (void)buf;
+    (void)length;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_writev(connection_t* conn, const struct iovec* iov, int iov_count) {
+    (void)conn;
+    (void)iov;
+    (void)iov_count;
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tls_sendfile(connection_t* conn, int fd, off_t offset, size_t length) {
+    (void)conn;
+    (void)fd;
+    (void)offset;
+    (void)length;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int tls_alpn_is_h2(connection_t* conn) {
+    (void)conn;
+    return 0;
+}
+
+void tls_detach(connection_t* conn) {
+    (void)conn;
+}
+
+#endif
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "../include/uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags, void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Multishot receive has no probe bit of its own; it arrived in the same
+// release as zero-copy send, which does
+static int uring_supported(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (!probe) {
+        return 0;
+    }
+    int supported = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                    probe->last_op >= IORING_OP_SEND_ZC &&
+                    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+int uring_init(uring_t* ring, unsigned int entries) {
+    memset(ring, 0, sizeof(uring_t));
+
+    // Room for plenty of multishot completions per submission, and the
+    // kernel defers the task work of completions to our next wait
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    const unsigned int required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required || !uring_supported(ring->fd)) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->features = params.features;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Submission slots map one to one onto sqes, so the array never changes
+    for (unsigned int i = 0; i <= ring->sq_mask; i++) {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+}
+
+void uring_destroy(uring_t* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Make the filled-in entries visible to the kernel and hand them over
+static int uring_enter(uring_t* ring, unsigned int min_complete, unsigned int flags,
+                       void* arg, size_t arg_size) {
+    unsigned int tail = *ring->sq_tail + ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+    unsigned int to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static unsigned int uring_sq_used(uring_t* ring) {
+    unsigned int tail = *ring->sq_tail + ring->sq_pending;
+    return tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int uring_reserve(uring_t* ring, unsigned int count) {
+    if (uring_sq_used(ring) + count <= ring->sq_mask + 1) {
+        return 0;
+    }
+    // Full: push what is queued so far to make room
+    if (uring_enter(ring, 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EBUSY) {
+        return -1;
+    }
+    return uring_sq_used(ring) + count <= ring->sq_mask + 1 ? 0 : -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    if (uring_reserve(ring, 1) != 0) {
+        return NULL;
+    }
+    unsigned int tail = *ring->sq_tail + ring->sq_pending;
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t* ring, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    int result = uring_enter(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                             &arg, sizeof(arg));
+    if (result < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY)) {
+        return 0;  // Nothing to wait for after all, or completions to reap first
+    }
+    return result < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+    unsigned int head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t* ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(uring_t* ring, uring_buf_ring_t* buf_ring, uint16_t group,
+                        unsigned int entries, unsigned int buffer_size) {
+    memset(buf_ring, 0, sizeof(uring_buf_ring_t));
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+    void* mem = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    buf_ring->ring = mem;
+    buf_ring->buffers = malloc((size_t)entries * buffer_size);
+    buf_ring->entries = entries;
+    buf_ring->buffer_size = buffer_size;
+    buf_ring->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (!buf_ring->buffers ||
+        sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        free(buf_ring->buffers);
+        munmap(mem, ring_size);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < entries; i++) {
+        uring_buf_ring_recycle(buf_ring, i);
+    }
+    return 0;
+}
+
+void uring_buf_ring_destroy(uring_t* ring, uring_buf_ring_t* buf_ring) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = buf_ring->group;
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(buf_ring->ring, buf_ring->entries * sizeof(struct io_uring_buf));
+    free(buf_ring->buffers);
+}
+
+void uring_buf_ring_recycle(uring_buf_ring_t* buf_ring, unsigned int id) {
+    struct io_uring_buf* buf = &buf_ring->ring->bufs[buf_ring->tail & (buf_ring->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(buf_ring, id);
+    buf->len = buf_ring->buffer_size;
+    buf->bid = (uint16_t)id;
+    buf_ring->tail++;
+    // The tail shares memory with the first entry's reserved field
+    __atomic_store_n(&buf_ring->ring->tail, buf_ring->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "../include/uring_loop.h"
+#include "../include/event_loop.h"
+#include "../include/connection.h"
+
+#ifdef HAVE_URING
+#include "../include/uring.h"
+
+// The low bits of user_data say what completed; the rest is the connection
+// or, for the listener and the completion eventfd, the loop itself
+enum {
+    URING_OP_IGNORE = 0,
+    URING_OP_ACCEPT,
+    URING_OP_COMPLETIONS,
+    URING_OP_RECV,
+    URING_OP_SEND_MEMORY,
+    URING_OP_FILE_READ,
+    URING_OP_FILE_SEND,
+};
+#define URING_OP_MASK 7
+
+typedef struct uring_loop {
+    uring_t ring;
+    uring_buf_ring_t buffers;
+    int accept_armed;
+    int completions_armed;
+    connection_t* starved;       // connections waiting for buffers
+} uring_loop_t;
+
+// The memory a send chain refers to until it completes
+typedef struct uring_send {
+    struct msghdr msg;
+    struct iovec iov[CONN_MAX_IOVECS];
+    size_t memory_length;
+    char* bounce;                // file bytes on their way to the socket
+    size_t file_length;          // bytes asked of the read
+    int file_read;
+    int pending;                 // operations of the chain not yet completed
+} uring_send_t;
+
+static uint64_t uring_tag(void* pointer, int op) {
+    return (uint64_t)(uintptr_t)pointer | op;
+}
+
+static int uring_arm_accept(uring_loop_t* ring, event_loop_t* loop) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_tag(loop, URING_OP_ACCEPT);
+    ring->accept_armed = 1;
+    return 0;
+}
+
+static int uring_arm_completions(uring_loop_t* ring, event_loop_t* loop) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->completion_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_tag(loop, URING_OP_COMPLETIONS);
+    ring->completions_armed = 1;
+    return 0;
+}
+
+static int uring_arm_recv(connection_t* conn) {
+    uring_loop_t* ring = conn->loop->uring;
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring->buffers.group;
+    sqe->user_data = uring_tag(conn, URING_OP_RECV);
+    conn->ring.recv_armed = 1;
+    conn->ring.ops++;
+    return 0;
+}
+
+// Stop a connection that is not keeping up from taking every buffer
+static void uring_pause_recv(connection_t* conn) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&conn->loop->uring->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_tag(conn, URING_OP_RECV);
+    sqe->user_data = URING_OP_IGNORE;
+    conn->ring.recv_cancelling = 1;
+}
+
+void uring_loop_stop_accepting(event_loop_t* loop) {
+    uring_loop_t* ring = loop->uring;
+    if (!ring->accept_armed) {
+        return;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_tag(loop, URING_OP_ACCEPT);
+    sqe->user_data = URING_OP_IGNORE;
+}
+
+struct uring_loop* uring_loop_create(event_loop_t* loop) {
+    uring_loop_t* ring = calloc(1, sizeof(uring_loop_t));
+    if (!ring) {
+        return NULL;
+    }
+    if (uring_init(&ring->ring, URING_ENTRIES) != 0) {
+        free(ring);
+        return NULL;
+    }
+    if (uring_buf_ring_init(&ring->ring, &ring->buffers, 0, URING_RECV_BUFFERS,
+                            URING_RECV_BUFFER_SIZE) != 0) {
+        uring_destroy(&ring->ring);
+        free(ring);
+        return NULL;
+    }
+
+    if (uring_arm_accept(ring, loop) != 0 || uring_arm_completions(ring, loop) != 0) {
+        uring_loop_destroy(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void uring_loop_destroy(struct uring_loop* ring) {
+    uring_buf_ring_destroy(&ring->ring, &ring->buffers);
+    uring_destroy(&ring->ring);
+    free(ring);
+}
+
+int uring_loop_wait(struct uring_loop* ring, int timeout_ms) {
+    return uring_submit_and_wait(&ring->ring, timeout_ms);
+}
+
+int uring_watch(connection_t* conn) {
+    return uring_arm_recv(conn);
+}
+
+static void uring_drop_buffer(connection_t* conn) {
+    if (conn->ring.recv_buffered) {
+        uring_buf_ring_recycle(&conn->loop->uring->buffers, conn->ring.recv_buffer);
+        conn->ring.recv_buffered = 0;
+    }
+}
+
+// Keep what the connection did not take of the buffer being handled
+static int uring_spill(connection_t* conn) {
+    uring_conn_t* state = &conn->ring;
+    uring_loop_t* ring = conn->loop->uring;
+    size_t length = state->recv_length - state->recv_offset;
+    if (state->spill_len + length > state->spill_cap) {
+        size_t new_cap = state->spill_cap ? state->spill_cap : URING_RECV_BUFFER_SIZE;
+        while (new_cap < state->spill_len + length) {
+            new_cap *= 2;
+        }
+        char* spill = realloc(state->spill, new_cap);
+        if (!spill) {
+            return -1;
+        }
+        state->spill = spill;
+        state->spill_cap = new_cap;
+    }
+    memcpy(state->spill + state->spill_len,
+           uring_buffer(&ring->buffers, state->recv_buffer) + state->recv_offset, length);
+    state->spill_len += length;
+    uring_buf_ring_recycle(&ring->buffers, state->recv_buffer);
+    state->recv_buffered = 0;
+    return 0;
+}
+
+ssize_t uring_recv(connection_t* conn, char* buf, size_t length) {
+    uring_loop_t* ring = conn->loop->uring;
+    uring_conn_t* state = &conn->ring;
+
+    // Spilled bytes arrived first
+    size_t copied = 0;
+    if (state->spill_start < state->spill_len) {
+        size_t available = state->spill_len - state->spill_start;
+        copied = available < length ? available : length;
+        memcpy(buf, state->spill + state->spill_start, copied);
+        state->spill_start += copied;
+        if (state->spill_start == state->spill_len) {
+            state->spill_start = 0;
+            state->spill_len = 0;
+        }
+    }
+    if (state->recv_buffered && copied < length) {
+        size_t available = state->recv_length - state->recv_offset;
+        size_t n = available < length - copied ? available : length - copied;
+        memcpy(buf + copied, uring_buffer(&ring->buffers, state->recv_buffer) + state->recv_offset, n);
+        copied += n;
+        state->recv_offset += n;
+        if (state->recv_offset == state->recv_length) {
+            uring_buf_ring_recycle(&ring->buffers, state->recv_buffer);
+            state->recv_buffered = 0;
+        }
+    }
+    if (copied > 0) {
+        return (ssize_t)copied;
+    }
+
+    if (state->recv_error) {
+        errno = state->recv_error;
+        return -1;
+    }
+    if (state->recv_eof) {
+        return 0;
+    }
+    // A receive that was paused or ran out starts again once all is taken
+    if (!state->recv_armed && !state->recv_starved && uring_arm_recv(conn) != 0) {
+        return -1;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int uring_send(connection_t* conn, const struct iovec* iov, int iov_count,
+               int fd, off_t offset, size_t length) {
+    uring_loop_t* ring = conn->loop->uring;
+    uring_conn_t* state = &conn->ring;
+    if (!state->send) {
+        state->send = calloc(1, sizeof(uring_send_t));
+        if (!state->send) {
+            return -1;
+        }
+    }
+    uring_send_t* send = state->send;
+    if (length > 0 && !send->bounce) {
+        send->bounce = malloc(URING_FILE_CHUNK);
+        if (!send->bounce) {
+            return -1;
+        }
+    }
+    int count = (iov_count > 0) + (length > 0 ? 2 : 0);
+    if (uring_reserve(&ring->ring, count) != 0) {
+        return -1;
+    }
+
+    // Headers and memory bodies in one sendmsg; MSG_WAITALL makes the ring
+    // retry a short send itself, so any shortfall is a real error
+    send->memory_length = 0;
+    if (iov_count > 0) {
+        memcpy(send->iov, iov, iov_count * sizeof(struct iovec));
+        for (int i = 0; i < iov_count; i++) {
+            send->memory_length += iov[i].iov_len;
+        }
+        memset(&send->msg, 0, sizeof(send->msg));
+        send->msg.msg_iov = send->iov;
+        send->msg.msg_iovlen = iov_count;
+
+        struct io_uring_sqe* sqe = uring_get_sqe(&ring->ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+        sqe->len = 1;
+        // Like TCP_CORK under epoll: hold the headers for the file data behind them
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (length > 0 ? MSG_MORE : 0);
+        sqe->flags = length > 0 ? IOSQE_IO_LINK : 0;
+        sqe->user_data = uring_tag(conn, URING_OP_SEND_MEMORY);
+    }
+
+    // A file part is read without blocking the loop, then sent after it
+    send->file_length = length < URING_FILE_CHUNK ? length : URING_FILE_CHUNK;
+    send->file_read = 0;
+    if (length > 0) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&ring->ring);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = (uint64_t)(uintptr_t)send->bounce;
+        sqe->len = send->file_length;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = uring_tag(conn, URING_OP_FILE_READ);
+
+        sqe = uring_get_sqe(&ring->ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)send->bounce;
+        sqe->len = send->file_length;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = uring_tag(conn, URING_OP_FILE_SEND);
+    }
+
+    send->pending = count;
+    state->ops += count;
+    state->send_busy = 1;
+    state->send_failed = 0;
+    return 0;
+}
+
+void uring_release(connection_t* conn) {
+    free(conn->ring.spill);
+    conn->ring.spill = NULL;
+    if (conn->ring.send) {
+        free(conn->ring.send->bounce);
+        free(conn->ring.send);
+        conn->ring.send = NULL;
+    }
+    free(conn->ring.retired_write_buf);
+    conn->ring.retired_write_buf = NULL;
+}
+
+// An operation on a connection that is closing ended; the last one frees it
+static int uring_closing(connection_t* conn) {
+    if (conn->fd >= 0) {
+        return 0;
+    }
+    if (conn->ring.ops == 0) {
+        connection_destroy(conn);
+    }
+    return 1;
+}
+
+static void uring_on_recv(connection_t* conn, int result, unsigned int flags) {
+    uring_loop_t* ring = conn->loop->uring;
+    uring_conn_t* state = &conn->ring;
+    if (!(flags & IORING_CQE_F_MORE)) {
+        state->recv_armed = 0;
+        state->recv_cancelling = 0;
+        state->ops--;
+    }
+
+    unsigned int id = flags >> IORING_CQE_BUFFER_SHIFT;
+    if ((flags & IORING_CQE_F_BUFFER) && (result <= 0 || conn->fd < 0)) {
+        uring_buf_ring_recycle(&ring->buffers, id);
+    }
+    if (uring_closing(conn)) {
+        return;
+    }
+
+    if (result > 0) {
+        state->recv_buffered = 1;
+        state->recv_buffer = id;
+        state->recv_length = (size_t)result;
+        state->recv_offset = 0;
+    } else if (result == 0) {
+        state->recv_eof = 1;
+    } else if (result == -ENOBUFS) {
+        // Picked up again by uring_loop_dispatch() once buffers come back
+        state->recv_starved = 1;
+        state->ops++;
+        state->starved_next = ring->starved;
+        ring->starved = conn;
+        return;
+    } else if (result == -ECANCELED) {
+        if (state->spill_len == 0 && uring_arm_recv(conn) != 0) {
+            connection_destroy(conn);
+        }
+        return;
+    } else {
+        state->recv_error = -result;
+    }
+
+    if (connection_on_ready(conn) != 0) {
+        uring_drop_buffer(conn);
+        connection_destroy(conn);
+        return;
+    }
+    if (!state->recv_buffered) {
+        return;
+    }
+    if (uring_spill(conn) != 0) {
+        uring_drop_buffer(conn);
+        connection_destroy(conn);
+        return;
+    }
+    // Not keeping up: stop receiving until the connection has caught up
+    if (state->spill_len >= URING_CONN_MAX_SPILL && state->recv_armed && !state->recv_cancelling) {
+        uring_pause_recv(conn);
+    }
+}
+
+static void uring_on_send(connection_t* conn, int op, int result) {
+    uring_conn_t* state = &conn->ring;
+    uring_send_t* send = state->send;
+    state->ops--;
+    send->pending--;
+
+    if (op == URING_OP_FILE_READ) {
+        // Nothing read means the file shrank under us
+        if (result <= 0) {
+            state->send_failed = 1;
+        }
+        send->file_read = result;
+    } else if (op == URING_OP_FILE_SEND && result == -ECANCELED && send->file_read > 0) {
+        // A short read breaks the link; the rest is read again next time
+    } else {
+        size_t expected = op == URING_OP_SEND_MEMORY ? send->memory_length : send->file_length;
+        if (result > 0 && conn->fd >= 0) {
+            connection_sent(conn, (size_t)result);
+        }
+        if (result < 0 || (size_t)result != expected) {
+            state->send_failed = 1;
+        }
+    }
+    if (send->pending > 0) {
+        return;
+    }
+
+    state->send_busy = 0;
+    free(state->retired_write_buf);
+    state->retired_write_buf = NULL;
+    if (uring_closing(conn)) {
+        return;
+    }
+    if (state->send_failed || connection_on_ready(conn) != 0) {
+        connection_destroy(conn);
+    }
+}
+
+// Connections that ran out of buffers try again now that every completion
+// has handed its buffer back
+static void uring_resume_starved(uring_loop_t* ring) {
+    while (ring->starved) {
+        connection_t* conn = ring->starved;
+        ring->starved = conn->ring.starved_next;
+        conn->ring.starved_next = NULL;
+        conn->ring.recv_starved = 0;
+        conn->ring.ops--;
+        if (uring_closing(conn)) {
+            continue;
+        }
+        if (uring_arm_recv(conn) != 0) {
+            connection_destroy(conn);
+        }
+    }
+}
+
+void uring_loop_dispatch(event_loop_t* loop) {
+    uring_loop_t* ring = loop->uring;
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&ring->ring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int result = cqe->res;
+        unsigned int flags = cqe->flags;
+        uring_cqe_seen(&ring->ring);
+
+        int op = (int)(data & URING_OP_MASK);
+        void* target = (void*)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+        switch (op) {
+        case URING_OP_ACCEPT:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                ring->accept_armed = 0;
+            }
+            if (result >= 0) {
+                event_loop_add_connection(loop, result, 0);
+            } else if (result != -ECONNABORTED && result != -EINTR && result != -ECANCELED) {
+                errno = -result;
+                perror("Accept failed");
+            }
+            break;
+        case URING_OP_COMPLETIONS:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                ring->completions_armed = 0;
+            }
+            event_loop_run_completions(loop);
+            break;
+        case URING_OP_RECV:
+            uring_on_recv(target, result, flags);
+            break;
+        case URING_OP_SEND_MEMORY:
+        case URING_OP_FILE_READ:
+        case URING_OP_FILE_SEND:
+            uring_on_send(target, op, result);
+            break;
+        default:
+            break;
+        }
+    }
+
+    uring_resume_starved(ring);
+    // Multishot requests end on errors or overflow and have to be renewed,
+    // except the accept of a loop that is draining
+    if (!ring->accept_armed && !loop->draining) {
+        uring_arm_accept(ring, loop);
+    }
+    if (!ring->completions_armed) {
+        uring_arm_completions(ring, loop);
+    }
+}
+
+#else
+
+struct uring_loop* uring_loop_create(event_loop_t* loop) {
+    (void)loop;
+    return NULL;  // Built without io_uring support
+}
+
+void uring_loop_destroy(struct uring_loop* ring) {
+    (void)ring;
+}
+
+int uring_loop_wait(struct uring_loop* ring, int timeout_ms) {
+    (void)ring;
+    (void)timeout_ms;
+    return -1;
+}
+
+void uring_loop_dispatch(event_loop_t* loop) {
+    (void)loop;
+}
+
+void uring_loop_stop_accepting(event_loop_t* loop) {
+    (void)loop;
+}
+
+int uring_watch(connection_t* conn) {
+    (void)conn;
+    return -1;
+}
+
+ssize_t uring_recv(connection_t* conn, char* buf, size_t length) {
+    (void)conn;
+    (void)buf;
+    (void)length;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_send(connection_t* conn, const struct iovec* iov, int iov_count,
+               int fd, off_t offset, size_t length) {
+    (void)conn;
+    (void)iov;
+    (void)iov_count;
+    (void)fd;
+    (void)offset;
+    (void)length;
+    return -1;
+}
+
+void uring_release(connection_t* conn) {
+    (void)conn;
+}
+
+#endif
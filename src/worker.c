@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../include/worker.h"
+#include "../include/event_loop.h"
+#include "../include/tls.h"
+#include "../include/reload.h"
+#include "../include/thread_pool.h"
+
+int create_listen_socket(const server_config_t* config, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Every worker binds its own socket; the kernel spreads connections between them
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(fd);
+        return -1;
+    }
+
+    // The kernel silently clamps this to net.core.somaxconn
+    if (listen(fd, config->backlog) < 0) {
+        perror("Listen failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Pick the n-th CPU this process may run on, wrapping around
+static int select_cpu(int n) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+    int count = CPU_COUNT(&allowed);
+    if (count == 0) {
+        return -1;
+    }
+
+    int target = n % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static int workers_exited;
+
+static void* worker_main(void* arg) {
+    worker_t* worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "Worker %d: could not pin to CPU %d\n", worker->id, worker->cpu);
+        }
+    }
+
+    event_loop_run(&worker->loop);
+    __atomic_add_fetch(&workers_exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Wait for reload and stop signals until the workers are to drain: once a
+// new process serves on the listeners, or on a stop. Returns early if the
+// workers end by themselves.
+static void wait_for_signals(worker_t* workers, int count) {
+    int* listen_fds = malloc(count * sizeof(int));
+    int* tls_listen_fds = malloc(count * sizeof(int));
+    for (int i = 0; listen_fds && tls_listen_fds && i < count; i++) {
+        listen_fds[i] = workers[i].listen_fd;
+        tls_listen_fds[i] = workers[i].tls_listen_fd;
+    }
+
+    while (__atomic_load_n(&workers_exited, __ATOMIC_ACQUIRE) < count) {
+        int request = reload_wait(1000);
+        if (request == RELOAD_STOP) {
+            printf("Stopping: draining connections\n");
+            fflush(stdout);
+            break;
+        }
+        if (request == RELOAD_RELOAD) {
+            if (!listen_fds || !tls_listen_fds) {
+                fprintf(stderr, "Reload failed: out of memory, carrying on\n");
+            } else if (reload_spawn(listen_fds, tls_listen_fds, count) == 0) {
+                break;
+            }
+        }
+    }
+    free(listen_fds);
+    free(tls_listen_fds);
+}
+
+int run_workers(const server_config_t* config) {
+    worker_t* workers = calloc(config->workers, sizeof(worker_t));
+    if (!workers) {
+        return -1;
+    }
+
+    // Set up every listener before starting any thread so failures abort cleanly
+    int created = 0;
+    for (; created < config->workers; created++) {
+        worker_t* worker = &workers[created];
+        worker->id = created;
+        worker->cpu = config->pin_cpus ? select_cpu(created) : -1;
+        // After a reload the listeners are still those of the first process
+        worker->listen_fd = reload_take_listener(0);
+        if (worker->listen_fd < 0) {
+            worker->listen_fd = create_listen_socket(config, config->port);
+        }
+        if (worker->listen_fd < 0) {
+            break;
+        }
+        worker->tls_listen_fd = -1;
+        if (tls_enabled()) {
+            worker->tls_listen_fd = reload_take_listener(1);
+        }
+        if (tls_enabled() && worker->tls_listen_fd < 0) {
+            worker->tls_listen_fd = create_listen_socket(config, config->tls_port);
+            if (worker->tls_listen_fd < 0) {
+                close(worker->listen_fd);
+                break;
+            }
+        }
+        if (event_loop_init(&worker->loop, worker->listen_fd, worker->tls_listen_fd, config) < 0) {
+            perror("Event loop setup failed");
+            close(worker->listen_fd);
+            if (worker->tls_listen_fd >= 0) {
+                close(worker->tls_listen_fd);
+            }
+            break;
+        }
+    }
+
+    int started = 0;
+    if (created == config->workers) {
+        for (; started < created; started++) {
+            if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+                perror("pthread_create failed");
+                break;
+            }
+        }
+    }
+
+    if (created == config->workers && started < created) {
+        // Some loops are already running; let the caller exit the process
+        free(workers);
+        return -1;
+    }
+
+    if (started > 0) {
+        if (tls_enabled()) {
+            printf("Server listening on port %d (HTTPS on %d) with %d worker(s)\n", config->port,
+                   config->tls_port, started);
+        } else {
+            printf("Server listening on port %d with %d worker(s)\n", config->port, started);
+        }
+        fflush(stdout);
+        reload_ready();
+        wait_for_signals(workers, started);
+    }
+    for (int i = 0; i < started; i++) {
+        event_loop_drain(&workers[i].loop);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    // Handlers still running on the pool post back to their loops
+    thread_pool_stop();
+
+    for (int i = 0; i < created; i++) {
+        event_loop_destroy(&workers[i].loop);
+        close(workers[i].listen_fd);
+        if (workers[i].tls_listen_fd >= 0) {
+            close(workers[i].tls_listen_fd);
+        }
+    }
+    free(workers);
+    return started == config->workers ? 0 : -1;
+}
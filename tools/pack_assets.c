@@ -0,0 +1,31 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../include/asset_pack.h"
+#include "../include/mime_types.h"
+
+// Build an asset pack for the server's -P option from a directory tree
+int main(int argc, char** argv) {
+    const char* mime_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        if (opt != 'm') {
+            optind = argc + 1;
+            break;
+        }
+        mime_file = optarg;
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-m mime.types] root output\n", argv[0]);
+        return 1;
+    }
+
+    // Content types are fixed into the pack, so they come from the same table the server uses
+    if (mime_types_init(mime_file) != 0) {
+        return 1;
+    }
+    int status = asset_pack_write(argv[optind], argv[optind + 1]);
+    mime_types_shutdown();
+    return status == 0 ? 0 : 1;
+}